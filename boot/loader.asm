@@ -98,6 +98,7 @@ setup_page_tables:
     mov eax, p3_table
     or eax, 0b11
     mov [p4_table], eax
+    mov [p4_table + 256 * 8], eax ; Same 1 GiB at PHYS_MAP_BASE for early boot
     mov eax, p2_table
     or eax, 0b11
     mov [p3_table], eax
@@ -31,7 +31,10 @@ extern "C" {
     fn rust_process_list();
     fn pmm_total_memory() -> u64;
     fn pmm_free_memory() -> u64;
+    fn pmm_zero_pool_get_stats(out: *mut PmmZeroStats);
+    fn zram_get_stats(out: *mut ZramStats);
     fn pci_test_devices();
+    fn memops_benchmark();
 
     // socket-level FFI
     fn sock_socket() -> i32;
@@ -48,6 +51,29 @@ extern "C" {
     fn net_get_config(ip_out: *mut u8, netmask_out: *mut u8, gateway_out: *mut u8, mac_out: *mut u8) -> i32;
 }
 
+#[repr(C)]
+#[derive(Default)]
+struct PmmZeroStats {
+    pooled: u64,
+    hits: u64,
+    misses: u64,
+    filled: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct ZramStats {
+    disk_size: u64,
+    pages: u64,
+    zero_pages: u64,
+    orig_bytes: u64,
+    compr_bytes: u64,
+    mem_used: u64,
+    reads: u64,
+    writes: u64,
+    failed: u64,
+}
+
 // Utility functions
 fn print_str(s: &[u8]) {
     let mut buf = [0u8; 1024];
@@ -91,6 +117,35 @@ fn print_int(n: usize) {
     print_str(&buf[..i+1]);
 }
 
+fn print_hex(n: u64) {
+    let mut buf = [0u8; 19];
+    buf[0] = b'0';
+    buf[1] = b'x';
+    for i in 0..16 {
+        let digit = ((n >> ((15 - i) * 4)) & 0xF) as u8;
+        buf[2 + i] = if digit < 10 { b'0' + digit } else { b'a' + digit - 10 };
+    }
+    print_str(&buf[..18]);
+}
+
+// Right-align n in a column of the given width
+fn print_num_col(n: usize, width: usize) {
+    let mut digits = 1;
+    let mut v = n;
+    while v >= 10 {
+        v /= 10;
+        digits += 1;
+    }
+    print_pad(digits, width);
+    print_int(n);
+}
+
+fn print_pad(used: usize, width: usize) {
+    for _ in used..width {
+        print_str(b" ");
+    }
+}
+
 fn get_str(bytes: &[u8]) -> &[u8] {
     if let Some(null_pos) = bytes.iter().position(|&b| b == 0) {
         &bytes[..null_pos]
@@ -465,9 +520,8 @@ impl BashShell {
             unsafe {
                 let c = rust_keyboard_get_char();
                 if c == -1 || c == 0 { 
-                    // Use HLT to wait for interrupts instead of busy waiting
-                    extern "C" { fn pause(); }
-                    pause(); // This will halt until the next interrupt
+                    // Sleep until the keyboard interrupt queues a key
+                    crate::keyboard::wait_for_input();
                     continue; 
                 }
                 let ch = c as u8;
@@ -505,6 +559,7 @@ impl BashShell {
     }
     
     pub fn execute_command(&mut self, command_line: &[u8]) {
+        let _tag = crate::heap_profile::TagScope::new(crate::heap_profile::HeapTag::Shell);
         // Trim leading/trailing whitespace and check if empty
         let start = command_line.iter().position(|&c| c != b' ' && c != b'\t').unwrap_or(0);
         let end = command_line.iter().rposition(|&c| c != b' ' && c != b'\t').unwrap_or(0);
@@ -591,6 +646,13 @@ impl BashShell {
             b"whoami" => self.cmd_whoami(), // work
             b"uname" => self.cmd_uname(), // work
             b"free" => self.cmd_free(),//works
+            b"meminfo" => self.cmd_meminfo(),
+            b"swapon" => self.cmd_swapon_heap(args_slice, argc),
+            b"ksm" => self.cmd_ksm_heap(args_slice, argc),
+            b"zramctl" => self.cmd_zramctl(),
+            b"sched" => self.cmd_sched_heap(args_slice, argc),
+            b"membench" => self.cmd_membench(),
+            b"heapstat" => self.cmd_heapstat_heap(args_slice, argc),
             b"df" => self.cmd_df(), //works
             b"mv" => self.cmd_mv_heap(args_slice, argc), //not implemented
             b"ifconfig" | b"ipconfig" => self.cmd_ifconfig(),//works with default will be able to test soon after tcp implementation
@@ -1602,6 +1664,7 @@ impl BashShell {
             fn sock_recv(s: i32, buf: *mut u8, len: usize) -> isize;
             fn sock_close(s: i32) -> i32;
             fn network_poll();
+            fn net_wait_traffic(ticks: u64);
         }
 
         if argc < 2 {
@@ -1678,8 +1741,8 @@ impl BashShell {
                 let slice = &buf[..n as usize];
                 print_str(slice);
             } else {
-                // no data yet, small pause
-                unsafe { extern "C" { fn pause(); } pause(); }
+                // no data yet, wait for the next packets
+                unsafe { net_wait_traffic(1); }
             }
         }
         print_str(b"\n");
@@ -2539,6 +2602,13 @@ impl BashShell {
         print_str(b"  ps                 - List processes\n");
         print_str(b"  kill <pid>         - Terminate process\n");
         print_str(b"  free               - Show memory usage\n");
+        print_str(b"  meminfo            - Detailed memory and huge page usage\n");
+        print_str(b"  swapon [dev [start [sectors]]] - Enable swap on a block device\n");
+        print_str(b"  ksm [on|off|scan]  - Same-page merging status and control\n");
+        print_str(b"  zramctl            - Compressed RAM disk usage\n");
+        print_str(b"  sched [tid fair|rr [prio]] - Task scheduling policy and CPU share\n");
+        print_str(b"  membench           - memcpy/memset throughput\n");
+        print_str(b"  heapstat [leaks N|check] - Kernel heap profile\n");
         print_str(b"  df                 - Show disk usage\n");
         print_str(b"  mount              - Show mounted filesystems\n");
         print_str(b"  uname              - System information\n");
@@ -2741,13 +2811,411 @@ impl BashShell {
             print_int(used_kb as usize);
             print_str(b"      ");
             print_int(free_kb as usize);
-            print_str(b"           0           0      ");
+            print_str(b"           0      ");
+            let cache = crate::page_cache::stats();
+            print_int(cache.pages * 4);
+            print_str(b"      ");
             print_int(free_kb as usize);
             print_str(b"\n");
+
+            let (swap_total, swap_free) = crate::swap::stats().map_or((0, 0), |s| (s.total * 4, s.free * 4));
+            print_str(b"Swap:       ");
+            print_int(swap_total);
+            print_str(b"      ");
+            print_int(swap_total - swap_free);
+            print_str(b"      ");
+            print_int(swap_free);
+            print_str(b"\n");
+
+            let heap = crate::heap::heap_stats();
+            print_str(b"Heap:       ");
+            print_int(heap.mapped / 1024);
+            print_str(b"      ");
+            print_int((heap.mapped - heap.free_bytes) / 1024);
+            print_str(b"      ");
+            print_int(heap.free_bytes / 1024);
+            print_str(b"  (max ");
+            print_int(heap.max / 1024);
+            print_str(b", largest free ");
+            print_int(heap.largest_free / 1024);
+            print_str(b")\n");
+
+            let mut zero = PmmZeroStats::default();
+            pmm_zero_pool_get_stats(&mut zero);
+            print_str(b"Zeroed:     pooled ");
+            print_int(zero.pooled as usize);
+            print_str(b"  hits ");
+            print_int(zero.hits as usize);
+            print_str(b"  misses ");
+            print_int(zero.misses as usize);
+            print_str(b"  filled ");
+            print_int(zero.filled as usize);
+            print_str(b"\n");
+
+            print_str(b"Cache:      files ");
+            print_int(cache.files);
+            print_str(b"  pages ");
+            print_int(cache.pages);
+            print_str(b"  hits ");
+            print_int(cache.hits as usize);
+            print_str(b"  misses ");
+            print_int(cache.misses as usize);
+            print_str(b"  writebacks ");
+            print_int(cache.writebacks as usize);
+            print_str(b"\n");
+
+            let faults = crate::vm::fault_stats();
+            print_str(b"Faults:     demand-zero ");
+            print_int(faults.demand_zero as usize);
+            print_str(b"  zero-page ");
+            print_int(faults.zero_page as usize);
+            print_str(b"  stack-grow ");
+            print_int(faults.stack_grow as usize);
+            print_str(b"  cow-copy ");
+            print_int(faults.cow_copy as usize);
+            print_str(b"  cow-reuse ");
+            print_int(faults.cow_reuse as usize);
+            print_str(b"  file ");
+            print_int(faults.file as usize);
+            print_str(b"  swap-in ");
+            print_int(faults.swap_in as usize);
+            print_str(b"  failed ");
+            print_int(faults.failed as usize);
+            print_str(b"\n");
+
+            let lru = crate::reclaim::stats();
+            print_str(b"Reclaim:    active ");
+            print_int(lru.active);
+            print_str(b"  inactive ");
+            print_int(lru.inactive);
+            print_str(b"  scanned ");
+            print_int(lru.scanned as usize);
+            print_str(b"  dropped ");
+            print_int(lru.cache_dropped as usize);
+            print_str(b"  swapped ");
+            print_int(lru.swapped_out as usize);
+            print_str(b"  direct ");
+            print_int(lru.direct as usize);
+            print_str(b"\n");
         }
         self.last_exit_code = 0;
     }
     
+    fn cmd_meminfo(&mut self) {
+        let (total_kb, free_kb) = unsafe { (pmm_total_memory() / 1024, pmm_free_memory() / 1024) };
+        let cache = crate::page_cache::stats();
+        let faults = crate::vm::fault_stats();
+        let huge = crate::vm::huge_pages_in_use() as usize;
+        let lru = crate::reclaim::stats();
+        let swap = crate::swap::stats();
+        let (swap_total, swap_free) = swap.map_or((0, 0), |s| (s.total * 4, s.free * 4));
+        let ksm = crate::ksm::stats();
+        let lines: [(&[u8], usize); 15] = [
+            (b"MemTotal:       ", total_kb as usize),
+            (b"MemFree:        ", free_kb as usize),
+            (b"Cached:         ", cache.pages * 4),
+            (b"Active:         ", lru.active * 4),
+            (b"Inactive:       ", lru.inactive * 4),
+            (b"SwapTotal:      ", swap_total),
+            (b"SwapFree:       ", swap_free),
+            (b"AnonHugePages:  ", huge * 2048),
+            (b"KsmSaved:       ", ksm.sharing.saturating_sub(ksm.shared) * 4),
+            (b"HugePagesInUse: ", huge),
+            (b"HugeFaults:     ", faults.huge as usize),
+            (b"HugeFallbacks:  ", faults.huge_fallback as usize),
+            (b"HugeSplits:     ", faults.huge_split as usize),
+            (b"SwapIns:        ", swap.map_or(0, |s| s.ins as usize)),
+            (b"SwapOuts:       ", swap.map_or(0, |s| s.outs as usize)),
+        ];
+        for (i, (label, value)) in lines.iter().enumerate() {
+            print_str(label);
+            print_num_col(*value, 10);
+            // The first nine are sizes, the rest counts
+            print_str(if i < 9 { b" kB\n" } else { b"\n" });
+        }
+        self.last_exit_code = 0;
+    }
+
+    fn cmd_swapon_heap(&mut self, args_buffer: &[u8], argc: usize) {
+        if argc < 2 {
+            match crate::swap::stats() {
+                Some(s) => {
+                    print_str(b"Swap on block device ");
+                    print_int(s.dev_id as usize);
+                    print_str(b": ");
+                    print_int(s.total * 4);
+                    print_str(b" kB, ");
+                    print_int((s.total - s.free) * 4);
+                    print_str(b" kB used\n");
+                }
+                None => print_str(b"Swap is off\n"),
+            }
+            self.last_exit_code = 0;
+            return;
+        }
+        let mut nums = [0u64; 3];
+        for i in 1..argc.min(4) {
+            match parse_int(get_str(self.get_arg_heap(args_buffer, i))) {
+                Some(n) if n >= 0 => nums[i - 1] = n as u64,
+                _ => {
+                    print_str(b"Usage: swapon [dev [start [sectors]]]\n");
+                    self.last_exit_code = 1;
+                    return;
+                }
+            }
+        }
+        match crate::swap::swapon(nums[0] as i32, nums[1], nums[2]) {
+            0 => {
+                print_str(b"Swap enabled on block device ");
+                print_int(nums[0] as usize);
+                print_str(b"\n");
+                self.last_exit_code = 0;
+            }
+            -16 => {
+                print_str(b"swapon: swap is already enabled\n");
+                self.last_exit_code = 1;
+            }
+            -19 => {
+                print_str(b"swapon: no such block device\n");
+                self.last_exit_code = 1;
+            }
+            _ => {
+                print_str(b"swapon: invalid range\n");
+                self.last_exit_code = 1;
+            }
+        }
+    }
+
+    fn cmd_ksm_heap(&mut self, args_buffer: &[u8], argc: usize) {
+        let sub = if argc > 1 { get_str(self.get_arg_heap(args_buffer, 1)) } else { &b""[..] };
+        match sub {
+            b"on" => crate::ksm::set_enabled(true),
+            b"off" => crate::ksm::set_enabled(false),
+            b"scan" => crate::ksm::scan_all(),
+            b"" => {}
+            _ => {
+                print_str(b"Usage: ksm [on|off|scan]\n");
+                self.last_exit_code = 1;
+                return;
+            }
+        }
+        let s = crate::ksm::stats();
+        print_str(if s.enabled { b"KSM: on\n" } else { b"KSM: off\n" });
+        print_str(b"  pages shared    ");
+        print_int(s.shared);
+        print_str(b"\n  pages sharing   ");
+        print_int(s.sharing);
+        print_str(b"\n  zero pages      ");
+        print_int(s.zero as usize);
+        print_str(b"\n  merges          ");
+        print_int(s.merged as usize);
+        print_str(b"\n  pages scanned   ");
+        print_int(s.scanned as usize);
+        print_str(b"\n  full scans      ");
+        print_int(s.full_scans as usize);
+        print_str(b"\n  memory saved    ");
+        print_int(s.sharing.saturating_sub(s.shared) * 4);
+        print_str(b" kB\n");
+        self.last_exit_code = 0;
+    }
+
+    fn cmd_zramctl(&mut self) {
+        let mut z = ZramStats::default();
+        unsafe { zram_get_stats(&mut z); }
+        print_str(b"NAME   DISKSIZE      DATA     COMPR     TOTAL      ZERO   RATIO\n");
+        print_str(b"zram1");
+        let cols = [z.disk_size / 1024, z.orig_bytes / 1024, z.compr_bytes / 1024, z.mem_used / 1024];
+        for kb in cols.iter() {
+            print_num_col(*kb as usize, 9);
+            print_str(b"K");
+        }
+        print_num_col(z.zero_pages as usize, 10);
+        // Uncompressed data per byte of memory used, two decimals
+        let ratio = if z.mem_used > 0 { z.orig_bytes * 100 / z.mem_used } else { 0 };
+        print_num_col((ratio / 100) as usize, 5);
+        print_str(b".");
+        if ratio % 100 < 10 {
+            print_str(b"0");
+        }
+        print_int((ratio % 100) as usize);
+        print_str(b"\nreads ");
+        print_int(z.reads as usize);
+        print_str(b"  writes ");
+        print_int(z.writes as usize);
+        print_str(b"  failed ");
+        print_int(z.failed as usize);
+        print_str(b"\n");
+        self.last_exit_code = 0;
+    }
+
+    fn cmd_sched_heap(&mut self, args_buffer: &[u8], argc: usize) {
+        use crate::scheduler::{self, TaskSchedInfo, SCHED_NORMAL, SCHED_RR};
+        if argc > 1 {
+            let tid = parse_int(get_str(self.get_arg_heap(args_buffer, 1)));
+            let policy = if argc > 2 {
+                match get_str(self.get_arg_heap(args_buffer, 2)) {
+                    b"fair" => Some(SCHED_NORMAL),
+                    b"rr" => Some(SCHED_RR),
+                    _ => None,
+                }
+            } else {
+                None
+            };
+            let prio = if argc > 3 { parse_int(get_str(self.get_arg_heap(args_buffer, 3))) } else { Some(-1) };
+            let (tid, policy, prio) = match (tid, policy, prio) {
+                (Some(t), Some(p), Some(pr)) if pr >= -1 => (t, p, pr),
+                _ => {
+                    print_str(b"Usage: sched [tid fair|rr [prio]]\n");
+                    self.last_exit_code = 1;
+                    return;
+                }
+            };
+            let task = match scheduler::task_by_id(tid) {
+                Some(t) => t,
+                None => {
+                    print_str(b"sched: no such task\n");
+                    self.last_exit_code = 1;
+                    return;
+                }
+            };
+            scheduler::set_policy(task, policy, if prio >= 0 { Some(prio) } else { None });
+        }
+
+        let mut tasks = [TaskSchedInfo { id: 0, cpu: 0, state: 0, policy: 0, priority: 0, weight: 0, vruntime: 0, exec_ticks: 0 }; 16];
+        let n = scheduler::task_info(&mut tasks);
+        let total: u64 = tasks[..n].iter().map(|t| t.exec_ticks).sum();
+        print_int(scheduler::cpus_online() as usize);
+        print_str(b" CPU(s) online\n");
+        print_str(b"  TID CPU STATE   POLICY PRIO WEIGHT  VRUNTIME(ms)  CPU%\n");
+        for t in &tasks[..n] {
+            print_num_col(t.id as usize, 5);
+            print_num_col(t.cpu.max(0) as usize, 4);
+            print_str(match t.state {
+                scheduler::TASK_RUNNING => b" running ",
+                scheduler::TASK_READY => b" ready   ",
+                _ => b" blocked ",
+            });
+            print_str(if t.policy == SCHED_NORMAL { b"fair  " } else { b"rr    " });
+            print_num_col(t.priority.max(0) as usize, 5);
+            print_num_col(t.weight as usize, 7);
+            if t.policy == SCHED_NORMAL {
+                print_num_col((t.vruntime / 1_000_000) as usize, 14);
+            } else {
+                print_str(b"             -");
+            }
+            let share = if total > 0 { t.exec_ticks * 100 / total } else { 0 };
+            print_num_col(share as usize, 6);
+            print_str(b"\n");
+        }
+        self.last_exit_code = 0;
+    }
+
+    fn cmd_heapstat_heap(&mut self, args_buffer: &[u8], argc: usize) {
+        use crate::heap_profile::{self, TrackEntry, NUM_TAGS, TAG_NAMES, TICKS_PER_SEC};
+        let sub = if argc > 1 { get_str(self.get_arg_heap(args_buffer, 1)) } else { &b""[..] };
+        if sub == b"check" {
+            if crate::heap::heap_validate() {
+                print_str(b"heap: block list OK\n");
+                self.last_exit_code = 0;
+            } else {
+                print_str(b"heap: corruption found, see serial log\n");
+                self.last_exit_code = 1;
+            }
+            return;
+        }
+        if sub == b"leaks" {
+            let secs = if argc > 2 { parse_int(get_str(self.get_arg_heap(args_buffer, 2))).unwrap_or(60) } else { 60 };
+            let secs = if secs < 0 { 0 } else { secs as u64 };
+            let mut entries = [TrackEntry { ptr: 0, size: 0, caller: 0, tick: 0, tag: 0 }; 32];
+            let (found, shown) = heap_profile::leaks(secs, &mut entries);
+            let now = unsafe { timer_get_ticks() };
+            print_int(found);
+            print_str(b" allocations older than ");
+            print_int(secs as usize);
+            print_str(b"s\n");
+            for e in &entries[..shown] {
+                print_str(b"  ");
+                print_hex(e.ptr as u64);
+                print_str(b"  ");
+                print_int(e.size);
+                print_str(b" B  ");
+                print_str(TAG_NAMES[e.tag as usize]);
+                print_str(b"  age ");
+                print_int((now.saturating_sub(e.tick) / TICKS_PER_SEC) as usize);
+                print_str(b"s");
+                if e.caller != 0 {
+                    print_str(b"  from ");
+                    print_hex(e.caller as u64);
+                }
+                print_str(b"\n");
+            }
+            if found > shown {
+                print_str(b"  ...\n");
+            }
+            self.last_exit_code = 0;
+            return;
+        }
+        if !sub.is_empty() {
+            print_str(b"Usage: heapstat [leaks <seconds>|check]\n");
+            self.last_exit_code = 1;
+            return;
+        }
+
+        let heap = crate::heap::heap_stats();
+        let totals = heap_profile::totals();
+        let tags = heap_profile::tag_stats();
+        print_str(b"Heap: ");
+        print_int(heap.mapped / 1024);
+        print_str(b" KiB mapped of ");
+        print_int(heap.max / 1024);
+        print_str(b" KiB, ");
+        print_int(heap.used_blocks);
+        print_str(b" blocks used, ");
+        print_int(heap.free_bytes / 1024);
+        print_str(b" KiB free in ");
+        print_int(heap.free_blocks);
+        print_str(b" blocks, largest ");
+        print_int(heap.largest_free / 1024);
+        print_str(b" KiB\n");
+        print_str(b"Live: ");
+        print_int(totals.live_bytes / 1024);
+        print_str(b" KiB (peak ");
+        print_int(totals.peak_bytes / 1024);
+        print_str(b" KiB) in ");
+        print_int(totals.tracked);
+        print_str(b" allocations, ");
+        print_int(totals.untracked as usize);
+        print_str(b" untracked\n");
+
+        print_str(b"tag        live KiB  peak KiB    allocs     total\n");
+        for i in 0..NUM_TAGS {
+            print_str(TAG_NAMES[i]);
+            print_pad(TAG_NAMES[i].len(), 8);
+            print_num_col(tags[i].live_bytes / 1024, 10);
+            print_num_col(tags[i].peak_bytes / 1024, 10);
+            print_num_col(tags[i].live_allocs, 10);
+            print_num_col(tags[i].total_allocs as usize, 10);
+            print_str(b"\n");
+        }
+
+        const LABELS: [&[u8]; crate::heap::HEAP_HIST_BUCKETS] =
+            [b"<64", b"<256", b"<1K", b"<4K", b"<16K", b"<64K", b"<256K", b">=256K"];
+        print_str(b"Free blocks:");
+        for i in 0..crate::heap::HEAP_HIST_BUCKETS {
+            print_str(b" ");
+            print_str(LABELS[i]);
+            print_str(b":");
+            print_int(heap.histogram[i]);
+        }
+        print_str(b"\n");
+        self.last_exit_code = 0;
+    }
+
+    fn cmd_membench(&mut self) {
+        unsafe { memops_benchmark(); }
+        self.last_exit_code = 0;
+    }
+
     fn cmd_df(&mut self) {
         print_str(b"Filesystem     1K-blocks  Used Available Use% Mounted on\n");
         print_str(b"ramfs             16384     0     16384   0% /\n");
@@ -3057,11 +3525,7 @@ pub extern "C" fn rust_bash_execute(command: *const u8) {
     unsafe {
         if let Some(ref mut shell) = BASH_SHELL {
             // Convert C string to Rust slice
-            let mut len = 0;
-            while *command.add(len) != 0 {
-                len += 1;
-            }
-            let cmd_slice = core::slice::from_raw_parts(command, len);
+            let cmd_slice = crate::memory::cstr_bytes(command);
             shell.execute_command(cmd_slice);
         }
     }
@@ -3,6 +3,7 @@
 
 use core::ptr::{read_volatile, write_volatile};
 use alloc::vec::Vec;
+use crate::heap::{dma_alloc, dma_free, DmaBuffer};
 
 // E1000 Register Offsets
 const REG_CTRL: u32 = 0x00000;
@@ -58,10 +59,12 @@ const DESC_STATUS_EOP: u8 = 0x02; // End of packet
 
 const NUM_RX_DESC: usize = 32;
 const NUM_TX_DESC: usize = 32;
+const BUFFER_SIZE: usize = 2048; // Matches RCTL_BSIZE
+// The descriptor ring base must be 16-byte aligned and its length a
+// multiple of 128 bytes
+const RING_ALIGN: usize = 128;
 
 extern "C" {
-    fn rust_kmalloc(size: usize) -> *mut u8;
-    fn rust_kfree(ptr: *mut u8);
     fn serial_write(s: *const u8);
 }
 
@@ -91,10 +94,13 @@ struct TxDescriptor {
 pub struct E1000Device {
     mem_base: u64,
     mac_address: [u8; 6],
+    rx_ring: DmaBuffer,
+    tx_ring: DmaBuffer,
     rx_descs: *mut RxDescriptor,
     tx_descs: *mut TxDescriptor,
-    rx_buffers: Vec<*mut u8>,
-    tx_buffers: Vec<*mut u8>,
+    // All packet buffers of a ring share one contiguous block, BUFFER_SIZE apart
+    rx_buffers: DmaBuffer,
+    tx_buffers: DmaBuffer,
     rx_current: usize,
     tx_current: usize,
 }
@@ -105,60 +111,28 @@ unsafe impl Sync for E1000Device {}
 impl E1000Device {
     pub fn new(mem_base: u64) -> Option<Self> {
         unsafe {
-            // Allocate descriptor rings
-            let rx_descs = rust_kmalloc(core::mem::size_of::<RxDescriptor>() * NUM_RX_DESC) as *mut RxDescriptor;
-            let tx_descs = rust_kmalloc(core::mem::size_of::<TxDescriptor>() * NUM_TX_DESC) as *mut TxDescriptor;
-
-            if rx_descs.is_null() || tx_descs.is_null() {
-                if !rx_descs.is_null() {
-                    rust_kfree(rx_descs as *mut u8);
-                }
-                if !tx_descs.is_null() {
-                    rust_kfree(tx_descs as *mut u8);
-                }
+            // Allocate descriptor rings and packet buffers
+            let rx_ring = dma_alloc(core::mem::size_of::<RxDescriptor>() * NUM_RX_DESC, RING_ALIGN);
+            let tx_ring = dma_alloc(core::mem::size_of::<TxDescriptor>() * NUM_TX_DESC, RING_ALIGN);
+            let rx_buffers = dma_alloc(BUFFER_SIZE * NUM_RX_DESC, BUFFER_SIZE);
+            let tx_buffers = dma_alloc(BUFFER_SIZE * NUM_TX_DESC, BUFFER_SIZE);
+
+            if rx_ring.is_null() || tx_ring.is_null() || rx_buffers.is_null() || tx_buffers.is_null() {
+                // dma_free ignores null buffers
+                dma_free(rx_ring);
+                dma_free(tx_ring);
+                dma_free(rx_buffers);
+                dma_free(tx_buffers);
                 return None;
             }
 
-            // Allocate packet buffers
-            let mut rx_buffers = Vec::new();
-            let mut tx_buffers = Vec::new();
-
-            for _ in 0..NUM_RX_DESC {
-                let buf = rust_kmalloc(2048);
-                if buf.is_null() {
-                    // Cleanup on failure
-                    for b in rx_buffers {
-                        rust_kfree(b);
-                    }
-                    rust_kfree(rx_descs as *mut u8);
-                    rust_kfree(tx_descs as *mut u8);
-                    return None;
-                }
-                rx_buffers.push(buf);
-            }
-
-            for _ in 0..NUM_TX_DESC {
-                let buf = rust_kmalloc(2048);
-                if buf.is_null() {
-                    // Cleanup on failure
-                    for b in rx_buffers {
-                        rust_kfree(b);
-                    }
-                    for b in tx_buffers {
-                        rust_kfree(b);
-                    }
-                    rust_kfree(rx_descs as *mut u8);
-                    rust_kfree(tx_descs as *mut u8);
-                    return None;
-                }
-                tx_buffers.push(buf);
-            }
-
             let mut device = E1000Device {
                 mem_base,
                 mac_address: [0; 6],
-                rx_descs,
-                tx_descs,
+                rx_ring,
+                tx_ring,
+                rx_descs: rx_ring.virt as *mut RxDescriptor,
+                tx_descs: tx_ring.virt as *mut TxDescriptor,
                 rx_buffers,
                 tx_buffers,
                 rx_current: 0,
@@ -290,12 +264,12 @@ impl E1000Device {
             // Setup RX descriptors
             for i in 0..NUM_RX_DESC {
                 let desc = &mut *self.rx_descs.add(i);
-                desc.addr = self.rx_buffers[i] as u64;
+                desc.addr = self.rx_buffers.phys + (i * BUFFER_SIZE) as u64;
                 desc.status = 0;
             }
 
-            self.write_reg(REG_RXDESCLO, self.rx_descs as u32);
-            self.write_reg(REG_RXDESCHI, ((self.rx_descs as u64) >> 32) as u32);
+            self.write_reg(REG_RXDESCLO, self.rx_ring.phys as u32);
+            self.write_reg(REG_RXDESCHI, (self.rx_ring.phys >> 32) as u32);
             self.write_reg(REG_RXDESCLEN, (NUM_RX_DESC * core::mem::size_of::<RxDescriptor>()) as u32);
             self.write_reg(REG_RXDESCHEAD, 0);
             self.write_reg(REG_RXDESCTAIL, (NUM_RX_DESC - 1) as u32);
@@ -303,13 +277,13 @@ impl E1000Device {
             // Setup TX descriptors
             for i in 0..NUM_TX_DESC {
                 let desc = &mut *self.tx_descs.add(i);
-                desc.addr = self.tx_buffers[i] as u64;
+                desc.addr = self.tx_buffers.phys + (i * BUFFER_SIZE) as u64;
                 desc.status = DESC_STATUS_DD;
                 desc.cmd = 0;
             }
 
-            self.write_reg(REG_TXDESCLO, self.tx_descs as u32);
-            self.write_reg(REG_TXDESCHI, ((self.tx_descs as u64) >> 32) as u32);
+            self.write_reg(REG_TXDESCLO, self.tx_ring.phys as u32);
+            self.write_reg(REG_TXDESCHI, (self.tx_ring.phys >> 32) as u32);
             self.write_reg(REG_TXDESCLEN, (NUM_TX_DESC * core::mem::size_of::<TxDescriptor>()) as u32);
             self.write_reg(REG_TXDESCHEAD, 0);
             self.write_reg(REG_TXDESCTAIL, 0);
@@ -330,7 +304,7 @@ impl E1000Device {
     }
 
     pub fn transmit(&mut self, data: &[u8]) -> Result<(), &'static str> {
-        if data.len() > 2048 {
+        if data.len() > BUFFER_SIZE {
             return Err("Packet too large");
         }
 
@@ -343,7 +317,7 @@ impl E1000Device {
             }
 
             // Copy data to buffer
-            core::ptr::copy_nonoverlapping(data.as_ptr(), self.tx_buffers[self.tx_current], data.len());
+            core::ptr::copy_nonoverlapping(data.as_ptr(), self.tx_buffers.virt.add(self.tx_current * BUFFER_SIZE), data.len());
 
             // Setup descriptor
             desc.length = data.len() as u16;
@@ -368,7 +342,7 @@ impl E1000Device {
 
             let length = desc.length as usize;
             let mut packet = Vec::with_capacity(length);
-            let data = core::slice::from_raw_parts(self.rx_buffers[self.rx_current], length);
+            let data = core::slice::from_raw_parts(self.rx_buffers.virt.add(self.rx_current * BUFFER_SIZE), length);
             packet.extend_from_slice(data);
 
             // Basic RX debug dump (first 32 bytes)
@@ -406,16 +380,10 @@ impl E1000Device {
 
 impl Drop for E1000Device {
     fn drop(&mut self) {
-        unsafe {
-            for buf in &self.rx_buffers {
-                rust_kfree(*buf);
-            }
-            for buf in &self.tx_buffers {
-                rust_kfree(*buf);
-            }
-            rust_kfree(self.rx_descs as *mut u8);
-            rust_kfree(self.tx_descs as *mut u8);
-        }
+        dma_free(self.rx_buffers);
+        dma_free(self.tx_buffers);
+        dma_free(self.rx_ring);
+        dma_free(self.tx_ring);
     }
 }
 
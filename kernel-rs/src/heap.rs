@@ -1,6 +1,9 @@
 use core::mem::size_of;
 use core::ptr::null_mut;
 
+use crate::heap_profile;
+use crate::memory::{phys_to_virt, virt_to_phys};
+
 extern "C" {
     fn serial_write(s: *const u8);
 }
@@ -26,9 +29,35 @@ fn serial_write_hex(val: u64) {
 }
 
 
-const HEAP_SIZE: usize = 1024 * 1024 * 4; // 4 MiB
+extern "C" {
+    fn alloc_page() -> *mut u8;
+    fn free_page(addr: *mut u8);
+    fn alloc_pages(order: u32) -> *mut u8;
+    fn alloc_pages_below(order: u32, limit: u64) -> *mut u8;
+    fn free_pages(addr: *mut u8, order: u32);
+    fn pmm_block_order(addr: *mut u8) -> i32;
+    fn map_page(virt_addr: u64, phys_addr: u64, flags: u64);
+    fn unmap_range(virt_addr: u64, size: u64);
+    fn get_phys_addr(virt_addr: u64) -> u64;
+}
+
+// The heap lives in its own slice of the kernel half of the address space
+// (PML4 slot 384, shared by every process PML4) and is backed by PMM frames
+// mapped on demand.
+const HEAP_VIRT_BASE: usize = 0xFFFF_C000_0000_0000;
+const HEAP_VIRT_SIZE: usize = 1024 * 1024 * 1024; // 1 GiB reserved
+const HEAP_INITIAL_SIZE: usize = 1024 * 1024; // 1 MiB
+const HEAP_DEFAULT_MAX: usize = 256 * 1024 * 1024; // 256 MiB
+const HEAP_GROW_MIN: usize = 64 * 1024;
+// Free space kept mapped at the end of the heap before pages go back to the PMM
+const HEAP_SHRINK_SLACK: usize = 256 * 1024;
 const ALIGNMENT: usize = 16;
 const BLOCK_MAGIC: u32 = 0xDEADBEEF;
+const PAGE_SIZE: usize = 4096;
+const HEAP_PAGES: usize = HEAP_VIRT_SIZE / PAGE_SIZE;
+const PTE_PRESENT: u64 = 0x1;
+const PTE_RW: u64 = 0x2;
+const PTE_GLOBAL: u64 = 0x100; // Shared by every address space
 
 #[repr(C, align(16))]
 pub struct Block {
@@ -39,29 +68,159 @@ pub struct Block {
     pub prev: *mut Block,
 }
 
-#[repr(align(16))]
-struct AlignedHeap([u8; HEAP_SIZE]);
-static mut HEAP: AlignedHeap = AlignedHeap([0; HEAP_SIZE]);
 static mut HEAP_HEAD: *mut Block = null_mut();
+static mut HEAP_TAIL: *mut Block = null_mut();
+static mut HEAP_MAPPED: usize = 0; // Bytes mapped from HEAP_VIRT_BASE
+static mut HEAP_MAX: usize = HEAP_DEFAULT_MAX;
+// For every heap page owned by a slab: log2(slab pages) + 1, 0 otherwise.
+// Slabs are aligned to their size, so this locates the slab header of any
+// object and lets rust_kfree() tell slab objects from block allocations.
+static mut PAGE_OWNER: [u8; HEAP_PAGES] = [0; HEAP_PAGES];
+
+extern "C" {
+    fn klock_irqsave() -> u64;
+    fn klock_irqrestore(rflags: u64);
+}
+
+/// Disable interrupts and take the kernel lock (kernel/smp.h), so the
+/// section also excludes the other CPUs. Nests.
+pub fn irq_save() -> u64 {
+    unsafe { klock_irqsave() }
+}
+
+pub fn irq_restore(flags: u64) {
+    unsafe { klock_irqrestore(flags) }
+}
+
+/// Map up to `bytes` (page-rounded) of fresh frames at the end of the heap.
+/// Returns the number of bytes actually added.
+unsafe fn heap_map_more(bytes: usize) -> usize {
+    let mut want = (bytes + PAGE_SIZE - 1) & !(PAGE_SIZE - 1);
+    if HEAP_MAPPED + want > HEAP_MAX {
+        want = HEAP_MAX.saturating_sub(HEAP_MAPPED) & !(PAGE_SIZE - 1);
+    }
+    let mut added = 0;
+    while added < want {
+        let frame = alloc_page();
+        if frame.is_null() {
+            break;
+        }
+        map_page((HEAP_VIRT_BASE + HEAP_MAPPED + added) as u64, virt_to_phys(frame), PTE_PRESENT | PTE_RW | PTE_GLOBAL);
+        added += PAGE_SIZE;
+    }
+    HEAP_MAPPED += added;
+    added
+}
+
+/// Extend the heap so that a free block of at least `size` bytes (plus
+/// alignment slack) exists at its end.
+unsafe fn heap_grow(size: usize) -> bool {
+    if HEAP_TAIL.is_null() {
+        return false;
+    }
+    let hdr = size_of::<Block>();
+    let old_end = HEAP_VIRT_BASE + HEAP_MAPPED;
+    let mut need = size + 2 * hdr;
+    if !HEAP_TAIL.is_null() && (*HEAP_TAIL).is_free {
+        need = need.saturating_sub((*HEAP_TAIL).size);
+    }
+    let added = heap_map_more(need.max(HEAP_GROW_MIN));
+    if added == 0 {
+        return false;
+    }
+    let tail = HEAP_TAIL;
+    if (*tail).is_free {
+        (*tail).size += added;
+    } else {
+        let block = old_end as *mut Block;
+        (*block).magic = BLOCK_MAGIC;
+        (*block).size = added - hdr;
+        (*block).is_free = true;
+        (*block).next = null_mut();
+        (*block).prev = tail;
+        (*tail).next = block;
+        HEAP_TAIL = block;
+    }
+    true
+}
+
+/// Give whole pages at the end of the heap back to the PMM once the free
+/// tail is comfortably larger than HEAP_SHRINK_SLACK.
+unsafe fn heap_shrink() {
+    let tail = HEAP_TAIL;
+    if tail.is_null() || !(*tail).is_free {
+        return;
+    }
+    let hdr = size_of::<Block>();
+    let end = HEAP_VIRT_BASE + HEAP_MAPPED;
+    let mut keep_end = (tail as usize + hdr + HEAP_SHRINK_SLACK + PAGE_SIZE - 1) & !(PAGE_SIZE - 1);
+    if keep_end < HEAP_VIRT_BASE + HEAP_INITIAL_SIZE {
+        keep_end = HEAP_VIRT_BASE + HEAP_INITIAL_SIZE;
+    }
+    if keep_end >= end || end - keep_end < HEAP_SHRINK_SLACK {
+        return;
+    }
+    let release = end - keep_end;
+    // Interrupts are off, so nothing can reuse the frames before the
+    // batched TLB invalidation below
+    let mut virt = keep_end;
+    while virt < end {
+        let phys = get_phys_addr(virt as u64);
+        if phys != 0 {
+            free_page(phys_to_virt(phys));
+        }
+        virt += PAGE_SIZE;
+    }
+    unmap_range(keep_end as u64, release as u64);
+    (*tail).size -= release;
+    HEAP_MAPPED -= release;
+}
 
 #[no_mangle]
 pub extern "C" fn init_heap() {
     unsafe {
-        let head = HEAP.0.as_mut_ptr() as *mut Block;
-        let heap_base = HEAP.0.as_ptr() as usize;
-        let heap_end = heap_base + HEAP_SIZE;
+        HEAP_MAPPED = 0;
+        PAGE_OWNER = [0; HEAP_PAGES];
+        if heap_map_more(HEAP_INITIAL_SIZE) < PAGE_SIZE {
+            serial_write(b"[HEAP-ERROR] Could not map initial heap\n\0".as_ptr());
+            return;
+        }
+        let head = HEAP_VIRT_BASE as *mut Block;
         (*head).magic = BLOCK_MAGIC;
-        (*head).size = HEAP_SIZE - size_of::<Block>();
+        (*head).size = HEAP_MAPPED - size_of::<Block>();
         (*head).is_free = true;
         (*head).next = null_mut();
         (*head).prev = null_mut();
         HEAP_HEAD = head;
+        HEAP_TAIL = head;
         serial_write(b"[MEM] Paging enabled, heap at 0x\0".as_ptr());
-        serial_write_hex(heap_base as u64);
+        serial_write_hex(HEAP_VIRT_BASE as u64);
         serial_write(b"-0x\0".as_ptr());
-        serial_write_hex(heap_end as u64);
+        serial_write_hex((HEAP_VIRT_BASE + HEAP_MAPPED) as u64);
+        serial_write(b", max 0x\0".as_ptr());
+        serial_write_hex(HEAP_MAX as u64);
         serial_write(b"\n\0".as_ptr());
     }
+    crate::slab::init();
+}
+
+/// Set the maximum heap size in bytes. Fails if the value is below what is
+/// already mapped or above the reserved virtual range.
+#[no_mangle]
+pub extern "C" fn rust_heap_set_max(bytes: usize) -> i32 {
+    let bytes = bytes & !(PAGE_SIZE - 1);
+    unsafe {
+        if bytes < HEAP_MAPPED || bytes > HEAP_VIRT_SIZE {
+            return -1;
+        }
+        HEAP_MAX = bytes;
+    }
+    0
+}
+
+/// Bytes currently mapped for the heap and its configured maximum.
+pub fn heap_size() -> (usize, usize) {
+    unsafe { (HEAP_MAPPED, HEAP_MAX) }
 }
 
 #[no_mangle]
@@ -69,50 +228,268 @@ pub extern "C" fn rust_get_block_header_size() -> usize {
     size_of::<Block>()
 }
 
-#[no_mangle]
-pub extern "C" fn rust_kmalloc(size: usize) -> *mut u8 {
-    unsafe {
-        if size == 0 {
+/// First-fit allocation of `size` bytes whose payload starts on an `align`
+/// boundary, growing the heap when no free block fits.
+unsafe fn block_alloc(size: usize, align: usize) -> *mut u8 {
+    loop {
+        let ptr = block_alloc_fit(size, align);
+        if !ptr.is_null() {
+            return ptr;
+        }
+        if !heap_grow(size + align) {
+            serial_write(b"[HEAP-ERROR] Out of memory!\n\0".as_ptr());
             return null_mut();
         }
+    }
+}
 
-        let aligned_size = (size + (ALIGNMENT - 1)) & !(ALIGNMENT - 1);
-        let mut current = HEAP_HEAD;
+/// A misaligned free block is split so the gap in front of the payload stays
+/// on the list as a smaller free block.
+unsafe fn block_alloc_fit(size: usize, align: usize) -> *mut u8 {
+    let hdr = size_of::<Block>();
+    let aligned_size = (size + (ALIGNMENT - 1)) & !(ALIGNMENT - 1);
+    let mut current = HEAP_HEAD;
 
-        while !current.is_null() {
-            let block = &mut *current;
-            if block.is_free && block.size >= aligned_size {
-                // This block is large enough.
-                // Check if we need to split it.
-                if block.size > aligned_size + size_of::<Block>() {
-                    // Split the block.
-                    let new_block_addr = (current as usize) + size_of::<Block>() + aligned_size;
-                    let new_block = new_block_addr as *mut Block;
-                    
+    while !current.is_null() {
+        let block = &mut *current;
+        if block.is_free {
+            let start = current as usize;
+            let end = start + hdr + block.size;
+            let mut payload = (start + hdr + align - 1) & !(align - 1);
+            // A leading gap must be large enough to hold a free block of its own
+            while payload != start + hdr && payload - hdr - start < hdr + ALIGNMENT {
+                payload += align;
+            }
+            if payload + aligned_size <= end {
+                let mut cur = current;
+                if payload != start + hdr {
+                    let new_block = (payload - hdr) as *mut Block;
                     (*new_block).magic = BLOCK_MAGIC;
-                    (*new_block).size = block.size - aligned_size - size_of::<Block>();
+                    (*new_block).size = end - payload;
                     (*new_block).is_free = true;
                     (*new_block).next = block.next;
                     (*new_block).prev = current;
-
                     if !block.next.is_null() {
                         (*block.next).prev = new_block;
                     }
-                    
-                    // The original block is now smaller.
-                    block.size = aligned_size;
+                    block.size = (new_block as usize) - start - hdr;
                     block.next = new_block;
+                    if HEAP_TAIL == current {
+                        HEAP_TAIL = new_block;
+                    }
+                    cur = new_block;
                 }
-                
-                block.is_free = false;
-                return (current as *mut u8).add(size_of::<Block>());
+                let b = &mut *cur;
+                // Split off the tail if it can hold another block
+                if b.size > aligned_size + hdr {
+                    let tail = ((cur as usize) + hdr + aligned_size) as *mut Block;
+                    (*tail).magic = BLOCK_MAGIC;
+                    (*tail).size = b.size - aligned_size - hdr;
+                    (*tail).is_free = true;
+                    (*tail).next = b.next;
+                    (*tail).prev = cur;
+                    if !b.next.is_null() {
+                        (*b.next).prev = tail;
+                    }
+                    b.size = aligned_size;
+                    b.next = tail;
+                    if HEAP_TAIL == cur {
+                        HEAP_TAIL = tail;
+                    }
+                }
+                b.is_free = false;
+                return (cur as *mut u8).add(hdr);
             }
-            current = block.next;
         }
+        current = block.next;
+    }
+    null_mut()
+}
+
+unsafe fn block_free(ptr: *mut u8) {
+    let block_ptr = ptr.sub(size_of::<Block>()) as *mut Block;
+    let block = &mut *block_ptr;
+
+    if block.magic != BLOCK_MAGIC || block.is_free {
+        serial_write(b"[HEAP-ERROR] Invalid free() or double free!\n\0".as_ptr());
+        return;
+    }
+
+    block.is_free = true;
+
+    // Coalesce with next block
+    if !block.next.is_null() {
+        let next_block = &mut *block.next;
+        if next_block.is_free {
+            block.size += size_of::<Block>() + next_block.size;
+            block.next = next_block.next;
+            if !next_block.next.is_null() {
+                (*next_block.next).prev = block_ptr;
+            } else {
+                HEAP_TAIL = block_ptr;
+            }
+        }
+    }
+
+    // Coalesce with previous block
+    if !block.prev.is_null() {
+        let prev_block = &mut *block.prev;
+        if prev_block.is_free {
+            prev_block.size += size_of::<Block>() + block.size;
+            prev_block.next = block.next;
+            if !block.next.is_null() {
+                (*block.next).prev = block.prev;
+            } else {
+                HEAP_TAIL = block.prev;
+            }
+        }
+    }
+
+    heap_shrink();
+}
+
+/// Allocation of a power-of-two number of pages, aligned to its own size;
+/// used by the slab allocator for its slabs.
+pub fn page_alloc(bytes: usize) -> *mut u8 {
+    unsafe { block_alloc(bytes, bytes) }
+}
+
+pub fn page_free(ptr: *mut u8) {
+    unsafe { block_free(ptr) }
+}
+
+/// Mark the pages of the slab at `base` as slab-owned (or not).
+pub fn set_page_owner(base: *mut u8, bytes: usize, owned: bool) {
+    unsafe {
+        let first = (base as usize - HEAP_VIRT_BASE) / PAGE_SIZE;
+        let pages = bytes / PAGE_SIZE;
+        let tag = if owned { pages.trailing_zeros() as u8 + 1 } else { 0 };
+        for i in first..first + pages {
+            PAGE_OWNER[i] = tag;
+        }
+    }
+}
+
+/// Slab header owning `ptr`, or null if `ptr` is a block allocation.
+fn page_owner(ptr: *mut u8) -> *mut u8 {
+    unsafe {
+        let addr = ptr as usize;
+        if addr < HEAP_VIRT_BASE || addr >= HEAP_VIRT_BASE + HEAP_MAPPED {
+            return null_mut();
+        }
+        let tag = PAGE_OWNER[(addr - HEAP_VIRT_BASE) / PAGE_SIZE] as usize;
+        if tag == 0 {
+            null_mut()
+        } else {
+            let slab_bytes = PAGE_SIZE << (tag - 1);
+            (addr & !(slab_bytes - 1)) as *mut u8
+        }
+    }
+}
+
+/// A physically contiguous DMA buffer: `virt` is its direct-map address for
+/// the CPU, `phys` the bus address to program into the device.
+#[derive(Clone, Copy)]
+pub struct DmaBuffer {
+    pub virt: *mut u8,
+    pub phys: u64,
+    pub size: usize,
+}
+
+impl DmaBuffer {
+    pub const fn null() -> Self {
+        DmaBuffer { virt: null_mut(), phys: 0, size: 0 }
+    }
+
+    pub fn is_null(&self) -> bool {
+        self.virt.is_null()
+    }
+}
+
+// Limit for devices whose DMA engines only take 32-bit addresses
+pub const DMA_LIMIT_32BIT: u64 = 1 << 32;
+
+/// Physically contiguous memory for device DMA, straight from the PMM
+/// (the heap is only virtually contiguous). Buddy blocks are aligned to
+/// their own size, so `align` (a power of two) is met by rounding the
+/// block up to it. Returns a null buffer on failure.
+pub fn dma_alloc(size: usize, align: usize) -> DmaBuffer {
+    dma_alloc_below(size, align, 0)
+}
 
-        serial_write(b"[HEAP-ERROR] Out of memory!\n\0".as_ptr());
-        null_mut()
+/// Like dma_alloc(), but the whole buffer lies below the physical address
+/// `limit` (0 = no limit).
+pub fn dma_alloc_below(size: usize, align: usize, limit: u64) -> DmaBuffer {
+    if size == 0 || !align.is_power_of_two() {
+        return DmaBuffer::null();
+    }
+    let bytes = size.max(align);
+    let mut order = 0;
+    while (PAGE_SIZE << order) < bytes {
+        order += 1;
+    }
+    let virt = unsafe {
+        if limit == 0 { alloc_pages(order) } else { alloc_pages_below(order, limit) }
+    };
+    if virt.is_null() {
+        return DmaBuffer::null();
     }
+    DmaBuffer { virt, phys: virt_to_phys(virt), size: PAGE_SIZE << order }
+}
+
+pub fn dma_free(buf: DmaBuffer) {
+    if buf.is_null() {
+        return;
+    }
+    unsafe {
+        let order = pmm_block_order(buf.virt);
+        if order >= 0 {
+            free_pages(buf.virt, order as u32);
+        }
+    }
+}
+
+/// Allocate `size` bytes aligned to `align` (a power of two) and record
+/// them under `tag` (the current tag if it is out of range) for the heap
+/// profile. Slab objects are only ALIGNMENT-aligned, so stricter requests
+/// are carved out of the block heap.
+pub fn kmalloc_aligned_tagged(size: usize, align: usize, tag: u8, caller: usize) -> *mut u8 {
+    if size == 0 || !align.is_power_of_two() {
+        return null_mut();
+    }
+    let flags = irq_save();
+    let ptr = if size <= crate::slab::SLAB_MAX_SIZE && align <= ALIGNMENT {
+        crate::slab::kmalloc_small(size)
+    } else {
+        unsafe { block_alloc(size, align.max(ALIGNMENT)) }
+    };
+    let tag = if tag as usize >= heap_profile::NUM_TAGS { heap_profile::current_tag() } else { tag };
+    unsafe { heap_profile::record_alloc(ptr, size, tag, caller); }
+    irq_restore(flags);
+    ptr
+}
+
+pub fn kmalloc_tagged(size: usize, tag: u8, caller: usize) -> *mut u8 {
+    kmalloc_aligned_tagged(size, ALIGNMENT, tag, caller)
+}
+
+#[no_mangle]
+pub extern "C" fn rust_kmalloc(size: usize) -> *mut u8 {
+    kmalloc_tagged(size, heap_profile::TAG_CURRENT, 0)
+}
+
+/// Allocation honoring `align`; used by the Rust global allocator.
+#[no_mangle]
+pub extern "C" fn rust_kmalloc_aligned(size: usize, align: usize) -> *mut u8 {
+    kmalloc_aligned_tagged(size, align, heap_profile::TAG_CURRENT, 0)
+}
+
+/// C entry point for tagged allocations; a negative tag means the current
+/// one, `caller` is the call site reported by the leak check.
+#[no_mangle]
+pub extern "C" fn rust_kmalloc_tagged(size: usize, tag: i32, caller: *const u8) -> *mut u8 {
+    let tag = if tag < 0 { heap_profile::TAG_CURRENT } else { tag as u8 };
+    kmalloc_tagged(size, tag, caller as usize)
 }
 
 #[no_mangle]
@@ -120,51 +497,132 @@ pub extern "C" fn rust_kfree(ptr: *mut u8) {
     if ptr.is_null() {
         return;
     }
-    
+    let flags = irq_save();
     unsafe {
-        let block_ptr = (ptr as *mut u8).sub(size_of::<Block>()) as *mut Block;
-        let block = &mut *block_ptr;
-        
-        if block.magic != BLOCK_MAGIC || block.is_free {
-            serial_write(b"[HEAP-ERROR] Invalid free() or double free!\n\0".as_ptr());
-            return;
+        heap_profile::record_free(ptr);
+        let slab = page_owner(ptr);
+        if !slab.is_null() {
+            crate::slab::free_in_slab(slab, ptr);
+        } else {
+            block_free(ptr);
         }
+    }
+    irq_restore(flags);
+}
 
-        block.is_free = true;
+// Free-block size histogram buckets: <64, <256, <1K, <4K, <16K, <64K,
+// <256K and everything larger
+pub const HEAP_HIST_BUCKETS: usize = 8;
 
-        // Coalesce with next block
-        if !block.next.is_null() {
-            let next_block = &mut *block.next;
-            if next_block.is_free {
-                block.size += size_of::<Block>() + next_block.size;
-                block.next = next_block.next;
-                if !next_block.next.is_null() {
-                    (*next_block.next).prev = block_ptr;
-                }
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct HeapStats {
+    pub mapped: usize,
+    pub max: usize,
+    pub used_bytes: usize,  // Payload of allocated blocks (slabs included)
+    pub free_bytes: usize,  // Payload of free blocks
+    pub used_blocks: usize,
+    pub free_blocks: usize,
+    pub largest_free: usize,
+    pub histogram: [usize; HEAP_HIST_BUCKETS],
+}
+
+fn hist_bucket(size: usize) -> usize {
+    let mut bucket = 0;
+    let mut limit = 64;
+    while bucket < HEAP_HIST_BUCKETS - 1 && size >= limit {
+        bucket += 1;
+        limit <<= 2;
+    }
+    bucket
+}
+
+/// Walk the block list and summarize it.
+pub fn heap_stats() -> HeapStats {
+    let mut st = HeapStats {
+        mapped: 0, max: 0, used_bytes: 0, free_bytes: 0, used_blocks: 0, free_blocks: 0,
+        largest_free: 0, histogram: [0; HEAP_HIST_BUCKETS],
+    };
+    let flags = irq_save();
+    unsafe {
+        st.mapped = HEAP_MAPPED;
+        st.max = HEAP_MAX;
+        let mut current = HEAP_HEAD;
+        while !current.is_null() {
+            let b = &*current;
+            if b.is_free {
+                st.free_bytes += b.size;
+                st.free_blocks += 1;
+                st.largest_free = st.largest_free.max(b.size);
+                st.histogram[hist_bucket(b.size)] += 1;
+            } else {
+                st.used_bytes += b.size;
+                st.used_blocks += 1;
             }
+            current = b.next;
         }
+    }
+    irq_restore(flags);
+    st
+}
 
-        // Coalesce with previous block
-        if !block.prev.is_null() {
-            let prev_block = &mut *block.prev;
-            if prev_block.is_free {
-                prev_block.size += size_of::<Block>() + block.size;
-                prev_block.next = block.next;
-                if !block.next.is_null() {
-                    (*block.next).prev = block.prev;
-                }
+/// Check the block list: headers intact, links consistent, blocks back to
+/// back inside the mapped heap and no two free neighbours left uncoalesced.
+pub fn heap_validate() -> bool {
+    let hdr = size_of::<Block>();
+    let flags = irq_save();
+    let mut ok = true;
+    unsafe {
+        let end = HEAP_VIRT_BASE + HEAP_MAPPED;
+        let mut prev: *mut Block = null_mut();
+        let mut current = HEAP_HEAD;
+        while !current.is_null() {
+            let addr = current as usize;
+            let b = &*current;
+            let why: &[u8] = if addr < HEAP_VIRT_BASE || addr + hdr > end {
+                b"block outside the heap\0"
+            } else if b.magic != BLOCK_MAGIC {
+                b"bad block magic\0"
+            } else if b.prev != prev {
+                b"broken prev link\0"
+            } else if addr + hdr + b.size > end {
+                b"block runs past the heap end\0"
+            } else if !b.next.is_null() && b.next as usize != addr + hdr + b.size {
+                b"gap or overlap before next block\0"
+            } else if b.next.is_null() && current != HEAP_TAIL {
+                b"last block is not the tail\0"
+            } else if b.is_free && !prev.is_null() && (*prev).is_free {
+                b"uncoalesced free blocks\0"
+            } else {
+                b""
+            };
+            if !why.is_empty() {
+                serial_write(b"[HEAP-ERROR] Validation failed at 0x\0".as_ptr());
+                serial_write_hex(addr as u64);
+                serial_write(b": \0".as_ptr());
+                serial_write(why.as_ptr());
+                serial_write(b"\n\0".as_ptr());
+                ok = false;
+                break;
             }
+            prev = current;
+            current = b.next;
         }
     }
+    irq_restore(flags);
+    ok
 }
 
-// Stubs for functions that were removed but might still be called elsewhere
 #[no_mangle]
 pub extern "C" fn rust_heap_validate() -> bool {
-    true // Bump allocator is always valid
+    heap_validate()
 }
 
 #[no_mangle]
-pub extern "C" fn rust_heap_stats() -> (usize, usize, usize) {
-    (0, 0, 0) // Not implemented for bump allocator
+pub extern "C" fn rust_heap_stats(out: *mut HeapStats) -> i32 {
+    if out.is_null() {
+        return -1;
+    }
+    unsafe { *out = heap_stats(); }
+    0
 }
@@ -0,0 +1,256 @@
+// Heap allocation profiling.
+//
+// Every live allocation made through rust_kmalloc(), the slab cache API or
+// the Rust global allocator is recorded in a fixed-size open-addressing
+// table keyed by its address, together with its size, the subsystem tag in
+// effect when it was made, the calling address (C callers only) and the
+// tick it was made at. Per-tag live and peak byte counts are updated as
+// allocations come and go, and the table is what the leak report walks.
+// Once the table is full, further allocations still succeed but are only
+// counted as untracked.
+//
+// Subsystems tag their allocations by holding a TagScope (Rust) or via
+// rust_heap_set_tag()/kmalloc_tagged() (C) around the code that allocates.
+// The current tag is per CPU and travels with the running context across
+// task switches (scheduler.rs), so scopes on different CPUs stay separate.
+// All functions here are called with interrupts disabled by heap.rs.
+
+use crate::scheduler::MAX_CPUS;
+
+extern "C" {
+    fn timer_get_ticks() -> u64;
+    fn smp_cpu_id() -> u32;
+}
+
+#[repr(u8)]
+#[derive(Clone, Copy, PartialEq)]
+pub enum HeapTag {
+    Other = 0,
+    Process = 1,
+    Vfs = 2,
+    Ext2 = 3,
+    Net = 4,
+    Shell = 5,
+}
+
+pub const NUM_TAGS: usize = 6;
+// Stands for this CPU's current tag; the allocator resolves it with
+// interrupts disabled so the task cannot migrate in between
+pub const TAG_CURRENT: u8 = NUM_TAGS as u8;
+pub const TAG_NAMES: [&[u8]; NUM_TAGS] = [b"other", b"process", b"vfs", b"ext2", b"net", b"shell"];
+
+pub const TICKS_PER_SEC: u64 = 100; // timer_init(100) in kernel.c
+
+const TRACK_SLOTS: usize = 8192; // Power of two
+const TRACK_SHIFT: u32 = 64 - 13;
+
+#[derive(Clone, Copy)]
+pub struct TrackEntry {
+    pub ptr: usize, // 0 = empty slot
+    pub size: usize,
+    pub caller: usize,
+    pub tick: u64,
+    pub tag: u8,
+}
+
+impl TrackEntry {
+    const fn empty() -> Self {
+        TrackEntry { ptr: 0, size: 0, caller: 0, tick: 0, tag: 0 }
+    }
+}
+
+#[derive(Clone, Copy)]
+pub struct TagStats {
+    pub live_bytes: usize,
+    pub peak_bytes: usize,
+    pub live_allocs: usize,
+    pub total_allocs: u64,
+}
+
+impl TagStats {
+    const fn empty() -> Self {
+        TagStats { live_bytes: 0, peak_bytes: 0, live_allocs: 0, total_allocs: 0 }
+    }
+}
+
+#[derive(Clone, Copy)]
+pub struct ProfileTotals {
+    pub live_bytes: usize,
+    pub peak_bytes: usize,
+    pub tracked: usize,
+    pub untracked: u64,
+}
+
+static mut TRACK: [TrackEntry; TRACK_SLOTS] = [const { TrackEntry::empty() }; TRACK_SLOTS];
+static mut TRACKED: usize = 0;
+static mut UNTRACKED: u64 = 0;
+static mut TAG_STATS: [TagStats; NUM_TAGS] = [const { TagStats::empty() }; NUM_TAGS];
+static mut LIVE_BYTES: usize = 0;
+static mut PEAK_BYTES: usize = 0;
+static mut CURRENT_TAG: [u8; MAX_CPUS] = [HeapTag::Other as u8; MAX_CPUS];
+
+/// Tags allocations made while it is alive; the previous tag is restored
+/// when it is dropped, so scopes nest (also across interrupts).
+pub struct TagScope(u8);
+
+impl TagScope {
+    pub fn new(tag: HeapTag) -> Self {
+        TagScope(set_tag(tag as u8))
+    }
+}
+
+impl Drop for TagScope {
+    fn drop(&mut self) {
+        set_tag(self.0);
+    }
+}
+
+/// Make `tag` this CPU's current tag and return the previous one.
+pub fn set_tag(tag: u8) -> u8 {
+    // Not migrated between reading the CPU number and updating its slot
+    let flags = crate::heap::irq_save();
+    let prev = unsafe {
+        let slot = &mut CURRENT_TAG[smp_cpu_id() as usize];
+        let prev = *slot;
+        *slot = if (tag as usize) < NUM_TAGS { tag } else { HeapTag::Other as u8 };
+        prev
+    };
+    crate::heap::irq_restore(flags);
+    prev
+}
+
+/// This CPU's current tag. Called with interrupts disabled.
+pub fn current_tag() -> u8 {
+    unsafe { CURRENT_TAG[smp_cpu_id() as usize] }
+}
+
+fn slot_of(ptr: usize) -> usize {
+    ((ptr >> 4) as u64).wrapping_mul(0x9E37_79B9_7F4A_7C15) as usize >> TRACK_SHIFT
+}
+
+pub unsafe fn record_alloc(ptr: *mut u8, size: usize, tag: u8, caller: usize) {
+    if ptr.is_null() {
+        return;
+    }
+    let tag = if (tag as usize) < NUM_TAGS { tag } else { HeapTag::Other as u8 };
+    // Keep a quarter of the table empty so probe sequences stay short
+    if TRACKED >= TRACK_SLOTS - TRACK_SLOTS / 4 {
+        UNTRACKED += 1;
+        return;
+    }
+    let mut i = slot_of(ptr as usize);
+    while TRACK[i].ptr != 0 {
+        i = (i + 1) & (TRACK_SLOTS - 1);
+    }
+    TRACK[i] = TrackEntry { ptr: ptr as usize, size, caller, tick: timer_get_ticks(), tag };
+    TRACKED += 1;
+
+    let stats = &mut TAG_STATS[tag as usize];
+    stats.live_bytes += size;
+    stats.live_allocs += 1;
+    stats.total_allocs += 1;
+    if stats.live_bytes > stats.peak_bytes {
+        stats.peak_bytes = stats.live_bytes;
+    }
+    LIVE_BYTES += size;
+    if LIVE_BYTES > PEAK_BYTES {
+        PEAK_BYTES = LIVE_BYTES;
+    }
+}
+
+pub unsafe fn record_free(ptr: *mut u8) {
+    let mut i = slot_of(ptr as usize);
+    loop {
+        if TRACK[i].ptr == 0 {
+            return; // Untracked allocation
+        }
+        if TRACK[i].ptr == ptr as usize {
+            break;
+        }
+        i = (i + 1) & (TRACK_SLOTS - 1);
+    }
+    let entry = TRACK[i];
+    let stats = &mut TAG_STATS[entry.tag as usize];
+    stats.live_bytes -= entry.size;
+    stats.live_allocs -= 1;
+    LIVE_BYTES -= entry.size;
+    TRACKED -= 1;
+
+    // Backward-shift deletion: pull later entries of the probe sequence
+    // into the hole so lookups never need tombstones
+    let mut hole = i;
+    let mut j = i;
+    loop {
+        j = (j + 1) & (TRACK_SLOTS - 1);
+        if TRACK[j].ptr == 0 {
+            break;
+        }
+        let home = slot_of(TRACK[j].ptr);
+        let stays = if hole <= j { hole < home && home <= j } else { hole < home || home <= j };
+        if !stays {
+            TRACK[hole] = TRACK[j];
+            hole = j;
+        }
+    }
+    TRACK[hole] = TrackEntry::empty();
+}
+
+pub fn tag_stats() -> [TagStats; NUM_TAGS] {
+    let flags = crate::heap::irq_save();
+    let stats = unsafe { TAG_STATS };
+    crate::heap::irq_restore(flags);
+    stats
+}
+
+pub fn totals() -> ProfileTotals {
+    let flags = crate::heap::irq_save();
+    let t = unsafe {
+        ProfileTotals { live_bytes: LIVE_BYTES, peak_bytes: PEAK_BYTES, tracked: TRACKED, untracked: UNTRACKED }
+    };
+    crate::heap::irq_restore(flags);
+    t
+}
+
+/// Copy up to `out.len()` of the oldest allocations made at least
+/// `min_age_secs` ago into `out`, oldest first. Returns how many
+/// allocations qualify and how many of them were copied.
+pub fn leaks(min_age_secs: u64, out: &mut [TrackEntry]) -> (usize, usize) {
+    let flags = crate::heap::irq_save();
+    let mut found = 0;
+    let mut kept = 0;
+    unsafe {
+        let now = timer_get_ticks();
+        let min_age = min_age_secs * TICKS_PER_SEC;
+        for i in 0..TRACK_SLOTS {
+            let e = TRACK[i];
+            if e.ptr == 0 || now.saturating_sub(e.tick) < min_age {
+                continue;
+            }
+            found += 1;
+            // Insertion into `out`, sorted by age
+            let mut pos = kept;
+            while pos > 0 && out[pos - 1].tick > e.tick {
+                pos -= 1;
+            }
+            if pos < out.len() {
+                let end = if kept < out.len() { kept } else { out.len() - 1 };
+                let mut k = end;
+                while k > pos {
+                    out[k] = out[k - 1];
+                    k -= 1;
+                }
+                out[pos] = e;
+                if kept < out.len() {
+                    kept += 1;
+                }
+            }
+        }
+    }
+    crate::heap::irq_restore(flags);
+    (found, kept)
+}
+
+#[no_mangle]
+pub extern "C" fn rust_heap_set_tag(tag: i32) -> i32 {
+    set_tag(tag as u8) as i32
+}
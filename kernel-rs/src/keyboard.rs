@@ -70,6 +70,7 @@ pub fn handle_keyboard_interrupt() {
                 if let Some(ref mut buffer) = KEYBOARD_BUFFER {
                     if buffer.len() < 256 { // Prevent buffer overflow
                         buffer.push_back(ascii);
+                        crate::waitqueue::wake(input_channel(), true);
                     }
                 }
             }
@@ -120,6 +121,16 @@ pub fn clear_buffer() {
     }
 }
 
+// Wait channel for readers of the buffer
+fn input_channel() -> u64 {
+    core::ptr::addr_of!(KEYBOARD_BUFFER) as u64
+}
+
+/// Sleep until there is a character to read.
+pub fn wait_for_input() {
+    crate::waitqueue::wait_event(input_channel(), 0, buffer_has_data);
+}
+
 pub fn buffer_has_data() -> bool {
     if !KEYBOARD_INITIALIZED.load(Ordering::SeqCst) {
         return false;
@@ -0,0 +1,320 @@
+// Kernel same-page merging.
+//
+// A scanner run from the idle loop walks the private anonymous and code
+// pages of every user process and merges pages with identical contents into
+// one read-only frame, shared copy-on-write the way fork() shares pages: a
+// write to a merged page faults and gets a private copy (see cow_fault in
+// vm.rs). Pages that are entirely zero go back to the shared zero page.
+//
+// Merged ("KSM") frames are kept in the stable table, keyed by a hash of
+// their contents, which holds one reference on each; a frame leaves it once
+// that is the last reference. Unmerged pages seen during the current pass go
+// in the unstable table, so the second of two identical pages met in a pass
+// merges with the first. Pages written since the previous pass (PTE dirty
+// bit set) are likely to change again; they are only marked clean and
+// considered on the next pass.
+//
+// Pages are write-protected before they are compared, so they cannot change
+// between the comparison and the remap. Only pages with a single reference
+// are candidates: pages shared after fork() or mapped from the page cache
+// are shared already.
+
+use alloc::collections::BTreeMap;
+use alloc::vec::Vec;
+
+extern "C" {
+    fn rust_get_pte(pml4_phys: u64, virt: u64) -> *mut u64;
+    fn rust_get_pde(pml4_phys: u64, virt: u64) -> *mut u64;
+    fn page_get(phys: u64);
+    fn page_put(phys: u64);
+    fn page_refcount(phys: u64) -> u32;
+    fn paging_invalidate_page(cr3: u64, virt: u64);
+}
+
+use crate::memory::phys_to_virt;
+use crate::process::{self, MemoryRegion, MemoryRegionType, PrivilegeLevel, ProcessControlBlock, ProcessState};
+
+const PAGE_SIZE: u64 = 4096;
+const HUGE_PAGE_SIZE: u64 = 2 * 1024 * 1024;
+const USER_SPACE_END: u64 = 0x0000_8000_0000_0000;
+const PTE_PRESENT: u64 = 0x1;
+const PTE_RW: u64 = 0x2;
+const PTE_DIRTY: u64 = 0x40;
+const PTE_HUGE: u64 = 0x80;
+const PTE_COW: u64 = 0x200;
+const PTE_ADDR_MASK: u64 = 0x000F_FFFF_FFFF_F000;
+
+// Page table entries looked at per idle call
+const PAGES_PER_IDLE: usize = 64;
+
+#[derive(Clone, Copy)]
+struct Candidate {
+    pid: u32,
+    addr: u64,
+    phys: u64,
+}
+
+#[derive(Clone, Copy)]
+pub struct KsmStats {
+    pub enabled: bool,
+    pub shared: usize,  // KSM frames
+    pub sharing: usize, // Mappings of KSM frames
+    pub zero: u64,      // Pages returned to the zero page
+    pub merged: u64,
+    pub scanned: u64,
+    pub full_scans: u64,
+}
+
+static mut ENABLED: bool = true;
+static mut STABLE: BTreeMap<u64, Vec<u64>> = BTreeMap::new();
+static mut UNSTABLE: BTreeMap<u64, Candidate> = BTreeMap::new();
+// Where the scan resumes: a PID (0 = start a new pass) and an address in it
+static mut CURSOR_PID: u32 = 0;
+static mut CURSOR_ADDR: u64 = 0;
+static mut ZERO: u64 = 0;
+static mut MERGED: u64 = 0;
+static mut SCANNED: u64 = 0;
+static mut FULL_SCANS: u64 = 0;
+
+// FNV-1a over 64-bit words
+fn page_hash(page: *const u8) -> u64 {
+    let words = page as *const u64;
+    let mut h: u64 = 0xCBF2_9CE4_8422_2325;
+    for i in 0..(PAGE_SIZE / 8) as usize {
+        h ^= unsafe { *words.add(i) };
+        h = h.wrapping_mul(0x0000_0100_0000_01B3);
+    }
+    h
+}
+
+fn pages_equal(a: u64, b: u64) -> bool {
+    unsafe {
+        let a = core::slice::from_raw_parts(phys_to_virt(a), PAGE_SIZE as usize);
+        let b = core::slice::from_raw_parts(phys_to_virt(b), PAGE_SIZE as usize);
+        a == b
+    }
+}
+
+fn page_is_zero(phys: u64) -> bool {
+    let words = phys_to_virt(phys) as *const u64;
+    (0..(PAGE_SIZE / 8) as usize).all(|i| unsafe { *words.add(i) } == 0)
+}
+
+fn scannable_process(p: &ProcessControlBlock) -> bool {
+    p.privilege_level == PrivilegeLevel::User && p.state != ProcessState::Terminated && p.page_directory != 0
+}
+
+fn anonymous(r: &MemoryRegion) -> bool {
+    matches!(r.region_type, MemoryRegionType::Data | MemoryRegionType::Heap | MemoryRegionType::Stack)
+}
+
+fn scannable_region(r: &MemoryRegion) -> bool {
+    !r.shared && (anonymous(r) || r.region_type == MemoryRegionType::Code)
+}
+
+/// Make `pte` read-only, copy-on-write if it was writable.
+unsafe fn write_protect(cr3: u64, pte: *mut u64, addr: u64) {
+    if *pte & PTE_RW != 0 {
+        *pte = (*pte & !PTE_RW) | PTE_COW;
+        paging_invalidate_page(cr3, addr);
+    }
+}
+
+/// Point the write-protected `pte` at KSM frame `frame`, dropping the page
+/// it mapped.
+unsafe fn remap(cr3: u64, pte: *mut u64, addr: u64, frame: u64) {
+    let old = *pte & PTE_ADDR_MASK;
+    page_get(frame);
+    *pte = frame | (*pte & 0xFFF);
+    paging_invalidate_page(cr3, addr);
+    page_put(old);
+    MERGED += 1;
+}
+
+/// The PTE mapping candidate `c`, if it still maps the same unshared frame.
+unsafe fn candidate_pte(c: &Candidate) -> Option<(u64, *mut u64)> {
+    let cr3 = process::process_by_pid(c.pid).filter(|p| scannable_process(p))?.page_directory;
+    let pte = rust_get_pte(cr3, c.addr);
+    if pte.is_null() || *pte & PTE_PRESENT == 0 || *pte & PTE_ADDR_MASK != c.phys
+        || *pte & PTE_DIRTY != 0 || page_refcount(c.phys) != 1 {
+        return None;
+    }
+    Some((cr3, pte))
+}
+
+unsafe fn scan_page(pid: u32, cr3: u64, region: &MemoryRegion, addr: u64) {
+    let pte = rust_get_pte(cr3, addr);
+    if pte.is_null() || *pte & PTE_PRESENT == 0 {
+        return;
+    }
+    SCANNED += 1;
+    let phys = *pte & PTE_ADDR_MASK;
+    let zero = crate::vm::zero_page();
+    if phys == zero || page_refcount(phys) != 1 {
+        return;
+    }
+    if *pte & PTE_DIRTY != 0 {
+        *pte &= !PTE_DIRTY;
+        paging_invalidate_page(cr3, addr);
+        return;
+    }
+
+    // The write-fault path only replaces the zero page in anonymous memory
+    if zero != 0 && anonymous(region) && page_is_zero(phys) {
+        write_protect(cr3, pte, addr);
+        if page_is_zero(phys) {
+            *pte = zero | (*pte & 0xFFF & !PTE_COW);
+            paging_invalidate_page(cr3, addr);
+            page_put(phys);
+            ZERO += 1;
+        }
+        return;
+    }
+    let hash = page_hash(phys_to_virt(phys));
+    if let Some(frames) = STABLE.get(&hash) {
+        write_protect(cr3, pte, addr);
+        if let Some(&frame) = frames.iter().find(|&&f| pages_equal(f, phys)) {
+            remap(cr3, pte, addr, frame);
+            return;
+        }
+    }
+    if let Some(c) = UNSTABLE.get(&hash).copied() {
+        if let Some((ccr3, cpte)) = candidate_pte(&c) {
+            write_protect(cr3, pte, addr);
+            write_protect(ccr3, cpte, c.addr);
+            if pages_equal(c.phys, phys) {
+                // The earlier page becomes the KSM frame
+                UNSTABLE.remove(&hash);
+                page_get(c.phys);
+                STABLE.entry(hash).or_insert_with(Vec::new).push(c.phys);
+                remap(cr3, pte, addr, c.phys);
+                return;
+            }
+        }
+    }
+    UNSTABLE.insert(hash, Candidate { pid, addr, phys });
+}
+
+/// Drop KSM frames nothing maps any more.
+unsafe fn prune_stable() {
+    STABLE.retain(|_, frames| {
+        frames.retain(|&f| {
+            if page_refcount(f) > 1 {
+                return true;
+            }
+            page_put(f);
+            false
+        });
+        !frames.is_empty()
+    });
+}
+
+/// Look at up to `budget` page table entries. Returns true when that
+/// finished a pass over every process.
+unsafe fn scan(mut budget: usize) -> bool {
+    while budget > 0 {
+        let current = process::process_by_pid(CURSOR_PID).map_or(false, |p| scannable_process(p));
+        if CURSOR_PID == 0 || CURSOR_ADDR >= USER_SPACE_END || !current {
+            let mut next = process::process_after(CURSOR_PID).map(|p| p.pid);
+            while let Some(pid) = next {
+                if process::process_by_pid(pid).map_or(false, |p| scannable_process(p)) {
+                    break;
+                }
+                next = process::process_after(pid).map(|p| p.pid);
+            }
+            match next {
+                Some(pid) => {
+                    CURSOR_PID = pid;
+                    CURSOR_ADDR = 0;
+                }
+                None => {
+                    CURSOR_PID = 0;
+                    UNSTABLE.clear();
+                    prune_stable();
+                    FULL_SCANS += 1;
+                    return true;
+                }
+            }
+        }
+        let pcb = match process::process_by_pid(CURSOR_PID) {
+            Some(p) => p,
+            None => continue,
+        };
+        let (pid, cr3) = (pcb.pid, pcb.page_directory);
+        let mut region = pcb.memory_regions.find(CURSOR_ADDR)
+            .or_else(|| pcb.memory_regions.next_above(CURSOR_ADDR));
+        while let Some(r) = region {
+            if scannable_region(r) {
+                break;
+            }
+            region = pcb.memory_regions.next_above(r.start_addr);
+        }
+        let region = match region {
+            Some(r) => r.clone(),
+            None => {
+                CURSOR_ADDR = USER_SPACE_END;
+                continue;
+            }
+        };
+        let mut addr = CURSOR_ADDR.max(region.start_addr);
+        while addr < region.end_addr && budget > 0 {
+            budget -= 1;
+            let pde = rust_get_pde(cr3, addr);
+            if pde.is_null() || *pde & PTE_PRESENT == 0 || *pde & PTE_HUGE != 0 {
+                // No 4 KiB pages anywhere in this 2 MiB block
+                addr = (addr & !(HUGE_PAGE_SIZE - 1)) + HUGE_PAGE_SIZE;
+                continue;
+            }
+            scan_page(pid, cr3, &region, addr);
+            addr += PAGE_SIZE;
+        }
+        CURSOR_ADDR = addr;
+    }
+    false
+}
+
+pub fn set_enabled(on: bool) {
+    unsafe { ENABLED = on; }
+}
+
+/// Run a complete pass now, starting from the first process.
+pub fn scan_all() {
+    let flags = crate::heap::irq_save();
+    unsafe {
+        CURSOR_PID = 0;
+        UNSTABLE.clear();
+        while !scan(PAGES_PER_IDLE) {}
+    }
+    crate::heap::irq_restore(flags);
+}
+
+pub fn stats() -> KsmStats {
+    let flags = crate::heap::irq_save();
+    let s = unsafe {
+        KsmStats {
+            enabled: ENABLED,
+            shared: STABLE.values().map(|f| f.len()).sum(),
+            // The stable table's own reference is not a mapping
+            sharing: STABLE.values().flatten().map(|&f| page_refcount(f).saturating_sub(1) as usize).sum(),
+            zero: ZERO,
+            merged: MERGED,
+            scanned: SCANNED,
+            full_scans: FULL_SCANS,
+        }
+    };
+    crate::heap::irq_restore(flags);
+    s
+}
+
+/// Background scan, run from pause() when the CPU is otherwise idle.
+#[no_mangle]
+pub extern "C" fn rust_ksm_idle() {
+    unsafe {
+        if !ENABLED {
+            return;
+        }
+    }
+    let flags = crate::heap::irq_save();
+    unsafe { scan(PAGES_PER_IDLE); }
+    crate::heap::irq_restore(flags);
+}
@@ -1,19 +1,54 @@
+// memcpy/memset are the CPUID-dispatched kernels in kernel/memops.c, the
+// string primitives its word-at-a-time versions. None of them validate
+// pointers.
+extern "C" {
+    fn memcpy(dest: *mut u8, src: *const u8, len: usize) -> *mut u8;
+    fn memset(dest: *mut u8, val: i32, len: usize) -> *mut u8;
+    pub fn strlen(s: *const u8) -> usize;
+    pub fn strnlen(s: *const u8, max_len: usize) -> usize;
+    pub fn strcmp(a: *const u8, b: *const u8) -> i32;
+    pub fn strncmp(a: *const u8, b: *const u8, n: usize) -> i32;
+    pub fn memcmp(a: *const u8, b: *const u8, n: usize) -> i32;
+    pub fn memchr(s: *const u8, c: i32, n: usize) -> *const u8;
+    pub fn strchr(s: *const u8, c: i32) -> *const u8;
+}
+
+extern "C" {
+    fn get_phys_addr(virt_addr: u64) -> u64;
+}
+
+// All physical memory is mapped at PHYS_MAP_BASE (see kernel/paging.h); PMM
+// pages are handed out as pointers into this range.
+pub const PHYS_MAP_BASE: usize = 0xFFFF_8000_0000_0000;
+pub const PHYS_MAP_SIZE: usize = 512 << 30;
+
+pub fn phys_to_virt(phys: u64) -> *mut u8 {
+    (phys as usize + PHYS_MAP_BASE) as *mut u8
+}
+
+pub fn virt_to_phys(virt: *const u8) -> u64 {
+    let addr = virt as usize;
+    if addr >= PHYS_MAP_BASE && addr < PHYS_MAP_BASE + PHYS_MAP_SIZE {
+        (addr - PHYS_MAP_BASE) as u64
+    } else {
+        unsafe { get_phys_addr(addr as u64) }
+    }
+}
+
+/// View a NUL-terminated C string as a byte slice (without the NUL).
+pub unsafe fn cstr_bytes<'a>(s: *const u8) -> &'a [u8] {
+    if s.is_null() {
+        return &[];
+    }
+    core::slice::from_raw_parts(s, strlen(s))
+}
+
 #[no_mangle]
 pub extern "C" fn rust_memset(dest: *mut u8, val: i32, len: usize) -> *mut u8 {
-    unsafe {
-        for i in 0..len {
-            *dest.add(i) = val as u8;
-        }
-        dest
-    }
+    unsafe { memset(dest, val, len) }
 }
 
 #[no_mangle]
 pub extern "C" fn rust_memcpy(dest: *mut u8, src: *const u8, len: usize) -> *mut u8 {
-    unsafe {
-        for i in 0..len {
-            *dest.add(i) = *src.add(i);
-        }
-        dest
-    }
+    unsafe { memcpy(dest, src, len) }
 }
@@ -2,6 +2,7 @@
 #![allow(dead_code)]
 use alloc::vec;
 use alloc::vec::Vec;
+use alloc::boxed::Box;
 use alloc::collections::BTreeMap;
 use spin::Mutex;
 use smoltcp::phy::{Device, DeviceCapabilities, Medium, RxToken, TxToken};
@@ -10,6 +11,8 @@ use smoltcp::iface::{Config, Interface, SocketSet, SocketHandle};
 use smoltcp::socket::{tcp, udp, icmp, dhcpv4};
 use smoltcp::time::Instant;
 
+use crate::heap_profile::{HeapTag, TagScope};
+
 extern "C" {
     fn serial_write(s: *const u8);
     fn serial_write_dec(s: *const u8, n: u64);
@@ -229,11 +232,22 @@ struct SocketEntry {
     listening_socket: Option<SocketHandle>,
 }
 
+static mut SOCKET_CACHE: *mut crate::slab::KmemCache = core::ptr::null_mut();
+
+fn socket_cache() -> *mut crate::slab::KmemCache {
+    unsafe {
+        if SOCKET_CACHE.is_null() {
+            SOCKET_CACHE = crate::slab::cache_create(b"socket_entry", core::mem::size_of::<SocketEntry>());
+        }
+        SOCKET_CACHE
+    }
+}
+
 pub struct NetworkStack {
     device: NetDevice,
     interface: Interface,
     sockets: SocketSet<'static>,
-    socket_map: BTreeMap<i32, SocketEntry>,
+    socket_map: BTreeMap<i32, Box<SocketEntry>>,
     next_fd: i32,
     gateway: Option<Ipv4Address>,
     dns_servers: Vec<Ipv4Address>,
@@ -381,10 +395,8 @@ impl NetworkStack {
                 }
             }
             
-            // Small delay between polls
-            for _ in 0..1000 {
-                core::hint::spin_loop();
-            }
+            // Let other tasks run until the next tick
+            crate::waitqueue::sleep_ticks(1);
         }
     }
     
@@ -457,7 +469,8 @@ impl NetworkStack {
         }
     }
     
-    pub fn poll(&mut self) {
+    // Returns whether any packets were processed
+    pub fn poll(&mut self) -> bool {
         // Ensure interrupts are enabled for timer to work
         unsafe { core::arch::asm!("sti", options(nomem, nostack)); }
         
@@ -505,137 +518,9 @@ impl NetworkStack {
                 serial_write_dec(b" iterations\n\0".as_ptr(), iterations as u64);
             }
         }
+        total_processed > 0
     }
 
-    pub fn icmp_ping(&mut self, ip: [u8; 4], timeout_ms: i32) -> i32 {
-        unsafe {
-            serial_write(b"[PING] start ip=\0".as_ptr());
-            serial_write_dec(b"\0".as_ptr(), ip[0] as u64);
-            serial_write(b".\0".as_ptr());
-            serial_write_dec(b"\0".as_ptr(), ip[1] as u64);
-            serial_write(b".\0".as_ptr());
-            serial_write_dec(b"\0".as_ptr(), ip[2] as u64);
-            serial_write(b".\0".as_ptr());
-            serial_write_dec(b"\0".as_ptr(), ip[3] as u64);
-            serial_write(b"\n\0".as_ptr());
-        }
-        
-        unsafe { serial_write(b"[PING] Creating ICMP socket buffers...\n\0".as_ptr()); }
-        
-        // Create ICMP socket
-        let rx_buf = icmp::PacketBuffer::new(vec![icmp::PacketMetadata::EMPTY; 4], vec![0u8; 1024]);
-        unsafe { serial_write(b"[PING] RX buffer created\n\0".as_ptr()); }
-        
-        let tx_buf = icmp::PacketBuffer::new(vec![icmp::PacketMetadata::EMPTY; 4], vec![0u8; 1024]);
-        unsafe { serial_write(b"[PING] TX buffer created\n\0".as_ptr()); }
-        
-        let mut icmp_sock = icmp::Socket::new(rx_buf, tx_buf);
-        unsafe { serial_write(b"[PING] Socket created\n\0".as_ptr()); }
-        
-        // Bind with an identifier; smoltcp permits Ident binding for echo matching
-        icmp_sock.bind(icmp::Endpoint::Ident(0x1234)).ok();
-        unsafe { serial_write(b"[PING] Socket bound\n\0".as_ptr()); }
-
-        let handle = self.sockets.add(icmp_sock);
-        unsafe { serial_write(b"[PING] Socket added to set\n\0".as_ptr()); }
-
-        // Prepare payload
-        let payload: [u8; 8] = [0,1,2,3,4,5,6,7];
-
-        // Convert ticks (100 Hz) to milliseconds
-        let ticks_start = unsafe { timer_get_ticks() };
-        let start_ms = (ticks_start as i64) * 10;
-        let deadline = start_ms + timeout_ms as i64;
-        let dest = IpAddress::v4(ip[0], ip[1], ip[2], ip[3]);
-        unsafe { serial_write(b"[PING] start_ms=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), start_ms as u64); }
-        unsafe { serial_write(b"[PING] deadline=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), deadline as u64); }
-        unsafe { serial_write(b"[PING] timeout_ms=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), timeout_ms as u64); }
-
-        // Poll heavily initially to allow ARP resolution
-        unsafe { serial_write(b"[PING] Polling for ARP resolution...\n\0".as_ptr()); }
-        for i in 0..20 {
-            self.poll();
-            // Small yield every few polls to allow interrupts
-            if i % 5 == 0 {
-                for _ in 0..500 { core::hint::spin_loop(); }
-            }
-        }
-        unsafe { serial_write(b"[PING] Initial polling complete\n\0".as_ptr()); }
-
-        // We allow a couple of retransmissions to cover ARP resolution delays.
-        let mut rtt_ms: i32 = -1;
-        let mut last_tx_ms = start_ms - 100000; // ensure immediate first send
-        let mut sent = 0;
-        let mut iterations = 0;
-        loop {
-            let ticks_now = unsafe { timer_get_ticks() };
-            let now = (ticks_now as i64) * 10;
-            iterations += 1;
-            
-            if now >= deadline {
-                unsafe { serial_write(b"[PING] Timeout reached now=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), now as u64); }
-                unsafe { serial_write(b"[PING] deadline=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), deadline as u64); }
-                unsafe { serial_write(b"[PING] iterations=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), iterations as u64); }
-                break;
-            }
-
-            // (Re)send every ~200ms up to 5 times (increased from 3)
-            if sent < 5 && now - last_tx_ms >= 200 {
-                let socket = self.sockets.get_mut::<icmp::Socket>(handle);
-                if socket.can_send() {
-                    match socket.send_slice(&payload, dest) {
-                        Ok(_) => {
-                            unsafe { serial_write(b"[PING] sent #\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), (sent + 1) as u64); }
-                            last_tx_ms = now;
-                            sent += 1;
-                            
-                            // CRITICAL: Poll immediately after send to actually transmit the packet
-                            self.poll();
-                        }
-                        Err(e) => {
-                            unsafe { serial_write(b"[PING] send failed, will retry\n\0".as_ptr()); }
-                        }
-                    }
-                } else {
-                    unsafe { serial_write(b"[PING] cannot send yet\n\0".as_ptr()); }
-                }
-            }
-
-            // Poll multiple times per iteration for better responsiveness
-            for _ in 0..5 {
-                self.poll();
-            }
-
-            let socket = self.sockets.get_mut::<icmp::Socket>(handle);
-            if socket.can_recv() {
-                match socket.recv() {
-                    Ok((data, from)) => {
-                        unsafe { serial_write(b"[PING] recv len=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), data.len() as u64); }
-                        if data.len() >= payload.len() {
-                            rtt_ms = (now - start_ms) as i32;
-                            unsafe { serial_write(b"[PING] SUCCESS! RTT=\0".as_ptr()); serial_write_dec(b"ms\n\0".as_ptr(), rtt_ms as u64); }
-                            break;
-                        }
-                    }
-                    Err(e) => {
-                        // Continue polling
-                    }
-                }
-            }
-            
-            // Small yield to allow timer interrupts
-            if iterations % 10 == 0 {
-                for _ in 0..1000 { core::hint::spin_loop(); }
-            }
-        }
-
-        unsafe { serial_write(b"[PING] rtt_ms=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), rtt_ms as u64); }
-
-        // Cleanup
-        self.sockets.remove(handle);
-        rtt_ms
-    }
-    
     pub fn create_tcp_socket(&mut self) -> i32 {
         let rx_buffer = tcp::SocketBuffer::new(vec![0; 4096]);
         let tx_buffer = tcp::SocketBuffer::new(vec![0; 4096]);
@@ -645,12 +530,12 @@ impl NetworkStack {
         let fd = self.next_fd;
         self.next_fd += 1;
         
-        self.socket_map.insert(fd, SocketEntry {
+        self.socket_map.insert(fd, crate::slab::boxed(socket_cache(), SocketEntry {
             socket_type: SocketType::Tcp,
             handle,
             state: SocketState::Open,
             listening_socket: None,
-        });
+        }));
         
         fd
     }
@@ -664,140 +549,16 @@ impl NetworkStack {
         let fd = self.next_fd;
         self.next_fd += 1;
         
-        self.socket_map.insert(fd, SocketEntry {
+        self.socket_map.insert(fd, crate::slab::boxed(socket_cache(), SocketEntry {
             socket_type: SocketType::Udp,
             handle,
             state: SocketState::Open,
             listening_socket: None,
-        });
+        }));
         
         fd
     }
     
-    pub fn tcp_connect(&mut self, fd: i32, ip: &[u8; 4], port: u16) -> i32 {
-        let handle = if let Some(entry) = self.socket_map.get(&fd) {
-            if entry.socket_type != SocketType::Tcp {
-                return -1;
-            }
-            entry.handle
-        } else {
-            return -1;
-        };
-
-        {
-            let socket = self.sockets.get_mut::<tcp::Socket>(handle);
-            let remote_addr = smoltcp::wire::IpAddress::v4(ip[0], ip[1], ip[2], ip[3]);
-            let local_port = 49152 + (fd as u16 % 16384);
-            
-            unsafe { 
-                serial_write(b"[TCP] connect: attempting to connect to \0".as_ptr()); 
-                serial_write_dec(b".\0".as_ptr(), ip[0] as u64);
-                serial_write_dec(b".\0".as_ptr(), ip[1] as u64);
-                serial_write_dec(b".\0".as_ptr(), ip[2] as u64);
-                serial_write_dec(b":\0".as_ptr(), ip[3] as u64);
-                serial_write_dec(b" from local port \0".as_ptr(), port as u64);
-                serial_write_dec(b"\n\0".as_ptr(), local_port as u64);
-            }
-            
-            match socket.connect(self.interface.context(), (remote_addr, port), local_port) {
-                Ok(_) => {
-                    unsafe { serial_write(b"[TCP] connect: socket.connect() succeeded\n\0".as_ptr()); }
-                }
-                Err(e) => {
-                    unsafe { 
-                        serial_write(b"[TCP] connect: socket.connect() failed with error\n\0".as_ptr()); 
-                    }
-                    return -1;
-                }
-            }
-        }
-
-        // Poll aggressively for ARP resolution and handshake completion
-        unsafe { serial_write(b"[TCP] connect: polling for handshake completion...\n\0".as_ptr()); }
-        
-        let start_ms = (unsafe { timer_get_ticks() } as i64) * 10;
-        let handshake_deadline = start_ms + 3000; // 3 seconds for handshake
-        let mut poll_count = 0;
-        
-        loop {
-            let now = (unsafe { timer_get_ticks() } as i64) * 10;
-            if now >= handshake_deadline {
-                unsafe { serial_write(b"[TCP] connect: handshake timeout\n\0".as_ptr()); }
-                break;
-            }
-            
-            // Poll the network stack - this processes incoming packets and sends responses
-            self.poll();
-            poll_count += 1;
-            
-            // Check socket state frequently
-            let socket = self.sockets.get::<tcp::Socket>(handle);
-            let state = socket.state();
-            
-            // Debug state every 50 polls
-            if poll_count % 50 == 0 {
-                let state_val = match state {
-                    tcp::State::Closed => 0,
-                    tcp::State::Listen => 1,
-                    tcp::State::SynSent => 2,
-                    tcp::State::SynReceived => 3,
-                    tcp::State::Established => 4,
-                    tcp::State::FinWait1 => 5,
-                    tcp::State::FinWait2 => 6,
-                    tcp::State::CloseWait => 7,
-                    tcp::State::Closing => 8,
-                    tcp::State::LastAck => 9,
-                    tcp::State::TimeWait => 10,
-                };
-                unsafe {
-                    serial_write(b"[TCP] connect: poll_count=\0".as_ptr());
-                    serial_write_dec(b", state=\0".as_ptr(), poll_count as u64);
-                    serial_write_dec(b", is_active=\0".as_ptr(), state_val as u64);
-                    serial_write_dec(b"\n\0".as_ptr(), socket.is_active() as u64);
-                }
-            }
-            
-            // Check if connection is established
-            if socket.is_active() && state == tcp::State::Established {
-                unsafe {
-                    serial_write(b"[TCP] connect: Connection established after \0".as_ptr());
-                    serial_write_dec(b" polls!\n\0".as_ptr(), poll_count as u64);
-                }
-                return 0; // Success!
-            }
-            
-            // Small yield every few polls to allow timer interrupts
-            if poll_count % 10 == 0 {
-                for _ in 0..500 { core::hint::spin_loop(); }
-            }
-        }
-        
-        // Final state check
-        {
-            let socket = self.sockets.get::<tcp::Socket>(handle);
-            let state_val = match socket.state() {
-                tcp::State::Closed => 0,
-                tcp::State::Listen => 1,
-                tcp::State::SynSent => 2,
-                tcp::State::SynReceived => 3,
-                tcp::State::Established => 4,
-                tcp::State::FinWait1 => 5,
-                tcp::State::FinWait2 => 6,
-                tcp::State::CloseWait => 7,
-                tcp::State::Closing => 8,
-                tcp::State::LastAck => 9,
-                tcp::State::TimeWait => 10,
-            };
-            unsafe {
-                serial_write(b"[TCP] connect: Final state after \0".as_ptr());
-                serial_write_dec(b" polls - state=\0".as_ptr(), poll_count as u64);
-                serial_write_dec(b", is_active=\0".as_ptr(), state_val as u64);
-                serial_write_dec(b"\n\0".as_ptr(), socket.is_active() as u64);
-            }
-        }
-        -1
-    }
-    
     pub fn tcp_bind(&mut self, fd: i32, port: u16) -> i32 {
         if let Some(entry) = self.socket_map.get_mut(&fd) {
             if entry.socket_type != SocketType::Tcp {
@@ -817,93 +578,6 @@ impl NetworkStack {
         }
     }
     
-    pub fn tcp_send(&mut self, fd: i32, data: &[u8]) -> isize {
-        let handle = if let Some(entry) = self.socket_map.get(&fd) {
-            if entry.socket_type != SocketType::Tcp { 
-                unsafe { serial_write(b"[TCP] send: not TCP socket\n\0".as_ptr()); }
-                return -1; 
-            }
-            entry.handle
-        } else { 
-            unsafe { serial_write(b"[TCP] send: invalid fd\n\0".as_ptr()); }
-            return -1; 
-        };
-
-        // Poll initially to drive connection establishment
-        unsafe { serial_write(b"[TCP] send: polling for connection...\n\0".as_ptr()); }
-        for _ in 0..100 {
-            self.poll();
-            if self.sockets.get::<tcp::Socket>(handle).is_active() {
-                break;
-            }
-        }
-
-        // Ensure socket is active before sending
-        {
-            let socket = self.sockets.get::<tcp::Socket>(handle);
-            if !socket.is_active() {
-                unsafe { 
-                    serial_write(b"[TCP] send: socket not active after polling\n\0".as_ptr()); 
-                }
-                return -1;
-            }
-            unsafe { serial_write(b"[TCP] send: socket is active\n\0".as_ptr()); }
-        }
-
-        // Try to send with polling retries to handle WouldBlock
-        let mut total_sent: usize = 0;
-        let start_ms = (unsafe { timer_get_ticks() } as i64) * 10;
-        let deadline = start_ms + 10000; // up to 10s overall (increased from 5s)
-        let mut attempts = 0;
-        loop {
-            attempts += 1;
-            let now = (unsafe { timer_get_ticks() } as i64) * 10;
-            if now >= deadline { 
-                unsafe { 
-                    serial_write(b"[TCP] send: timeout after attempts=\0".as_ptr()); 
-                    serial_write_dec(b"\0".as_ptr(), attempts as u64);
-                    serial_write(b"\n\0".as_ptr());
-                }
-                break; 
-            }
-
-            {
-                let socket = self.sockets.get_mut::<tcp::Socket>(handle);
-                if !socket.is_active() {
-                    unsafe { serial_write(b"[TCP] send: socket became inactive\n\0".as_ptr()); }
-                    break;
-                }
-                if socket.may_send() && socket.can_send() {
-                    match socket.send_slice(data) {
-                        Ok(len) => { 
-                            unsafe { 
-                                serial_write(b"[TCP] send: success, len=\0".as_ptr()); 
-                                serial_write_dec(b"\0".as_ptr(), len as u64);
-                                serial_write(b"\n\0".as_ptr());
-                            }
-                            total_sent += len; 
-                            break; 
-                        }
-                        Err(e) => { 
-                            unsafe { serial_write(b"[TCP] send: error, retrying...\n\0".as_ptr()); }
-                        }
-                    }
-                }
-            }
-
-            // Drive the stack and try again - poll more frequently
-            for _ in 0..5 {
-                self.poll();
-            }
-            
-            // Small yield to allow timer interrupts
-            if attempts % 20 == 0 {
-                for _ in 0..1000 { core::hint::spin_loop(); }
-            }
-        }
-        if total_sent > 0 { total_sent as isize } else { -1 }
-    }
-    
     pub fn tcp_recv(&mut self, fd: i32, buffer: &mut [u8]) -> isize {
         if let Some(entry) = self.socket_map.get(&fd) {
             if entry.socket_type != SocketType::Tcp {
@@ -935,6 +609,7 @@ impl NetworkStack {
 // Initialize with RTL8139
 #[no_mangle]
 pub extern "C" fn network_init_rtl8139(io_base: u16) -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     extern "C" { fn rtl8139_init(io_base: u16) -> i32; }
     unsafe {
         if rtl8139_init(io_base) == 0 {
@@ -951,6 +626,7 @@ pub extern "C" fn network_init_rtl8139(io_base: u16) -> i32 {
 // Initialize with E1000
 #[no_mangle]
 pub extern "C" fn network_init_e1000(mem_base: u64) -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     extern "C" { fn e1000_init(mem_base: u64) -> i32; }
     unsafe {
         if e1000_init(mem_base) == 0 {
@@ -967,6 +643,7 @@ pub extern "C" fn network_init_e1000(mem_base: u64) -> i32 {
 // Initialize with PCnet
 #[no_mangle]
 pub extern "C" fn network_init_pcnet(io_base: u16) -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     extern "C" { fn pcnet_init(io_base: u16) -> i32; }
     unsafe {
         if pcnet_init(io_base) == 0 {
@@ -983,6 +660,7 @@ pub extern "C" fn network_init_pcnet(io_base: u16) -> i32 {
 // Legacy function - tries RTL8139 by default
 #[no_mangle]
 pub extern "C" fn network_init() -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     // Will be called after driver is initialized separately
     if unsafe { ACTIVE_DRIVER.is_some() } {
         let stack = NetworkStack::new();
@@ -996,6 +674,7 @@ pub extern "C" fn network_init() -> i32 {
 // Initialize network with custom IP configuration
 #[no_mangle]
 pub extern "C" fn network_init_with_ip(ip0: u8, ip1: u8, ip2: u8, ip3: u8, gw0: u8, gw1: u8, gw2: u8, gw3: u8) -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     if unsafe { ACTIVE_DRIVER.is_some() } {
         let stack = NetworkStack::new_with_ip([ip0, ip1, ip2, ip3], [gw0, gw1, gw2, gw3]);
         *NETWORK_STACK.lock() = Some(stack);
@@ -1007,41 +686,441 @@ pub extern "C" fn network_init_with_ip(ip0: u8, ip1: u8, ip2: u8, ip3: u8, gw0:
 
 #[no_mangle]
 pub extern "C" fn network_poll() {
+    let _tag = TagScope::new(HeapTag::Net);
     // Use try_lock to avoid deadlock if called from interrupt while stack is already locked
     if let Some(mut stack_guard) = NETWORK_STACK.try_lock() {
         if let Some(ref mut stack) = *stack_guard {
-            stack.poll();
+            if stack.poll() {
+                crate::waitqueue::wake(traffic_channel(), true);
+            }
         }
     }
     // If we can't get the lock, just skip this poll - the next interrupt will try again
 }
 
+// Wait channel woken whenever the timer-driven poll processes packets
+fn traffic_channel() -> u64 {
+    &NETWORK_STACK as *const _ as u64
+}
+
+/// Sleep until packets arrive or `ticks` timer ticks pass, for callers that
+/// poll sockets without holding the stack.
+#[no_mangle]
+pub extern "C" fn net_wait_traffic(ticks: u64) {
+    crate::waitqueue::sleep(traffic_channel(), ticks);
+}
+
+// Run `f` against the stack with its lock held, or return None if networking
+// is down. Blocking operations below go through this once per poll pass so the
+// lock is never held across a sleep.
+fn with_stack<R>(f: impl FnOnce(&mut NetworkStack) -> R) -> Option<R> {
+    NETWORK_STACK.lock().as_mut().map(f)
+}
+
+fn icmp_ping(ip: [u8; 4], timeout_ms: i32) -> i32 {
+    unsafe {
+        serial_write(b"[PING] start ip=\0".as_ptr());
+        serial_write_dec(b"\0".as_ptr(), ip[0] as u64);
+        serial_write(b".\0".as_ptr());
+        serial_write_dec(b"\0".as_ptr(), ip[1] as u64);
+        serial_write(b".\0".as_ptr());
+        serial_write_dec(b"\0".as_ptr(), ip[2] as u64);
+        serial_write(b".\0".as_ptr());
+        serial_write_dec(b"\0".as_ptr(), ip[3] as u64);
+        serial_write(b"\n\0".as_ptr());
+    }
+    
+    unsafe { serial_write(b"[PING] Creating ICMP socket buffers...\n\0".as_ptr()); }
+    
+    // Create ICMP socket
+    let rx_buf = icmp::PacketBuffer::new(vec![icmp::PacketMetadata::EMPTY; 4], vec![0u8; 1024]);
+    unsafe { serial_write(b"[PING] RX buffer created\n\0".as_ptr()); }
+    
+    let tx_buf = icmp::PacketBuffer::new(vec![icmp::PacketMetadata::EMPTY; 4], vec![0u8; 1024]);
+    unsafe { serial_write(b"[PING] TX buffer created\n\0".as_ptr()); }
+    
+    let mut icmp_sock = icmp::Socket::new(rx_buf, tx_buf);
+    unsafe { serial_write(b"[PING] Socket created\n\0".as_ptr()); }
+    
+    // Bind with an identifier; smoltcp permits Ident binding for echo matching
+    icmp_sock.bind(icmp::Endpoint::Ident(0x1234)).ok();
+    unsafe { serial_write(b"[PING] Socket bound\n\0".as_ptr()); }
+
+    let handle = match with_stack(|stack| stack.sockets.add(icmp_sock)) {
+        Some(handle) => handle,
+        None => return -1,
+    };
+    unsafe { serial_write(b"[PING] Socket added to set\n\0".as_ptr()); }
+
+    // Prepare payload
+    let payload: [u8; 8] = [0,1,2,3,4,5,6,7];
+
+    // Convert ticks (100 Hz) to milliseconds
+    let ticks_start = unsafe { timer_get_ticks() };
+    let start_ms = (ticks_start as i64) * 10;
+    let deadline = start_ms + timeout_ms as i64;
+    let dest = IpAddress::v4(ip[0], ip[1], ip[2], ip[3]);
+    unsafe { serial_write(b"[PING] start_ms=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), start_ms as u64); }
+    unsafe { serial_write(b"[PING] deadline=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), deadline as u64); }
+    unsafe { serial_write(b"[PING] timeout_ms=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), timeout_ms as u64); }
+
+    // Poll heavily initially to allow ARP resolution
+    unsafe { serial_write(b"[PING] Polling for ARP resolution...\n\0".as_ptr()); }
+    for _ in 0..20 {
+        if !with_stack(|stack| stack.poll()).unwrap_or(false) {
+            // Nothing arrived; let other tasks run until traffic or the next tick
+            net_wait_traffic(1);
+        }
+    }
+    unsafe { serial_write(b"[PING] Initial polling complete\n\0".as_ptr()); }
+
+    // We allow a couple of retransmissions to cover ARP resolution delays.
+    let mut rtt_ms: i32 = -1;
+    let mut last_tx_ms = start_ms - 100000; // ensure immediate first send
+    let mut sent = 0;
+    let mut iterations = 0;
+    loop {
+        let ticks_now = unsafe { timer_get_ticks() };
+        let now = (ticks_now as i64) * 10;
+        iterations += 1;
+        
+        if now >= deadline {
+            unsafe { serial_write(b"[PING] Timeout reached now=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), now as u64); }
+            unsafe { serial_write(b"[PING] deadline=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), deadline as u64); }
+            unsafe { serial_write(b"[PING] iterations=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), iterations as u64); }
+            break;
+        }
+
+        let busy = with_stack(|stack| {
+            // (Re)send every ~200ms up to 5 times (increased from 3)
+            if sent < 5 && now - last_tx_ms >= 200 {
+                let socket = stack.sockets.get_mut::<icmp::Socket>(handle);
+                if socket.can_send() {
+                    match socket.send_slice(&payload, dest) {
+                        Ok(_) => {
+                            unsafe { serial_write(b"[PING] sent #\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), (sent + 1) as u64); }
+                            last_tx_ms = now;
+                            sent += 1;
+                            
+                            // CRITICAL: Poll immediately after send to actually transmit the packet
+                            stack.poll();
+                        }
+                        Err(e) => {
+                            unsafe { serial_write(b"[PING] send failed, will retry\n\0".as_ptr()); }
+                        }
+                    }
+                } else {
+                    unsafe { serial_write(b"[PING] cannot send yet\n\0".as_ptr()); }
+                }
+            }
+
+            // Poll multiple times per iteration for better responsiveness
+            let mut busy = false;
+            for _ in 0..5 {
+                busy |= stack.poll();
+            }
+
+            let socket = stack.sockets.get_mut::<icmp::Socket>(handle);
+            if socket.can_recv() {
+                match socket.recv() {
+                    Ok((data, from)) => {
+                        unsafe { serial_write(b"[PING] recv len=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), data.len() as u64); }
+                        if data.len() >= payload.len() {
+                            rtt_ms = (now - start_ms) as i32;
+                            unsafe { serial_write(b"[PING] SUCCESS! RTT=\0".as_ptr()); serial_write_dec(b"ms\n\0".as_ptr(), rtt_ms as u64); }
+                        }
+                    }
+                    Err(e) => {
+                        // Continue polling
+                    }
+                }
+            }
+            busy
+        });
+
+        match busy {
+            None => break,
+            Some(_) if rtt_ms >= 0 => break,
+            // Nothing arrived; let other tasks run until traffic or the next tick
+            Some(false) => net_wait_traffic(1),
+            Some(true) => {}
+        }
+    }
+
+    unsafe { serial_write(b"[PING] rtt_ms=\0".as_ptr()); serial_write_dec(b"\0".as_ptr(), rtt_ms as u64); }
+
+    // Cleanup
+    with_stack(|stack| { stack.sockets.remove(handle); });
+    rtt_ms
+}
+
+fn tcp_connect(fd: i32, ip: &[u8; 4], port: u16) -> i32 {
+    let started = with_stack(|stack| {
+        let handle = if let Some(entry) = stack.socket_map.get(&fd) {
+            if entry.socket_type != SocketType::Tcp {
+                return None;
+            }
+            entry.handle
+        } else {
+            return None;
+        };
+
+        let socket = stack.sockets.get_mut::<tcp::Socket>(handle);
+        let remote_addr = smoltcp::wire::IpAddress::v4(ip[0], ip[1], ip[2], ip[3]);
+        let local_port = 49152 + (fd as u16 % 16384);
+        
+        unsafe { 
+            serial_write(b"[TCP] connect: attempting to connect to \0".as_ptr()); 
+            serial_write_dec(b".\0".as_ptr(), ip[0] as u64);
+            serial_write_dec(b".\0".as_ptr(), ip[1] as u64);
+            serial_write_dec(b".\0".as_ptr(), ip[2] as u64);
+            serial_write_dec(b":\0".as_ptr(), ip[3] as u64);
+            serial_write_dec(b" from local port \0".as_ptr(), port as u64);
+            serial_write_dec(b"\n\0".as_ptr(), local_port as u64);
+        }
+        
+        match socket.connect(stack.interface.context(), (remote_addr, port), local_port) {
+            Ok(_) => {
+                unsafe { serial_write(b"[TCP] connect: socket.connect() succeeded\n\0".as_ptr()); }
+                Some(handle)
+            }
+            Err(e) => {
+                unsafe { 
+                    serial_write(b"[TCP] connect: socket.connect() failed with error\n\0".as_ptr()); 
+                }
+                None
+            }
+        }
+    });
+    let handle = match started {
+        Some(Some(handle)) => handle,
+        _ => return -1,
+    };
+
+    // Poll aggressively for ARP resolution and handshake completion
+    unsafe { serial_write(b"[TCP] connect: polling for handshake completion...\n\0".as_ptr()); }
+    
+    let start_ms = (unsafe { timer_get_ticks() } as i64) * 10;
+    let handshake_deadline = start_ms + 3000; // 3 seconds for handshake
+    let mut poll_count = 0;
+    let mut established = false;
+    
+    loop {
+        let now = (unsafe { timer_get_ticks() } as i64) * 10;
+        if now >= handshake_deadline {
+            unsafe { serial_write(b"[TCP] connect: handshake timeout\n\0".as_ptr()); }
+            break;
+        }
+        
+        let busy = with_stack(|stack| {
+            // Poll the network stack - this processes incoming packets and sends responses
+            let busy = stack.poll();
+            poll_count += 1;
+            
+            // Check socket state frequently
+            let socket = stack.sockets.get::<tcp::Socket>(handle);
+            let state = socket.state();
+            
+            // Debug state every 50 polls
+            if poll_count % 50 == 0 {
+                let state_val = match state {
+                    tcp::State::Closed => 0,
+                    tcp::State::Listen => 1,
+                    tcp::State::SynSent => 2,
+                    tcp::State::SynReceived => 3,
+                    tcp::State::Established => 4,
+                    tcp::State::FinWait1 => 5,
+                    tcp::State::FinWait2 => 6,
+                    tcp::State::CloseWait => 7,
+                    tcp::State::Closing => 8,
+                    tcp::State::LastAck => 9,
+                    tcp::State::TimeWait => 10,
+                };
+                unsafe {
+                    serial_write(b"[TCP] connect: poll_count=\0".as_ptr());
+                    serial_write_dec(b", state=\0".as_ptr(), poll_count as u64);
+                    serial_write_dec(b", is_active=\0".as_ptr(), state_val as u64);
+                    serial_write_dec(b"\n\0".as_ptr(), socket.is_active() as u64);
+                }
+            }
+            
+            // Check if connection is established
+            if socket.is_active() && state == tcp::State::Established {
+                unsafe {
+                    serial_write(b"[TCP] connect: Connection established after \0".as_ptr());
+                    serial_write_dec(b" polls!\n\0".as_ptr(), poll_count as u64);
+                }
+                established = true;
+            }
+            busy
+        });
+
+        match busy {
+            None => return -1,
+            Some(_) if established => return 0, // Success!
+            // Nothing arrived; let other tasks run until traffic or the next tick
+            Some(false) => net_wait_traffic(1),
+            Some(true) => {}
+        }
+    }
+    
+    // Final state check
+    with_stack(|stack| {
+        let socket = stack.sockets.get::<tcp::Socket>(handle);
+        let state_val = match socket.state() {
+            tcp::State::Closed => 0,
+            tcp::State::Listen => 1,
+            tcp::State::SynSent => 2,
+            tcp::State::SynReceived => 3,
+            tcp::State::Established => 4,
+            tcp::State::FinWait1 => 5,
+            tcp::State::FinWait2 => 6,
+            tcp::State::CloseWait => 7,
+            tcp::State::Closing => 8,
+            tcp::State::LastAck => 9,
+            tcp::State::TimeWait => 10,
+        };
+        unsafe {
+            serial_write(b"[TCP] connect: Final state after \0".as_ptr());
+            serial_write_dec(b" polls - state=\0".as_ptr(), poll_count as u64);
+            serial_write_dec(b", is_active=\0".as_ptr(), state_val as u64);
+            serial_write_dec(b"\n\0".as_ptr(), socket.is_active() as u64);
+        }
+    });
+    -1
+}
+
+fn tcp_send(fd: i32, data: &[u8]) -> isize {
+    let handle = with_stack(|stack| {
+        if let Some(entry) = stack.socket_map.get(&fd) {
+            if entry.socket_type != SocketType::Tcp { 
+                unsafe { serial_write(b"[TCP] send: not TCP socket\n\0".as_ptr()); }
+                return None; 
+            }
+            Some(entry.handle)
+        } else { 
+            unsafe { serial_write(b"[TCP] send: invalid fd\n\0".as_ptr()); }
+            None
+        }
+    });
+    let handle = match handle {
+        Some(Some(handle)) => handle,
+        _ => return -1,
+    };
+
+    // Poll initially to drive connection establishment
+    unsafe { serial_write(b"[TCP] send: polling for connection...\n\0".as_ptr()); }
+    let mut active = false;
+    for _ in 0..100 {
+        let busy = with_stack(|stack| {
+            let busy = stack.poll();
+            active = stack.sockets.get::<tcp::Socket>(handle).is_active();
+            busy
+        });
+        match busy {
+            None => return -1,
+            Some(_) if active => break,
+            Some(false) => net_wait_traffic(1),
+            Some(true) => {}
+        }
+    }
+
+    // Ensure socket is active before sending
+    if !active {
+        unsafe { 
+            serial_write(b"[TCP] send: socket not active after polling\n\0".as_ptr()); 
+        }
+        return -1;
+    }
+    unsafe { serial_write(b"[TCP] send: socket is active\n\0".as_ptr()); }
+
+    // Try to send with polling retries to handle WouldBlock
+    let mut total_sent: usize = 0;
+    let start_ms = (unsafe { timer_get_ticks() } as i64) * 10;
+    let deadline = start_ms + 10000; // up to 10s overall (increased from 5s)
+    let mut attempts = 0;
+    loop {
+        attempts += 1;
+        let now = (unsafe { timer_get_ticks() } as i64) * 10;
+        if now >= deadline { 
+            unsafe { 
+                serial_write(b"[TCP] send: timeout after attempts=\0".as_ptr()); 
+                serial_write_dec(b"\0".as_ptr(), attempts as u64);
+                serial_write(b"\n\0".as_ptr());
+            }
+            break; 
+        }
+
+        let mut done = false;
+        let busy = with_stack(|stack| {
+            {
+                let socket = stack.sockets.get_mut::<tcp::Socket>(handle);
+                if !socket.is_active() {
+                    unsafe { serial_write(b"[TCP] send: socket became inactive\n\0".as_ptr()); }
+                    done = true;
+                    return false;
+                }
+                if socket.may_send() && socket.can_send() {
+                    match socket.send_slice(data) {
+                        Ok(len) => { 
+                            unsafe { 
+                                serial_write(b"[TCP] send: success, len=\0".as_ptr()); 
+                                serial_write_dec(b"\0".as_ptr(), len as u64);
+                                serial_write(b"\n\0".as_ptr());
+                            }
+                            total_sent += len; 
+                            done = true;
+                            return false;
+                        }
+                        Err(e) => { 
+                            unsafe { serial_write(b"[TCP] send: error, retrying...\n\0".as_ptr()); }
+                        }
+                    }
+                }
+            }
+
+            // Drive the stack and try again - poll more frequently
+            let mut busy = false;
+            for _ in 0..5 {
+                busy |= stack.poll();
+            }
+            busy
+        });
+
+        match busy {
+            None => break,
+            Some(_) if done => break,
+            // Nothing arrived; let other tasks run until traffic or the next tick
+            Some(false) => net_wait_traffic(1),
+            Some(true) => {}
+        }
+    }
+    if total_sent > 0 { total_sent as isize } else { -1 }
+}
+
 #[no_mangle]
 pub extern "C" fn net_icmp_ping(ip: *const u8, timeout_ms: i32) -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     unsafe { serial_write(b"[PING] net_icmp_ping called\n\0".as_ptr()); }
     if ip.is_null() { 
         unsafe { serial_write(b"[PING] ERROR: ip is null\n\0".as_ptr()); }
         return -1; 
     }
     
-    unsafe { serial_write(b"[PING] Locking NETWORK_STACK...\n\0".as_ptr()); }
-    let mut stack_lock = NETWORK_STACK.lock();
-    unsafe { serial_write(b"[PING] Lock acquired\n\0".as_ptr()); }
-    
-    if let Some(ref mut stack) = *stack_lock {
-        unsafe { serial_write(b"[PING] Stack exists, parsing IP...\n\0".as_ptr()); }
-        let ip_slice = unsafe { core::slice::from_raw_parts(ip, 4) };
-        let addr = [ip_slice[0], ip_slice[1], ip_slice[2], ip_slice[3]];
-        unsafe { serial_write(b"[PING] Calling icmp_ping...\n\0".as_ptr()); }
-        stack.icmp_ping(addr, timeout_ms)
-    } else {
+    if NETWORK_STACK.lock().is_none() {
         unsafe { serial_write(b"[PING] NETWORK_STACK is None\n\0".as_ptr()); }
-        -1
+        return -1;
     }
+    
+    let ip_slice = unsafe { core::slice::from_raw_parts(ip, 4) };
+    let addr = [ip_slice[0], ip_slice[1], ip_slice[2], ip_slice[3]];
+    unsafe { serial_write(b"[PING] Calling icmp_ping...\n\0".as_ptr()); }
+    icmp_ping(addr, timeout_ms)
 }
 
 #[no_mangle]
 pub extern "C" fn sock_socket() -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     if let Some(ref mut stack) = *NETWORK_STACK.lock() {
         stack.create_tcp_socket()
     } else {
@@ -1051,17 +1130,15 @@ pub extern "C" fn sock_socket() -> i32 {
 
 #[no_mangle]
 pub extern "C" fn sock_connect(s: i32, ip: *const u8, port: u16) -> i32 {
-    if let Some(ref mut stack) = *NETWORK_STACK.lock() {
-        let ip_slice = unsafe { core::slice::from_raw_parts(ip, 4) };
-        let ip_array: [u8; 4] = [ip_slice[0], ip_slice[1], ip_slice[2], ip_slice[3]];
-        stack.tcp_connect(s, &ip_array, port)
-    } else {
-        -1
-    }
+    let _tag = TagScope::new(HeapTag::Net);
+    let ip_slice = unsafe { core::slice::from_raw_parts(ip, 4) };
+    let ip_array: [u8; 4] = [ip_slice[0], ip_slice[1], ip_slice[2], ip_slice[3]];
+    tcp_connect(s, &ip_array, port)
 }
 
 #[no_mangle]
 pub extern "C" fn sock_bind(s: i32, _ip: *const u8, port: u16) -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     if let Some(ref mut stack) = *NETWORK_STACK.lock() {
         stack.tcp_bind(s, port)
     } else {
@@ -1081,6 +1158,7 @@ pub extern "C" fn sock_listen(_s: i32, _backlog: i32) -> i32 {
 
 #[no_mangle]
 pub extern "C" fn sock_accept(s: i32, out_ip: *mut u8, out_port: *mut u16) -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     if let Some(ref mut stack) = *NETWORK_STACK.lock() {
         if let Some(listening_entry) = stack.socket_map.get(&s) {
             if listening_entry.state != SocketState::Listening {
@@ -1115,16 +1193,14 @@ pub extern "C" fn sock_accept(s: i32, out_ip: *mut u8, out_port: *mut u16) -> i3
 
 #[no_mangle]
 pub extern "C" fn sock_send(s: i32, buf: *const u8, len: usize) -> isize {
-    if let Some(ref mut stack) = *NETWORK_STACK.lock() {
-        let data = unsafe { core::slice::from_raw_parts(buf, len) };
-        stack.tcp_send(s, data)
-    } else {
-        -1
-    }
+    let _tag = TagScope::new(HeapTag::Net);
+    let data = unsafe { core::slice::from_raw_parts(buf, len) };
+    tcp_send(s, data)
 }
 
 #[no_mangle]
 pub extern "C" fn sock_recv(s: i32, buf: *mut u8, len: usize) -> isize {
+    let _tag = TagScope::new(HeapTag::Net);
     if let Some(ref mut stack) = *NETWORK_STACK.lock() {
         let buffer = unsafe { core::slice::from_raw_parts_mut(buf, len) };
         stack.tcp_recv(s, buffer)
@@ -1135,6 +1211,7 @@ pub extern "C" fn sock_recv(s: i32, buf: *mut u8, len: usize) -> isize {
 
 #[no_mangle]
 pub extern "C" fn sock_close(s: i32) -> i32 {
+    let _tag = TagScope::new(HeapTag::Net);
     if let Some(ref mut stack) = *NETWORK_STACK.lock() {
         stack.close_socket(s)
     } else {
@@ -0,0 +1,231 @@
+// Page cache for memory-mapped files.
+//
+// Pages of a file mapped with mmap() are read in on the first fault and
+// looked up by (inode, page index) after that, so every process mapping
+// the same file shares a single copy of each page. The cache holds one
+// reference on each of its frames, and every PTE mapping a frame holds
+// another, like any other user frame (see paging_free_pml4).
+//
+// Shared mappings map the cached frame itself, writable when the mapping
+// is. Stores are only noticed through the PTE dirty bit, which msync() and
+// munmap() fold into the cached page before writing it back. Private
+// mappings map the frame read-only and copy-on-write (see vm.rs).
+//
+// The last munmap() of a file writes back its dirty pages, but they stay
+// cached for the next mapping until reclaim (see reclaim.rs) evicts them.
+// Pages still mapped somewhere are never evicted.
+
+use alloc::collections::BTreeMap;
+use alloc::vec::Vec;
+
+use crate::memory::{phys_to_virt, virt_to_phys};
+use crate::vfs::OpenFile;
+
+extern "C" {
+    fn page_put(phys: u64);
+    fn page_refcount(phys: u64) -> u32;
+}
+
+const PAGE_SIZE: u64 = 4096;
+
+struct CachedPage {
+    phys: u64,
+    dirty: bool,
+}
+
+struct FileCache {
+    path: Vec<u8>, // NUL-terminated, as in OpenFile
+    size: u64,
+    maps: u32, // Memory regions backed by this file
+    pages: BTreeMap<u64, CachedPage>,
+}
+
+#[derive(Clone, Copy)]
+pub struct CacheStats {
+    pub files: usize,
+    pub pages: usize,
+    pub hits: u64,
+    pub misses: u64,
+    pub writebacks: u64,
+}
+
+static mut FILES: BTreeMap<u64, FileCache> = BTreeMap::new();
+static mut HITS: u64 = 0;
+static mut MISSES: u64 = 0;
+static mut WRITEBACKS: u64 = 0;
+
+/// Register a new mapping of `file`. Returns the file size, or a negative
+/// errno if the file is gone.
+pub fn map_file(file: &OpenFile) -> Result<u64, i32> {
+    let size = crate::vfs::file_size(file.path.as_ptr(), file.ino).ok_or(-2)?;
+    unsafe {
+        let cache = FILES.entry(file.ino).or_insert_with(|| FileCache {
+            path: file.path.clone(),
+            size,
+            maps: 0,
+            pages: BTreeMap::new(),
+        });
+        cache.maps += 1;
+    }
+    Ok(size)
+}
+
+/// Another region now refers to file `ino` (fork, or munmap splitting a
+/// region in two).
+pub fn dup_mapping(ino: u64) {
+    unsafe {
+        if let Some(cache) = FILES.get_mut(&ino) {
+            cache.maps += 1;
+        }
+    }
+}
+
+/// Drop a mapping of file `ino`; the last one writes back its dirty pages.
+pub fn unmap_file(ino: u64) {
+    unsafe {
+        let cache = match FILES.get_mut(&ino) {
+            Some(c) => c,
+            None => return,
+        };
+        cache.maps -= 1;
+        if cache.maps != 0 {
+            return;
+        }
+        if cache.pages.is_empty() {
+            FILES.remove(&ino);
+            return;
+        }
+        let indices: Vec<u64> = cache.pages.keys().copied().collect();
+        for index in indices {
+            writeback_page(ino, index);
+        }
+    }
+}
+
+/// Physical frame holding page `index` of file `ino`, reading it in on a
+/// miss. None past the end of the file or when the file cannot be read.
+pub fn get_page(ino: u64, index: u64) -> Option<u64> {
+    unsafe {
+        let cache = FILES.get_mut(&ino)?;
+        if let Some(page) = cache.pages.get(&index) {
+            HITS += 1;
+            return Some(page.phys);
+        }
+        if index * PAGE_SIZE >= cache.size {
+            return None;
+        }
+        // Allocating may reclaim and evict other pages of the cache, so the
+        // file is looked up again afterwards
+        let frame = crate::reclaim::alloc_user_page(true);
+        if frame.is_null() {
+            return None;
+        }
+        let cache = match FILES.get_mut(&ino) {
+            Some(c) => c,
+            None => {
+                page_put(virt_to_phys(frame));
+                return None;
+            }
+        };
+        let offset = index * PAGE_SIZE;
+        // The tail of the last page stays zero
+        let buf = core::slice::from_raw_parts_mut(frame, PAGE_SIZE as usize);
+        if crate::vfs::read_at(cache.path.as_ptr(), ino, offset, buf) < 0 {
+            page_put(virt_to_phys(frame));
+            return None;
+        }
+        let phys = virt_to_phys(frame);
+        cache.pages.insert(index, CachedPage { phys, dirty: false });
+        crate::reclaim::add_cache(ino, index, phys);
+        MISSES += 1;
+        Some(phys)
+    }
+}
+
+/// Frame caching page `index` of file `ino`, if it is cached.
+pub fn page_phys(ino: u64, index: u64) -> Option<u64> {
+    unsafe { FILES.get(&ino)?.pages.get(&index).map(|p| p.phys) }
+}
+
+/// Drop page `index` of file `ino` from the cache, writing it back first
+/// if it is dirty. Fails while the page is mapped.
+pub fn evict(ino: u64, index: u64) -> bool {
+    unsafe {
+        let phys = match page_phys(ino, index) {
+            Some(p) if page_refcount(p) == 1 => p,
+            _ => return false,
+        };
+        writeback_page(ino, index);
+        let cache = FILES.get_mut(&ino).unwrap();
+        cache.pages.remove(&index);
+        if cache.maps == 0 && cache.pages.is_empty() {
+            FILES.remove(&ino);
+        }
+        page_put(phys);
+        true
+    }
+}
+
+pub fn mark_dirty(ino: u64, index: u64) {
+    unsafe {
+        if let Some(page) = FILES.get_mut(&ino).and_then(|c| c.pages.get_mut(&index)) {
+            page.dirty = true;
+        }
+    }
+}
+
+/// Write page `index` of file `ino` back if it is dirty.
+pub fn writeback_page(ino: u64, index: u64) {
+    unsafe {
+        let cache = match FILES.get_mut(&ino) {
+            Some(c) => c,
+            None => return,
+        };
+        let page = match cache.pages.get_mut(&index) {
+            Some(p) if p.dirty => p,
+            _ => return,
+        };
+        page.dirty = false;
+        let offset = index * PAGE_SIZE;
+        if offset >= cache.size {
+            return;
+        }
+        let len = core::cmp::min(PAGE_SIZE, cache.size - offset) as usize;
+        let data = core::slice::from_raw_parts(phys_to_virt(page.phys), len);
+        crate::vfs::write_at(cache.path.as_ptr(), ino, offset, data);
+        WRITEBACKS += 1;
+    }
+}
+
+/// The VFS replaced the contents of file `ino`; refresh any cached pages.
+pub fn file_written(ino: u64, data: &[u8]) {
+    unsafe {
+        let cache = match FILES.get_mut(&ino) {
+            Some(c) => c,
+            None => return,
+        };
+        cache.size = data.len() as u64;
+        for (&index, page) in cache.pages.iter_mut() {
+            let dst = phys_to_virt(page.phys);
+            let offset = (index * PAGE_SIZE) as usize;
+            let n = if offset < data.len() { core::cmp::min(PAGE_SIZE as usize, data.len() - offset) } else { 0 };
+            if n > 0 {
+                core::ptr::copy_nonoverlapping(data.as_ptr().add(offset), dst, n);
+            }
+            core::ptr::write_bytes(dst.add(n), 0, PAGE_SIZE as usize - n);
+            page.dirty = false;
+        }
+    }
+}
+
+pub fn stats() -> CacheStats {
+    unsafe {
+        CacheStats {
+            files: FILES.len(),
+            pages: FILES.values().map(|c| c.pages.len()).sum(),
+            hits: HITS,
+            misses: MISSES,
+            writebacks: WRITEBACKS,
+        }
+    }
+}
@@ -2,6 +2,7 @@
 #![allow(dead_code)]
 
 use alloc::vec::Vec;
+use crate::heap::{dma_alloc_below, dma_free, DmaBuffer, DMA_LIMIT_32BIT};
 
 // PCnet Register Offsets
 const REG_APROM: u16 = 0x00;
@@ -37,10 +38,12 @@ const STATUS_INTR: u16 = 0x0080;
 
 const NUM_RX_DESC: usize = 32;
 const NUM_TX_DESC: usize = 32;
+const BUFFER_SIZE: usize = 1536;
+// SWSTYLE 2 descriptors are 16 bytes and must be 16-byte aligned; all
+// addresses the chip sees are 32-bit
+const DESC_ALIGN: usize = 16;
 
 extern "C" {
-    fn rust_kmalloc(size: usize) -> *mut u8;
-    fn rust_kfree(ptr: *mut u8);
     fn serial_write(s: *const u8);
 }
 
@@ -81,11 +84,15 @@ struct TxDescriptor {
 pub struct PcnetDevice {
     io_base: u16,
     mac_address: [u8; 6],
+    init_dma: DmaBuffer,
+    rx_ring: DmaBuffer,
+    tx_ring: DmaBuffer,
     init_block: *mut InitBlock,
     rx_descs: *mut RxDescriptor,
     tx_descs: *mut TxDescriptor,
-    rx_buffers: Vec<*mut u8>,
-    tx_buffers: Vec<*mut u8>,
+    // All packet buffers of a ring share one contiguous block, BUFFER_SIZE apart
+    rx_buffers: DmaBuffer,
+    tx_buffers: DmaBuffer,
     rx_current: usize,
     tx_current: usize,
 }
@@ -96,68 +103,33 @@ unsafe impl Sync for PcnetDevice {}
 impl PcnetDevice {
     pub fn new(io_base: u16) -> Option<Self> {
         unsafe {
-            // Allocate init block
-            let init_block = rust_kmalloc(core::mem::size_of::<InitBlock>()) as *mut InitBlock;
-            if init_block.is_null() {
+            // Allocate init block, descriptor rings and packet buffers
+            let init_dma = dma_alloc_below(core::mem::size_of::<InitBlock>(), DESC_ALIGN, DMA_LIMIT_32BIT);
+            let rx_ring = dma_alloc_below(core::mem::size_of::<RxDescriptor>() * NUM_RX_DESC, DESC_ALIGN, DMA_LIMIT_32BIT);
+            let tx_ring = dma_alloc_below(core::mem::size_of::<TxDescriptor>() * NUM_TX_DESC, DESC_ALIGN, DMA_LIMIT_32BIT);
+            let rx_buffers = dma_alloc_below(BUFFER_SIZE * NUM_RX_DESC, DESC_ALIGN, DMA_LIMIT_32BIT);
+            let tx_buffers = dma_alloc_below(BUFFER_SIZE * NUM_TX_DESC, DESC_ALIGN, DMA_LIMIT_32BIT);
+
+            if init_dma.is_null() || rx_ring.is_null() || tx_ring.is_null()
+                || rx_buffers.is_null() || tx_buffers.is_null() {
+                // dma_free ignores null buffers
+                dma_free(init_dma);
+                dma_free(rx_ring);
+                dma_free(tx_ring);
+                dma_free(rx_buffers);
+                dma_free(tx_buffers);
                 return None;
             }
 
-            // Allocate descriptor rings
-            let rx_descs = rust_kmalloc(core::mem::size_of::<RxDescriptor>() * NUM_RX_DESC) as *mut RxDescriptor;
-            let tx_descs = rust_kmalloc(core::mem::size_of::<TxDescriptor>() * NUM_TX_DESC) as *mut TxDescriptor;
-
-            if rx_descs.is_null() || tx_descs.is_null() {
-                rust_kfree(init_block as *mut u8);
-                if !rx_descs.is_null() {
-                    rust_kfree(rx_descs as *mut u8);
-                }
-                if !tx_descs.is_null() {
-                    rust_kfree(tx_descs as *mut u8);
-                }
-                return None;
-            }
-
-            // Allocate packet buffers
-            let mut rx_buffers = Vec::new();
-            let mut tx_buffers = Vec::new();
-
-            for _ in 0..NUM_RX_DESC {
-                let buf = rust_kmalloc(1536);
-                if buf.is_null() {
-                    for b in rx_buffers {
-                        rust_kfree(b);
-                    }
-                    rust_kfree(init_block as *mut u8);
-                    rust_kfree(rx_descs as *mut u8);
-                    rust_kfree(tx_descs as *mut u8);
-                    return None;
-                }
-                rx_buffers.push(buf);
-            }
-
-            for _ in 0..NUM_TX_DESC {
-                let buf = rust_kmalloc(1536);
-                if buf.is_null() {
-                    for b in rx_buffers {
-                        rust_kfree(b);
-                    }
-                    for b in tx_buffers {
-                        rust_kfree(b);
-                    }
-                    rust_kfree(init_block as *mut u8);
-                    rust_kfree(rx_descs as *mut u8);
-                    rust_kfree(tx_descs as *mut u8);
-                    return None;
-                }
-                tx_buffers.push(buf);
-            }
-
             let mut device = PcnetDevice {
                 io_base,
                 mac_address: [0; 6],
-                init_block,
-                rx_descs,
-                tx_descs,
+                init_dma,
+                rx_ring,
+                tx_ring,
+                init_block: init_dma.virt as *mut InitBlock,
+                rx_descs: rx_ring.virt as *mut RxDescriptor,
+                tx_descs: tx_ring.virt as *mut TxDescriptor,
                 rx_buffers,
                 tx_buffers,
                 rx_current: 0,
@@ -238,14 +210,14 @@ impl PcnetDevice {
             ib.tlen = ((NUM_TX_DESC as u8).trailing_zeros() << 4) as u8;
             ib.padr.copy_from_slice(&self.mac_address);
             ib.ladr = [0xFF; 8]; // Accept all multicast
-            ib.rdra = self.rx_descs as u32;
-            ib.tdra = self.tx_descs as u32;
+            ib.rdra = self.rx_ring.phys as u32;
+            ib.tdra = self.tx_ring.phys as u32;
 
             // Setup RX descriptors
             for i in 0..NUM_RX_DESC {
                 let desc = &mut *self.rx_descs.add(i);
-                desc.addr = self.rx_buffers[i] as u32;
-                desc.buf_len = (-1536i16) as u16;
+                desc.addr = (self.rx_buffers.phys + (i * BUFFER_SIZE) as u64) as u32;
+                desc.buf_len = (-(BUFFER_SIZE as i16)) as u16;
                 desc.flags = 0x8000; // OWN bit
                 desc.msg_len = 0;
             }
@@ -253,13 +225,13 @@ impl PcnetDevice {
             // Setup TX descriptors
             for i in 0..NUM_TX_DESC {
                 let desc = &mut *self.tx_descs.add(i);
-                desc.addr = self.tx_buffers[i] as u32;
+                desc.addr = (self.tx_buffers.phys + (i * BUFFER_SIZE) as u64) as u32;
                 desc.buf_len = 0;
                 desc.flags = 0;
             }
 
             // Set init block address
-            let init_addr = self.init_block as u32;
+            let init_addr = self.init_dma.phys as u32;
             self.write_csr(CSR_IADR0, (init_addr & 0xFFFF) as u16);
             self.write_csr(CSR_IADR1, ((init_addr >> 16) & 0xFFFF) as u16);
 
@@ -286,7 +258,7 @@ impl PcnetDevice {
     }
 
     pub fn transmit(&mut self, data: &[u8]) -> Result<(), &'static str> {
-        if data.len() > 1536 {
+        if data.len() > BUFFER_SIZE {
             return Err("Packet too large");
         }
 
@@ -299,7 +271,7 @@ impl PcnetDevice {
             }
 
             // Copy data to buffer
-            core::ptr::copy_nonoverlapping(data.as_ptr(), self.tx_buffers[self.tx_current], data.len());
+            core::ptr::copy_nonoverlapping(data.as_ptr(), self.tx_buffers.virt.add(self.tx_current * BUFFER_SIZE), data.len());
 
             // Setup descriptor
             desc.buf_len = (-(data.len() as i16)) as u16;
@@ -331,7 +303,7 @@ impl PcnetDevice {
 
             let length = (desc.msg_len - 4) as usize; // Subtract CRC
             let mut packet = Vec::with_capacity(length);
-            let data = core::slice::from_raw_parts(self.rx_buffers[self.rx_current], length);
+            let data = core::slice::from_raw_parts(self.rx_buffers.virt.add(self.rx_current * BUFFER_SIZE), length);
             packet.extend_from_slice(data);
 
             // Reset descriptor
@@ -347,17 +319,11 @@ impl PcnetDevice {
 
 impl Drop for PcnetDevice {
     fn drop(&mut self) {
-        unsafe {
-            for buf in &self.rx_buffers {
-                rust_kfree(*buf);
-            }
-            for buf in &self.tx_buffers {
-                rust_kfree(*buf);
-            }
-            rust_kfree(self.init_block as *mut u8);
-            rust_kfree(self.rx_descs as *mut u8);
-            rust_kfree(self.tx_descs as *mut u8);
-        }
+        dma_free(self.rx_buffers);
+        dma_free(self.tx_buffers);
+        dma_free(self.init_dma);
+        dma_free(self.rx_ring);
+        dma_free(self.tx_ring);
     }
 }
 
@@ -6,6 +6,9 @@ use core::option::Option;
 use core::option::Option::{Some, None};
 use core::convert::AsMut;
 
+use crate::heap_profile::{HeapTag, TagScope};
+use crate::vma::VmaTree;
+
 extern "C" {
     fn serial_write(s: *const u8);
     fn rust_kmalloc(size: usize) -> *mut u8;
@@ -30,13 +33,14 @@ pub enum PrivilegeLevel {
 }
 
 // Memory region types
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, PartialEq)]
 pub enum MemoryRegionType {
     Code,
     Data,
     Stack,
     Heap,
     Shared,
+    File, // mmap() of a file, see page_cache.rs
 }
 
 // Memory region descriptor
@@ -47,8 +51,15 @@ pub struct MemoryRegion {
     pub end_addr: u64,
     pub permissions: u32, // Read=1, Write=2, Execute=4
     pub region_type: MemoryRegionType,
+    // File regions: inode, offset of start_addr in the file, MAP_SHARED
+    pub file_ino: u64,
+    pub file_offset: u64,
+    pub shared: bool,
 }
 
+// Initial program break of user processes, above the data segment
+pub const USER_HEAP_BASE: u64 = 0x0000_0000_0100_0000; // 16MB
+
 // Process Control Block (PCB)
 #[repr(C)]
 pub struct ProcessControlBlock {
@@ -85,7 +96,7 @@ pub struct ProcessControlBlock {
     
     // Memory management
     pub page_directory: u64, // Physical address of page directory
-    pub memory_regions: Vec<MemoryRegion>,
+    pub memory_regions: VmaTree,
     pub heap_start: u64,
     pub heap_end: u64,
     pub stack_start: u64,
@@ -133,7 +144,7 @@ impl ProcessControlBlock {
             },
             
             page_directory: 0,
-            memory_regions: Vec::new(),
+            memory_regions: VmaTree::new(),
             heap_start: 0,
             heap_end: 0,
             stack_start: 0,
@@ -151,16 +162,14 @@ impl ProcessControlBlock {
     }
     
     pub fn add_memory_region(&mut self, region: MemoryRegion) {
-        self.memory_regions.push(region);
+        self.memory_regions.insert(region);
     }
     
     pub fn check_memory_access(&self, addr: u64, access_type: u32) -> bool {
-        for region in &self.memory_regions {
-            if addr >= region.start_addr && addr < region.end_addr {
-                return (region.permissions & access_type) != 0;
-            }
+        match self.memory_regions.find(addr) {
+            Some(region) => (region.permissions & access_type) != 0,
+            None => false,
         }
-        false
     }
 }
 
@@ -181,10 +190,12 @@ impl ProcessManager {
     }
     
     pub fn create_process(&mut self, parent_pid: u32, privilege_level: PrivilegeLevel) -> u32 {
+        let _tag = TagScope::new(HeapTag::Process);
         let pid = self.next_pid;
         self.next_pid += 1;
         
-        let mut pcb = Box::new(ProcessControlBlock::new(pid, parent_pid, privilege_level));
+        let mut pcb = crate::slab::boxed(unsafe { crate::slab::PCB_CACHE },
+                                         ProcessControlBlock::new(pid, parent_pid, privilege_level));
         
         // Set up initial memory regions based on privilege level
         match privilege_level {
@@ -195,6 +206,9 @@ impl ProcessManager {
                     end_addr: 0xFFFF_FFFF_FFFF_FFFF,
                     permissions: 7, // Read + Write + Execute
                     region_type: MemoryRegionType::Code,
+                    file_ino: 0,
+                    file_offset: 0,
+                    shared: false,
                 });
             },
             PrivilegeLevel::User => {
@@ -205,6 +219,9 @@ impl ProcessManager {
                     end_addr: 0x0000_0000_0080_0000,   // 8MB
                     permissions: 5, // Read + Execute
                     region_type: MemoryRegionType::Code,
+                    file_ino: 0,
+                    file_offset: 0,
+                    shared: false,
                 });
                 
                 // Data segment (read + write)
@@ -213,6 +230,9 @@ impl ProcessManager {
                     end_addr: 0x0000_0000_00C0_0000,   // 12MB
                     permissions: 3, // Read + Write
                     region_type: MemoryRegionType::Data,
+                    file_ino: 0,
+                    file_offset: 0,
+                    shared: false,
                 });
                 
                 // Stack segment (read + write)
@@ -221,8 +241,14 @@ impl ProcessManager {
                     end_addr: 0x0000_8000_0000_0000,
                     permissions: 3, // Read + Write
                     region_type: MemoryRegionType::Stack,
+                    file_ino: 0,
+                    file_offset: 0,
+                    shared: false,
                 });
                 
+                // Empty heap; brk() grows it upwards
+                pcb.heap_start = USER_HEAP_BASE;
+                pcb.heap_end = USER_HEAP_BASE;
                 pcb.stack_start = 0x0000_7FFF_FFF0_0000;
                 pcb.stack_end = 0x0000_8000_0000_0000;
                 pcb.rsp = 0x0000_7FFF_FFFF_F000; // Stack pointer near top
@@ -272,6 +298,14 @@ impl ProcessManager {
             .map(|p| p.as_mut())
     }
     
+    /// The process with the lowest PID above `pid`.
+    pub fn get_process_after(&mut self, pid: u32) -> Option<&mut ProcessControlBlock> {
+        self.processes.iter_mut()
+            .filter(|p| p.pid > pid)
+            .min_by_key(|p| p.pid)
+            .map(|p| p.as_mut())
+    }
+    
     pub fn get_current_process(&mut self) -> Option<&mut ProcessControlBlock> {
         if self.current_pid == 0 { return None; }
         self.get_process(self.current_pid)
@@ -371,6 +405,36 @@ impl ProcessManager {
 // Global process manager
 static mut PROCESS_MANAGER: Option<ProcessManager> = None;
 
+/// The process whose address space is active, if any.
+pub fn current_process() -> Option<&'static mut ProcessControlBlock> {
+    unsafe {
+        match PROCESS_MANAGER {
+            Some(ref mut pm) => pm.get_current_process(),
+            None => None,
+        }
+    }
+}
+
+pub fn process_by_pid(pid: u32) -> Option<&'static mut ProcessControlBlock> {
+    unsafe {
+        match PROCESS_MANAGER {
+            Some(ref mut pm) => pm.get_process(pid),
+            None => None,
+        }
+    }
+}
+
+/// The process with the lowest PID above `pid`, for walks over all
+/// processes that may be interrupted and resumed.
+pub fn process_after(pid: u32) -> Option<&'static mut ProcessControlBlock> {
+    unsafe {
+        match PROCESS_MANAGER {
+            Some(ref mut pm) => pm.get_process_after(pid),
+            None => None,
+        }
+    }
+}
+
 #[no_mangle]
 pub extern "C" fn rust_process_init() {
     unsafe {
@@ -441,16 +505,26 @@ pub extern "C" fn rust_process_get_current_pid() -> u32 {
     }
 }
 
+// Must match task_t in kernel/task.h
 #[repr(C)]
 #[derive(Clone, Copy, Debug, PartialEq)]
 pub struct Task {
     pub rsp: u64,
     pub rip: u64,
-    pub stack: [u8; 16384],
-    pub state: u8,
+    pub state: i32,
     pub id: i32,
-    pub user_mode: u8,
-    pub priority: u8,
+    pub user_mode: i32,
+    pub priority: i32,
     pub cr3: u64,
     pub next: *mut Task,
+    pub rq_next: *mut Task, // Run queue link (scheduler.rs)
+    pub time_slice: i32,    // Timer ticks left
+    pub policy: i32,        // SCHED_RR or SCHED_NORMAL
+    pub vruntime: u64,      // Weighted run time in ns (fair class)
+    pub exec_ticks: u64,    // Timer ticks spent running
+    pub wait_channel: u64,  // Channel slept on, 0 if none (waitqueue.rs)
+    pub wait_next: *mut Task,
+    pub wait_deadline: u64, // Tick the sleep times out at, 0 for none
+    pub cpu: i32,           // CPU whose run queue the task is on
+    pub stack: [u8; 16384],
 }
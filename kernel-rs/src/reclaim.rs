@@ -0,0 +1,267 @@
+// Page reclaim.
+//
+// Anonymous user pages and page-cache pages are kept on an active and an
+// inactive LRU list. Pages enter at the tail of the active list. Aging takes
+// pages from the head of the active list and moves those not referenced
+// since the last pass (PTE accessed bit clear) to the inactive list; reclaim
+// evicts from the head of the inactive list. Unmapped cache pages are
+// dropped (written back first if dirty) and anonymous pages are written to
+// swap, when a swap area is enabled, leaving a swap entry in the PTE (see
+// swap.rs). Pages referenced while inactive go back to the active list.
+//
+// There is no reverse mapping: an anonymous entry remembers the process and
+// address that mapped the frame and is only evicted while that PTE still
+// maps it and nothing else does (refcount 1, so pages shared copy-on-write
+// after fork() stay). Entries whose page went away in the meantime are
+// dropped when a scan reaches them. Huge pages are never put on the lists.
+//
+// Reclaim runs directly from the page-fault handler when a user page cannot
+// be allocated, and from the idle loop while free memory is below
+// LOW_WATERMARK_PAGES.
+
+use alloc::collections::VecDeque;
+
+extern "C" {
+    fn alloc_page() -> *mut u8;
+    fn alloc_zeroed_page() -> *mut u8;
+    fn rust_get_pte(pml4_phys: u64, virt: u64) -> *mut u64;
+    fn page_put(phys: u64);
+    fn page_refcount(phys: u64) -> u32;
+    fn pmm_free_memory() -> u64;
+    fn paging_invalidate_page(cr3: u64, virt: u64);
+}
+
+use crate::memory::phys_to_virt;
+use crate::process::{self, MemoryRegionType};
+
+const PAGE_SIZE: u64 = 4096;
+const PTE_PRESENT: u64 = 0x1;
+const PTE_ACCESSED: u64 = 0x20;
+const PTE_ADDR_MASK: u64 = 0x000F_FFFF_FFFF_F000;
+
+// Free memory the idle loop tries to keep available, and how much it
+// reclaims per call
+const LOW_WATERMARK_PAGES: u64 = 1024;
+const IDLE_RECLAIM_BATCH: usize = 16;
+// Pages reclaimed before a failed fault allocation is retried
+const DIRECT_RECLAIM_BATCH: usize = 32;
+
+#[derive(Clone, Copy)]
+enum Owner {
+    Anon { pid: u32, addr: u64 },
+    Cache { ino: u64, index: u64 },
+}
+
+#[derive(Clone, Copy)]
+struct LruEntry {
+    owner: Owner,
+    phys: u64,
+}
+
+#[derive(Clone, Copy)]
+pub struct ReclaimStats {
+    pub active: usize,
+    pub inactive: usize,
+    pub scanned: u64,
+    pub cache_dropped: u64,
+    pub swapped_out: u64,
+    pub direct: u64, // Direct reclaim runs from the fault handler
+}
+
+static mut ACTIVE: VecDeque<LruEntry> = VecDeque::new();
+static mut INACTIVE: VecDeque<LruEntry> = VecDeque::new();
+static mut SCANNED: u64 = 0;
+static mut CACHE_DROPPED: u64 = 0;
+static mut SWAPPED_OUT: u64 = 0;
+static mut DIRECT: u64 = 0;
+
+pub fn add_anon(pid: u32, addr: u64, phys: u64) {
+    unsafe { ACTIVE.push_back(LruEntry { owner: Owner::Anon { pid, addr }, phys }); }
+}
+
+pub fn add_cache(ino: u64, index: u64, phys: u64) {
+    unsafe { ACTIVE.push_back(LruEntry { owner: Owner::Cache { ino, index }, phys }); }
+}
+
+/// The address space and PTE still mapping an anonymous entry's frame, or
+/// None if the entry is stale.
+unsafe fn anon_pte(pid: u32, addr: u64, phys: u64) -> Option<(u64, *mut u64)> {
+    let cr3 = match process::process_by_pid(pid) {
+        Some(p) if p.page_directory != 0 => p.page_directory,
+        _ => return None,
+    };
+    let pte = rust_get_pte(cr3, addr);
+    if pte.is_null() || *pte & PTE_PRESENT == 0 || *pte & PTE_ADDR_MASK != phys {
+        return None;
+    }
+    Some((cr3, pte))
+}
+
+enum State {
+    Stale,
+    Referenced,
+    Idle,
+}
+
+/// Check an entry and clear its referenced state for the next pass.
+unsafe fn test_and_clear_referenced(e: &LruEntry) -> State {
+    match e.owner {
+        Owner::Anon { pid, addr } => {
+            let pte = match anon_pte(pid, addr, e.phys) {
+                Some((_, pte)) => pte,
+                None => return State::Stale,
+            };
+            if *pte & PTE_ACCESSED != 0 {
+                *pte &= !PTE_ACCESSED;
+                return State::Referenced;
+            }
+            State::Idle
+        }
+        Owner::Cache { ino, index } => {
+            if crate::page_cache::page_phys(ino, index) != Some(e.phys) {
+                return State::Stale;
+            }
+            // Without a reverse mapping the accessed bits of mapped cache
+            // pages cannot be found; count being mapped as in use
+            if page_refcount(e.phys) > 1 { State::Referenced } else { State::Idle }
+        }
+    }
+}
+
+/// Evict an idle entry. Returns whether its frame was freed.
+unsafe fn evict(e: &LruEntry) -> bool {
+    match e.owner {
+        Owner::Cache { ino, index } => {
+            if crate::page_cache::evict(ino, index) {
+                CACHE_DROPPED += 1;
+                return true;
+            }
+            false
+        }
+        Owner::Anon { pid, addr } => {
+            if !crate::swap::enabled() || page_refcount(e.phys) != 1 {
+                return false;
+            }
+            // Only private anonymous memory goes to swap
+            let private_anon = process::process_by_pid(pid)
+                .and_then(|p| p.memory_regions.find(addr).cloned())
+                .map_or(false, |r| !r.shared && matches!(r.region_type,
+                        MemoryRegionType::Data | MemoryRegionType::Heap | MemoryRegionType::Stack));
+            let (cr3, pte) = match anon_pte(pid, addr, e.phys) {
+                Some(p) if private_anon => p,
+                _ => return false,
+            };
+            let entry = match crate::swap::write_page(phys_to_virt(e.phys)) {
+                Some(entry) => entry,
+                None => return false,
+            };
+            *pte = entry;
+            paging_invalidate_page(cr3, addr);
+            page_put(e.phys);
+            SWAPPED_OUT += 1;
+            true
+        }
+    }
+}
+
+/// Move up to `n` entries from the head of the active list.
+unsafe fn age_active(n: usize) {
+    for _ in 0..n {
+        let e = match ACTIVE.pop_front() {
+            Some(e) => e,
+            None => return,
+        };
+        SCANNED += 1;
+        match test_and_clear_referenced(&e) {
+            State::Stale => {}
+            State::Referenced => ACTIVE.push_back(e),
+            State::Idle => INACTIVE.push_back(e),
+        }
+    }
+}
+
+/// Try to free `target` pages. Returns how many were freed.
+pub fn reclaim(target: usize) -> usize {
+    let flags = crate::heap::irq_save();
+    let mut freed = 0;
+    unsafe {
+        // Each entry is looked at no more than about twice per call
+        let mut budget = 2 * (ACTIVE.len() + INACTIVE.len());
+        while freed < target && budget > 0 {
+            // Keep the inactive list at about a third of all pages
+            if INACTIVE.len() * 2 < ACTIVE.len() {
+                age_active(32.min(budget));
+            }
+            let e = match INACTIVE.pop_front() {
+                Some(e) => e,
+                None if ACTIVE.is_empty() => break,
+                None => {
+                    age_active(32.min(budget));
+                    budget = budget.saturating_sub(32);
+                    continue;
+                }
+            };
+            budget -= 1;
+            SCANNED += 1;
+            match test_and_clear_referenced(&e) {
+                State::Stale => {}
+                State::Referenced => ACTIVE.push_back(e),
+                State::Idle => {
+                    if evict(&e) {
+                        freed += 1;
+                    } else {
+                        // Cannot go now (shared, or no swap); look again later
+                        ACTIVE.push_back(e);
+                    }
+                }
+            }
+        }
+    }
+    crate::heap::irq_restore(flags);
+    freed
+}
+
+/// Allocate a frame for a user page, reclaiming memory if there is none.
+pub fn alloc_user_page(zeroed: bool) -> *mut u8 {
+    let alloc = || unsafe { if zeroed { alloc_zeroed_page() } else { alloc_page() } };
+    let frame = alloc();
+    if !frame.is_null() {
+        return frame;
+    }
+    unsafe { DIRECT += 1; }
+    if reclaim(DIRECT_RECLAIM_BATCH) == 0 {
+        return core::ptr::null_mut();
+    }
+    alloc()
+}
+
+pub fn stats() -> ReclaimStats {
+    unsafe {
+        ReclaimStats {
+            active: ACTIVE.len(),
+            inactive: INACTIVE.len(),
+            scanned: SCANNED,
+            cache_dropped: CACHE_DROPPED,
+            swapped_out: SWAPPED_OUT,
+            direct: DIRECT,
+        }
+    }
+}
+
+/// Background reclaim, run from pause() when the CPU is otherwise idle.
+#[no_mangle]
+pub extern "C" fn rust_reclaim_idle() {
+    unsafe {
+        if ACTIVE.is_empty() && INACTIVE.is_empty() {
+            return;
+        }
+        if pmm_free_memory() / PAGE_SIZE < LOW_WATERMARK_PAGES {
+            reclaim(IDLE_RECLAIM_BATCH);
+        } else {
+            // Still age a little so stale entries do not pile up
+            let flags = crate::heap::irq_save();
+            age_active(IDLE_RECLAIM_BATCH);
+            crate::heap::irq_restore(flags);
+        }
+    }
+}
@@ -4,6 +4,7 @@
 use core::ptr::{read_volatile, write_volatile};
 use spin::Mutex;
 use alloc::vec::Vec;
+use crate::heap::{dma_alloc_below, dma_free, DmaBuffer, DMA_LIMIT_32BIT};
 
 // RTL8139 Register Offsets
 const REG_MAC0: u16 = 0x00;
@@ -47,12 +48,10 @@ const TCR_IFG: u32 = 0x03000000; // Interframe gap
 // Buffer sizes
 const RX_BUFFER_SIZE: usize = 8192 + 16 + 1500;
 const TX_BUFFER_SIZE: usize = 1536;
+// RBSTART/TSAD take 32-bit addresses; TX buffers must be dword aligned
+const TX_ALIGN: usize = 4;
 
 extern "C" {
-    fn rust_kmalloc(size: usize) -> *mut u8;
-    fn rust_kfree(ptr: *mut u8);
-    fn pmm_alloc_page() -> u64;
-    fn pmm_free_page(addr: u64);
     fn serial_write(s: *const u8);
     fn serial_write_dec(s: *const u8, n: u64);
     fn serial_write_str(s: *const u8);
@@ -61,8 +60,9 @@ extern "C" {
 pub struct Rtl8139Device {
     io_base: u16,
     mac_address: [u8; 6],
-    rx_buffer: *mut u8,
-    tx_buffers: [*mut u8; 4],
+    rx_buffer: DmaBuffer,
+    // The four TX buffers share one contiguous block, TX_BUFFER_SIZE apart
+    tx_buffers: DmaBuffer,
     current_tx: usize,
     rx_offset: u16,
 }
@@ -73,26 +73,16 @@ unsafe impl Sync for Rtl8139Device {}
 impl Rtl8139Device {
     pub fn new(io_base: u16) -> Option<Self> {
         unsafe {
-            // Allocate RX buffer
-            let rx_buffer = rust_kmalloc(RX_BUFFER_SIZE);
-            if rx_buffer.is_null() {
+            // Allocate RX ring and TX buffers
+            let rx_buffer = dma_alloc_below(RX_BUFFER_SIZE, TX_ALIGN, DMA_LIMIT_32BIT);
+            let tx_buffers = dma_alloc_below(TX_BUFFER_SIZE * 4, TX_ALIGN, DMA_LIMIT_32BIT);
+            if rx_buffer.is_null() || tx_buffers.is_null() {
+                // dma_free ignores null buffers
+                dma_free(rx_buffer);
+                dma_free(tx_buffers);
                 return None;
             }
 
-            // Allocate TX buffers
-            let mut tx_buffers = [core::ptr::null_mut(); 4];
-            for i in 0..4 {
-                tx_buffers[i] = rust_kmalloc(TX_BUFFER_SIZE);
-                if tx_buffers[i].is_null() {
-                    // Cleanup on failure
-                    rust_kfree(rx_buffer);
-                    for j in 0..i {
-                        rust_kfree(tx_buffers[j]);
-                    }
-                    return None;
-                }
-            }
-
             let mut device = Rtl8139Device {
                 io_base,
                 mac_address: [0; 6],
@@ -208,8 +198,8 @@ impl Rtl8139Device {
 
             // Set RX buffer
             serial_write(b"[RTL8139] Setting RX buffer addr=\0".as_ptr());
-            serial_write_dec(b"\n\0".as_ptr(), self.rx_buffer as u64);
-            self.outl(REG_RBSTART, self.rx_buffer as u32);
+            serial_write_dec(b"\n\0".as_ptr(), self.rx_buffer.phys);
+            self.outl(REG_RBSTART, self.rx_buffer.phys as u32);
             
             // Verify RX buffer was set
             let rb_verify = self.inl(REG_RBSTART);
@@ -256,14 +246,14 @@ impl Rtl8139Device {
         }
 
         unsafe {
-            let tx_buffer = self.tx_buffers[self.current_tx];
+            let tx_buffer = self.tx_buffers.virt.add(self.current_tx * TX_BUFFER_SIZE);
             core::ptr::copy_nonoverlapping(data.as_ptr(), tx_buffer, data.len());
 
             let tsd_offset = REG_TSD0 + (self.current_tx as u16 * 4);
             let tsad_offset = REG_TSAD0 + (self.current_tx as u16 * 4);
 
             // Set transmit address
-            self.outl(tsad_offset, tx_buffer as u32);
+            self.outl(tsad_offset, (self.tx_buffers.phys + (self.current_tx * TX_BUFFER_SIZE) as u64) as u32);
 
             // Set transmit status (length)
             self.outl(tsd_offset, data.len() as u32);
@@ -302,7 +292,7 @@ impl Rtl8139Device {
                 return None;
             }
             
-            let rx_ptr = self.rx_buffer.add(offset);
+            let rx_ptr = self.rx_buffer.virt.add(offset);
 
             // Read header (4 bytes: 2 bytes status, 2 bytes length)
             let header = read_volatile(rx_ptr as *const u32);
@@ -414,12 +404,8 @@ impl Rtl8139Device {
 
 impl Drop for Rtl8139Device {
     fn drop(&mut self) {
-        unsafe {
-            rust_kfree(self.rx_buffer);
-            for i in 0..4 {
-                rust_kfree(self.tx_buffers[i]);
-            }
-        }
+        dma_free(self.rx_buffer);
+        dma_free(self.tx_buffers);
     }
 }
 
@@ -1,37 +1,765 @@
+// Task scheduler with two classes: fixed-priority multi-level run queues
+// and a fair-share class based on virtual runtime.
+//
+// Priority class (SCHED_RR, the default). Each priority level (Task.priority,
+// lower = more urgent, clamped to 0..NUM_LEVELS-1) has a FIFO of READY tasks
+// linked through rq_next, and ready_mask has a bit set for every non-empty
+// level, so picking the next task is a trailing_zeros() and a dequeue however
+// many tasks exist. A task runs until its time slice (longer for more urgent
+// levels) is used up, it yields, blocks or exits, or a more urgent task
+// becomes ready. A preempted task with time left goes back to the head of its
+// level; one whose slice ran out goes to the tail with a fresh slice, so
+// tasks of equal priority take turns.
+//
+// Fair class (SCHED_NORMAL). Each task accumulates virtual runtime: the CPU
+// time it used scaled down by its weight, which follows the priority as nice
+// levels do (1.25x per step). Ready tasks sit in a tree ordered by vruntime
+// and the one that has had the least runs next, for a slice that is its
+// weight's share of SCHED_LATENCY_NS but never below MIN_GRANULARITY_NS. A
+// waking task's vruntime is pulled up to near the smallest in the tree, so
+// sleeping does not bank CPU time. Fair tasks only run when no priority-class
+// task is ready.
+//
+// Every CPU has its own run queues of both classes (CpuRq) and a task is
+// queued on one CPU at a time (Task.cpu). New tasks go to the least loaded
+// CPU and woken ones back to theirs unless another CPU sits idle. A CPU
+// whose queues run dry takes the next task of the busiest one, and every
+// BALANCE_INTERVAL_TICKS each CPU pulls a task from one that has at least
+// BALANCE_MIN_IMBALANCE more queued. Migrated fair tasks keep their
+// vruntime relative to the queue they came from.
+//
+// The running task is not on a queue. All queue operations run under
+// irq_save(), which also takes the kernel lock, so one CPU at a time
+// touches any run queue. Task switches happen with the lock held; the
+// next task's own irq_restore() (or task_entry_trampoline()) drops it.
+// Application processors run rust_scheduler_idle_loop() when they have
+// nothing to do; the boot CPU idles in place.
+
+use alloc::collections::BTreeMap;
 use crate::process::Task;
 
 extern "C" {
-    // C-side task list and helpers
-    static mut current: *mut Task;
-    fn task_switch(old_rsp: *mut u64, new_rsp: u64);
+    fn task_switch(old_rsp: *mut u64, new_rsp: u64, cr3: u64);
+    fn idle_work();
+    // kernel/smp.c
+    fn smp_cpu_id() -> u32;
+    fn smp_send_reschedule(cpu: u32);
+    fn klock_depth() -> u32;
+    fn klock_set_depth(depth: u32);
+    fn klock_release_all() -> u32;
+    fn klock_reacquire(depth: u32);
+    fn gdt_set_kernel_stack(rsp0: u64);
+}
+
+// task_state_t in kernel/task.h
+pub const TASK_RUNNING: i32 = 0;
+pub const TASK_READY: i32 = 1;
+pub const TASK_BLOCKED: i32 = 2;
+pub const TASK_TERMINATED: i32 = 3;
+
+// Policies, numbered as in Linux
+pub const SCHED_NORMAL: i32 = 0;
+pub const SCHED_RR: i32 = 2;
+
+pub const NUM_LEVELS: usize = 32;
+// SMP_MAX_CPUS in kernel/smp.h
+pub const MAX_CPUS: usize = 16;
+
+// Time slice in timer ticks (100 Hz) for the most and least urgent levels
+const MAX_SLICE_TICKS: i32 = 20;
+const MIN_SLICE_TICKS: i32 = 2;
+
+const TICK_NS: u64 = 10_000_000;
+// Period in which every ready fair task should run once, and the shortest
+// slice a fair task gets however many there are
+const SCHED_LATENCY_NS: u64 = 60_000_000;
+const MIN_GRANULARITY_NS: u64 = 20_000_000;
+
+// How often a busy CPU looks for an overloaded one, and by how many queued
+// tasks that one must be ahead before a task moves
+const BALANCE_INTERVAL_TICKS: u64 = 10;
+const BALANCE_MIN_IMBALANCE: usize = 2;
+
+// Fair-class weight by priority: the Linux nice table, priority 20 = nice 0
+const NICE_0_WEIGHT: u64 = 1024;
+const PRIO_TO_WEIGHT: [u64; 40] = [
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+];
+
+struct RunQueue {
+    head: *mut Task,
+    tail: *mut Task,
+}
+
+struct CpuRq {
+    current: *mut Task,
+    queues: [RunQueue; NUM_LEVELS],
+    ready_mask: u32,
+    // Ready fair tasks by (vruntime, id), the total of their weights, and a
+    // floor that only moves forward for placing waking tasks
+    fair_tree: BTreeMap<(u64, i32), *mut Task>,
+    fair_weight: u64,
+    min_vruntime: u64,
+    nr_ready: usize, // Tasks queued in either class
+    has_idle: bool,  // Runs rust_scheduler_idle_loop()
+    idle_rsp: u64,   // Saved stack of the idle loop while a task runs
+    ticks: u64,
+}
+
+static mut RQS: [CpuRq; MAX_CPUS] = [const {
+    CpuRq {
+        current: core::ptr::null_mut(),
+        queues: [const { RunQueue { head: core::ptr::null_mut(), tail: core::ptr::null_mut() } }; NUM_LEVELS],
+        ready_mask: 0,
+        fair_tree: BTreeMap::new(),
+        fair_weight: 0,
+        min_vruntime: 0,
+        nr_ready: 0,
+        has_idle: false,
+        idle_rsp: 0,
+        ticks: 0,
+    }
+}; MAX_CPUS];
+// CPUs taking tasks; the boot CPU from the start, the others once their
+// idle loop runs
+static mut ONLINE: u32 = 1;
+
+fn this_cpu() -> usize {
+    unsafe { smp_cpu_id() as usize }
+}
+
+unsafe fn rq(cpu: usize) -> &'static mut CpuRq {
+    &mut RQS[cpu]
+}
+
+fn online(cpu: usize) -> bool {
+    unsafe { ONLINE & (1 << cpu) != 0 }
+}
+
+fn level_of(t: *const Task) -> usize {
+    let prio = unsafe { (*t).priority };
+    prio.clamp(0, NUM_LEVELS as i32 - 1) as usize
+}
+
+fn slice_for(level: usize) -> i32 {
+    MAX_SLICE_TICKS - (MAX_SLICE_TICKS - MIN_SLICE_TICKS) * level as i32 / (NUM_LEVELS as i32 - 1)
+}
+
+fn is_fair(t: *const Task) -> bool {
+    unsafe { (*t).policy == SCHED_NORMAL }
+}
+
+fn weight_of(t: *const Task) -> u64 {
+    let prio = unsafe { (*t).priority };
+    PRIO_TO_WEIGHT[prio.clamp(0, PRIO_TO_WEIGHT.len() as i32 - 1) as usize]
+}
+
+unsafe fn enqueue(rq: &mut CpuRq, t: *mut Task, at_head: bool) {
+    let level = level_of(t);
+    let q = &mut rq.queues[level];
+    (*t).rq_next = core::ptr::null_mut();
+    if q.head.is_null() {
+        q.head = t;
+        q.tail = t;
+    } else if at_head {
+        (*t).rq_next = q.head;
+        q.head = t;
+    } else {
+        (*q.tail).rq_next = t;
+        q.tail = t;
+    }
+    rq.ready_mask |= 1 << level;
+    rq.nr_ready += 1;
+}
+
+/// Take the first task off the most urgent non-empty level.
+unsafe fn dequeue_next(rq: &mut CpuRq) -> *mut Task {
+    if rq.ready_mask == 0 {
+        return core::ptr::null_mut();
+    }
+    let level = rq.ready_mask.trailing_zeros() as usize;
+    let q = &mut rq.queues[level];
+    let t = q.head;
+    q.head = (*t).rq_next;
+    if q.head.is_null() {
+        q.tail = core::ptr::null_mut();
+        rq.ready_mask &= !(1 << level);
+    }
+    (*t).rq_next = core::ptr::null_mut();
+    rq.nr_ready -= 1;
+    t
+}
+
+/// Unlink a task from the middle of its level; only needed when its policy
+/// or priority changes.
+unsafe fn dequeue(rq: &mut CpuRq, t: *mut Task) {
+    let level = level_of(t);
+    let q = &mut rq.queues[level];
+    let mut prev: *mut Task = core::ptr::null_mut();
+    let mut cur = q.head;
+    while !cur.is_null() && cur != t {
+        prev = cur;
+        cur = (*cur).rq_next;
+    }
+    if cur.is_null() {
+        return;
+    }
+    if prev.is_null() {
+        q.head = (*t).rq_next;
+    } else {
+        (*prev).rq_next = (*t).rq_next;
+    }
+    if q.tail == t {
+        q.tail = prev;
+    }
+    if q.head.is_null() {
+        rq.ready_mask &= !(1 << level);
+    }
+    (*t).rq_next = core::ptr::null_mut();
+    rq.nr_ready -= 1;
+}
+
+/// Whether a task more urgent than `level` is ready.
+fn more_urgent_ready(rq: &CpuRq, level: usize) -> bool {
+    rq.ready_mask & ((1u32 << level) - 1) != 0
+}
+
+unsafe fn fair_enqueue(rq: &mut CpuRq, t: *mut Task) {
+    rq.fair_tree.insert(((*t).vruntime, (*t).id), t);
+    rq.fair_weight += weight_of(t);
+    rq.nr_ready += 1;
+}
+
+unsafe fn fair_dequeue(rq: &mut CpuRq, t: *mut Task) {
+    if rq.fair_tree.remove(&((*t).vruntime, (*t).id)).is_some() {
+        rq.fair_weight -= weight_of(t);
+        rq.nr_ready -= 1;
+    }
+}
+
+fn fair_leftmost(rq: &CpuRq) -> *mut Task {
+    rq.fair_tree.first_key_value().map_or(core::ptr::null_mut(), |(_, &t)| t)
+}
+
+/// Advance min_vruntime to the smallest vruntime among the running and
+/// ready fair tasks.
+unsafe fn update_min_vruntime(rq: &mut CpuRq) {
+    let mut min = u64::MAX;
+    let cur = rq.current;
+    if !cur.is_null() && is_fair(cur) && (*cur).state == TASK_RUNNING {
+        min = (*cur).vruntime;
+    }
+    if let Some((&(v, _), _)) = rq.fair_tree.first_key_value() {
+        min = min.min(v);
+    }
+    if min != u64::MAX && min > rq.min_vruntime {
+        rq.min_vruntime = min;
+    }
+}
+
+/// Start a fair task that is becoming ready no earlier than the tasks
+/// already there, less half a latency period of credit for having slept.
+unsafe fn place_fair(rq: &CpuRq, t: *mut Task) {
+    let floor = rq.min_vruntime.saturating_sub(SCHED_LATENCY_NS / 2);
+    if (*t).vruntime < floor {
+        (*t).vruntime = floor;
+    }
+}
+
+/// The running fair task's slice in ticks: its weight's share of the
+/// latency period, at least the minimum granularity.
+unsafe fn fair_slice(rq: &CpuRq, t: *const Task) -> i32 {
+    let total = rq.fair_weight + weight_of(t);
+    let ns = (SCHED_LATENCY_NS * weight_of(t) / total).max(MIN_GRANULARITY_NS);
+    ((ns + TICK_NS - 1) / TICK_NS) as i32
+}
+
+/// Make a task that is not running ready in its class on `cpu`.
+unsafe fn make_ready(cpu: usize, t: *mut Task, at_head: bool) {
+    let rq = rq(cpu);
+    (*t).state = TASK_READY;
+    (*t).cpu = cpu as i32;
+    if is_fair(t) {
+        fair_enqueue(rq, t);
+    } else {
+        if !at_head {
+            (*t).time_slice = slice_for(level_of(t));
+        }
+        enqueue(rq, t, at_head);
+    }
+}
+
+/// Take the task `rq` would run next off its queues.
+unsafe fn pick_local(rq: &mut CpuRq) -> *mut Task {
+    if rq.ready_mask != 0 {
+        return dequeue_next(rq);
+    }
+    let t = fair_leftmost(rq);
+    if !t.is_null() {
+        fair_dequeue(rq, t);
+    }
+    t
+}
+
+/// Queued plus running tasks.
+unsafe fn load(cpu: usize) -> usize {
+    let rq = rq(cpu);
+    rq.nr_ready + if rq.current.is_null() { 0 } else { 1 }
+}
+
+/// The other online CPU with the most queued tasks, if any has some.
+unsafe fn busiest(cpu: usize) -> Option<usize> {
+    let mut best = None;
+    let mut most = 0;
+    for other in 0..MAX_CPUS {
+        if other != cpu && online(other) && rq(other).nr_ready > most {
+            most = rq(other).nr_ready;
+            best = Some(other);
+        }
+    }
+    best
+}
+
+/// Move the next task of `from` over to `cpu`, still off the queues.
+unsafe fn steal(cpu: usize, from: usize) -> *mut Task {
+    let src = rq(from);
+    let t = pick_local(src);
+    if t.is_null() {
+        return t;
+    }
+    if is_fair(t) {
+        (*t).vruntime = (*t).vruntime.saturating_sub(src.min_vruntime) + rq(cpu).min_vruntime;
+    }
+    (*t).cpu = cpu as i32;
+    t
+}
+
+unsafe fn pick_next(cpu: usize) -> *mut Task {
+    let t = pick_local(rq(cpu));
+    if !t.is_null() {
+        return t;
+    }
+    match busiest(cpu) {
+        Some(from) => steal(cpu, from),
+        None => core::ptr::null_mut(),
+    }
+}
+
+/// Pull one task over from a CPU that has clearly more queued.
+unsafe fn balance(cpu: usize) {
+    if let Some(from) = busiest(cpu) {
+        if rq(from).nr_ready >= rq(cpu).nr_ready + BALANCE_MIN_IMBALANCE {
+            let t = steal(cpu, from);
+            if !t.is_null() {
+                make_ready(cpu, t, false);
+            }
+        }
+    }
+}
+
+/// Where a task that becomes ready should go: back to `prev` unless that
+/// CPU is busy and another one is idle.
+unsafe fn select_cpu(prev: usize) -> usize {
+    if online(prev) && load(prev) == 0 {
+        return prev;
+    }
+    for cpu in 0..MAX_CPUS {
+        if online(cpu) && rq(cpu).has_idle && load(cpu) == 0 {
+            return cpu;
+        }
+    }
+    if online(prev) { prev } else { this_cpu() }
+}
+
+/// The online CPU with the fewest tasks, this one on a tie.
+unsafe fn least_loaded() -> usize {
+    let mut best = this_cpu();
+    for cpu in 0..MAX_CPUS {
+        if online(cpu) && load(cpu) < load(best) {
+            best = cpu;
+        }
+    }
+    best
+}
+
+/// The CPU `t` is running on, if it is some CPU's current task.
+unsafe fn running_on(t: *mut Task) -> Option<usize> {
+    (0..MAX_CPUS).find(|&cpu| rq(cpu).current == t)
+}
+
+/// Save the running context to `save` and resume the one at `rsp`. The
+/// kernel lock depth and the heap profile tag belong to the context, not
+/// the CPU.
+unsafe fn switch_context(save: *mut u64, rsp: u64, cr3: u64) {
+    let depth = klock_depth();
+    let tag = crate::heap_profile::current_tag();
+    task_switch(save, rsp, cr3);
+    klock_set_depth(depth);
+    crate::heap_profile::set_tag(tag);
+}
+
+unsafe fn switch_to(save: *mut u64, next: *mut Task) {
+    // Interrupts from user mode land on the task's own kernel stack
+    gdt_set_kernel_stack(((*next).stack.as_ptr() as u64 + (*next).stack.len() as u64) & !15);
+    switch_context(save, (*next).rsp, (*next).cr3);
+}
+
+/// Whether the runnable task `prev` should give up the CPU now.
+unsafe fn should_preempt(rq: &CpuRq, prev: *mut Task, yielding: bool) -> bool {
+    if is_fair(prev) {
+        if rq.ready_mask != 0 {
+            return true;
+        }
+        let left = fair_leftmost(rq);
+        if left.is_null() {
+            return false;
+        }
+        return yielding || ((*prev).time_slice <= 0 && (*left).vruntime < (*prev).vruntime);
+    }
+    let level = level_of(prev);
+    if (*prev).time_slice > 0 {
+        more_urgent_ready(rq, level)
+    } else {
+        // Slice used up: only tasks at the same level or above get a turn
+        rq.ready_mask & (u32::MAX >> (NUM_LEVELS - 1 - level)) != 0
+    }
+}
+
+/// Switch to the next ready task if the running one should give up the
+/// CPU. `yielding` gives up the rest of the time slice.
+unsafe fn schedule(yielding: bool) {
+    let cpu = this_cpu();
+    let rq = rq(cpu);
+    let prev = rq.current;
+    if prev.is_null() {
+        return;
+    }
+    let runnable = (*prev).state == TASK_RUNNING || (*prev).state == TASK_READY;
+    if yielding {
+        (*prev).time_slice = 0;
+    }
+    if runnable && !should_preempt(rq, prev, yielding) {
+        if (*prev).time_slice <= 0 {
+            (*prev).time_slice = if is_fair(prev) { fair_slice(rq, prev) } else { slice_for(level_of(prev)) };
+        }
+        return;
+    }
+    let next = pick_next(cpu);
+    if next.is_null() {
+        if !runnable && rq.has_idle {
+            // Nothing else to run here: back to the idle loop
+            rq.current = core::ptr::null_mut();
+            switch_context(&mut (*prev).rsp as *mut u64, rq.idle_rsp, 0);
+        }
+        return;
+    }
+    if runnable {
+        make_ready(cpu, prev, (*prev).time_slice > 0);
+    }
+    (*next).state = TASK_RUNNING;
+    if is_fair(next) {
+        (*next).time_slice = fair_slice(rq, next);
+    } else if (*next).time_slice <= 0 {
+        (*next).time_slice = slice_for(level_of(next));
+    }
+    rq.current = next;
+    update_min_vruntime(rq);
+    switch_to(&mut (*prev).rsp as *mut u64, next);
+}
+
+/// Make a newly created task runnable on the least loaded CPU. The first
+/// task on the boot CPU adopts the running context instead of being queued.
+pub fn task_created(t: *mut Task) {
+    let flags = crate::heap::irq_save();
+    unsafe {
+        (*t).policy = SCHED_RR;
+        (*t).exec_ticks = 0;
+        (*t).time_slice = slice_for(level_of(t));
+        let here = this_cpu();
+        let rq_here = rq(here);
+        if (rq_here.current.is_null() && !rq_here.has_idle) || rq_here.current == t {
+            (*t).cpu = here as i32;
+            (*t).vruntime = rq_here.min_vruntime;
+            (*t).state = TASK_RUNNING;
+            rq_here.current = t;
+        } else {
+            let cpu = least_loaded();
+            (*t).cpu = cpu as i32;
+            (*t).vruntime = rq(cpu).min_vruntime;
+            (*t).state = TASK_READY;
+            enqueue(rq(cpu), t, false);
+            if cpu != here {
+                smp_send_reschedule(cpu as u32);
+            }
+        }
+    }
+    crate::heap::irq_restore(flags);
+}
+
+/// Let a more urgent task that just became ready run now.
+pub fn reschedule() {
+    let flags = crate::heap::irq_save();
+    unsafe { schedule(false); }
+    crate::heap::irq_restore(flags);
+}
+
+pub fn yield_now() {
+    let flags = crate::heap::irq_save();
+    unsafe { schedule(true); }
+    crate::heap::irq_restore(flags);
+}
+
+/// Terminate the running task and switch away for good. With nothing else
+/// to run (the boot CPU has no idle loop to fall back to), idle in the dead
+/// task until something is ready.
+pub fn exit_current() -> ! {
+    crate::heap::irq_save();
+    unsafe {
+        let cur = rq(this_cpu()).current;
+        if !cur.is_null() {
+            (*cur).state = TASK_TERMINATED;
+        }
+        loop {
+            schedule(true);
+            idle();
+        }
+    }
+}
+
+/// The live task with the given ID; `None` for free slots.
+pub fn task_by_id(id: i32) -> Option<*mut Task> {
+    unsafe {
+        let t = crate::TASKS.get_mut(usize::try_from(id).ok()?)?;
+        if t.id != id || t.state == TASK_TERMINATED {
+            return None;
+        }
+        Some(t as *mut Task)
+    }
+}
+
+/// The task running on this CPU.
+pub fn current_task() -> Option<*mut Task> {
+    let cur = unsafe { rq(this_cpu()).current };
+    if cur.is_null() { None } else { Some(cur) }
 }
 
 #[no_mangle]
-pub extern "C" fn rust_scheduler_tick() {
+pub extern "C" fn rust_current_task() -> *mut Task {
+    current_task().unwrap_or(core::ptr::null_mut())
+}
+
+/// Whether `t` is some CPU's current task; a terminated one may still be
+/// idling on its stack.
+pub fn on_cpu(t: *mut Task) -> bool {
+    unsafe { running_on(t).is_some() }
+}
+
+/// CPUs taking tasks.
+pub fn cpus_online() -> u32 {
+    unsafe { ONLINE.count_ones() }
+}
+
+/// Change a task's policy and, if given, its priority, moving it between
+/// queues if it is ready. Returns false for an unknown policy.
+pub fn set_policy(t: *mut Task, policy: i32, priority: Option<i32>) -> bool {
+    if policy != SCHED_NORMAL && policy != SCHED_RR {
+        return false;
+    }
+    let flags = crate::heap::irq_save();
     unsafe {
-        if current.is_null() { return; }
-        let prev = current;
-        let mut t = current;
-        let mut best: *mut Task = core::ptr::null_mut();
-        let mut best_priority = i32::MAX;
-        let _first = true;
-        // Find the READY task with the highest priority (lowest value)
+        let cpu = (*t).cpu as usize;
+        let rq = rq(cpu);
+        let ready = (*t).state == TASK_READY;
+        if ready {
+            if is_fair(t) { fair_dequeue(rq, t) } else { dequeue(rq, t) }
+        }
+        if policy == SCHED_NORMAL && !is_fair(t) {
+            place_fair(rq, t);
+        }
+        (*t).policy = policy;
+        if let Some(p) = priority {
+            (*t).priority = p;
+        }
+        (*t).time_slice = 0;
+        if ready {
+            make_ready(cpu, t, false);
+        }
+    }
+    crate::heap::irq_restore(flags);
+    true
+}
+
+#[derive(Clone, Copy)]
+pub struct TaskSchedInfo {
+    pub id: i32,
+    pub cpu: i32,
+    pub state: i32,
+    pub policy: i32,
+    pub priority: i32,
+    pub weight: u64,
+    pub vruntime: u64,    // Nanoseconds, fair class only
+    pub exec_ticks: u64,
+}
+
+/// Scheduling details of up to `out.len()` live tasks. Returns how many
+/// were written.
+pub fn task_info(out: &mut [TaskSchedInfo]) -> usize {
+    let flags = crate::heap::irq_save();
+    let mut n = 0;
+    unsafe {
+        for t in crate::TASKS.iter() {
+            if n == out.len() {
+                break;
+            }
+            if t.id < 0 || t.state == TASK_TERMINATED {
+                continue;
+            }
+            out[n] = TaskSchedInfo {
+                id: t.id,
+                cpu: t.cpu,
+                state: t.state,
+                policy: t.policy,
+                priority: t.priority,
+                weight: weight_of(t),
+                vruntime: t.vruntime,
+                exec_ticks: t.exec_ticks,
+            };
+            n += 1;
+        }
+    }
+    crate::heap::irq_restore(flags);
+    n
+}
+
+/// Nothing to run: do idle work with interrupts enabled and the kernel lock
+/// dropped, then halt until the next interrupt. Called and returns with
+/// interrupts disabled and the lock held.
+pub unsafe fn idle() {
+    let depth = klock_release_all();
+    core::arch::asm!("sti", options(nomem, nostack));
+    idle_work();
+    core::arch::asm!("cli", options(nomem, nostack));
+    klock_reacquire(depth);
+    // Anything the idle work made ready runs first
+    if rq(this_cpu()).nr_ready != 0 {
+        return;
+    }
+    // A wakeup IPI sent after the lock is dropped is still taken by the hlt
+    let depth = klock_release_all();
+    core::arch::asm!("sti; hlt; cli", options(nomem, nostack));
+    klock_reacquire(depth);
+}
+
+/// Run tasks on an application processor, for good. Entered from
+/// kernel/smp.c with interrupts disabled; tasks that block or exit with
+/// nothing left to run here come back to this loop.
+#[no_mangle]
+pub extern "C" fn rust_scheduler_idle_loop() -> ! {
+    crate::heap::irq_save();
+    unsafe {
+        let cpu = this_cpu();
+        let rq = rq(cpu);
+        rq.has_idle = true;
+        ONLINE |= 1 << cpu;
         loop {
-            if (*t).state == 1 /* TASK_READY */ {
-                if ((*t).priority as i32) < best_priority {
-                    best_priority = (*t).priority as i32;
-                    best = t;
+            let next = pick_next(cpu);
+            if next.is_null() {
+                idle();
+                continue;
+            }
+            (*next).state = TASK_RUNNING;
+            if is_fair(next) {
+                (*next).time_slice = fair_slice(rq, next);
+            } else if (*next).time_slice <= 0 {
+                (*next).time_slice = slice_for(level_of(next));
+            }
+            rq.current = next;
+            update_min_vruntime(rq);
+            switch_to(&mut rq.idle_rsp as *mut u64, next);
+        }
+    }
+}
+
+/// Timer tick: charge the running task and preempt it when its slice is
+/// used up or a more urgent task is ready.
+#[no_mangle]
+pub extern "C" fn rust_scheduler_tick() {
+    let flags = crate::heap::irq_save();
+    crate::waitqueue::expire_timeouts();
+    unsafe {
+        let cpu = this_cpu();
+        let rq = rq(cpu);
+        let cur = rq.current;
+        if !cur.is_null() {
+            (*cur).exec_ticks += 1;
+            if is_fair(cur) {
+                (*cur).vruntime += TICK_NS * NICE_0_WEIGHT / weight_of(cur);
+                update_min_vruntime(rq);
+            }
+            (*cur).time_slice -= 1;
+            rq.ticks += 1;
+            if rq.ticks % BALANCE_INTERVAL_TICKS == 0 {
+                balance(cpu);
+            }
+            schedule(false);
+        }
+    }
+    crate::heap::irq_restore(flags);
+}
+
+/// Put the running task to sleep until rust_task_wake(). With nothing else
+/// to run, an application processor goes back to its idle loop; the boot
+/// CPU idles in the blocked task until something wakes it.
+#[no_mangle]
+pub extern "C" fn rust_task_block() {
+    let flags = crate::heap::irq_save();
+    unsafe {
+        let me = rq(this_cpu()).current;
+        if !me.is_null() {
+            (*me).state = TASK_BLOCKED;
+            while (*me).state == TASK_BLOCKED {
+                schedule(true);
+                if (*me).state == TASK_BLOCKED {
+                    idle();
                 }
             }
-            t = (*t).next;
-            if t == current { break; }
         }
-        // If multiple tasks have the same priority, pick the next one after current
-        if !best.is_null() && best != current {
-            let old_rsp = &mut (*prev).rsp as *mut u64;
-            let new_rsp = (*best).rsp;
-            current = best;
-            task_switch(old_rsp, new_rsp);
+    }
+    crate::heap::irq_restore(flags);
+}
+
+/// Make a blocked task runnable again, on another CPU if its own is busy
+/// and one is idle.
+#[no_mangle]
+pub extern "C" fn rust_task_wake(t: *mut Task) {
+    if t.is_null() {
+        return;
+    }
+    let flags = crate::heap::irq_save();
+    unsafe {
+        if (*t).state == TASK_BLOCKED {
+            if let Some(cpu) = running_on(t) {
+                // Woken before it got off the CPU
+                (*t).state = TASK_RUNNING;
+                smp_send_reschedule(cpu as u32);
+            } else {
+                let cpu = select_cpu((*t).cpu as usize);
+                if is_fair(t) {
+                    place_fair(rq(cpu), t);
+                }
+                make_ready(cpu, t, false);
+                if cpu != this_cpu() {
+                    smp_send_reschedule(cpu as u32);
+                }
+            }
         }
     }
+    crate::heap::irq_restore(flags);
 }
@@ -0,0 +1,328 @@
+// Slab allocator for small kernel objects.
+//
+// Objects of up to SLAB_MAX_SIZE bytes are served from per-size-class caches
+// (16 B .. 4 KiB), and subsystems can create named caches for their own
+// object types. Each slab is a size-aligned run of heap pages starting with
+// a `Slab` header followed by equally sized objects; free objects are kept
+// on an intrusive freelist, so alloc and free are O(1). The heap records
+// which pages belong to which slab, which lets rust_kfree() route any slab
+// pointer back to its cache without a size argument.
+use core::mem::size_of;
+use core::ptr::null_mut;
+
+use crate::heap;
+use crate::heap_profile;
+
+extern "C" {
+    fn serial_write(s: *const u8);
+}
+
+pub const SLAB_MIN_SIZE: usize = 16;
+pub const SLAB_MAX_SIZE: usize = 4096;
+const NUM_SIZE_CLASSES: usize = 9; // 16, 32, ..., 4096
+const MAX_NAMED_CACHES: usize = 16;
+const SLAB_MAGIC: u32 = 0x51AB_C0DE;
+// Fully free slabs kept around per cache before they go back to the heap
+const MAX_EMPTY_SLABS: usize = 1;
+
+#[repr(C, align(16))]
+pub struct Slab {
+    magic: u32,
+    inuse: u32,
+    cache: *mut KmemCache,
+    free: *mut FreeObj,
+    next: *mut Slab,
+    prev: *mut Slab,
+}
+
+struct FreeObj {
+    next: *mut FreeObj,
+}
+
+#[repr(C)]
+pub struct KmemCache {
+    pub name: [u8; 16],
+    pub obj_size: usize,
+    pub objs_per_slab: usize,
+    pub slab_bytes: usize,
+    partial: *mut Slab,
+    full: *mut Slab,
+    empty: *mut Slab,
+    pub nr_slabs: usize,
+    pub nr_empty: usize,
+    pub active_objs: usize,
+    pub total_allocs: u64,
+    // Heap profile tag for objects of a named cache (the subsystem that
+    // created it); size-class caches use the current tag instead
+    pub tag: u8,
+}
+
+impl KmemCache {
+    const fn empty() -> Self {
+        KmemCache {
+            name: [0; 16],
+            obj_size: 0,
+            objs_per_slab: 0,
+            slab_bytes: 0,
+            partial: null_mut(),
+            full: null_mut(),
+            empty: null_mut(),
+            nr_slabs: 0,
+            nr_empty: 0,
+            active_objs: 0,
+            total_allocs: 0,
+            tag: u8::MAX,
+        }
+    }
+
+    fn init(&mut self, name: &[u8], obj_size: usize) {
+        let obj_size = (obj_size.max(SLAB_MIN_SIZE) + 15) & !15;
+        // Size the slab so that at least ~8 objects fit in it
+        let mut slab_bytes = 4096;
+        while slab_bytes < obj_size * 8 {
+            slab_bytes *= 2;
+        }
+        let hdr = size_of::<Slab>();
+        *self = KmemCache::empty();
+        let n = core::cmp::min(name.len(), self.name.len() - 1);
+        self.name[..n].copy_from_slice(&name[..n]);
+        self.obj_size = obj_size;
+        self.slab_bytes = slab_bytes;
+        self.objs_per_slab = (slab_bytes - hdr) / obj_size;
+    }
+}
+
+static mut SIZE_CACHES: [KmemCache; NUM_SIZE_CLASSES] = [const { KmemCache::empty() }; NUM_SIZE_CLASSES];
+static mut NAMED_CACHES: [KmemCache; MAX_NAMED_CACHES] = [const { KmemCache::empty() }; MAX_NAMED_CACHES];
+static mut NUM_NAMED_CACHES: usize = 0;
+
+// Named cache for process control blocks; other subsystems create theirs
+// on first use (see network.rs, ext2.c)
+pub static mut PCB_CACHE: *mut KmemCache = null_mut();
+
+pub fn init() {
+    unsafe {
+        let names: [&[u8]; NUM_SIZE_CLASSES] = [
+            b"kmalloc-16", b"kmalloc-32", b"kmalloc-64", b"kmalloc-128", b"kmalloc-256",
+            b"kmalloc-512", b"kmalloc-1k", b"kmalloc-2k", b"kmalloc-4k",
+        ];
+        for i in 0..NUM_SIZE_CLASSES {
+            SIZE_CACHES[i].init(names[i], SLAB_MIN_SIZE << i);
+        }
+        NUM_NAMED_CACHES = 0;
+        let _tag = heap_profile::TagScope::new(heap_profile::HeapTag::Process);
+        PCB_CACHE = cache_create(b"pcb", size_of::<crate::process::ProcessControlBlock>());
+    }
+}
+
+fn size_class(size: usize) -> usize {
+    let size = size.max(SLAB_MIN_SIZE);
+    (usize::BITS - (size - 1).leading_zeros()) as usize - 4
+}
+
+/// Create a named cache; falls back to the matching size class when the
+/// named-cache table is full or the object is too large for a slab.
+pub fn cache_create(name: &[u8], obj_size: usize) -> *mut KmemCache {
+    unsafe {
+        if obj_size > SLAB_MAX_SIZE {
+            return null_mut();
+        }
+        if NUM_NAMED_CACHES >= MAX_NAMED_CACHES {
+            return &raw mut SIZE_CACHES[size_class(obj_size)];
+        }
+        let cache = &raw mut NAMED_CACHES[NUM_NAMED_CACHES];
+        NUM_NAMED_CACHES += 1;
+        (*cache).init(name, obj_size);
+        (*cache).tag = heap_profile::current_tag();
+        cache
+    }
+}
+
+unsafe fn list_add(head: *mut *mut Slab, slab: *mut Slab) {
+    (*slab).prev = null_mut();
+    (*slab).next = *head;
+    if !(*head).is_null() {
+        (**head).prev = slab;
+    }
+    *head = slab;
+}
+
+unsafe fn list_del(head: *mut *mut Slab, slab: *mut Slab) {
+    if !(*slab).prev.is_null() {
+        (*(*slab).prev).next = (*slab).next;
+    } else {
+        *head = (*slab).next;
+    }
+    if !(*slab).next.is_null() {
+        (*(*slab).next).prev = (*slab).prev;
+    }
+    (*slab).next = null_mut();
+    (*slab).prev = null_mut();
+}
+
+unsafe fn slab_grow(cache: *mut KmemCache) -> *mut Slab {
+    let mem = heap::page_alloc((*cache).slab_bytes);
+    if mem.is_null() {
+        return null_mut();
+    }
+    let slab = mem as *mut Slab;
+    (*slab).magic = SLAB_MAGIC;
+    (*slab).inuse = 0;
+    (*slab).cache = cache;
+    (*slab).next = null_mut();
+    (*slab).prev = null_mut();
+    // Thread the freelist through the objects in address order
+    let base = mem.add(size_of::<Slab>());
+    let mut head: *mut FreeObj = null_mut();
+    for i in (0..(*cache).objs_per_slab).rev() {
+        let obj = base.add(i * (*cache).obj_size) as *mut FreeObj;
+        (*obj).next = head;
+        head = obj;
+    }
+    (*slab).free = head;
+    heap::set_page_owner(mem, (*cache).slab_bytes, true);
+    (*cache).nr_slabs += 1;
+    slab
+}
+
+unsafe fn slab_destroy(cache: *mut KmemCache, slab: *mut Slab) {
+    (*slab).magic = 0;
+    heap::set_page_owner(slab as *mut u8, (*cache).slab_bytes, false);
+    heap::page_free(slab as *mut u8);
+    (*cache).nr_slabs -= 1;
+}
+
+pub fn cache_alloc(cache: *mut KmemCache) -> *mut u8 {
+    if cache.is_null() {
+        return null_mut();
+    }
+    unsafe {
+        let c = &mut *cache;
+        let mut slab = c.partial;
+        if slab.is_null() {
+            slab = c.empty;
+            if !slab.is_null() {
+                list_del(&mut c.empty, slab);
+                c.nr_empty -= 1;
+            } else {
+                slab = slab_grow(cache);
+                if slab.is_null() {
+                    serial_write(b"[SLAB] Out of memory growing cache\n\0".as_ptr());
+                    return null_mut();
+                }
+            }
+            list_add(&mut c.partial, slab);
+        }
+        let obj = (*slab).free;
+        (*slab).free = (*obj).next;
+        (*slab).inuse += 1;
+        if (*slab).free.is_null() {
+            list_del(&mut c.partial, slab);
+            list_add(&mut c.full, slab);
+        }
+        c.active_objs += 1;
+        c.total_allocs += 1;
+        obj as *mut u8
+    }
+}
+
+/// Free an object given the slab header that owns it (from the heap's page
+/// owner table).
+pub unsafe fn free_in_slab(slab_ptr: *mut u8, ptr: *mut u8) {
+    let slab = slab_ptr as *mut Slab;
+    if (*slab).magic != SLAB_MAGIC {
+        serial_write(b"[SLAB-ERROR] Free of pointer with corrupt slab header\n\0".as_ptr());
+        return;
+    }
+    let cache = (*slab).cache;
+    let c = &mut *cache;
+    let offset = ptr as usize - (slab as usize + size_of::<Slab>());
+    if offset % c.obj_size != 0 {
+        serial_write(b"[SLAB-ERROR] Free of misaligned object pointer\n\0".as_ptr());
+        return;
+    }
+    let was_full = (*slab).free.is_null();
+    let obj = ptr as *mut FreeObj;
+    (*obj).next = (*slab).free;
+    (*slab).free = obj;
+    (*slab).inuse -= 1;
+    c.active_objs -= 1;
+    if was_full {
+        list_del(&mut c.full, slab);
+        list_add(&mut c.partial, slab);
+    }
+    if (*slab).inuse == 0 {
+        list_del(&mut c.partial, slab);
+        if c.nr_empty >= MAX_EMPTY_SLABS {
+            slab_destroy(cache, slab);
+        } else {
+            list_add(&mut c.empty, slab);
+            c.nr_empty += 1;
+        }
+    }
+}
+
+/// Allocate from `cache` and record the object in the heap profile. Called
+/// with interrupts disabled.
+unsafe fn cache_alloc_tracked(cache: *mut KmemCache) -> *mut u8 {
+    let obj = cache_alloc(cache);
+    if !obj.is_null() {
+        let tag = if ((*cache).tag as usize) < heap_profile::NUM_TAGS { (*cache).tag } else { heap_profile::current_tag() };
+        heap_profile::record_alloc(obj, (*cache).obj_size, tag, 0);
+    }
+    obj
+}
+
+pub fn kmalloc_small(size: usize) -> *mut u8 {
+    unsafe { cache_alloc(&raw mut SIZE_CACHES[size_class(size)]) }
+}
+
+/// Move a value into an object allocated from `cache` and return it boxed.
+/// The box is released through the global allocator, which routes slab
+/// pointers back to their owning cache.
+pub fn boxed<T>(cache: *mut KmemCache, value: T) -> alloc::boxed::Box<T> {
+    let flags = heap::irq_save();
+    let ptr = if cache.is_null() { null_mut() } else { unsafe { cache_alloc_tracked(cache) as *mut T } };
+    heap::irq_restore(flags);
+    if ptr.is_null() {
+        return alloc::boxed::Box::new(value);
+    }
+    unsafe {
+        ptr.write(value);
+        alloc::boxed::Box::from_raw(ptr)
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn rust_kmem_cache_create(name: *const u8, obj_size: usize) -> *mut KmemCache {
+    let mut len = 0;
+    if !name.is_null() {
+        unsafe {
+            while len < 15 && *name.add(len) != 0 {
+                len += 1;
+            }
+        }
+    }
+    let name_slice = if len == 0 { &b"anon"[..] } else { unsafe { core::slice::from_raw_parts(name, len) } };
+    let flags = heap::irq_save();
+    let cache = cache_create(name_slice, obj_size);
+    heap::irq_restore(flags);
+    cache
+}
+
+#[no_mangle]
+pub extern "C" fn rust_kmem_cache_alloc(cache: *mut KmemCache) -> *mut u8 {
+    if cache.is_null() {
+        return null_mut();
+    }
+    let flags = heap::irq_save();
+    let obj = unsafe { cache_alloc_tracked(cache) };
+    heap::irq_restore(flags);
+    obj
+}
+
+#[no_mangle]
+pub extern "C" fn rust_kmem_cache_free(_cache: *mut KmemCache, ptr: *mut u8) {
+    // The owning slab (and therefore cache) is found from the pointer itself
+    heap::rust_kfree(ptr);
+}
@@ -0,0 +1,175 @@
+// Swap area on a block device.
+//
+// swapon() claims a range of sectors on any blockdev_t and divides it into
+// page-sized slots. A swapped-out page is left in its PTE as a non-present
+// entry holding the slot number and PTE_SWAP. Each slot has a use count
+// (the PTEs referring to it): fork() shares swap entries the way it shares
+// frames, and every process swaps in its own copy.
+
+use alloc::vec;
+use alloc::vec::Vec;
+
+#[repr(C)]
+struct BlockDev {
+    id: i32,
+    read: extern "C" fn(sector: i32, buf: *mut u8, count: i32) -> i32,
+    write: extern "C" fn(sector: i32, buf: *const u8, count: i32) -> i32,
+    total_sectors: i32,
+}
+
+extern "C" {
+    fn blockdev_get(id: i32) -> *mut BlockDev;
+}
+
+const PTE_PRESENT: u64 = 0x1;
+pub const PTE_SWAP: u64 = 0x800; // Software bit, only in non-present PTEs
+const SECTORS_PER_SLOT: u64 = 4096 / 512;
+
+struct SwapArea {
+    dev: *mut BlockDev,
+    dev_id: i32,
+    start_sector: u64,
+    counts: Vec<u16>, // Use count per slot, 0 = free
+    free: usize,
+    next: usize, // Where the search for a free slot resumes
+}
+
+#[derive(Clone, Copy)]
+pub struct SwapStats {
+    pub dev_id: i32,
+    pub total: usize, // Slots
+    pub free: usize,
+    pub outs: u64,
+    pub ins: u64,
+}
+
+static mut SWAP: Option<SwapArea> = None;
+static mut OUTS: u64 = 0;
+static mut INS: u64 = 0;
+
+/// Use `sectors` sectors of block device `dev_id` starting at
+/// `start_sector` as swap (0 = up to the end of the device). Returns 0 or
+/// a negative errno.
+pub fn swapon(dev_id: i32, start_sector: u64, sectors: u64) -> i32 {
+    unsafe {
+        if SWAP.is_some() {
+            return -16; // EBUSY
+        }
+        let dev = blockdev_get(dev_id);
+        if dev.is_null() {
+            return -19; // ENODEV
+        }
+        let total = (*dev).total_sectors as u64;
+        if start_sector >= total {
+            return -22; // EINVAL
+        }
+        let sectors = if sectors == 0 || start_sector + sectors > total { total - start_sector } else { sectors };
+        let slots = (sectors / SECTORS_PER_SLOT) as usize;
+        if slots == 0 {
+            return -22;
+        }
+        SWAP = Some(SwapArea { dev, dev_id, start_sector, counts: vec![0; slots], free: slots, next: 0 });
+    }
+    0
+}
+
+pub fn enabled() -> bool {
+    unsafe { SWAP.is_some() }
+}
+
+pub fn stats() -> Option<SwapStats> {
+    unsafe {
+        SWAP.as_ref().map(|s| SwapStats { dev_id: s.dev_id, total: s.counts.len(), free: s.free, outs: OUTS, ins: INS })
+    }
+}
+
+pub fn is_swap_entry(pte: u64) -> bool {
+    pte & PTE_PRESENT == 0 && pte & PTE_SWAP != 0
+}
+
+fn entry_slot(entry: u64) -> usize {
+    (entry >> 12) as usize
+}
+
+/// Write the page at `frame` to a free slot. Returns the PTE value that
+/// refers to it, or None if swap is off, full or the write failed.
+pub fn write_page(frame: *const u8) -> Option<u64> {
+    unsafe {
+        let area = SWAP.as_mut()?;
+        if area.free == 0 {
+            return None;
+        }
+        let n = area.counts.len();
+        let mut slot = area.next;
+        while area.counts[slot] != 0 {
+            slot = (slot + 1) % n;
+        }
+        let sector = area.start_sector + slot as u64 * SECTORS_PER_SLOT;
+        if ((*area.dev).write)(sector as i32, frame, SECTORS_PER_SLOT as i32) != 0 {
+            return None;
+        }
+        area.counts[slot] = 1;
+        area.free -= 1;
+        area.next = (slot + 1) % n;
+        OUTS += 1;
+        Some(((slot as u64) << 12) | PTE_SWAP)
+    }
+}
+
+/// Read the page `entry` refers to into `frame`.
+pub fn read_page(entry: u64, frame: *mut u8) -> bool {
+    unsafe {
+        let area = match SWAP.as_mut() {
+            Some(a) => a,
+            None => return false,
+        };
+        let slot = entry_slot(entry);
+        if slot >= area.counts.len() || area.counts[slot] == 0 {
+            return false;
+        }
+        let sector = area.start_sector + slot as u64 * SECTORS_PER_SLOT;
+        if ((*area.dev).read)(sector as i32, frame, SECTORS_PER_SLOT as i32) != 0 {
+            return false;
+        }
+        INS += 1;
+        true
+    }
+}
+
+/// A copied address space now refers to `entry` too.
+pub fn dup_entry(entry: u64) {
+    unsafe {
+        if let Some(area) = SWAP.as_mut() {
+            let slot = entry_slot(entry);
+            if slot < area.counts.len() && area.counts[slot] != 0 {
+                area.counts[slot] = area.counts[slot].saturating_add(1);
+            }
+        }
+    }
+}
+
+/// Drop a reference to `entry`; the slot is free once none are left.
+pub fn free_entry(entry: u64) {
+    unsafe {
+        if let Some(area) = SWAP.as_mut() {
+            let slot = entry_slot(entry);
+            if slot < area.counts.len() && area.counts[slot] != 0 {
+                area.counts[slot] -= 1;
+                if area.counts[slot] == 0 {
+                    area.free += 1;
+                }
+            }
+        }
+    }
+}
+
+// Called from paging.c when address spaces are cloned and freed
+#[no_mangle]
+pub extern "C" fn rust_swap_entry_dup(entry: u64) {
+    dup_entry(entry);
+}
+
+#[no_mangle]
+pub extern "C" fn rust_swap_entry_free(entry: u64) {
+    free_entry(entry);
+}
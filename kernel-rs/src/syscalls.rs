@@ -18,6 +18,29 @@ extern "C" {
     fn rust_vfs_mkdir(path_ptr: *const u8) -> i32;
     fn rust_vfs_unlink(path_ptr: *const u8) -> i32;
     fn rust_vfs_ls(path_ptr: *const u8) -> i32;
+    fn is_valid_range(buf: *const u8, len: usize) -> i32;
+    fn is_valid_string(s: *const u8, max_len: usize) -> i32;
+}
+
+const MAX_PATH_LEN: usize = 4096;
+
+// Validate a user buffer once at the syscall boundary; everything past this
+// point copies with the unchecked memcpy/memset kernels.
+fn user_buffer_ok(buf: *const u8, len: usize, access_type: u32) -> bool {
+    unsafe {
+        if is_valid_range(buf, len) == 0 {
+            return false;
+        }
+        let pid = rust_process_get_current_pid();
+        rust_process_check_access(pid, buf as u64, access_type)
+            && rust_process_check_access(pid, buf as u64 + len as u64 - 1, access_type)
+    }
+}
+
+// User path strings are validated here, once; the VFS then uses the
+// unchecked string primitives on them.
+fn user_path_ok(path: *const u8) -> bool {
+    unsafe { is_valid_string(path, MAX_PATH_LEN) != 0 }
 }
 
 // System call numbers
@@ -121,6 +144,23 @@ pub const SYS_GETTIMEOFDAY: u64 = 96;
 pub const SYS_GETRLIMIT: u64 = 97;
 pub const SYS_GETRUSAGE: u64 = 98;
 pub const SYS_SYSINFO: u64 = 99;
+pub const SYS_SCHED_SETSCHEDULER: u64 = 144;
+pub const SYS_SCHED_GETSCHEDULER: u64 = 145;
+
+// open() flags
+pub const O_CREAT: i32 = 0x40;
+
+// mmap() protection and flags; PROT_* match MemoryRegion permissions
+pub const PROT_READ: i32 = 0x1;
+pub const PROT_WRITE: i32 = 0x2;
+pub const PROT_EXEC: i32 = 0x4;
+pub const MAP_SHARED: i32 = 0x01;
+pub const MAP_PRIVATE: i32 = 0x02;
+pub const MAP_FIXED: i32 = 0x10;
+pub const MAP_ANONYMOUS: i32 = 0x20;
+pub const MS_ASYNC: i32 = 0x1;
+pub const MS_INVALIDATE: i32 = 0x2;
+pub const MS_SYNC: i32 = 0x4;
 
 // Error codes
 pub const EPERM: i64 = -1;      // Operation not permitted
@@ -169,6 +209,11 @@ pub extern "C" fn rust_syscall_handler(
     arg5: u64,
     arg6: u64,
 ) -> i64 {
+    // The int 0x80 gate only clears IF on this CPU. Until the VM, VFS and
+    // page cache have locks of their own, the kernel lock keeps the other
+    // CPUs' faults and idle work out while a call runs.
+    let flags = crate::heap::irq_save();
+
     // Get current process ID for privilege checking
     let current_pid = unsafe { rust_process_get_current_pid() };
     
@@ -210,7 +255,7 @@ pub extern "C" fn rust_syscall_handler(
         serial_write(msg.as_ptr());
     }
     
-    match syscall_num {
+    let ret = match syscall_num {
         SYS_READ => sys_read(arg1 as i32, arg2 as *mut u8, arg3 as usize),
         SYS_WRITE => sys_write(arg1 as i32, arg2 as *const u8, arg3 as usize),
         SYS_OPEN => sys_open(arg1 as *const u8, arg2 as i32, arg3 as u32),
@@ -231,16 +276,22 @@ pub extern "C" fn rust_syscall_handler(
         SYS_BRK => sys_brk(arg1 as *mut u8),
         SYS_MMAP => sys_mmap(arg1 as *mut u8, arg2 as usize, arg3 as i32, arg4 as i32, arg5 as i32, arg6 as i64),
         SYS_MUNMAP => sys_munmap(arg1 as *mut u8, arg2 as usize),
+        SYS_MPROTECT => sys_mprotect(arg1 as *mut u8, arg2 as usize, arg3 as i32),
+        SYS_MSYNC => sys_msync(arg1 as *mut u8, arg2 as usize, arg3 as i32),
         SYS_UNAME => sys_uname(arg1 as *mut u8),
         SYS_GETTIMEOFDAY => sys_gettimeofday(arg1 as *mut u8, arg2 as *mut u8),
         SYS_SCHED_YIELD => sys_sched_yield(),
+        SYS_SCHED_SETSCHEDULER => sys_sched_setscheduler(arg1 as i32, arg2 as i32, arg3 as *const i32),
+        SYS_SCHED_GETSCHEDULER => sys_sched_getscheduler(arg1 as i32),
         _ => {
             unsafe {
                 serial_write(b"[SYSCALL] Unimplemented system call\n\0".as_ptr());
             }
             EINVAL
         }
-    }
+    };
+    crate::heap::irq_restore(flags);
+    ret
 }
 
 // System call implementations
@@ -249,9 +300,7 @@ fn sys_read(fd: i32, buf: *mut u8, count: usize) -> i64 {
         return EINVAL;
     }
     
-    // Check memory access permissions
-    let current_pid = unsafe { rust_process_get_current_pid() };
-    if !unsafe { rust_process_check_access(current_pid, buf as u64, 2) } { // Write access
+    if !user_buffer_ok(buf, count, 2) { // Write access
         return EFAULT;
     }
     
@@ -273,9 +322,7 @@ fn sys_write(fd: i32, buf: *const u8, count: usize) -> i64 {
         return EINVAL;
     }
     
-    // Check memory access permissions
-    let current_pid = unsafe { rust_process_get_current_pid() };
-    if !unsafe { rust_process_check_access(current_pid, buf as u64, 1) } { // Read access
+    if !user_buffer_ok(buf, count, 1) { // Read access
         return EFAULT;
     }
     
@@ -307,6 +354,9 @@ fn sys_open(pathname: *const u8, flags: i32, mode: u32) -> i64 {
     if pathname.is_null() {
         return EINVAL;
     }
+    if !user_path_ok(pathname) {
+        return EFAULT;
+    }
     
     // Check memory access permissions
     let current_pid = unsafe { rust_process_get_current_pid() };
@@ -314,21 +364,38 @@ fn sys_open(pathname: *const u8, flags: i32, mode: u32) -> i64 {
         return EFAULT;
     }
     
-    // For now, return a dummy file descriptor
-    unsafe {
-        serial_write(b"[SYSCALL] sys_open - not fully implemented\n\0".as_ptr());
+    let pcb = match crate::process::current_process() {
+        Some(p) => p,
+        None => return ESRCH,
+    };
+    let fd = match (3..pcb.fd_table.len()).find(|&i| pcb.fd_table[i].is_none()) {
+        Some(fd) => fd,
+        None => return EMFILE,
+    };
+    match crate::vfs::open(pathname, flags & O_CREAT != 0) {
+        Ok(handle) => {
+            pcb.fd_table[fd] = Some(handle);
+            fd as i64
+        }
+        Err(e) => e as i64,
     }
-    3 // Return fd 3 as a placeholder
 }
 
 fn sys_close(fd: i32) -> i64 {
     match fd {
         0..=2 => EBADF, // Can't close stdin/stdout/stderr
         _ => {
-            unsafe {
-                serial_write(b"[SYSCALL] sys_close - not fully implemented\n\0".as_ptr());
+            let pcb = match crate::process::current_process() {
+                Some(p) => p,
+                None => return EBADF,
+            };
+            match pcb.fd_table.get_mut(fd as usize).and_then(|e| e.take()) {
+                Some(handle) => {
+                    crate::vfs::close(handle);
+                    0
+                }
+                None => EBADF,
             }
-            0 // Success
         }
     }
 }
@@ -354,15 +421,47 @@ fn sys_fork() -> i64 {
     unsafe {
         extern "C" {
             fn rust_process_create(parent_pid: u32, is_kernel: bool) -> u32;
+            fn rust_process_terminate(pid: u32, exit_code: i32);
         }
         let current_pid = rust_process_get_current_pid();
         let new_pid = rust_process_create(current_pid, false); // Create user process
         
         if new_pid == 0 {
-            ENOMEM // Failed to create process
-        } else {
-            new_pid as i64 // Return child PID to parent
+            return ENOMEM; // Failed to create process
+        }
+
+        // Share the parent's address space copy-on-write instead of copying it
+        let parent = match crate::process::process_by_pid(current_pid) {
+            Some(p) => p,
+            None => return new_pid as i64,
+        };
+        if parent.page_directory == 0 {
+            return new_pid as i64;
         }
+        let cr3 = crate::vm::fork_address_space(parent.page_directory);
+        if cr3 == 0 {
+            rust_process_terminate(new_pid, -1);
+            return ENOMEM;
+        }
+        let regions = parent.memory_regions.clone();
+        crate::vm::dup_file_mappings(&regions);
+        let (heap_start, heap_end) = (parent.heap_start, parent.heap_end);
+        let (stack_start, stack_end) = (parent.stack_start, parent.stack_end);
+        let (fd_table, cwd) = (parent.fd_table, parent.cwd);
+        if let Some(child) = crate::process::process_by_pid(new_pid) {
+            child.page_directory = cr3;
+            child.memory_regions = regions;
+            child.heap_start = heap_start;
+            child.heap_end = heap_end;
+            child.stack_start = stack_start;
+            child.stack_end = stack_end;
+            for handle in fd_table[3..].iter().flatten() {
+                crate::vfs::dup_handle(*handle);
+            }
+            child.fd_table = fd_table;
+            child.cwd = cwd;
+        }
+        new_pid as i64 // Return child PID to parent
     }
 }
 
@@ -370,6 +469,9 @@ fn sys_execve(filename: *const u8, argv: *const *const u8, envp: *const *const u
     if filename.is_null() {
         return EINVAL;
     }
+    if !user_path_ok(filename) {
+        return EFAULT;
+    }
     
     unsafe {
         serial_write(b"[SYSCALL] sys_execve - not fully implemented\n\0".as_ptr());
@@ -403,6 +505,9 @@ fn sys_chdir(path: *const u8) -> i64 {
     if path.is_null() {
         return EINVAL;
     }
+    if !user_path_ok(path) {
+        return EFAULT;
+    }
     
     unsafe {
         let result = rust_vfs_ls(path); // Check if directory exists
@@ -416,9 +521,12 @@ fn sys_chdir(path: *const u8) -> i64 {
 }
 
 fn sys_getcwd(buf: *mut u8, size: usize) -> i64 {
-    if buf.is_null() || size == 0 {
+    if buf.is_null() || size < 2 {
         return EINVAL;
     }
+    if !user_buffer_ok(buf, size, 2) {
+        return EFAULT;
+    }
     
     // For now, always return root directory
     unsafe {
@@ -432,6 +540,9 @@ fn sys_mkdir(pathname: *const u8, mode: u32) -> i64 {
     if pathname.is_null() {
         return EINVAL;
     }
+    if !user_path_ok(pathname) {
+        return EFAULT;
+    }
     
     unsafe {
         let result = rust_vfs_mkdir(pathname);
@@ -447,6 +558,9 @@ fn sys_rmdir(pathname: *const u8) -> i64 {
     if pathname.is_null() {
         return EINVAL;
     }
+    if !user_path_ok(pathname) {
+        return EFAULT;
+    }
     
     unsafe {
         let result = rust_vfs_unlink(pathname);
@@ -462,6 +576,9 @@ fn sys_unlink(pathname: *const u8) -> i64 {
     if pathname.is_null() {
         return EINVAL;
     }
+    if !user_path_ok(pathname) {
+        return EFAULT;
+    }
     
     unsafe {
         let result = rust_vfs_unlink(pathname);
@@ -477,6 +594,9 @@ fn sys_creat(pathname: *const u8, mode: u32) -> i64 {
     if pathname.is_null() {
         return EINVAL;
     }
+    if !user_path_ok(pathname) {
+        return EFAULT;
+    }
     
     unsafe {
         let result = rust_vfs_create_file(pathname);
@@ -492,31 +612,76 @@ fn sys_access(pathname: *const u8, mode: i32) -> i64 {
     if pathname.is_null() {
         return EINVAL;
     }
+    if !user_path_ok(pathname) {
+        return EFAULT;
+    }
     
     // For now, always return success
     0
 }
 
 fn sys_brk(addr: *mut u8) -> i64 {
-    // Simple heap management - not fully implemented
-    unsafe {
-        serial_write(b"[SYSCALL] sys_brk - not fully implemented\n\0".as_ptr());
+    match crate::process::current_process() {
+        Some(pcb) => crate::vm::brk(pcb, addr as u64),
+        None => ENOMEM,
     }
-    addr as i64
 }
 
 fn sys_mmap(addr: *mut u8, length: usize, prot: i32, flags: i32, fd: i32, offset: i64) -> i64 {
-    unsafe {
-        serial_write(b"[SYSCALL] sys_mmap - not fully implemented\n\0".as_ptr());
+    // Exactly one of MAP_SHARED and MAP_PRIVATE
+    let shared = match flags & (MAP_SHARED | MAP_PRIVATE) {
+        MAP_SHARED => true,
+        MAP_PRIVATE => false,
+        _ => return EINVAL,
+    };
+    if length == 0 || offset < 0 || prot & !(PROT_READ | PROT_WRITE | PROT_EXEC) != 0 {
+        return EINVAL;
     }
-    ENOMEM
+    let pcb = match crate::process::current_process() {
+        Some(p) => p,
+        None => return ESRCH,
+    };
+    if flags & MAP_ANONYMOUS != 0 {
+        return crate::vm::mmap_anon(pcb, addr as u64, length as u64, prot as u32,
+                                    shared, flags & MAP_FIXED != 0);
+    }
+    let file = match pcb.fd_table.get(fd as usize) {
+        Some(Some(handle)) if fd > 2 => match crate::vfs::open_file(*handle) {
+            Some(f) => f,
+            None => return EBADF,
+        },
+        _ => return EBADF,
+    };
+    crate::vm::mmap_file(pcb, file, addr as u64, length as u64, offset as u64,
+                         prot as u32, shared, flags & MAP_FIXED != 0)
 }
 
 fn sys_munmap(addr: *mut u8, length: usize) -> i64 {
-    unsafe {
-        serial_write(b"[SYSCALL] sys_munmap - not fully implemented\n\0".as_ptr());
+    match crate::process::current_process() {
+        Some(pcb) => crate::vm::munmap(pcb, addr as u64, length as u64),
+        None => EINVAL,
+    }
+}
+
+fn sys_mprotect(addr: *mut u8, length: usize, prot: i32) -> i64 {
+    if prot & !(PROT_READ | PROT_WRITE | PROT_EXEC) != 0 {
+        return EINVAL;
+    }
+    match crate::process::current_process() {
+        Some(pcb) => crate::vm::mprotect(pcb, addr as u64, length as u64, prot as u32),
+        None => EINVAL,
+    }
+}
+
+fn sys_msync(addr: *mut u8, length: usize, flags: i32) -> i64 {
+    if flags & !(MS_ASYNC | MS_INVALIDATE | MS_SYNC) != 0 || flags & (MS_ASYNC | MS_SYNC) == MS_ASYNC | MS_SYNC {
+        return EINVAL;
+    }
+    // Write-back is synchronous, so MS_ASYNC and MS_SYNC behave alike
+    match crate::process::current_process() {
+        Some(pcb) => crate::vm::msync(pcb, addr as u64, length as u64),
+        None => EINVAL,
     }
-    0
 }
 
 fn sys_uname(buf: *mut u8) -> i64 {
@@ -527,6 +692,9 @@ fn sys_uname(buf: *mut u8) -> i64 {
     // Fill uname structure
     unsafe {
         let uname_info = b"ShadeOS\0\0\0\0\0\0\0\0\0shadeos\0\0\0\0\0\0\0\0\01.0.0\0\0\0\0\0\0\0\0\0\0\0\0#1 SMP\0\0\0\0\0\0\0\0\0\0x86_64\0\0\0\0\0\0\0\0\0\0";
+        if !user_buffer_ok(buf, uname_info.len(), 2) {
+            return EFAULT;
+        }
         core::ptr::copy_nonoverlapping(uname_info.as_ptr(), buf, uname_info.len());
     }
     0
@@ -537,6 +705,10 @@ fn sys_gettimeofday(tv: *mut u8, tz: *mut u8) -> i64 {
         return EINVAL;
     }
     
+    if !user_buffer_ok(tv, 16, 2) {
+        return EFAULT;
+    }
+    
     // Return dummy time values
     unsafe {
         // struct timeval { tv_sec: i64, tv_usec: i64 }
@@ -552,3 +724,49 @@ fn sys_sched_yield() -> i64 {
     }
     0
 }
+
+/// The task a sched_* call names: its task ID, or 0 for the caller.
+fn sched_target(pid: i32) -> Option<*mut crate::process::Task> {
+    match pid {
+        0 => crate::scheduler::current_task(),
+        _ => crate::scheduler::task_by_id(pid),
+    }
+}
+
+// param points to a struct sched_param, whose only field is the priority;
+// it may be null to keep the current one
+fn sys_sched_setscheduler(pid: i32, policy: i32, param: *const i32) -> i64 {
+    if pid < 0 {
+        return EINVAL;
+    }
+    let priority = if param.is_null() {
+        None
+    } else {
+        if !user_buffer_ok(param as *const u8, 4, 1) {
+            return EFAULT;
+        }
+        let prio = unsafe { *param };
+        if prio < 0 {
+            return EINVAL;
+        }
+        Some(prio)
+    };
+    let task = match sched_target(pid) {
+        Some(t) => t,
+        None => return ESRCH,
+    };
+    if !crate::scheduler::set_policy(task, policy, priority) {
+        return EINVAL;
+    }
+    0
+}
+
+fn sys_sched_getscheduler(pid: i32) -> i64 {
+    if pid < 0 {
+        return EINVAL;
+    }
+    match sched_target(pid) {
+        Some(t) => unsafe { (*t).policy as i64 },
+        None => ESRCH,
+    }
+}
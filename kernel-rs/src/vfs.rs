@@ -8,6 +8,8 @@ use core::clone::Clone;
 use core::option::Option;
 use core::option::Option::{Some, None};
 
+use crate::heap_profile::{HeapTag, TagScope};
+
 extern "C" {
     fn serial_write(s: *const u8);
     fn vga_print(s: *const u8);
@@ -24,6 +26,7 @@ enum FileType {
 #[derive(Clone)]
 struct FileEntry {
     name: String,
+    ino: u64, // Identifies the file to the page cache
     file_type: FileType,
     data: Vec<u8>,
     children: BTreeMap<String, FileEntry>,
@@ -33,6 +36,7 @@ impl FileEntry {
     fn new_file(name: String) -> Self {
         let entry = FileEntry {
             name,
+            ino: next_ino(),
             file_type: FileType::Regular,
             data: Vec::new(),
             children: BTreeMap::new(),
@@ -54,6 +58,7 @@ impl FileEntry {
     fn new_directory(name: String) -> Self {
         let entry = FileEntry {
             name,
+            ino: next_ino(),
             file_type: FileType::Directory,
             data: Vec::new(),
             children: BTreeMap::new(),
@@ -74,8 +79,18 @@ impl FileEntry {
 }
 
 static mut ROOT_FS: Option<FileEntry> = None;
+static mut NEXT_INO: u64 = 1;
+
+fn next_ino() -> u64 {
+    unsafe {
+        let ino = NEXT_INO;
+        NEXT_INO += 1;
+        ino
+    }
+}
 
 pub fn init() {
+    let _tag = TagScope::new(HeapTag::Vfs);
     unsafe {
         ROOT_FS = Some(FileEntry::new_directory("/".to_string()));
     }
@@ -85,18 +100,11 @@ fn get_path_components(path: *const u8) -> Vec<String> {
     if path.is_null() {
         return Vec::new();
     }
-    let mut path_str = String::new();
-    unsafe {
-        let mut ptr = path;
-        while *ptr != 0 {
-            path_str.push(*ptr as char);
-            ptr = ptr.add(1);
-        }
-    }
+    let path_bytes = unsafe { crate::memory::cstr_bytes(path) };
 
-    path_str.split('/')
+    path_bytes.split(|&c| c == b'/')
         .filter(|s| !s.is_empty())
-        .map(|s| s.to_string())
+        .map(|s| s.iter().map(|&c| c as char).collect())
         .collect()
 }
 
@@ -143,6 +151,7 @@ fn find_parent_and_name(path: *const u8) -> Option<(&'static mut FileEntry, Stri
 }
 
 pub fn create_file(path: *const u8) -> i32 {
+    let _tag = TagScope::new(HeapTag::Vfs);
     if let Some((parent, filename)) = find_parent_and_name(path) {
         if parent.children.contains_key(&filename) {
             return -17; // File exists
@@ -156,6 +165,7 @@ pub fn create_file(path: *const u8) -> i32 {
 }
 
 pub fn create_directory(path: *const u8) -> i32 {
+    let _tag = TagScope::new(HeapTag::Vfs);
     if let Some((parent, dirname)) = find_parent_and_name(path) {
         if parent.children.contains_key(&dirname) {
             return -17; // Directory exists
@@ -169,6 +179,7 @@ pub fn create_directory(path: *const u8) -> i32 {
 }
 
 pub fn delete_file(path: *const u8) -> i32 {
+    let _tag = TagScope::new(HeapTag::Vfs);
     if let Some((parent, filename)) = find_parent_and_name(path) {
         if parent.children.remove(&filename).is_some() {
             0
@@ -181,6 +192,7 @@ pub fn delete_file(path: *const u8) -> i32 {
 }
 
 pub fn read_file(path: *const u8, buf: *mut u8, max_len: i32) -> i32 {
+    let _tag = TagScope::new(HeapTag::Vfs);
     if buf.is_null() || max_len <= 0 {
         return -22; // Invalid argument
     }
@@ -202,6 +214,7 @@ pub fn read_file(path: *const u8, buf: *mut u8, max_len: i32) -> i32 {
 }
 
 pub fn write_file(path: *const u8, buf: *const u8, len: u64) -> u64 {
+    let _tag = TagScope::new(HeapTag::Vfs);
     if buf.is_null() {
         unsafe { serial_write(b"[VFS-DEBUG] write_file: buf is null\r\n\0".as_ptr()); }
         return 0;
@@ -215,6 +228,8 @@ pub fn write_file(path: *const u8, buf: *const u8, len: u64) -> u64 {
                 for i in 0..len as usize {
                     entry.data.push(unsafe { *buf.add(i) });
                 }
+                // Keep pages of the file that are mapped somewhere in step
+                crate::page_cache::file_written(entry.ino, &entry.data);
                 len
             },
             FileType::Directory => 0, // Can't write to directory
@@ -226,6 +241,7 @@ pub fn write_file(path: *const u8, buf: *const u8, len: u64) -> u64 {
 }
 
 pub fn list_directory(path: *const u8) -> i32 {
+    let _tag = TagScope::new(HeapTag::Vfs);
     if let Some(entry) = find_entry(path) {
         match entry.file_type {
             FileType::Directory => {
@@ -339,6 +355,119 @@ pub fn list_directory(path: *const u8) -> i32 {
     }
 }
 
+// --- Open files ---
+//
+// sys_open() resolves a path once and hands out a handle for it, which is
+// what fd_table entries above 2 refer to. A handle keeps the path and the
+// inode number it resolved to, so later users (mmap) notice when the file
+// has been deleted or replaced.
+
+pub struct OpenFile {
+    pub path: Vec<u8>, // NUL-terminated
+    pub ino: u64,
+    refs: u32,
+}
+
+static mut OPEN_FILES: BTreeMap<u32, OpenFile> = BTreeMap::new();
+static mut NEXT_HANDLE: u32 = 3; // 0-2 are the console
+
+fn regular_file(path: *const u8, ino: u64) -> Option<&'static mut FileEntry> {
+    match find_entry(path) {
+        Some(entry) if matches!(entry.file_type, FileType::Regular) && entry.ino == ino => Some(entry),
+        _ => None,
+    }
+}
+
+/// Open the regular file at `path`, creating it first if `create` is set.
+/// Returns a handle or a negative errno.
+pub fn open(path: *const u8, create: bool) -> Result<u32, i32> {
+    let _tag = TagScope::new(HeapTag::Vfs);
+    if find_entry(path).is_none() && create {
+        let ret = create_file(path);
+        if ret != 0 {
+            return Err(ret);
+        }
+    }
+    let entry = find_entry(path).ok_or(-2)?;
+    if !matches!(entry.file_type, FileType::Regular) {
+        return Err(-21); // Is a directory
+    }
+    let mut path_buf: Vec<u8> = unsafe { crate::memory::cstr_bytes(path) }.to_vec();
+    path_buf.push(0);
+    unsafe {
+        let handle = NEXT_HANDLE;
+        NEXT_HANDLE += 1;
+        OPEN_FILES.insert(handle, OpenFile { path: path_buf, ino: entry.ino, refs: 1 });
+        Ok(handle)
+    }
+}
+
+pub fn open_file(handle: u32) -> Option<&'static OpenFile> {
+    unsafe { OPEN_FILES.get(&handle) }
+}
+
+/// Take another reference on `handle` (an fd table copied by fork).
+pub fn dup_handle(handle: u32) {
+    unsafe {
+        if let Some(file) = OPEN_FILES.get_mut(&handle) {
+            file.refs += 1;
+        }
+    }
+}
+
+pub fn close(handle: u32) {
+    let _tag = TagScope::new(HeapTag::Vfs);
+    unsafe {
+        let last = match OPEN_FILES.get_mut(&handle) {
+            Some(file) => {
+                file.refs -= 1;
+                file.refs == 0
+            }
+            None => false,
+        };
+        if last {
+            OPEN_FILES.remove(&handle);
+        }
+    }
+}
+
+/// Size of file `ino` at `path`, or None if that file no longer exists.
+pub fn file_size(path: *const u8, ino: u64) -> Option<u64> {
+    regular_file(path, ino).map(|entry| entry.data.len() as u64)
+}
+
+/// Copy up to `buf.len()` bytes from `offset` of file `ino` at `path`.
+/// Returns the number of bytes copied or a negative errno.
+pub fn read_at(path: *const u8, ino: u64, offset: u64, buf: &mut [u8]) -> i32 {
+    let entry = match regular_file(path, ino) {
+        Some(e) => e,
+        None => return -2,
+    };
+    let len = entry.data.len() as u64;
+    if offset >= len {
+        return 0;
+    }
+    let n = core::cmp::min(buf.len() as u64, len - offset) as usize;
+    buf[..n].copy_from_slice(&entry.data[offset as usize..offset as usize + n]);
+    n as i32
+}
+
+/// Overwrite bytes of file `ino` at `path` starting at `offset`. Writes
+/// stop at the current end of the file; the file is never extended.
+pub fn write_at(path: *const u8, ino: u64, offset: u64, data: &[u8]) -> i32 {
+    let entry = match regular_file(path, ino) {
+        Some(e) => e,
+        None => return -2,
+    };
+    let len = entry.data.len() as u64;
+    if offset >= len {
+        return 0;
+    }
+    let n = core::cmp::min(data.len() as u64, len - offset) as usize;
+    entry.data[offset as usize..offset as usize + n].copy_from_slice(&data[..n]);
+    n as i32
+}
+
 // C interface functions
 #[no_mangle]
 pub extern "C" fn rust_vfs_init() {
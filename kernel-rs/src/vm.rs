@@ -2,8 +2,27 @@ extern "C" {
     fn rust_paging_new_pml4() -> u64;
     fn rust_paging_free_pml4(pml4_phys: u64);
     fn rust_map_page(pml4_phys: u64, virt: u64, phys: u64, flags: u64);
+    fn rust_get_phys_addr(pml4_phys: u64, virt: u64) -> u64;
+    fn rust_get_pte(pml4_phys: u64, virt: u64) -> *mut u64;
+    fn paging_invalidate_page(cr3: u64, virt: u64);
+    fn paging_clone_cow(src_cr3: u64) -> u64;
+    fn alloc_zeroed_page() -> *mut u8;
+    fn page_get(phys: u64);
+    fn page_put(phys: u64);
+    fn page_refcount(phys: u64) -> u32;
+    fn page_set_flags(phys: u64, pg_flags: u16);
+    fn alloc_huge_page() -> *mut u8;
+    fn pmm_huge_pages_in_use() -> u64;
+    fn rust_get_pde(pml4_phys: u64, virt: u64) -> *mut u64;
+    fn rust_map_huge_page(pml4_phys: u64, virt: u64, phys: u64, flags: u64) -> i32;
+    fn paging_split_user_huge(pml4_phys: u64, virt: u64) -> i32;
+    fn serial_write(s: *const u8);
 }
 
+use crate::memory::{phys_to_virt, virt_to_phys};
+use crate::process::{self, MemoryRegion, MemoryRegionType, PrivilegeLevel, ProcessControlBlock};
+use crate::vma::VmaTree;
+
 pub fn test_vm_ffi() {
     unsafe {
         let pml4 = rust_paging_new_pml4();
@@ -20,3 +39,726 @@ pub fn test_vm_ffi() {
         crate::vga_print(b"[RUST VM] Freed PML4\n\0".as_ptr());
     }
 }
+
+// --- Demand paging ---
+//
+// User pages of data, BSS, heap and stack regions are not populated up
+// front. The first access faults and is resolved here: reads map a single
+// shared zero page read-only, writes (including the first write to a page
+// that was read before) get a fresh zeroed frame. Stack regions grow
+// downwards on faults just below them. Write faults on PAGE_COW pages left
+// by fork() copy the page, or just make it writable again once this address
+// space is its only user. File regions are filled from the page cache.
+//
+// Private writable data and heap regions get transparent huge pages: the
+// first fault in a 2 MiB-aligned block that lies entirely inside the region
+// (and has no page table yet) maps a whole zeroed 2 MiB page when the PMM
+// has a free block that large, and falls back to 4 KiB pages otherwise.
+// Operations that touch only part of a huge page (munmap, mprotect, COW
+// without a free 2 MiB block) split it into 4 KiB pages first.
+
+const PAGE_SIZE: u64 = 4096;
+const HUGE_PAGE_SIZE: u64 = 2 * 1024 * 1024;
+const USER_SPACE_END: u64 = 0x0000_8000_0000_0000;
+
+// Page-fault error code bits
+const PF_PRESENT: u64 = 0x1;
+const PF_WRITE: u64 = 0x2;
+const PF_INSTR: u64 = 0x10;
+
+const PTE_PRESENT: u64 = 0x1;
+const PTE_RW: u64 = 0x2;
+const PTE_USER: u64 = 0x4;
+const PTE_DIRTY: u64 = 0x40;
+const PTE_HUGE: u64 = 0x80;
+const PTE_COW: u64 = 0x200;
+const PTE_SHARED: u64 = 0x400;
+const PTE_ADDR_MASK: u64 = 0x000F_FFFF_FFFF_F000;
+const PG_RESERVED: u16 = 0x1;
+
+// Region permission bits (see MemoryRegion)
+const PERM_READ: u32 = 1;
+const PERM_WRITE: u32 = 2;
+const PERM_EXEC: u32 = 4;
+
+const STACK_MAX: u64 = 8 * 1024 * 1024;
+// How far below the user stack pointer an access may land and still count
+// as stack growth (covers push/call and red-zone style accesses)
+const STACK_GROW_SLACK: u64 = 64 * 1024;
+
+#[derive(Clone, Copy)]
+pub struct FaultStats {
+    pub demand_zero: u64,
+    pub zero_page: u64,
+    pub stack_grow: u64,
+    pub cow_copy: u64,
+    pub cow_reuse: u64,
+    pub file: u64,
+    pub huge: u64,          // Faults resolved with a 2 MiB page
+    pub huge_fallback: u64, // Eligible, but no free 2 MiB block
+    pub huge_split: u64,
+    pub swap_in: u64,
+    pub failed: u64,
+}
+
+static mut FAULT_STATS: FaultStats = FaultStats {
+    demand_zero: 0, zero_page: 0, stack_grow: 0, cow_copy: 0, cow_reuse: 0, file: 0,
+    huge: 0, huge_fallback: 0, huge_split: 0, swap_in: 0, failed: 0,
+};
+static mut ZERO_PAGE_PHYS: u64 = 0;
+
+pub fn fault_stats() -> FaultStats {
+    unsafe { FAULT_STATS }
+}
+
+/// 2 MiB pages currently mapped by user processes.
+pub fn huge_pages_in_use() -> u64 {
+    unsafe { pmm_huge_pages_in_use() }
+}
+
+fn read_cr3() -> u64 {
+    let cr3: u64;
+    unsafe { core::arch::asm!("mov {}, cr3", out(reg) cr3, options(nomem, nostack)); }
+    cr3
+}
+
+/// Drop the TLB entry for `addr` in the active address space, on the other
+/// CPUs too since they may be running it as well.
+fn invlpg(addr: u64) {
+    unsafe { paging_invalidate_page(read_cr3(), addr) }
+}
+
+unsafe fn zero_page_phys() -> u64 {
+    if ZERO_PAGE_PHYS == 0 {
+        let page = alloc_zeroed_page();
+        if page.is_null() {
+            return 0;
+        }
+        ZERO_PAGE_PHYS = virt_to_phys(page);
+        // Mapped into every process; tearing one down must not free it
+        page_set_flags(ZERO_PAGE_PHYS, PG_RESERVED);
+    }
+    ZERO_PAGE_PHYS
+}
+
+/// The shared all-zero frame, allocated on first use (0 if out of memory).
+pub fn zero_page() -> u64 {
+    unsafe { zero_page_phys() }
+}
+
+/// PTE bits for an anonymous page of `region`.
+fn anon_pte_flags(region: &MemoryRegion) -> u64 {
+    let mut flags = PTE_PRESENT | PTE_USER;
+    if region.permissions & PERM_WRITE != 0 {
+        flags |= PTE_RW;
+    }
+    if region.shared {
+        flags |= PTE_SHARED;
+    }
+    flags
+}
+
+/// Whether pages of `region` can be swapped out (see reclaim.rs).
+fn swappable(region: &MemoryRegion) -> bool {
+    !region.shared && matches!(region.region_type,
+                               MemoryRegionType::Data | MemoryRegionType::Heap | MemoryRegionType::Stack)
+}
+
+/// Put the frame now mapped at `page` on the LRU lists if it can be swapped.
+unsafe fn lru_add(pid: u32, region: &MemoryRegion, cr3: u64, page: u64) {
+    if !swappable(region) {
+        return;
+    }
+    let pte = rust_get_pte(cr3, page);
+    if !pte.is_null() && *pte & PTE_PRESENT != 0 {
+        crate::reclaim::add_anon(pid, page, *pte & PTE_ADDR_MASK);
+    }
+}
+
+/// Map a freshly zeroed frame at `page` in the address space `cr3`.
+unsafe fn map_zeroed_frame(cr3: u64, page: u64, flags: u64) -> bool {
+    let frame = crate::reclaim::alloc_user_page(true);
+    if frame.is_null() {
+        serial_write(b"[VM] Out of memory resolving page fault\n\0".as_ptr());
+        return false;
+    }
+    rust_map_page(cr3, page, virt_to_phys(frame), flags);
+    FAULT_STATS.demand_zero += 1;
+    true
+}
+
+/// The page directory entry mapping `addr` if it is a 2 MiB page, else null.
+unsafe fn huge_pde(cr3: u64, addr: u64) -> *mut u64 {
+    let pde = rust_get_pde(cr3, addr);
+    if !pde.is_null() && *pde & (PTE_PRESENT | PTE_HUGE) == PTE_PRESENT | PTE_HUGE {
+        pde
+    } else {
+        core::ptr::null_mut()
+    }
+}
+
+/// Split the 2 MiB page mapping `addr` into 4 KiB pages.
+unsafe fn split_huge(cr3: u64, addr: u64) -> bool {
+    if paging_split_user_huge(cr3, addr) != 0 {
+        serial_write(b"[VM] Out of memory splitting huge page\n\0".as_ptr());
+        return false;
+    }
+    FAULT_STATS.huge_split += 1;
+    true
+}
+
+/// Back the 2 MiB block around `page` with a huge page if `region` allows
+/// it. Returns false if the caller should map a 4 KiB page instead.
+unsafe fn huge_fault(cr3: u64, region: &MemoryRegion, page: u64) -> bool {
+    let base = page & !(HUGE_PAGE_SIZE - 1);
+    if !matches!(region.region_type, MemoryRegionType::Data | MemoryRegionType::Heap)
+        || region.shared || region.permissions & PERM_WRITE == 0
+        || base < region.start_addr || base + HUGE_PAGE_SIZE > region.end_addr {
+        return false;
+    }
+    // Part of the block is already mapped with 4 KiB pages
+    let pde = rust_get_pde(cr3, base);
+    if !pde.is_null() && *pde & PTE_PRESENT != 0 {
+        return false;
+    }
+    let block = alloc_huge_page();
+    if block.is_null() {
+        FAULT_STATS.huge_fallback += 1;
+        return false;
+    }
+    let phys = virt_to_phys(block);
+    if rust_map_huge_page(cr3, base, phys, anon_pte_flags(region)) != 0 {
+        page_put(phys);
+        return false;
+    }
+    FAULT_STATS.huge += 1;
+    true
+}
+
+/// Resolve a write to a copy-on-write 2 MiB page mapped by `pde`.
+unsafe fn huge_cow_fault(cr3: u64, pde: *mut u64, addr: u64) -> bool {
+    let base = addr & !(HUGE_PAGE_SIZE - 1);
+    let old = *pde & PTE_ADDR_MASK;
+    let flags = (*pde & 0xFFF & !PTE_COW) | PTE_RW;
+    if page_refcount(old) == 1 {
+        *pde = old | flags;
+        FAULT_STATS.cow_reuse += 1;
+    } else {
+        let block = alloc_huge_page();
+        if block.is_null() {
+            // No free 2 MiB block: take private 4 KiB copies instead
+            return split_huge(cr3, base);
+        }
+        core::ptr::copy_nonoverlapping(phys_to_virt(old), block, HUGE_PAGE_SIZE as usize);
+        *pde = virt_to_phys(block) | flags;
+        page_put(old);
+        FAULT_STATS.cow_copy += 1;
+    }
+    invlpg(base);
+    true
+}
+
+/// Resolve a write to a copy-on-write page mapped by `pte`.
+unsafe fn cow_fault(pte: *mut u64, page: u64) -> bool {
+    let old = *pte & PTE_ADDR_MASK;
+    let flags = (*pte & 0xFFF & !PTE_COW) | PTE_RW;
+    if page_refcount(old) == 1 {
+        // Every other sharer has copied or exited already
+        *pte = old | flags;
+        FAULT_STATS.cow_reuse += 1;
+    } else {
+        let frame = crate::reclaim::alloc_user_page(false);
+        if frame.is_null() {
+            serial_write(b"[VM] Out of memory copying COW page\n\0".as_ptr());
+            return false;
+        }
+        core::ptr::copy_nonoverlapping(phys_to_virt(old), frame, PAGE_SIZE as usize);
+        *pte = virt_to_phys(frame) | flags;
+        page_put(old);
+        FAULT_STATS.cow_copy += 1;
+    }
+    invlpg(page);
+    true
+}
+
+/// Read the page swapped out to the swap entry in `pte` back in.
+unsafe fn swap_in(pte: *mut u64, flags: u64) -> bool {
+    let entry = *pte;
+    let frame = crate::reclaim::alloc_user_page(false);
+    if frame.is_null() {
+        serial_write(b"[VM] Out of memory reading swapped page\n\0".as_ptr());
+        return false;
+    }
+    if !crate::swap::read_page(entry, frame) {
+        serial_write(b"[VM] Swap read failed\n\0".as_ptr());
+        page_put(virt_to_phys(frame));
+        FAULT_STATS.failed += 1;
+        return false;
+    }
+    *pte = virt_to_phys(frame) | flags;
+    crate::swap::free_entry(entry);
+    FAULT_STATS.swap_in += 1;
+    true
+}
+
+/// Map page `page` of file region `region` from the page cache.
+unsafe fn file_fault(cr3: u64, region: &MemoryRegion, page: u64, write: bool) -> bool {
+    let index = (region.file_offset + (page - region.start_addr)) / PAGE_SIZE;
+    let phys = match crate::page_cache::get_page(region.file_ino, index) {
+        Some(p) => p,
+        None => {
+            // Past the end of the file, or out of memory
+            FAULT_STATS.failed += 1;
+            return false;
+        }
+    };
+    let writable = region.permissions & PERM_WRITE != 0;
+    if region.shared {
+        page_get(phys);
+        let flags = PTE_PRESENT | PTE_USER | PTE_SHARED | if writable { PTE_RW } else { 0 };
+        rust_map_page(cr3, page, phys, flags);
+    } else if write {
+        // Private store: copy right away instead of mapping the cached
+        // page only to copy it on the retry
+        let frame = crate::reclaim::alloc_user_page(false);
+        if frame.is_null() {
+            serial_write(b"[VM] Out of memory copying file page\n\0".as_ptr());
+            return false;
+        }
+        core::ptr::copy_nonoverlapping(phys_to_virt(phys), frame, PAGE_SIZE as usize);
+        rust_map_page(cr3, page, virt_to_phys(frame), PTE_PRESENT | PTE_USER | PTE_RW);
+    } else {
+        page_get(phys);
+        let flags = PTE_PRESENT | PTE_USER | if writable { PTE_COW } else { 0 };
+        rust_map_page(cr3, page, phys, flags);
+    }
+    FAULT_STATS.file += 1;
+    true
+}
+
+/// Extend the stack region downwards to cover `addr`, if the access is
+/// plausibly a stack access. Returns the grown region.
+fn grow_stack(pcb: &mut ProcessControlBlock, addr: u64, user_rsp: u64) -> Option<MemoryRegion> {
+    let page = addr & !(PAGE_SIZE - 1);
+    // `addr` is in no region, so everything up to the next one is free
+    let stack = pcb.memory_regions.next_above(addr)?;
+    if stack.region_type != MemoryRegionType::Stack || stack.end_addr - page > STACK_MAX {
+        return None;
+    }
+    if user_rsp != 0 && addr + STACK_GROW_SLACK < user_rsp {
+        return None;
+    }
+    let old_start = stack.start_addr;
+    pcb.memory_regions.extend_down(old_start, page);
+    pcb.stack_start = page;
+    unsafe { FAULT_STATS.stack_grow += 1; }
+    pcb.memory_regions.find(page).cloned()
+}
+
+/// Resolve a page fault at `addr` in the current process. `user_rsp` is the
+/// faulting user stack pointer, or 0 for faults taken in kernel mode.
+/// Returns 0 when the access can be retried.
+#[no_mangle]
+pub extern "C" fn rust_handle_page_fault(addr: u64, err_code: u64, user_rsp: u64) -> i32 {
+    // Page tables, the region list, the stats and the reclaim lists are
+    // shared with the other CPUs' idle work
+    let flags = crate::heap::irq_save();
+    let ret = handle_page_fault(addr, err_code, user_rsp);
+    crate::heap::irq_restore(flags);
+    ret
+}
+
+fn handle_page_fault(addr: u64, err_code: u64, user_rsp: u64) -> i32 {
+    if addr >= USER_SPACE_END {
+        return -1;
+    }
+    let pcb = match process::current_process() {
+        Some(p) if p.privilege_level == PrivilegeLevel::User => p,
+        _ => return -1,
+    };
+    let write = err_code & PF_WRITE != 0;
+    let cr3 = read_cr3();
+    let page = addr & !(PAGE_SIZE - 1);
+    let need = if write {
+        PERM_WRITE
+    } else if err_code & PF_INSTR != 0 {
+        PERM_EXEC
+    } else {
+        PERM_READ
+    };
+
+    let region = match pcb.memory_regions.find(addr).cloned() {
+        Some(r) => Some(r),
+        None => grow_stack(pcb, addr, user_rsp),
+    };
+    let region = match region {
+        Some(r) if r.permissions & need != 0 => r,
+        _ => {
+            unsafe { FAULT_STATS.failed += 1; }
+            return -1;
+        }
+    };
+    if err_code & PF_PRESENT != 0 && write {
+        unsafe {
+            let pte = rust_get_pte(cr3, page);
+            if !pte.is_null() && *pte & PTE_COW != 0 {
+                if !cow_fault(pte, page) {
+                    return -1;
+                }
+                lru_add(pcb.pid, &region, cr3, page);
+                return 0;
+            }
+            let pde = huge_pde(cr3, page);
+            if !pde.is_null() && *pde & PTE_COW != 0 {
+                return if huge_cow_fault(cr3, pde, page) { 0 } else { -1 };
+            }
+        }
+    }
+
+    if region.region_type == MemoryRegionType::File {
+        // Present pages only fault here on a protection violation; COW
+        // pages of private mappings were handled above
+        if err_code & PF_PRESENT != 0 {
+            unsafe { FAULT_STATS.failed += 1; }
+            return -1;
+        }
+        return unsafe { if file_fault(cr3, &region, page, write) { 0 } else { -1 } };
+    }
+    // Code and shared mappings are populated by their owners; only
+    // anonymous memory is filled on demand
+    let anonymous = matches!(region.region_type,
+                             MemoryRegionType::Data | MemoryRegionType::Heap | MemoryRegionType::Stack);
+    if !anonymous {
+        unsafe { FAULT_STATS.failed += 1; }
+        return -1;
+    }
+    let flags = anon_pte_flags(&region);
+
+    unsafe {
+        if err_code & PF_PRESENT != 0 {
+            // The only protection fault resolved here is the first write to
+            // the shared zero page
+            if !write || ZERO_PAGE_PHYS == 0 || rust_get_phys_addr(cr3, page) != ZERO_PAGE_PHYS {
+                FAULT_STATS.failed += 1;
+                return -1;
+            }
+            if !map_zeroed_frame(cr3, page, flags) {
+                return -1;
+            }
+            invlpg(page);
+            lru_add(pcb.pid, &region, cr3, page);
+            return 0;
+        }
+
+        let pte = rust_get_pte(cr3, page);
+        if !pte.is_null() && crate::swap::is_swap_entry(*pte) {
+            if !swap_in(pte, flags) {
+                return -1;
+            }
+            lru_add(pcb.pid, &region, cr3, page);
+            return 0;
+        }
+        if huge_fault(cr3, &region, page) {
+            return 0;
+        }
+        // Shared memory must not start out on the zero page: the first
+        // write would give only this process a private frame
+        if !write && err_code & PF_INSTR == 0 && !region.shared {
+            let zero = zero_page_phys();
+            if zero != 0 {
+                rust_map_page(cr3, page, zero, PTE_PRESENT | PTE_USER);
+                FAULT_STATS.zero_page += 1;
+                return 0;
+            }
+        }
+        if !map_zeroed_frame(cr3, page, flags) {
+            return -1;
+        }
+        lru_add(pcb.pid, &region, cr3, page);
+        0
+    }
+}
+
+/// Give a forked child a copy-on-write view of `parent_cr3`.
+pub fn fork_address_space(parent_cr3: u64) -> u64 {
+    unsafe { paging_clone_cow(parent_cr3) }
+}
+
+// --- mmap, munmap, mprotect, brk ---
+//
+// These edit the process's VmaTree and fix up whatever page table entries
+// the change affects; pages of new regions are faulted in as usual.
+
+// Where mmap() starts looking for free address space when given no hint
+const MMAP_BASE: u64 = 0x0000_1000_0000_0000;
+
+fn page_align_up(len: u64) -> u64 {
+    (len + PAGE_SIZE - 1) & !(PAGE_SIZE - 1)
+}
+
+/// Unmap the pages of `r` in [start, end), recording stores made through
+/// shared file mappings in the page cache and releasing swap slots.
+unsafe fn unmap_pages(cr3: u64, r: &MemoryRegion, start: u64, end: u64) {
+    let mut page = start;
+    while page < end {
+        let pde = huge_pde(cr3, page);
+        if !pde.is_null() {
+            let base = page & !(HUGE_PAGE_SIZE - 1);
+            if base >= start && base + HUGE_PAGE_SIZE <= end {
+                let phys = *pde & PTE_ADDR_MASK;
+                *pde = 0;
+                invlpg(base);
+                page_put(phys);
+                page = base + HUGE_PAGE_SIZE;
+                continue;
+            }
+            if !split_huge(cr3, page) {
+                // Leave the whole huge page mapped rather than lose data
+                // outside [start, end)
+                page = base + HUGE_PAGE_SIZE;
+                continue;
+            }
+        }
+        let pte = rust_get_pte(cr3, page);
+        if !pte.is_null() && crate::swap::is_swap_entry(*pte) {
+            crate::swap::free_entry(*pte);
+            *pte = 0;
+        } else if !pte.is_null() && *pte & PTE_PRESENT != 0 {
+            if r.region_type == MemoryRegionType::File && r.shared && *pte & PTE_DIRTY != 0 {
+                crate::page_cache::mark_dirty(r.file_ino, (r.file_offset + page - r.start_addr) / PAGE_SIZE);
+            }
+            let phys = *pte & PTE_ADDR_MASK;
+            *pte = 0;
+            invlpg(page);
+            page_put(phys);
+        }
+        page += PAGE_SIZE;
+    }
+}
+
+/// Remove every mapping in [start, end) from `pcb`.
+fn unmap_range(pcb: &mut ProcessControlBlock, start: u64, end: u64) {
+    let cr3 = pcb.page_directory;
+    for r in pcb.memory_regions.remove_range(start, end) {
+        if cr3 != 0 {
+            unsafe { unmap_pages(cr3, &r, r.start_addr, r.end_addr); }
+        }
+        if r.region_type == MemoryRegionType::File {
+            crate::page_cache::unmap_file(r.file_ino);
+        }
+    }
+}
+
+/// Pick the address for a new `len`-byte mapping. `addr` is a hint
+/// unless `fixed` is set, in which case whatever is mapped there goes.
+fn place_mapping(pcb: &mut ProcessControlBlock, addr: u64, len: u64, fixed: bool) -> Result<u64, i64> {
+    if addr & (PAGE_SIZE - 1) != 0 {
+        return Err(-22); // EINVAL
+    }
+    if fixed {
+        if addr == 0 || addr.checked_add(len).map_or(true, |e| e > USER_SPACE_END) {
+            return Err(-22);
+        }
+        unmap_range(pcb, addr, addr + len);
+        return Ok(addr);
+    }
+    let from = if addr != 0 { addr } else { MMAP_BASE };
+    pcb.memory_regions.find_free(from, len, USER_SPACE_END).ok_or(-12) // ENOMEM
+}
+
+/// Map `len` bytes of `file` starting at `offset` into `pcb`. `addr` is a
+/// hint unless `fixed` is set. Returns the address or a negative errno.
+pub fn mmap_file(pcb: &mut ProcessControlBlock, file: &crate::vfs::OpenFile, addr: u64, len: u64,
+                 offset: u64, permissions: u32, shared: bool, fixed: bool) -> i64 {
+    let len = page_align_up(len);
+    if len == 0 || offset & (PAGE_SIZE - 1) != 0 {
+        return -22;
+    }
+    // Look the file up before anything at a MAP_FIXED address goes away
+    if crate::vfs::file_size(file.path.as_ptr(), file.ino).is_none() {
+        return -2; // ENOENT
+    }
+    let start = match place_mapping(pcb, addr, len, fixed) {
+        Ok(a) => a,
+        Err(e) => return e,
+    };
+    if let Err(e) = crate::page_cache::map_file(file) {
+        return e as i64;
+    }
+    pcb.add_memory_region(MemoryRegion {
+        start_addr: start,
+        end_addr: start + len,
+        permissions,
+        region_type: MemoryRegionType::File,
+        file_ino: file.ino,
+        file_offset: offset,
+        shared,
+    });
+    start as i64
+}
+
+/// Map `len` bytes of demand-zero memory into `pcb`; see mmap_file().
+pub fn mmap_anon(pcb: &mut ProcessControlBlock, addr: u64, len: u64, permissions: u32,
+                 shared: bool, fixed: bool) -> i64 {
+    let len = page_align_up(len);
+    if len == 0 {
+        return -22;
+    }
+    let start = match place_mapping(pcb, addr, len, fixed) {
+        Ok(a) => a,
+        Err(e) => return e,
+    };
+    pcb.add_memory_region(MemoryRegion {
+        start_addr: start,
+        end_addr: start + len,
+        permissions,
+        region_type: MemoryRegionType::Data,
+        file_ino: 0,
+        file_offset: 0,
+        shared,
+    });
+    start as i64
+}
+
+pub fn munmap(pcb: &mut ProcessControlBlock, addr: u64, len: u64) -> i64 {
+    let len = page_align_up(len);
+    if len == 0 || addr & (PAGE_SIZE - 1) != 0 || addr.checked_add(len).map_or(true, |e| e > USER_SPACE_END) {
+        return -22;
+    }
+    unmap_range(pcb, addr, addr + len);
+    0
+}
+
+/// Change the permissions of [addr, addr + len), which must be mapped.
+pub fn mprotect(pcb: &mut ProcessControlBlock, addr: u64, len: u64, permissions: u32) -> i64 {
+    let len = page_align_up(len);
+    if addr & (PAGE_SIZE - 1) != 0 || addr.checked_add(len).map_or(true, |e| e > USER_SPACE_END) {
+        return -22;
+    }
+    if len == 0 {
+        return 0;
+    }
+    let end = addr + len;
+    if !pcb.memory_regions.is_covered(addr, end) {
+        return -12; // ENOMEM, as on Linux
+    }
+    let cr3 = pcb.page_directory;
+    for r in pcb.memory_regions.protect(addr, end, permissions) {
+        if cr3 == 0 {
+            continue;
+        }
+        let writable = permissions & PERM_WRITE != 0;
+        let reprotect = |entry: *mut u64| unsafe {
+            if !writable {
+                *entry &= !PTE_RW;
+            } else if r.shared {
+                *entry |= PTE_RW;
+            } else if *entry & PTE_RW == 0 {
+                // The frame may be shared with the page cache or a
+                // fork; cow_fault() reuses it if it is not
+                *entry |= PTE_COW;
+            }
+        };
+        let mut page = r.start_addr;
+        while page < r.end_addr {
+            unsafe {
+                let pde = huge_pde(cr3, page);
+                if !pde.is_null() {
+                    let base = page & !(HUGE_PAGE_SIZE - 1);
+                    if base >= r.start_addr && base + HUGE_PAGE_SIZE <= r.end_addr {
+                        reprotect(pde);
+                        invlpg(base);
+                        page = base + HUGE_PAGE_SIZE;
+                        continue;
+                    }
+                    if !split_huge(cr3, page) {
+                        return -12;
+                    }
+                }
+                let pte = rust_get_pte(cr3, page);
+                if !pte.is_null() && *pte & PTE_PRESENT != 0 && (*pte & PTE_ADDR_MASK) != ZERO_PAGE_PHYS {
+                    reprotect(pte);
+                    invlpg(page);
+                }
+                // Read faults on the zero page stay read-only; the write
+                // fault path replaces it
+            }
+            page += PAGE_SIZE;
+        }
+    }
+    0
+}
+
+/// Move the program break to `addr`. Returns the new break, or the old one
+/// if it cannot be moved there (including `addr` == 0, the query form).
+pub fn brk(pcb: &mut ProcessControlBlock, addr: u64) -> i64 {
+    let old = pcb.heap_end;
+    if pcb.heap_start == 0 || addr < pcb.heap_start || addr >= USER_SPACE_END {
+        return old as i64;
+    }
+    let old_top = page_align_up(old);
+    let new_top = page_align_up(addr);
+    if new_top > old_top {
+        if !pcb.memory_regions.is_free(old_top, new_top) {
+            return old as i64;
+        }
+        // Merges with the existing heap region
+        pcb.add_memory_region(MemoryRegion {
+            start_addr: old_top,
+            end_addr: new_top,
+            permissions: PERM_READ | PERM_WRITE,
+            region_type: MemoryRegionType::Heap,
+            file_ino: 0,
+            file_offset: 0,
+            shared: false,
+        });
+    } else if new_top < old_top {
+        unmap_range(pcb, new_top, old_top);
+    }
+    pcb.heap_end = addr;
+    addr as i64
+}
+
+/// Write back pages stored to through shared file mappings in
+/// [addr, addr + len).
+pub fn msync(pcb: &mut ProcessControlBlock, addr: u64, len: u64) -> i64 {
+    if addr & (PAGE_SIZE - 1) != 0 {
+        return -22;
+    }
+    let end = addr.saturating_add(page_align_up(len));
+    let cr3 = pcb.page_directory;
+    if cr3 == 0 {
+        return 0;
+    }
+    for r in pcb.memory_regions.overlapping(addr, end) {
+        if r.region_type != MemoryRegionType::File || !r.shared {
+            continue;
+        }
+        let mut page = addr.max(r.start_addr);
+        while page < end.min(r.end_addr) {
+            unsafe {
+                let pte = rust_get_pte(cr3, page);
+                if !pte.is_null() && *pte & (PTE_PRESENT | PTE_DIRTY) == PTE_PRESENT | PTE_DIRTY {
+                    // Clear the dirty bit first so stores racing with the
+                    // copy are caught by the next msync()
+                    *pte &= !PTE_DIRTY;
+                    invlpg(page);
+                    let index = (r.file_offset + page - r.start_addr) / PAGE_SIZE;
+                    crate::page_cache::mark_dirty(r.file_ino, index);
+                    crate::page_cache::writeback_page(r.file_ino, index);
+                }
+            }
+            page += PAGE_SIZE;
+        }
+    }
+    0
+}
+
+/// A forked child inherited `regions`; take its references on mapped files.
+pub fn dup_file_mappings(regions: &VmaTree) {
+    for r in regions.iter() {
+        if r.region_type == MemoryRegionType::File {
+            crate::page_cache::dup_mapping(r.file_ino);
+        }
+    }
+}
@@ -0,0 +1,173 @@
+// Per-process memory regions (VMAs), kept in a BTreeMap keyed by start
+// address. Regions never overlap, so the one containing an address is the
+// last one starting at or below it: lookups from the page-fault handler and
+// the syscall access checks are O(log n) instead of a scan of every region.
+//
+// Adjacent regions with identical attributes are merged on insert and
+// mprotect(), and split again when an operation covers only part of one.
+// Each File region holds one mapping reference on its page-cache entry, so
+// splits and merges of File regions take and drop references here; regions
+// handed back by remove_range() still hold theirs.
+
+use alloc::collections::BTreeMap;
+use alloc::vec::Vec;
+
+use crate::process::{MemoryRegion, MemoryRegionType};
+
+#[derive(Clone)]
+pub struct VmaTree {
+    map: BTreeMap<u64, MemoryRegion>,
+}
+
+fn mergeable(a: &MemoryRegion, b: &MemoryRegion) -> bool {
+    a.end_addr == b.start_addr
+        && a.region_type == b.region_type
+        && a.permissions == b.permissions
+        && a.shared == b.shared
+        && a.file_ino == b.file_ino
+        && (a.region_type != MemoryRegionType::File
+            || a.file_offset + (a.end_addr - a.start_addr) == b.file_offset)
+}
+
+impl VmaTree {
+    pub const fn new() -> Self {
+        VmaTree { map: BTreeMap::new() }
+    }
+
+    pub fn len(&self) -> usize {
+        self.map.len()
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = &MemoryRegion> {
+        self.map.values()
+    }
+
+    /// The region containing `addr`.
+    pub fn find(&self, addr: u64) -> Option<&MemoryRegion> {
+        self.map.range(..=addr).next_back().map(|(_, r)| r).filter(|r| addr < r.end_addr)
+    }
+
+    /// The first region starting above `addr`.
+    pub fn next_above(&self, addr: u64) -> Option<&MemoryRegion> {
+        self.map.range(addr + 1..).next().map(|(_, r)| r)
+    }
+
+    /// Regions overlapping [start, end), in address order.
+    pub fn overlapping(&self, start: u64, end: u64) -> impl Iterator<Item = &MemoryRegion> {
+        let from = self.find(start).map_or(start, |r| r.start_addr);
+        self.map.range(from..end.max(from)).map(|(_, r)| r)
+    }
+
+    pub fn is_free(&self, start: u64, end: u64) -> bool {
+        self.overlapping(start, end).next().is_none()
+    }
+
+    /// Whether every byte of [start, end) lies in some region.
+    pub fn is_covered(&self, start: u64, end: u64) -> bool {
+        let mut at = start;
+        for r in self.overlapping(start, end) {
+            if r.start_addr > at {
+                return false;
+            }
+            at = r.end_addr;
+        }
+        at >= end
+    }
+
+    /// Lowest `len`-byte gap starting at or above `from` and ending at or
+    /// below `limit`.
+    pub fn find_free(&self, from: u64, len: u64, limit: u64) -> Option<u64> {
+        let mut start = from;
+        loop {
+            let end = start.checked_add(len)?;
+            if end > limit {
+                return None;
+            }
+            match self.overlapping(start, end).last() {
+                Some(r) => start = r.end_addr,
+                None => return Some(start),
+            }
+        }
+    }
+
+    /// Add `region`, which must not overlap an existing one, merging it
+    /// with its neighbours where possible.
+    pub fn insert(&mut self, region: MemoryRegion) {
+        let start = region.start_addr;
+        self.map.insert(start, region);
+        let start = self.merge_prev(start);
+        if let Some(next) = self.next_above(start).map(|r| r.start_addr) {
+            self.merge_prev(next);
+        }
+    }
+
+    /// Merge the region at `start` into its predecessor if they are
+    /// compatible. Returns the start of the surviving region.
+    fn merge_prev(&mut self, start: u64) -> u64 {
+        let prev = match self.map.range(..start).next_back() {
+            Some((&k, p)) if mergeable(p, &self.map[&start]) => k,
+            _ => return start,
+        };
+        let region = self.map.remove(&start).unwrap();
+        if region.region_type == MemoryRegionType::File {
+            crate::page_cache::unmap_file(region.file_ino);
+        }
+        self.map.get_mut(&prev).unwrap().end_addr = region.end_addr;
+        prev
+    }
+
+    /// Make `addr` a region boundary if it falls inside a region.
+    pub fn split(&mut self, addr: u64) {
+        let (start, mut upper) = match self.find(addr) {
+            Some(r) if r.start_addr < addr => (r.start_addr, r.clone()),
+            _ => return,
+        };
+        self.map.get_mut(&start).unwrap().end_addr = addr;
+        if upper.region_type == MemoryRegionType::File {
+            upper.file_offset += addr - upper.start_addr;
+            crate::page_cache::dup_mapping(upper.file_ino);
+        }
+        upper.start_addr = addr;
+        self.map.insert(addr, upper);
+    }
+
+    /// Take [start, end) out of the tree, splitting regions that straddle
+    /// its ends. Returns the removed pieces.
+    pub fn remove_range(&mut self, start: u64, end: u64) -> Vec<MemoryRegion> {
+        self.split(start);
+        self.split(end);
+        let keys: Vec<u64> = self.map.range(start..end).map(|(&k, _)| k).collect();
+        keys.iter().filter_map(|k| self.map.remove(k)).collect()
+    }
+
+    /// Set the permissions of [start, end), which must be covered by
+    /// regions. Returns the affected regions as they now are.
+    pub fn protect(&mut self, start: u64, end: u64, permissions: u32) -> Vec<MemoryRegion> {
+        self.split(start);
+        self.split(end);
+        let keys: Vec<u64> = self.map.range(start..end).map(|(&k, _)| k).collect();
+        let mut changed = Vec::new();
+        for k in keys.iter() {
+            let r = self.map.get_mut(k).unwrap();
+            r.permissions = permissions;
+            changed.push(r.clone());
+        }
+        // Coalesce with each other and with the neighbours on either side
+        for k in keys.iter().rev() {
+            self.merge_prev(*k);
+        }
+        if let Some(next) = self.next_above(end - 1).map(|r| r.start_addr) {
+            self.merge_prev(next);
+        }
+        changed
+    }
+
+    /// Move the start of the region at `old_start` down to `new_start`
+    /// (stack growth). The space in between must be free.
+    pub fn extend_down(&mut self, old_start: u64, new_start: u64) {
+        if let Some(mut region) = self.map.remove(&old_start) {
+            region.start_addr = new_start;
+            self.map.insert(new_start, region);
+        }
+    }
+}
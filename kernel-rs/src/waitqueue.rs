@@ -0,0 +1,185 @@
+// Wait queues.
+//
+// A task waits on a channel, any non-zero address-sized key (usually the
+// address of what it waits for), until the channel is woken or an optional
+// timeout in timer ticks runs out. Waiting tasks are TASK_BLOCKED and off the
+// run queues. They are kept in a hash table of FIFO chains linked through
+// Task.wait_next, so a wakeup only looks at the tasks hashed to the same
+// bucket, and wake-one wakes the task that has waited longest.
+//
+// Wakeups may come from interrupt handlers and other CPUs. wait_event()
+// checks its condition under irq_save() right before each sleep, so a
+// wakeup cannot slip in between. Timeouts are expired from the timer tick once the
+// earliest deadline has passed.
+//
+// Without a task context (before the first task is created) a wait runs
+// idle work and halts until the next interrupt, then checks again.
+
+use crate::process::Task;
+
+extern "C" {
+    fn timer_get_ticks() -> u64;
+    fn rust_task_block();
+    fn rust_task_wake(t: *mut Task);
+}
+
+const BUCKET_BITS: u32 = 6;
+const BUCKETS: usize = 1 << BUCKET_BITS;
+
+// Channel for plain timed sleeps; nothing ever wakes it
+const SLEEP_CHANNEL: u64 = u64::MAX;
+
+static mut HEADS: [*mut Task; BUCKETS] = [core::ptr::null_mut(); BUCKETS];
+// Earliest deadline of any sleeper, u64::MAX if none
+static mut NEXT_DEADLINE: u64 = u64::MAX;
+
+fn bucket(channel: u64) -> usize {
+    (channel.wrapping_mul(0x9E37_79B9_7F4A_7C15) >> (64 - BUCKET_BITS)) as usize
+}
+
+unsafe fn insert(t: *mut Task) {
+    (*t).wait_next = core::ptr::null_mut();
+    let mut link = &mut HEADS[bucket((*t).wait_channel)] as *mut *mut Task;
+    while !(*link).is_null() {
+        link = &mut (**link).wait_next;
+    }
+    *link = t;
+}
+
+unsafe fn remove(t: *mut Task) {
+    let mut link = &mut HEADS[bucket((*t).wait_channel)] as *mut *mut Task;
+    while !(*link).is_null() {
+        if *link == t {
+            *link = (*t).wait_next;
+            break;
+        }
+        link = &mut (**link).wait_next;
+    }
+    (*t).wait_next = core::ptr::null_mut();
+    (*t).wait_channel = 0;
+}
+
+/// Sleep on `channel` until woken or until tick `deadline` (0 = none).
+/// Called with interrupts disabled. Returns false if the sleep timed out.
+unsafe fn sleep_locked(channel: u64, deadline: u64) -> bool {
+    let me = match crate::scheduler::current_task() {
+        Some(t) => t,
+        None => {
+            crate::scheduler::idle();
+            return deadline == 0 || timer_get_ticks() < deadline;
+        }
+    };
+    (*me).wait_channel = channel;
+    (*me).wait_deadline = deadline;
+    insert(me);
+    if deadline != 0 && deadline < NEXT_DEADLINE {
+        NEXT_DEADLINE = deadline;
+    }
+    rust_task_block();
+    if (*me).wait_channel != 0 {
+        // Woken by task_wake() rather than through the channel
+        remove(me);
+        (*me).wait_deadline = 0;
+    }
+    // Wakers clear the deadline, expire_timeouts() leaves it
+    let woken = (*me).wait_deadline == 0;
+    (*me).wait_deadline = 0;
+    woken
+}
+
+/// Sleep once on `channel`, for at most `timeout_ticks` unless that is 0.
+/// Returns false if the sleep timed out; a wakeup does not mean whatever
+/// the caller waits for is there, so check again.
+pub fn sleep(channel: u64, timeout_ticks: u64) -> bool {
+    let deadline = if timeout_ticks == 0 { 0 } else { unsafe { timer_get_ticks() + timeout_ticks } };
+    let flags = crate::heap::irq_save();
+    let woken = unsafe { sleep_locked(channel, deadline) };
+    crate::heap::irq_restore(flags);
+    woken
+}
+
+/// Wait until `cond` holds, sleeping on `channel` in between; whoever makes
+/// it true must wake the channel. Gives up after `timeout_ticks` timer
+/// ticks unless that is 0. Returns whether `cond` held.
+pub fn wait_event(channel: u64, timeout_ticks: u64, mut cond: impl FnMut() -> bool) -> bool {
+    let deadline = if timeout_ticks == 0 { 0 } else { unsafe { timer_get_ticks() + timeout_ticks } };
+    let flags = crate::heap::irq_save();
+    let met = loop {
+        if cond() {
+            break true;
+        }
+        if deadline != 0 && unsafe { timer_get_ticks() } >= deadline {
+            break false;
+        }
+        unsafe { sleep_locked(channel, deadline); }
+    };
+    crate::heap::irq_restore(flags);
+    met
+}
+
+/// Give up the CPU for `ticks` timer ticks.
+pub fn sleep_ticks(ticks: u64) {
+    if ticks > 0 {
+        wait_event(SLEEP_CHANNEL, ticks, || false);
+    }
+}
+
+/// Wake the tasks sleeping on `channel`, all or just the one that has
+/// waited longest. Returns how many were woken.
+pub fn wake(channel: u64, all: bool) -> usize {
+    let flags = crate::heap::irq_save();
+    let mut woken = 0;
+    unsafe {
+        let mut t = HEADS[bucket(channel)];
+        while !t.is_null() {
+            let next = (*t).wait_next;
+            if (*t).wait_channel == channel {
+                remove(t);
+                (*t).wait_deadline = 0;
+                rust_task_wake(t);
+                woken += 1;
+                if !all {
+                    break;
+                }
+            }
+            t = next;
+        }
+    }
+    crate::heap::irq_restore(flags);
+    woken
+}
+
+/// Wake sleepers whose timeout has run out. Called from the timer tick.
+pub fn expire_timeouts() {
+    unsafe {
+        let now = timer_get_ticks();
+        if now < NEXT_DEADLINE {
+            return;
+        }
+        NEXT_DEADLINE = u64::MAX;
+        for head in 0..BUCKETS {
+            let mut t = HEADS[head];
+            while !t.is_null() {
+                let next = (*t).wait_next;
+                let deadline = (*t).wait_deadline;
+                if deadline != 0 && deadline <= now {
+                    remove(t);
+                    rust_task_wake(t);
+                } else if deadline != 0 && deadline < NEXT_DEADLINE {
+                    NEXT_DEADLINE = deadline;
+                }
+                t = next;
+            }
+        }
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn rust_wait_sleep(channel: u64, timeout_ticks: u64) -> i32 {
+    if sleep(channel, timeout_ticks) { 0 } else { -1 }
+}
+
+#[no_mangle]
+pub extern "C" fn rust_wait_wake(channel: u64, all: i32) -> i32 {
+    wake(channel, all != 0) as i32
+}
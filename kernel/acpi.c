@@ -0,0 +1,175 @@
+#include "acpi.h"
+#include "paging.h"
+#include "pmm.h"
+#include "serial.h"
+
+#define MULTIBOOT2_TAG_TYPE_ACPI_OLD 14
+#define MULTIBOOT2_TAG_TYPE_ACPI_NEW 15
+#define MULTIBOOT2_TAG_ALIGN 8
+
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_LAPIC_OVERRIDE 5
+#define MADT_LAPIC_ENABLED  0x1
+#define MADT_PCAT_COMPAT    0x1
+
+typedef struct {
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;  // 0 = ACPI 1.0 (RSDT only), 2+ = XSDT as well
+    uint32_t rsdt_addr;
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+static acpi_madt_info_t madt_info;
+
+static int checksum_ok(const void* p, uint32_t len) {
+    const uint8_t* b = (const uint8_t*)p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += b[i];
+    return sum == 0;
+}
+
+// Firmware tables sit in reserved RAM, which the direct map does not
+// necessarily cover
+void* acpi_map(uint64_t phys, uint64_t len) {
+    uint64_t end = phys + len;
+    for (uint64_t p = phys & ~(uint64_t)(PAGE_SIZE - 1); p < end; p += PAGE_SIZE) {
+        if (!get_phys_addr(PHYS_MAP_BASE + p)) map_page(PHYS_MAP_BASE + p, p, PAGE_PRESENT);
+    }
+    return phys_to_virt(phys);
+}
+
+static acpi_rsdp_t* rsdp_from_multiboot(uint64_t mb2_info_ptr) {
+    if (mb2_info_ptr == 0 || (mb2_info_ptr & 0x7) != 0) return 0;
+    uint8_t* mb2 = (uint8_t*)mb2_info_ptr;
+    uint32_t total_size = *(uint32_t*)mb2;
+    acpi_rsdp_t* found = 0;
+    uint8_t* tag = mb2 + 8;
+    while (tag + 8 <= mb2 + total_size) {
+        uint32_t type = ((uint32_t*)tag)[0];
+        uint32_t size = ((uint32_t*)tag)[1];
+        if (type == 0 || size < 8) break;
+        // Prefer the ACPI 2.0 copy when both are there
+        if (type == MULTIBOOT2_TAG_TYPE_ACPI_NEW) return (acpi_rsdp_t*)(tag + 8);
+        if (type == MULTIBOOT2_TAG_TYPE_ACPI_OLD) found = (acpi_rsdp_t*)(tag + 8);
+        tag += (size + MULTIBOOT2_TAG_ALIGN - 1) & ~(MULTIBOOT2_TAG_ALIGN - 1);
+    }
+    return found;
+}
+
+// The RSDP is 16-byte aligned in the first KiB of the EBDA or in the BIOS
+// ROM area 0xE0000-0xFFFFF
+static acpi_rsdp_t* rsdp_scan(uint64_t start, uint64_t len) {
+    uint8_t* base = (uint8_t*)acpi_map(start, len);
+    for (uint64_t off = 0; off + sizeof(acpi_rsdp_t) <= len; off += 16) {
+        acpi_rsdp_t* r = (acpi_rsdp_t*)(base + off);
+        if (memcmp(r->signature, "RSD PTR ", 8) == 0 && checksum_ok(r, 20)) return r;
+    }
+    return 0;
+}
+
+static acpi_rsdp_t* find_rsdp(uint64_t mb2_info_ptr) {
+    acpi_rsdp_t* r = rsdp_from_multiboot(mb2_info_ptr);
+    if (r && memcmp(r->signature, "RSD PTR ", 8) == 0) return r;
+    uint16_t ebda_seg = *(uint16_t*)acpi_map(0x40E, 2);
+    if (ebda_seg) {
+        r = rsdp_scan((uint64_t)ebda_seg << 4, 1024);
+        if (r) return r;
+    }
+    return rsdp_scan(0xE0000, 0x20000);
+}
+
+static acpi_sdt_header_t* map_table(uint64_t phys) {
+    acpi_sdt_header_t* h = (acpi_sdt_header_t*)acpi_map(phys, sizeof(acpi_sdt_header_t));
+    return (acpi_sdt_header_t*)acpi_map(phys, h->length);
+}
+
+static acpi_sdt_header_t* find_table(acpi_rsdp_t* rsdp, const char* sig) {
+    int xsdt = rsdp->revision >= 2 && rsdp->xsdt_addr;
+    acpi_sdt_header_t* root = map_table(xsdt ? rsdp->xsdt_addr : rsdp->rsdt_addr);
+    if (!checksum_ok(root, root->length)) return 0;
+    uint32_t entry_size = xsdt ? 8 : 4;
+    uint32_t count = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    uint8_t* entries = (uint8_t*)root + sizeof(acpi_sdt_header_t);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t phys = xsdt ? *(uint64_t*)(entries + i * 8) : *(uint32_t*)(entries + i * 4);
+        acpi_sdt_header_t* h = map_table(phys);
+        if (memcmp(h->signature, sig, 4) == 0 && checksum_ok(h, h->length)) return h;
+    }
+    return 0;
+}
+
+static void parse_madt(acpi_madt_t* madt) {
+    madt_info.lapic_base = madt->lapic_addr;
+    madt_info.legacy_pics = (madt->flags & MADT_PCAT_COMPAT) != 0;
+    uint8_t* p = (uint8_t*)madt + sizeof(acpi_madt_t);
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        switch (p[0]) {
+        case MADT_LAPIC:
+            // Bytes: type, length, ACPI processor ID, APIC ID, flags (32-bit)
+            if ((*(uint32_t*)(p + 4) & MADT_LAPIC_ENABLED) && madt_info.cpu_count < ACPI_MAX_CPUS) {
+                madt_info.lapic_ids[madt_info.cpu_count++] = p[3];
+            }
+            break;
+        case MADT_IOAPIC:
+            // type, length, ID, reserved, address (32-bit), GSI base (32-bit)
+            if (!madt_info.ioapic_base) {
+                madt_info.ioapic_base = *(uint32_t*)(p + 4);
+                madt_info.ioapic_gsi_base = *(uint32_t*)(p + 8);
+            }
+            break;
+        case MADT_LAPIC_OVERRIDE:
+            // type, length, reserved (16-bit), address (64-bit)
+            madt_info.lapic_base = *(uint64_t*)(p + 4);
+            break;
+        }
+        p += p[1];
+    }
+}
+
+int acpi_init(uint64_t mb2_info_ptr) {
+    acpi_rsdp_t* rsdp = find_rsdp(mb2_info_ptr);
+    if (!rsdp) {
+        serial_write("[ACPI] No RSDP found\n");
+        return -1;
+    }
+    acpi_madt_t* madt = (acpi_madt_t*)find_table(rsdp, "APIC");
+    if (!madt) {
+        serial_write("[ACPI] No MADT found\n");
+        return -1;
+    }
+    parse_madt(madt);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "[ACPI] MADT: %d CPUs, LAPIC at 0x%lx, I/O APIC at 0x%lx\n",
+             madt_info.cpu_count, (unsigned long)madt_info.lapic_base, (unsigned long)madt_info.ioapic_base);
+    serial_write(msg);
+    return 0;
+}
+
+const acpi_madt_info_t* acpi_madt(void) {
+    return &madt_info;
+}
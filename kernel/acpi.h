@@ -0,0 +1,25 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "kernel.h"
+
+#define ACPI_MAX_CPUS 16
+
+// What the MADT (ACPI "APIC" table) says about the interrupt controllers
+typedef struct {
+    uint64_t lapic_base;  // Physical address of the local APIC registers
+    int cpu_count;        // Enabled processors
+    uint8_t lapic_ids[ACPI_MAX_CPUS];
+    uint64_t ioapic_base; // First I/O APIC, 0 if there is none
+    uint32_t ioapic_gsi_base;
+    int legacy_pics;      // 8259 PICs present (PCAT_COMPAT)
+} acpi_madt_info_t;
+
+// Find the RSDP (Multiboot2 tag, else the BIOS areas) and parse the MADT.
+// Returns -1 if there is no ACPI or no MADT.
+int acpi_init(uint64_t mb2_info_ptr);
+// Map `len` bytes of firmware memory at `phys` into the direct map
+void* acpi_map(uint64_t phys, uint64_t len);
+const acpi_madt_info_t* acpi_madt(void);
+
+#endif
@@ -40,3 +40,12 @@ blockdev_t* blockdev_get(int id) {
     if (blockdevs[id].read) return &blockdevs[id];
     return 0;
 }
+
+int blockdev_register(int id, int (*read)(int, void*, int), int (*write)(int, const void*, int), int total_sectors) {
+    if (id < 0 || id >= MAX_BLOCKDEVS || blockdevs[id].read) return -1;
+    blockdevs[id].id = id;
+    blockdevs[id].read = read;
+    blockdevs[id].write = write;
+    blockdevs[id].total_sectors = total_sectors;
+    return 0;
+}
@@ -15,5 +15,8 @@ typedef struct blockdev {
 
 void blockdev_init();
 blockdev_t* blockdev_get(int id);
+// Install a driver in a free slot; returns -1 if id is taken or invalid
+int blockdev_register(int id, int (*read)(int sector, void* buf, int count),
+                      int (*write)(int sector, const void* buf, int count), int total_sectors);
 
 #endif
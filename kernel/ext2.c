@@ -30,6 +30,25 @@ static void strcpy(char* dest, const char* src) {
 // Global filesystem context
 static ext2_fs_t* mounted_fs = NULL;
 static int ext2_initialized = 0;
+// Slab cache for block-sized scratch buffers, created once the block size is known
+static kmem_cache_t* ext2_block_cache = NULL;
+static size_t ext2_block_cache_size = 0;
+
+static void* ext2_alloc_block_buf(ext2_fs_t* fs) {
+    if (ext2_block_cache && fs->block_size == ext2_block_cache_size) {
+        return rust_kmem_cache_alloc(ext2_block_cache);
+    }
+    // No cache, or one for another block size (e.g. above SLAB_MAX_SIZE)
+    return rust_kmalloc(fs->block_size);
+}
+
+static void ext2_free_block_buf(ext2_fs_t* fs, void* buf) {
+    if (ext2_block_cache && fs->block_size == ext2_block_cache_size) {
+        rust_kmem_cache_free(ext2_block_cache, buf);
+        return;
+    }
+    rust_kfree(buf);
+}
 
 // ext2 filesystem initialization
 int ext2_init(blockdev_t* device) {
@@ -42,7 +61,7 @@ int ext2_init(blockdev_t* device) {
     serial_write("[EXT2] Initializing ext2 filesystem\n");
     
     // Allocate filesystem context
-    mounted_fs = (ext2_fs_t*)rust_kmalloc(sizeof(ext2_fs_t));
+    mounted_fs = (ext2_fs_t*)kmalloc_tagged(sizeof(ext2_fs_t), HEAP_TAG_EXT2);
     if (!mounted_fs) {
         vga_print("[EXT2] Failed to allocate filesystem context\n");
         serial_write("[EXT2] Failed to allocate filesystem context\n");
@@ -78,10 +97,17 @@ int ext2_init(blockdev_t* device) {
     mounted_fs->group_count = (mounted_fs->superblock.s_blocks_count + mounted_fs->blocks_per_group - 1) / mounted_fs->blocks_per_group;
     mounted_fs->inode_size = mounted_fs->superblock.s_inode_size;
     mounted_fs->first_inode = mounted_fs->superblock.s_first_ino;
+
+    if (!ext2_block_cache) {
+        int prev_tag = rust_heap_set_tag(HEAP_TAG_EXT2);
+        ext2_block_cache = rust_kmem_cache_create("ext2_block", mounted_fs->block_size);
+        rust_heap_set_tag(prev_tag);
+        if (ext2_block_cache) ext2_block_cache_size = mounted_fs->block_size;
+    }
     
     // Allocate and read group descriptors
     size_t gd_size = mounted_fs->group_count * sizeof(ext2_group_desc_t);
-    mounted_fs->group_descriptors = (ext2_group_desc_t*)rust_kmalloc(gd_size);
+    mounted_fs->group_descriptors = (ext2_group_desc_t*)kmalloc_tagged(gd_size, HEAP_TAG_EXT2);
     if (!mounted_fs->group_descriptors) {
         vga_print("[EXT2] Failed to allocate group descriptors\n");
         serial_write("[EXT2] Failed to allocate group descriptors\n");
@@ -91,7 +117,7 @@ int ext2_init(blockdev_t* device) {
     
     // Group descriptors start at block 2
     uint32_t gd_blocks = (gd_size + mounted_fs->block_size - 1) / mounted_fs->block_size;
-    uint8_t* gd_buf = (uint8_t*)rust_kmalloc(gd_blocks * mounted_fs->block_size);
+    uint8_t* gd_buf = (uint8_t*)kmalloc_tagged(gd_blocks * mounted_fs->block_size, HEAP_TAG_EXT2);
     if (!gd_buf) {
         vga_print("[EXT2] Failed to allocate group descriptor buffer\n");
         serial_write("[EXT2] Failed to allocate group descriptor buffer\n");
@@ -166,18 +192,18 @@ int ext2_read_inode(ext2_fs_t* fs, uint32_t inode_num, ext2_inode_t* inode) {
     uint32_t inode_block = ext2_inode_to_block(fs, inode_num);
     if (inode_block == 0) return -1;
     
-    uint8_t* block_buf = (uint8_t*)rust_kmalloc(fs->block_size);
+    uint8_t* block_buf = (uint8_t*)ext2_alloc_block_buf(fs);
     if (!block_buf) return -1;
     
     if (ext2_read_block(fs, inode_block, block_buf) != 0) {
-        rust_kfree(block_buf);
+        ext2_free_block_buf(fs, block_buf);
         return -1;
     }
     
     uint32_t inode_offset = ((inode_num - 1) % fs->inodes_per_group) * fs->inode_size % fs->block_size;
     memcpy(inode, block_buf + inode_offset, sizeof(ext2_inode_t));
     
-    rust_kfree(block_buf);
+    ext2_free_block_buf(fs, block_buf);
     return 0;
 }
 
@@ -188,11 +214,11 @@ int ext2_write_inode(ext2_fs_t* fs, uint32_t inode_num, const ext2_inode_t* inod
     uint32_t inode_block = ext2_inode_to_block(fs, inode_num);
     if (inode_block == 0) return -1;
     
-    uint8_t* block_buf = (uint8_t*)rust_kmalloc(fs->block_size);
+    uint8_t* block_buf = (uint8_t*)ext2_alloc_block_buf(fs);
     if (!block_buf) return -1;
     
     if (ext2_read_block(fs, inode_block, block_buf) != 0) {
-        rust_kfree(block_buf);
+        ext2_free_block_buf(fs, block_buf);
         return -1;
     }
     
@@ -200,7 +226,7 @@ int ext2_write_inode(ext2_fs_t* fs, uint32_t inode_num, const ext2_inode_t* inod
     memcpy(block_buf + inode_offset, inode, sizeof(ext2_inode_t));
     
     int result = ext2_write_block(fs, inode_block, block_buf);
-    rust_kfree(block_buf);
+    ext2_free_block_buf(fs, block_buf);
     
     return result;
 }
@@ -221,17 +247,17 @@ int ext2_get_block_number(ext2_fs_t* fs, const ext2_inode_t* inode, uint32_t blo
             return 0;
         }
         
-        uint32_t* block_array = (uint32_t*)rust_kmalloc(fs->block_size);
+        uint32_t* block_array = (uint32_t*)ext2_alloc_block_buf(fs);
         if (!block_array) return -1;
         
         if (ext2_read_block(fs, indirect_block, block_array) != 0) {
-            rust_kfree(block_array);
+            ext2_free_block_buf(fs, block_array);
             return -1;
         }
         
         uint32_t index = block_index - 12;
         *block_num = block_array[index];
-        rust_kfree(block_array);
+        ext2_free_block_buf(fs, block_array);
         return 0;
     }
     
@@ -320,7 +346,7 @@ int ext2_path_to_inode(ext2_fs_t* fs, const char* path, uint32_t* inode_num) {
         }
         
         // Search directory for component
-        uint8_t* dir_buf = (uint8_t*)rust_kmalloc(fs->block_size);
+        uint8_t* dir_buf = (uint8_t*)ext2_alloc_block_buf(fs);
         if (!dir_buf) return -1;
         
         int found = 0;
@@ -329,14 +355,14 @@ int ext2_path_to_inode(ext2_fs_t* fs, const char* path, uint32_t* inode_num) {
         while (block_index * fs->block_size < dir_inode.i_size) {
             uint32_t block_num;
             if (ext2_get_block_number(fs, &dir_inode, block_index, &block_num) != 0) {
-                rust_kfree(dir_buf);
+                ext2_free_block_buf(fs, dir_buf);
                 return -1;
             }
             
             if (block_num == 0) break;
             
             if (ext2_read_block(fs, block_num, dir_buf) != 0) {
-                rust_kfree(dir_buf);
+                ext2_free_block_buf(fs, dir_buf);
                 return -1;
             }
             
@@ -365,7 +391,7 @@ int ext2_path_to_inode(ext2_fs_t* fs, const char* path, uint32_t* inode_num) {
             block_index++;
         }
         
-        rust_kfree(dir_buf);
+        ext2_free_block_buf(fs, dir_buf);
         
         if (!found) {
             return -1; // Component not found
@@ -388,7 +414,7 @@ ext2_file_t* ext2_open(const char* path, int flags) {
         return NULL;
     }
     
-    ext2_file_t* file = (ext2_file_t*)rust_kmalloc(sizeof(ext2_file_t));
+    ext2_file_t* file = (ext2_file_t*)kmalloc_tagged(sizeof(ext2_file_t), HEAP_TAG_EXT2);
     if (!file) return NULL;
     
     file->fs = mounted_fs;
@@ -459,16 +485,16 @@ int ext2_read(ext2_file_t* file, void* buf, size_t count) {
             memset(read_buf + bytes_read, 0, bytes_to_read);
         } else {
             // Read block
-            uint8_t* block_buf = (uint8_t*)rust_kmalloc(file->fs->block_size);
+            uint8_t* block_buf = (uint8_t*)ext2_alloc_block_buf(file->fs);
             if (!block_buf) return -1;
             
             if (ext2_read_block(file->fs, block_num, block_buf) != 0) {
-                rust_kfree(block_buf);
+                ext2_free_block_buf(file->fs, block_buf);
                 return -1;
             }
             
             memcpy(read_buf + bytes_read, block_buf + block_offset, bytes_to_read);
-            rust_kfree(block_buf);
+            ext2_free_block_buf(file->fs, block_buf);
         }
         
         bytes_read += bytes_to_read;
@@ -513,22 +539,22 @@ int ext2_write(ext2_file_t* file, const void* buf, size_t count) {
         }
         
         // Read block, modify, write back
-        uint8_t* block_buf = (uint8_t*)rust_kmalloc(file->fs->block_size);
+        uint8_t* block_buf = (uint8_t*)ext2_alloc_block_buf(file->fs);
         if (!block_buf) return -1;
         
         if (ext2_read_block(file->fs, block_num, block_buf) != 0) {
-            rust_kfree(block_buf);
+            ext2_free_block_buf(file->fs, block_buf);
             return -1;
         }
         
         memcpy(block_buf + block_offset, write_buf + bytes_written, bytes_to_write);
         
         if (ext2_write_block(file->fs, block_num, block_buf) != 0) {
-            rust_kfree(block_buf);
+            ext2_free_block_buf(file->fs, block_buf);
             return -1;
         }
         
-        rust_kfree(block_buf);
+        ext2_free_block_buf(file->fs, block_buf);
         
         bytes_written += bytes_to_write;
         file->position += bytes_to_write;
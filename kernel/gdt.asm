@@ -8,9 +8,9 @@ gdt_flush:
     mov ax, 0x10      ; Data segment selector
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
     mov ss, ax
+    ; FS and GS are left alone: loading GS would clear the GS base, which
+    ; holds the per-CPU data pointer (smp.c)
     
     ; Far jump to reload CS
     push 0x08         ; Code segment selector
@@ -1,5 +1,7 @@
 #include "kernel.h"
 #include "serial.h"
+#include "gdt.h"
+#include "smp.h"
 
 struct gdt_entry {
     uint16_t limit_low;
@@ -15,12 +17,31 @@ struct gdt_ptr {
     uint64_t base;
 } __attribute__((packed));
 
-static struct gdt_entry gdt[5];
-static struct gdt_ptr gdt_pointer;
+// 64-bit TSS: only the stack pointers are used
+typedef struct {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed)) tss_t;
+
+// Five segments, then the 16-byte TSS descriptor. Every CPU has its own
+// GDT since loading a TSS marks its descriptor busy.
+#define GDT_ENTRIES 7
+#define IST_STACKS 2
+#define IST_STACK_SIZE 4096
+
+static struct gdt_entry gdt[SMP_MAX_CPUS][GDT_ENTRIES];
+static struct gdt_ptr gdt_pointer[SMP_MAX_CPUS];
+static tss_t tss[SMP_MAX_CPUS];
+static uint8_t ist_stacks[SMP_MAX_CPUS][IST_STACKS][IST_STACK_SIZE] __attribute__((aligned(16)));
 
 extern void gdt_flush(uint64_t);
 
-static void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+static void gdt_set_gate(struct gdt_entry* gdt, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     gdt[num].base_low = (base & 0xFFFF);
     gdt[num].base_middle = (base >> 16) & 0xFF;
     gdt[num].base_high = (base >> 24) & 0xFF;
@@ -31,15 +52,37 @@ static void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access,
     gdt[num].access = access;
 }
 
+void gdt_init_cpu(uint32_t cpu) {
+    struct gdt_entry* g = gdt[cpu];
+    gdt_pointer[cpu].limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+    gdt_pointer[cpu].base = (uint64_t)g;
+    gdt_set_gate(g, 0, 0, 0, 0, 0);                // Null segment
+    gdt_set_gate(g, 1, 0, 0xFFFFFFFF, 0x9A, 0xAF); // Code segment (64-bit)
+    gdt_set_gate(g, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment    
+    gdt_set_gate(g, 3, 0, 0xFFFFFFFF, 0xFA, 0xAF); // User code segment
+    gdt_set_gate(g, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User data segment
+
+    tss_t* t = &tss[cpu];
+    memset(t, 0, sizeof(*t));
+    t->ist[GDT_IST_DOUBLE_FAULT - 1] = (uint64_t)ist_stacks[cpu][0] + IST_STACK_SIZE;
+    t->ist[GDT_IST_NMI - 1] = (uint64_t)ist_stacks[cpu][1] + IST_STACK_SIZE;
+    t->iomap_base = sizeof(tss_t); // No I/O permission bitmap
+    // Available 64-bit TSS; the upper half of the base goes in the next slot
+    uint64_t base = (uint64_t)t;
+    gdt_set_gate(g, 5, (uint32_t)base, sizeof(tss_t) - 1, 0x89, 0x00);
+    memset(&g[6], 0, sizeof(g[6]));
+    *(uint32_t*)&g[6] = (uint32_t)(base >> 32);
+
+    gdt_flush((uint64_t)&gdt_pointer[cpu]);
+    __asm__ volatile("ltr %0" : : "r"((uint16_t)GDT_TSS_SELECTOR));
+}
+
 void gdt_init() {
-    gdt_pointer.limit = (sizeof(struct gdt_entry) * 5) - 1;
-    gdt_pointer.base = (uint64_t)&gdt;
-    gdt_set_gate(0, 0, 0, 0, 0);                // Null segment
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xAF); // Code segment (64-bit)
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment    
-    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xAF); // User code segment
-    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User data segment
-    gdt_flush((uint64_t)&gdt_pointer);
+    gdt_init_cpu(0);
+}
+
+void gdt_set_kernel_stack(uint64_t rsp0) {
+    tss[smp_cpu_id()].rsp[0] = rsp0;
 }
 
 // Export selectors for user mode
@@ -2,3 +2,15 @@ extern uint16_t gdt_kernel_code;
 extern uint16_t gdt_kernel_data;
 extern uint16_t gdt_user_code;
 extern uint16_t gdt_user_data;
+
+#define GDT_TSS_SELECTOR 0x28
+
+// Interrupt stack table slots (idt.c gives these vectors their own stacks)
+#define GDT_IST_DOUBLE_FAULT 1
+#define GDT_IST_NMI          2
+
+// Build and load the GDT and TSS of CPU `cpu` (0 = boot CPU, gdt_init)
+void gdt_init_cpu(uint32_t cpu);
+// Stack the CPU switches to on an interrupt from user mode; set to the
+// running task's stack on every task switch
+void gdt_set_kernel_stack(uint64_t rsp0);
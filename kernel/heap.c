@@ -6,8 +6,13 @@
 void* rust_kmalloc(size_t size);
 void rust_kfree(void* ptr);
 
+// The return address is recorded as the call site for the leak report
 void* kmalloc(size_t size) {
-    return rust_kmalloc(size);
+    return rust_kmalloc_tagged(size, -1, __builtin_return_address(0));
+}
+
+void* kmalloc_tagged(size_t size, int tag) {
+    return rust_kmalloc_tagged(size, tag, __builtin_return_address(0));
 }
 
 void kfree(void* ptr) {
@@ -3,7 +3,36 @@
 
 #include "kernel.h"
 
+// Virtual range reserved for the Rust kernel heap (kernel-rs/src/heap.rs)
+#define KERNEL_HEAP_BASE 0xFFFFC00000000000ULL
+#define KERNEL_HEAP_SIZE 0x40000000ULL // 1 GiB
+
 void* rust_kmalloc(size_t size);
+// align must be a power of two
+void* rust_kmalloc_aligned(size_t size, size_t align);
 void rust_kfree(void* ptr);
 
+// Heap profile tags (kernel-rs/src/heap_profile.rs). Allocations are
+// charged to the tag passed to kmalloc_tagged(), or else to the current
+// tag set with rust_heap_set_tag(), which returns the previous one.
+#define HEAP_TAG_OTHER   0
+#define HEAP_TAG_PROCESS 1
+#define HEAP_TAG_VFS     2
+#define HEAP_TAG_EXT2    3
+#define HEAP_TAG_NET     4
+#define HEAP_TAG_SHELL   5
+
+void* rust_kmalloc_tagged(size_t size, int tag, void* caller);
+void* kmalloc_tagged(size_t size, int tag);
+int rust_heap_set_tag(int tag);
+// Cap on how far the heap may grow (bytes); returns -1 if out of range
+int rust_heap_set_max(size_t bytes);
+
+// Slab caches for fixed-size kernel objects (kernel-rs/src/slab.rs).
+// Objects may also be released with rust_kfree().
+typedef struct kmem_cache kmem_cache_t;
+kmem_cache_t* rust_kmem_cache_create(const char* name, size_t obj_size);
+void* rust_kmem_cache_alloc(kmem_cache_t* cache);
+void rust_kmem_cache_free(kmem_cache_t* cache, void* ptr);
+
 #endif
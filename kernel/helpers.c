@@ -1,4 +1,13 @@
 #include "helpers.h"
+#include "pmm.h"
+
+// Pages cleared for the pre-zeroed pool each time the CPU goes idle; small
+// enough that the next interrupt is not noticeably delayed
+#define IDLE_ZERO_BATCH 8
+
+// Background page reclaim (reclaim.rs) and same-page merging (ksm.rs)
+extern void rust_reclaim_idle(void);
+extern void rust_ksm_idle(void);
 
 // These are the actual function definitions that can be called from Rust
 void sys_sti(void) { 
@@ -9,7 +18,17 @@ void sys_cli(void) {
     __asm__ volatile ("cli"); 
 }
 
+// Background work that only needs spare cycles
+void idle_work(void) {
+    pmm_zero_pool_refill(IDLE_ZERO_BATCH);
+    rust_reclaim_idle();
+    rust_ksm_idle();
+}
+
+// Wait for the next interrupt. Callers use this when they have nothing to
+// do, so idle work runs here first.
 void pause(void) { 
+    idle_work();
     __asm__ volatile ("hlt"); 
 }
 
@@ -3,4 +3,5 @@
 void sys_sti(void);
 void sys_cli(void);
 void pause(void);
+void idle_work(void);
 #endif
@@ -19,9 +19,25 @@ idt_flush:
   lidt [rax]
   ret
 
+; Offset of the saved CS in the CPU-pushed frame at stub entry
+%macro FRAME_CS 1
+  %if %1 == 8 || (%1 >= 10 && %1 <= 14) || %1 == 17
+    %define FRAME_CS_OFF 16
+  %else
+    %define FRAME_CS_OFF 8
+  %endif
+%endmacro
+
 %macro ISR_STUB 1
   global isr_stub_%1
  isr_stub_%1:
+    ; Coming from user mode: switch to the kernel's GS base (per-CPU data,
+    ; kernel/smp.h), parking the user's in IA32_KERNEL_GS_BASE
+    FRAME_CS %1
+    test byte [rsp + FRAME_CS_OFF], 3
+    jz %%kernel_entry
+    swapgs
+%%kernel_entry:
     ; Save all general-purpose registers that are not saved by the interrupt itself.
     push rax
     push rbx
@@ -45,10 +61,12 @@ idt_flush:
         ; Stack: [registers..., error_code, RIP, CS, RFLAGS, RSP, SS]
         mov rdi, %1          ; Arg1: interrupt number
         mov rsi, [rsp + 15*8] ; Arg2: error code is at rsp + size_of_pushed_registers
+        lea rdx, [rsp + 16*8] ; Arg3: CPU-pushed frame (RIP, CS, RFLAGS, RSP, SS)
     %else
         ; No error code pushed by CPU.
         mov rdi, %1          ; Arg1: interrupt number
         mov rsi, 0           ; Arg2: dummy error code
+        lea rdx, [rsp + 15*8] ; Arg3: CPU-pushed frame (RIP, CS, RFLAGS, RSP, SS)
     %endif
 
     call isr_handler
@@ -75,6 +93,11 @@ idt_flush:
         add rsp, 8
     %endif
 
+    ; Back to user mode: give it its own GS base again
+    test byte [rsp + 8], 3
+    jz %%kernel_exit
+    swapgs
+%%kernel_exit:
     iretq
 %endmacro
 
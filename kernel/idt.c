@@ -2,6 +2,8 @@
 #include "idt.h"
 #include "serial.h"
 #include "syscall.h"
+#include "gdt.h"
+#include "smp.h"
 
 struct idt_entry {
     uint16_t base_low;
@@ -78,11 +80,22 @@ void idt_init() {
     // Set syscall gate (int 0x80) to syscall_entry
     extern void syscall_entry();
     idt_set_gate(0x80, (uint64_t)syscall_entry, 0x08, 0xEE);
+    // Known-good stacks for faults that may come with a bad one
+    idt[8].ist = GDT_IST_DOUBLE_FAULT;
+    idt[2].ist = GDT_IST_NMI;
     idt_flush((uint64_t)&idt_pointer);    
 }
 
+// The other CPUs share the boot CPU's IDT
+void idt_load(void) {
+    idt_flush((uint64_t)&idt_pointer);
+}
+
 // Central interrupt handler
-void isr_handler(uint64_t int_no, uint64_t err_code) {
+// Demand paging (kernel-rs/src/vm.rs); returns 0 when the fault was resolved
+extern int rust_handle_page_fault(uint64_t addr, uint64_t err_code, uint64_t user_rsp);
+
+void isr_handler(uint64_t int_no, uint64_t err_code, interrupt_frame_t* frame) {
     char int_str[9];
     for (int i = 0; i < 8; i++) {
         int nibble = (int_no >> ((7 - i) * 4)) & 0xF;
@@ -108,6 +121,10 @@ void isr_handler(uint64_t int_no, uint64_t err_code) {
         // Page Fault
         uint64_t cr2;
         __asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));
+        int from_user = (frame->cs & 3) == 3;
+        if (rust_handle_page_fault(cr2, err_code, from_user ? frame->rsp : 0) == 0) {
+            return;
+        }
         serial_write("[INTERRUPT] Page Fault detected!\n");
         serial_write("[INTERRUPT] Faulting address: 0x");
         char addr_hex[17];
@@ -131,21 +148,24 @@ void isr_handler(uint64_t int_no, uint64_t err_code) {
         vga_print("[INTERRUPT] Page Fault Exception!\n");
         vga_set_color(0x0F);
         // Check if fault from user mode (CS & 3 == 3)
-        uint64_t cs;
-        __asm__ volatile ("mov %%cs, %0" : "=r"(cs));
-        if ((cs & 3) == 3) {
+        if (from_user) {
             vga_print("[PAGE FAULT] User process caused page fault. Killing process.\n");
             serial_write("[PAGE FAULT] User process killed.\n");
-            extern void task_exit();
+            extern void task_exit() __attribute__((noreturn));
             task_exit();
-            return;
         }
         // Kernel mode: panic
         while(1) { __asm__ volatile("hlt"); }
     }
+    if (int_no >= LAPIC_TIMER_VECTOR) {
+        smp_handle_interrupt(int_no);
+        return;
+    }
     if (int_no == 32) {
-        timer_interrupt_handler();
+        // EOI first: the tick may switch tasks, and the PIC must not wait
+        // until this one is resumed to deliver the next tick
         outb(0x20, 0x20); // EOI to master PIC
+        timer_interrupt_handler();
         return;
     } else if (int_no == 33) {
         keyboard_interrupt_handler();
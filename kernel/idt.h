@@ -9,8 +9,19 @@ typedef struct {
 	uint64_t dummy;
 } registers_t;
 
+// What the CPU pushes on interrupt entry (after the error code, if any)
+typedef struct {
+	uint64_t rip;
+	uint64_t cs;
+	uint64_t rflags;
+	uint64_t rsp;
+	uint64_t ss;
+} interrupt_frame_t;
+
 void idt_init();
-void isr_handler(uint64_t int_no, uint64_t err_code);
+// Load the IDT on an application processor
+void idt_load(void);
+void isr_handler(uint64_t int_no, uint64_t err_code, interrupt_frame_t* frame);
 extern void* isr_stub_table[256];
 
 // Register a C-level interrupt handler for a given interrupt vector.
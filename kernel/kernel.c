@@ -2,6 +2,7 @@
 #include "pmm.h"
 #include "paging.h"
 #include "heap.h"
+#include "memops.h"
 #include "timer.h"
 #include "keyboard.h"
 #include "serial.h"
@@ -9,6 +10,8 @@
 #include "task.h"
 #include "syscall.h"
 #include "blockdev.h" // Needed for blockdev_get in Rust FFI
+#include "zram.h"
+#include "smp.h"
 #include <stdbool.h>
 
 typedef unsigned int u32;
@@ -172,6 +175,8 @@ void print_dec64(unsigned long val) {
 }
 
 void kernel_main(uint64_t mb2_info_ptr) {
+    // Per-CPU data (GS base) before anything takes the kernel lock
+    smp_early_init();
     volatile uint16_t* vga = (uint16_t*)0xB8000;
     for (int i = 0; i < 80 * 25; i++) vga[i] = 0x0F20;
     const char* msg = "KERNEL STARTED - 64BIT MODE WORKING!";
@@ -180,6 +185,8 @@ void kernel_main(uint64_t mb2_info_ptr) {
     // VGA init/clear
     rust_vga_clear();
     serial_write("[KERNEL] Initializing ShadeOS v0.1\n");
+    // Pick memcpy/memset kernels before anything copies in bulk
+    memops_init();
 
     // Print Multiboot2 info pointer
     for (int i = 60; i >= 0; i -= 4) {
@@ -209,6 +216,7 @@ void kernel_main(uint64_t mb2_info_ptr) {
 
     // Paging
     paging_init();
+    pmm_init_highmem();
     // Heap
     init_heap();
     // Timer
@@ -224,6 +232,7 @@ void kernel_main(uint64_t mb2_info_ptr) {
     initialize_keyboard();
     // Block Devices
     blockdev_init();
+    zram_init();
 
     // Device framework + Network devices
     extern void device_framework_init(void);
@@ -313,6 +322,9 @@ void kernel_main(uint64_t mb2_info_ptr) {
     extern void rust_keyboard_clear_buffer();
     rust_keyboard_clear_buffer();
 
+    // Other CPUs (ACPI MADT); they start taking tasks right away
+    smp_init(mb2_info_ptr);
+
     // Initialize bash shell
     serial_write("[CORE] Syscalls and Scheduler initialized.\n");
     rust_bash_init();
@@ -38,6 +38,7 @@ void kfree(void* ptr);
 // Utility functions
 void* memset(void* dest, int val, size_t len);
 void* memcpy(void* dest, const void* src, size_t len);
+void* memmove(void* dest, const void* src, size_t len);
 size_t strlen(const char* str);
 int strcmp(const char* a, const char* b);
 int memcmp(const void* s1, const void* s2, size_t n);
@@ -55,9 +56,13 @@ void outl(uint16_t port, uint32_t data);
 // Multiboot2 memory map parsing
 void parse_multiboot2_memory_map(uint64_t mb2_info_ptr);
 
-// Scheduler functions
+// Wait queues (kernel-rs/src/waitqueue.rs). A task sleeps on a channel,
+// usually the address of what it waits for, until that channel is woken.
 void scheduler_sleep(void* wait_channel);
-void scheduler_wakeup(void* wait_channel);
+// Returns 0 when woken, -1 if `ticks` timer ticks passed first
+int scheduler_sleep_timeout(void* wait_channel, uint64_t ticks);
+void scheduler_wakeup(void* wait_channel);     // Wake every sleeper
+void scheduler_wakeup_one(void* wait_channel); // Wake the longest sleeper
 
 // Logging function
 void kernel_log(const char* format, ...);
@@ -0,0 +1,36 @@
+#ifndef MEMOPS_H
+#define MEMOPS_H
+
+#include "kernel.h"
+
+// CPU features used to pick memcpy/memset kernels
+#define MEMOPS_CPU_SSE2  0x1
+#define MEMOPS_CPU_AVX2  0x2
+#define MEMOPS_CPU_ERMS  0x4  // Enhanced REP MOVSB/STOSB
+#define MEMOPS_CPU_FSRM  0x8  // Fast short REP MOVSB
+
+// Detect CPU features, enable AVX state if present and select the
+// memcpy/memset/memmove kernels. Call once, early in boot.
+void memops_init(void);
+uint32_t memops_cpu_features(void);
+
+size_t strnlen(const char* str, size_t max_len);
+int strncmp(const char* a, const char* b, size_t n);
+void* memchr(const void* s, int c, size_t n);
+char* strchr(const char* s, int c);
+char* strncpy(char* dest, const char* src, size_t n);
+
+// Individual kernels, exposed for the benchmark
+void* memcpy_erms(void* dest, const void* src, size_t len);
+void* memcpy_sse2(void* dest, const void* src, size_t len);
+void* memcpy_avx2(void* dest, const void* src, size_t len);
+void* memset_erms(void* dest, int val, size_t len);
+void* memset_sse2(void* dest, int val, size_t len);
+void* memset_avx2(void* dest, int val, size_t len);
+// Zero one 4 KiB page with non-temporal stores, bypassing the cache
+void zero_page_nt(void* page);
+
+// Copy-throughput microbenchmark (rdtsc), results go to VGA and serial
+void memops_benchmark(void);
+
+#endif
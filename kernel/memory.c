@@ -4,6 +4,10 @@
 #include <stddef.h>
 #include "memory.h"
 #include "serial.h"
+#include "heap.h"
+#include "memops.h"
+#include "pmm.h"
+#include "paging.h"
 
 uint8_t* heap_start = (uint8_t*)0x100000; // 1MB
 uint8_t* heap_current = (uint8_t*)0x100000;
@@ -30,6 +34,16 @@ int is_valid_pointer(const void* ptr) {
         return 1;
     }
 
+    // Kernel heap, mapped on demand in its own virtual range
+    if (addr >= KERNEL_HEAP_BASE && addr < KERNEL_HEAP_BASE + KERNEL_HEAP_SIZE) {
+        return 1;
+    }
+
+    // Direct map of physical memory
+    if (addr >= PHYS_MAP_BASE && addr < PHYS_MAP_BASE + pmm_phys_end()) {
+        return 1;
+    }
+
     // Allow low memory for hardware access (e.g., VGA buffer at 0xB8000)
     if (addr >= 0x1000 && addr < 0x100000) {
         return 1;
@@ -38,14 +52,29 @@ int is_valid_pointer(const void* ptr) {
     return 0; // Pointer is likely invalid
 }
 
-int is_valid_string(const char* str, size_t max_len) {
-    if (!is_valid_pointer(str)) return 0;
-    
-    for (size_t i = 0; i < max_len; i++) {
-        if (!is_valid_pointer(str + i)) return 0;
-        if (str[i] == '\0') return 1;
+// Length of str, up to max_len, checking validity once per page rather
+// than per character. Sets *ok to 0 if an invalid page was reached first.
+static size_t checked_strnlen(const char* str, size_t max_len, int* ok) {
+    *ok = 0;
+    if (!str || !is_valid_pointer(str)) return 0;
+    size_t len = 0;
+    while (len < max_len) {
+        const char* p = str + len;
+        size_t page_left = PAGE_SIZE - ((uintptr_t)p & (PAGE_SIZE - 1));
+        if (page_left > max_len - len) page_left = max_len - len;
+        if (len && !is_valid_pointer(p)) return len;
+        size_t n = strnlen(p, page_left);
+        len += n;
+        if (n < page_left) break;
     }
-    return 0; // No null terminator found within max_len
+    *ok = 1;
+    return len;
+}
+
+int is_valid_string(const char* str, size_t max_len) {
+    int ok;
+    size_t len = checked_strnlen(str, max_len, &ok);
+    return ok && len < max_len; // Null terminator found within max_len
 }
 
 int is_valid_buffer(const void* buf, size_t len) {
@@ -58,78 +87,37 @@ int is_valid_buffer(const void* buf, size_t len) {
     return is_valid_pointer(start) && is_valid_pointer(end);
 }
 
+// Validate [buf, buf+len) once, without the 1MB cap of is_valid_buffer();
+// used at the user/kernel boundary before unchecked copies.
+int is_valid_range(const void* buf, size_t len) {
+    if (!buf || len == 0) return 0;
+    uintptr_t start = (uintptr_t)buf;
+    if (start + len < start) return 0; // Wraps around
+    return is_valid_pointer(buf) && is_valid_pointer((const uint8_t*)buf + len - 1);
+}
+
 void memory_init() {
     heap_current = heap_start;
     serial_write("[MEMORY] Memory subsystem initialized safely\n");
 }
 
-// Safe memory operations with bounds checking
+// Checked memory operations for untrusted pointers: the whole range is
+// validated once, then the fast kernels from memops.c do the work.
 void* safe_memset(void* dest, int val, size_t len) {
     if (!dest || len == 0) return NULL;
     if (!is_valid_buffer(dest, len)) return NULL;
-    if (len > 0x100000) return NULL; // Prevent integer overflow
-    
-    volatile uint8_t* d = (volatile uint8_t*)dest;
-    uint8_t value = (uint8_t)(val & 0xFF);
-    
-    for (size_t i = 0; i < len; i++) {
-        if (!is_valid_pointer(d + i)) break;
-        d[i] = value;
-    }
-    return dest;
+    return memset(dest, val, len);
 }
 
 void* safe_memcpy(void* dest, const void* src, size_t len) {
     if (!dest || !src || len == 0) return NULL;
     if (!is_valid_buffer(dest, len) || !is_valid_buffer(src, len)) return NULL;
-    if (len > 0x100000) return NULL; // Prevent integer overflow
-    
-    // Check for overlap
-    uintptr_t dest_start = (uintptr_t)dest;
-    uintptr_t dest_end = dest_start + len;
-    uintptr_t src_start = (uintptr_t)src;
-    uintptr_t src_end = src_start + len;
-    
-    if ((dest_start < src_end) && (src_start < dest_end)) {
-        // Overlapping regions - use memmove logic
-        if (dest_start < src_start) {
-            // Copy forward
-            uint8_t* d = (uint8_t*)dest;
-            const uint8_t* s = (const uint8_t*)src;
-            for (size_t i = 0; i < len; i++) {
-                if (!is_valid_pointer(d + i) || !is_valid_pointer(s + i)) break;
-                d[i] = s[i];
-            }
-        } else {
-            // Copy backward
-            uint8_t* d = (uint8_t*)dest;
-            const uint8_t* s = (const uint8_t*)src;
-            for (size_t i = len; i > 0; i--) {
-                if (!is_valid_pointer(d + i - 1) || !is_valid_pointer(s + i - 1)) break;
-                d[i - 1] = s[i - 1];
-            }
-        }
-    } else {
-        // Non-overlapping regions
-        uint8_t* d = (uint8_t*)dest;
-        const uint8_t* s = (const uint8_t*)src;
-        for (size_t i = 0; i < len; i++) {
-            if (!is_valid_pointer(d + i) || !is_valid_pointer(s + i)) break;
-            d[i] = s[i];
-        }
-    }
-    return dest;
+    return memmove(dest, src, len);
 }
 
 size_t safe_strlen(const char* str, size_t max_len) {
-    if (!str || max_len == 0) return 0;
-    if (!is_valid_pointer(str)) return 0;
-    
-    size_t len = 0;
-    while (len < max_len && is_valid_pointer(str + len) && str[len] != '\0') {
-        len++;
-    }
-    return len;
+    int ok;
+    return checked_strnlen(str, max_len, &ok);
 }
 
 // Port I/O with validation
@@ -179,45 +167,29 @@ void outl(uint16_t port, uint32_t data) {
 
 int safe_strcmp(const char* a, const char* b, size_t max_len) {
     if (!a || !b) return (a == b) ? 0 : (a ? 1 : -1);
-    if (!is_valid_pointer(a) || !is_valid_pointer(b)) return 0;
-    
-    for (size_t i = 0; i < max_len; i++) {
-        if (!is_valid_pointer(a + i) || !is_valid_pointer(b + i)) break;
-        
-        if (a[i] != b[i]) {
-            return (unsigned char)a[i] - (unsigned char)b[i];
-        }
-        if (a[i] == '\0') break;
-    }
-    return 0;
+    int ok_a, ok_b;
+    size_t len_a = checked_strnlen(a, max_len, &ok_a);
+    size_t len_b = checked_strnlen(b, max_len, &ok_b);
+    if (!ok_a || !ok_b) return 0;
+    // Both strings are readable up to their terminator (or max_len)
+    size_t n = (len_a < len_b ? len_a : len_b) + 1;
+    return strncmp(a, b, n < max_len ? n : max_len);
 }
 
 char* safe_strncpy(char* dest, const char* src, size_t dest_size) {
     if (!dest || !src || dest_size == 0) return NULL;
-    if (!is_valid_buffer(dest, dest_size) || !is_valid_pointer(src)) return NULL;
-    
-    size_t i;
-    for (i = 0; i < dest_size - 1; i++) {
-        if (!is_valid_pointer(src + i)) break;
-        dest[i] = src[i];
-        if (src[i] == '\0') break;
-    }
-    dest[i] = '\0'; // Always null terminate
+    if (!is_valid_buffer(dest, dest_size)) return NULL;
+    int ok;
+    size_t len = checked_strnlen(src, dest_size - 1, &ok);
+    memcpy(dest, src, len);
+    dest[len] = '\0'; // Always null terminate
     return dest;
 }
 
 int safe_memcmp(const void* s1, const void* s2, size_t n) {
     if (!s1 || !s2 || n == 0) return 0;
-    if (!is_valid_buffer(s1, n) || !is_valid_buffer(s2, n)) return 0;
-    
-    const unsigned char* a = (const unsigned char*)s1;
-    const unsigned char* b = (const unsigned char*)s2;
-    
-    for (size_t i = 0; i < n; i++) {
-        if (!is_valid_pointer(a + i) || !is_valid_pointer(b + i)) break;
-        if (a[i] != b[i]) return a[i] - b[i];
-    }
-    return 0;
+    if (!is_valid_range(s1, n) || !is_valid_range(s2, n)) return 0;
+    return memcmp(s1, s2, n);
 }
 
 // Safe integer to string conversion
@@ -383,30 +355,7 @@ int safe_sscanf(const char* str, const char* format, ...) {
     return result;
 }
 
-// Legacy wrapper functions for compatibility
-void* memcpy(void* dest, const void* src, size_t len) {
-    return safe_memcpy(dest, src, len);
-}
-
-void* memset(void* dest, int val, size_t len) {
-    return safe_memset(dest, val, len);
-}
-
-size_t strlen(const char* str) {
-    return safe_strlen(str, 4096); // Reasonable default limit
-}
-
-int strcmp(const char* a, const char* b) {
-    return safe_strcmp(a, b, 4096); // Reasonable default limit
-}
-
-char* strncpy(char* dest, const char* src, size_t n) {
-    return safe_strncpy(dest, src, n);
-}
-
-int memcmp(const void* s1, const void* s2, size_t n) {
-    return safe_memcmp(s1, s2, n);
-}
+// memcpy/memset/memmove and the unchecked string primitives live in memops.c
 
 int snprintf(char* str, size_t size, const char* format, ...) {
     if (!str || !format || size == 0) return -1;
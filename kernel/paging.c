@@ -3,6 +3,7 @@
 #include "kernel.h"
 #include "serial.h"
 #include "memory.h"
+#include "smp.h"
 
 #define PML4_ENTRIES 512
 #define PDPTE_ENTRIES 512
@@ -14,8 +15,12 @@ uint64_t* pml4_table = 0;
 // Prototype for debug print function
 void print_hex64(unsigned long val);
 
+// Swap slot use counts (swap.rs)
+extern void rust_swap_entry_dup(uint64_t entry);
+extern void rust_swap_entry_free(uint64_t entry);
+
 static inline uint64_t* get_table(uint64_t phys_addr) {
-    return (uint64_t*)(phys_addr);
+    return (uint64_t*)phys_to_virt(phys_addr);
 }
 
 static uint64_t get_pml4_index(uint64_t addr) { return (addr >> 39) & 0x1FF; }
@@ -23,7 +28,194 @@ static uint64_t get_pdpt_index(uint64_t addr) { return (addr >> 30) & 0x1FF; }
 static uint64_t get_pd_index(uint64_t addr)   { return (addr >> 21) & 0x1FF; }
 static uint64_t get_pt_index(uint64_t addr)   { return (addr >> 12) & 0x1FF; }
 
+// CPU paging features, detected once in paging_init
+static int gbpages_supported = 0; // 1 GiB leaf entries (CPUID 0x80000001 EDX.26)
+static int pge_enabled = 0;       // Global pages (CR4.PGE)
+static int pcid_enabled = 0;      // Process-context identifiers (CR4.PCIDE)
+static int invpcid_supported = 0;
+
+#define CR4_PGE    (1ULL << 7)
+#define CR4_PCIDE  (1ULL << 17)
+#define CR3_NOFLUSH (1ULL << 63)  // Keep the TLB entries of the new PCID
+
+// PCIDs tag each process address space in the TLB, so switching between
+// them does not flush. PCID 0 is the kernel's own PML4; if the 12-bit space
+// runs out, the remaining address spaces share PCID_SHARED, which is
+// flushed on every load.
+#define PCID_COUNT  4096
+#define PCID_SHARED (PCID_COUNT - 1)
+static uint8_t pcid_used[PCID_COUNT / 8];
+
+// Unmapping more pages than this in one go flushes the whole TLB instead of
+// issuing one invlpg per page
+#define INVLPG_MAX_PAGES 32
+
+static uint64_t kernel_cr3 = 0;
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static void detect_features(void) {
+    uint32_t a, b, c, d, max_leaf;
+    cpuid(0, 0, &max_leaf, &b, &c, &d);
+    cpuid(1, 0, &a, &b, &c, &d);
+    int pge = (d & (1u << 13)) != 0;
+    int pcid = (c & (1u << 17)) != 0;
+    if (max_leaf >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        invpcid_supported = (b & (1u << 10)) != 0;
+    }
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    if (a >= 0x80000001) {
+        cpuid(0x80000001, 0, &a, &b, &c, &d);
+        gbpages_supported = (d & (1u << 26)) != 0;
+    }
+    // Kernel mappings are global, which is what keeps invlpg on them
+    // effective across PCIDs; without PGE there is no PCID either.
+    pge_enabled = pge;
+    pcid_enabled = pge && pcid;
+}
+
+// Flush every TLB entry, global ones and all PCIDs included
+static void tlb_flush_all(void) {
+    if (pge_enabled) {
+        uint64_t cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        uint64_t cr3;
+        __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+        __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+}
+
+static void flush_pcid(uint16_t pcid) {
+    if (invpcid_supported) {
+        struct { uint64_t pcid; uint64_t addr; } desc = { pcid, 0 };
+        __asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"(1ULL) : "memory"); // Single context
+    } else {
+        tlb_flush_all();
+    }
+}
+
+static void reload_cr3(void) {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+void paging_flush_local(uint64_t cr3, uint64_t start, uint64_t pages) {
+    uint64_t cur;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cur));
+    int active = cr3 && (cur & PTE_ADDR_MASK) == (cr3 & PTE_ADDR_MASK);
+    if (!cr3 || active) {
+        // One invlpg per page is cheaper than refilling the TLB only for
+        // short ranges; invlpg also drops global entries, a CR3 reload
+        // would not.
+        if (pages <= INVLPG_MAX_PAGES) {
+            for (uint64_t i = 0; i < pages; i++) {
+                __asm__ volatile("invlpg (%0)" : : "r"(start + i * PAGE_SIZE) : "memory");
+            }
+        } else if (!cr3) {
+            tlb_flush_all();
+        } else {
+            reload_cr3();
+        }
+    } else if (pcid_enabled) {
+        // Only the owner's PCID can hold the translations; drop them all
+        flush_pcid((uint16_t)(cr3 & 0xFFF));
+    }
+}
+
+// Invalidate on this CPU, then on every other one that is up
+static void tlb_invalidate(uint64_t cr3, uint64_t start, uint64_t pages) {
+    paging_flush_local(cr3, start, pages);
+    smp_tlb_shootdown(cr3, start, pages);
+}
+
+static uint16_t pcid_alloc(void) {
+    if (!pcid_enabled) return 0;
+    for (int i = 1; i < PCID_SHARED; i++) {
+        if (!(pcid_used[i / 8] & (1 << (i % 8)))) {
+            pcid_used[i / 8] |= (uint8_t)(1 << (i % 8));
+            return (uint16_t)i;
+        }
+    }
+    return PCID_SHARED;
+}
+
+static void pcid_free(uint64_t cr3) {
+    uint16_t pcid = (uint16_t)(cr3 & 0xFFF);
+    if (!pcid_enabled || pcid == 0 || pcid == PCID_SHARED) return;
+    // Drop whatever the old address space left behind, on every CPU it may
+    // have run on, before reuse
+    tlb_invalidate(cr3, 0, TLB_FLUSH_ALL);
+    pcid_used[pcid / 8] &= (uint8_t)~(1 << (pcid % 8));
+}
+
+static uint64_t* alloc_table(void) {
+    return (uint64_t*)alloc_zeroed_page();
+}
+
+// Replace a huge leaf covering `entry_size` bytes with a table of 512 leaves
+// of the next size down, so that part of the range can be remapped.
+static uint64_t* split_huge(uint64_t* entry, uint64_t entry_size) {
+    uint64_t* table = alloc_table();
+    if (!table) return 0;
+    uint64_t child_size = entry_size / 512;
+    uint64_t base = *entry & PTE_ADDR_MASK & ~(entry_size - 1);
+    uint64_t flags = *entry & 0xFFF;
+    if (child_size == PAGE_SIZE) flags &= ~PAGE_HUGE;
+    for (int i = 0; i < 512; i++) {
+        table[i] = (base + i * child_size) | flags;
+    }
+    *entry = virt_to_phys(table) | PAGE_PRESENT | PAGE_RW | (flags & PAGE_USER);
+    return table;
+}
+
+// Return the table `entry` points to, creating it (or splitting a huge leaf
+// of `entry_size` bytes) when `create` is set.
+static uint64_t* next_table(uint64_t* entry, uint64_t entry_size, uint64_t flags, int create) {
+    if (!(*entry & PAGE_PRESENT)) {
+        if (!create) return 0;
+        uint64_t* table = alloc_table();
+        if (!table) return 0;
+        *entry = virt_to_phys(table) | PAGE_PRESENT | PAGE_RW;
+    } else if (*entry & PAGE_HUGE) {
+        if (!create) return 0;
+        if (!split_huge(entry, entry_size)) return 0;
+    }
+    // User mappings need the U/S bit on every level above them
+    *entry |= flags & PAGE_USER;
+    return get_table(*entry & PTE_ADDR_MASK);
+}
+
+// Free a table and all tables below it. `level` is 3 for a PDPT, 2 for a PD
+// and 1 for a PT; leaves are not followed.
+static void free_table_tree(uint64_t* table, int level) {
+    if (level > 1) {
+        for (int i = 0; i < 512; i++) {
+            if ((table[i] & PAGE_PRESENT) && !(table[i] & PAGE_HUGE)) {
+                free_table_tree(get_table(table[i] & PTE_ADDR_MASK), level - 1);
+            }
+        }
+    }
+    free_page(table);
+}
+
 void paging_init() {
+    detect_features();
     pml4_table = (uint64_t*)alloc_page();
     memset(pml4_table, 0, PAGE_SIZE);
 
@@ -37,75 +229,183 @@ void paging_init() {
             test_user_pml4[i] = pml4_table[i];
         }
     }
-    for (uint64_t addr = 0; addr < 0x1000000; addr += PAGE_SIZE) { // 16MB
-        map_page(addr, addr, PAGE_PRESENT | PAGE_RW);
+    // Direct map of all managed RAM (at least 16MB) at PHYS_MAP_BASE, built
+    // from 2 MiB/1 GiB pages. Page tables and PMM frames are reached
+    // through it wherever they live.
+    uint64_t ram_end = pmm_phys_end();
+    if (ram_end < 0x1000000) ram_end = 0x1000000;
+    ram_end = (ram_end + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    uint64_t global = pge_enabled ? PAGE_GLOBAL : 0;
+    map_range(PHYS_MAP_BASE, 0, ram_end, PAGE_PRESENT | PAGE_RW | global);
+
+    // The kernel runs at its load address, so keep an identity map of low
+    // memory (VGA, boot structures) and the kernel image. It is not global:
+    // process PML4s use the same lower-half addresses for user mappings.
+    extern uint8_t _kernel_end;
+    uint64_t identity_end = (uint64_t)&_kernel_end;
+    if (identity_end < 0x1000000) identity_end = 0x1000000;
+    identity_end = (identity_end + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    map_range(0, 0, identity_end, PAGE_PRESENT | PAGE_RW);
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "[PAGING] Direct map 0-%d MiB, identity 0-%d MiB, 1G=%d PGE=%d PCID=%d\n",
+             (int)(ram_end >> 20), (int)(identity_end >> 20), gbpages_supported, pge_enabled, pcid_enabled);
+    serial_write(msg);
+
+    // Load new PML4 (PCID 0), then turn on global pages and PCIDs
+    kernel_cr3 = virt_to_phys(pml4_table);
+    __asm__ volatile("mov %0, %%cr3" : : "r"(kernel_cr3));
+    uint64_t cr4 = read_cr4();
+    if (pge_enabled) cr4 |= CR4_PGE;
+    if (pcid_enabled) cr4 |= CR4_PCIDE;
+    write_cr4(cr4);
+}
+
+void paging_switch_cr3(uint64_t cr3) {
+    if (!cr3) cr3 = kernel_cr3;
+    uint64_t cur;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cur));
+    if (cur == cr3) return;
+    if (pcid_enabled && (cr3 & 0xFFF) != PCID_SHARED) cr3 |= CR3_NOFLUSH;
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+// map_page_size() in the address space rooted at pml4, which need not be
+// the kernel's
+static int map_page_in(uint64_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, uint64_t page_size) {
+    if (!pml4) return -1;
+    if (page_size == PAGE_SIZE_1G && !gbpages_supported) return -1;
+    if (page_size != PAGE_SIZE && page_size != PAGE_SIZE_2M && page_size != PAGE_SIZE_1G) return -1;
+    if ((virt_addr | phys_addr) & (page_size - 1)) return -1;
+
+    uint64_t* pdpt = next_table(&pml4[get_pml4_index(virt_addr)], 0, flags, 1);
+    if (!pdpt) return -1;
+    uint64_t* pdpte = &pdpt[get_pdpt_index(virt_addr)];
+    if (page_size == PAGE_SIZE_1G) {
+        if ((*pdpte & PAGE_PRESENT) && !(*pdpte & PAGE_HUGE)) {
+            free_table_tree(get_table(*pdpte & PTE_ADDR_MASK), 2);
+        }
+        *pdpte = phys_addr | (flags & 0xFFF) | PAGE_PRESENT | PAGE_HUGE;
+        return 0;
+    }
+
+    uint64_t* pd = next_table(pdpte, PAGE_SIZE_1G, flags, 1);
+    if (!pd) return -1;
+    uint64_t* pde = &pd[get_pd_index(virt_addr)];
+    if (page_size == PAGE_SIZE_2M) {
+        if ((*pde & PAGE_PRESENT) && !(*pde & PAGE_HUGE)) {
+            free_table_tree(get_table(*pde & PTE_ADDR_MASK), 1);
+        }
+        *pde = phys_addr | (flags & 0xFFF) | PAGE_PRESENT | PAGE_HUGE;
+        return 0;
     }
 
-    // Load new PML4
-    __asm__ volatile("mov %0, %%cr3" : : "r"(pml4_table));
+    uint64_t* pt = next_table(pde, PAGE_SIZE_2M, flags, 1);
+    if (!pt) return -1;
+    pt[get_pt_index(virt_addr)] = (phys_addr & ~0xFFFULL) | (flags & 0xFFF & ~PAGE_HUGE) | PAGE_PRESENT;
+    return 0;
+}
+
+int map_page_size(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, uint64_t page_size) {
+    return map_page_in(pml4_table, virt_addr, phys_addr, flags, page_size);
 }
 
 void map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags) {
-    uint64_t* pml4 = pml4_table;
-    if (!pml4) return;
-    
-    // PML4
-    if (!(pml4[get_pml4_index(virt_addr)] & PAGE_PRESENT)) {
-        uint64_t pdpt = (uint64_t)alloc_page();
-        memset((void*)pdpt, 0, PAGE_SIZE);
-        pml4[get_pml4_index(virt_addr)] = pdpt | PAGE_PRESENT | PAGE_RW;
+    map_page_size(virt_addr, phys_addr, flags, PAGE_SIZE);
+}
+
+int map_range(uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags) {
+    uint64_t end = (virt_addr + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    virt_addr &= ~(PAGE_SIZE - 1);
+    phys_addr &= ~(PAGE_SIZE - 1);
+    while (virt_addr < end) {
+        uint64_t left = end - virt_addr;
+        uint64_t align = virt_addr | phys_addr;
+        uint64_t step = PAGE_SIZE;
+        if (gbpages_supported && !(align & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G) {
+            step = PAGE_SIZE_1G;
+        } else if (!(align & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M) {
+            step = PAGE_SIZE_2M;
+        }
+        if (map_page_size(virt_addr, phys_addr, flags, step) != 0) return -1;
+        virt_addr += step;
+        phys_addr += step;
     }
-    uint64_t* pdpt = get_table(pml4[get_pml4_index(virt_addr)] & ~0xFFFULL);
-    
-    // PDPT
-    if (!(pdpt[get_pdpt_index(virt_addr)] & PAGE_PRESENT)) {
-        uint64_t pd = (uint64_t)alloc_page();
-        memset((void*)pd, 0, PAGE_SIZE);
-        pdpt[get_pdpt_index(virt_addr)] = pd | PAGE_PRESENT | PAGE_RW;
+    return 0;
+}
+
+// Clear the mapping at virt_addr without touching the TLB. A huge leaf is
+// removed whole when [virt_addr, virt_addr + max_len) covers it and split
+// otherwise. Returns the number of bytes the cleared (or absent) entry
+// spanned, so callers can step over unmapped regions quickly.
+static uint64_t clear_mapping(uint64_t virt_addr, uint64_t max_len) {
+    uint64_t* pml4e = &pml4_table[get_pml4_index(virt_addr)];
+    if (!(*pml4e & PAGE_PRESENT)) return (1ULL << 39) - (virt_addr & ((1ULL << 39) - 1));
+    uint64_t* pdpt = get_table(*pml4e & PTE_ADDR_MASK);
+    uint64_t* pdpte = &pdpt[get_pdpt_index(virt_addr)];
+    uint64_t off = virt_addr & (PAGE_SIZE_1G - 1);
+    if (!(*pdpte & PAGE_PRESENT)) return PAGE_SIZE_1G - off;
+    if ((*pdpte & PAGE_HUGE) && off == 0 && max_len >= PAGE_SIZE_1G) {
+        *pdpte = 0;
+        return PAGE_SIZE_1G;
     }
-    uint64_t* pd = get_table(pdpt[get_pdpt_index(virt_addr)] & ~0xFFFULL);
-    
-    // PD
-    if (!(pd[get_pd_index(virt_addr)] & PAGE_PRESENT)) {
-        uint64_t pt = (uint64_t)alloc_page();
-        memset((void*)pt, 0, PAGE_SIZE);
-        pd[get_pd_index(virt_addr)] = pt | PAGE_PRESENT | PAGE_RW;
+    uint64_t* pd = next_table(pdpte, PAGE_SIZE_1G, 0, (*pdpte & PAGE_HUGE) != 0);
+    if (!pd) return PAGE_SIZE;
+    uint64_t* pde = &pd[get_pd_index(virt_addr)];
+    off = virt_addr & (PAGE_SIZE_2M - 1);
+    if (!(*pde & PAGE_PRESENT)) return PAGE_SIZE_2M - off;
+    if ((*pde & PAGE_HUGE) && off == 0 && max_len >= PAGE_SIZE_2M) {
+        *pde = 0;
+        return PAGE_SIZE_2M;
     }
-    uint64_t* pt = get_table(pd[get_pd_index(virt_addr)] & ~0xFFFULL);
-    
-    // PT
-    pt[get_pt_index(virt_addr)] = (phys_addr & ~0xFFFULL) | (flags & 0xFFF) | PAGE_PRESENT;
+    // Unmapping 4K out of a huge page splits it first
+    uint64_t* pt = next_table(pde, PAGE_SIZE_2M, 0, (*pde & PAGE_HUGE) != 0);
+    if (!pt) return PAGE_SIZE;
+    pt[get_pt_index(virt_addr)] = 0;
+    return PAGE_SIZE;
 }
 
 void unmap_page(uint64_t virt_addr) {
-    uint64_t* pml4 = pml4_table;
-    if (!pml4) return;
-    uint64_t* pdpt = get_table(pml4[get_pml4_index(virt_addr)] & ~0xFFFULL);
-    if (!pdpt) return;
-    uint64_t* pd = get_table(pdpt[get_pdpt_index(virt_addr)] & ~0xFFFULL);
-    if (!pd) return;
-    uint64_t* pt = get_table(pd[get_pd_index(virt_addr)] & ~0xFFFULL);
-    if (!pt) return;
-    pt[get_pt_index(virt_addr)] = 0;
-    // (No TLB flush here; add if needed)
+    if (!pml4_table) return;
+    clear_mapping(virt_addr & ~(PAGE_SIZE - 1), PAGE_SIZE);
+    tlb_invalidate(0, virt_addr & ~(PAGE_SIZE - 1), 1);
 }
 
-uint64_t get_phys_addr(uint64_t virt_addr) {
-    uint64_t* pml4 = pml4_table;
+void unmap_range(uint64_t virt_addr, uint64_t size) {
+    if (!pml4_table || size == 0) return;
+    uint64_t end = (virt_addr + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint64_t start = virt_addr & ~(PAGE_SIZE - 1);
+    for (uint64_t addr = start; addr < end && addr >= start; ) {
+        addr += clear_mapping(addr, end - addr);
+    }
+    tlb_invalidate(0, start, (end - start) / PAGE_SIZE);
+}
+
+static uint64_t get_phys_addr_in(uint64_t* pml4, uint64_t virt_addr) {
     if (!pml4) return 0;
-    uint64_t* pdpt = get_table(pml4[get_pml4_index(virt_addr)] & ~0xFFFULL);
-    if (!pdpt) return 0;
-    uint64_t* pd = get_table(pdpt[get_pdpt_index(virt_addr)] & ~0xFFFULL);
-    if (!pd) return 0;
-    uint64_t* pt = get_table(pd[get_pd_index(virt_addr)] & ~0xFFFULL);
-    if (!pt) return 0;
-    uint64_t pte = pt[get_pt_index(virt_addr)];
+    uint64_t pml4e = pml4[get_pml4_index(virt_addr)];
+    if (!(pml4e & PAGE_PRESENT)) return 0;
+    uint64_t pdpte = get_table(pml4e & PTE_ADDR_MASK)[get_pdpt_index(virt_addr)];
+    if (!(pdpte & PAGE_PRESENT)) return 0;
+    if (pdpte & PAGE_HUGE) {
+        return (pdpte & PTE_ADDR_MASK & ~(PAGE_SIZE_1G - 1)) | (virt_addr & (PAGE_SIZE_1G - 1));
+    }
+    uint64_t pde = get_table(pdpte & PTE_ADDR_MASK)[get_pd_index(virt_addr)];
+    if (!(pde & PAGE_PRESENT)) return 0;
+    if (pde & PAGE_HUGE) {
+        return (pde & PTE_ADDR_MASK & ~(PAGE_SIZE_2M - 1)) | (virt_addr & (PAGE_SIZE_2M - 1));
+    }
+    uint64_t pte = get_table(pde & PTE_ADDR_MASK)[get_pt_index(virt_addr)];
     if (!(pte & PAGE_PRESENT)) return 0;
-    uint64_t phys_page_base = pte & ~0xFFFULL;
+    uint64_t phys_page_base = pte & PTE_ADDR_MASK;
     uint64_t offset = virt_addr & 0xFFFULL;
     return phys_page_base | offset;
 } 
 
+uint64_t get_phys_addr(uint64_t virt_addr) {
+    return get_phys_addr_in(pml4_table, virt_addr);
+}
+
 void map_user_page(uint64_t virt_addr, uint64_t phys_addr) {
     map_page(virt_addr, phys_addr, PAGE_PRESENT | PAGE_RW | PAGE_USER);
 } 
@@ -113,13 +413,12 @@ void map_user_page(uint64_t virt_addr, uint64_t phys_addr) {
 // Create a new PML4 for a user process, mapping kernel memory
 uint64_t paging_new_pml4() {
     serial_write("[PAGING] paging_new_pml4: called\n");
-    uint64_t* new_pml4 = (uint64_t*)alloc_page();
+    uint64_t* new_pml4 = (uint64_t*)alloc_zeroed_page();
     if (!new_pml4) {
-        serial_write("[PAGING] paging_new_pml4: alloc_page returned NULL!\n");
+        serial_write("[PAGING] paging_new_pml4: alloc_zeroed_page returned NULL!\n");
         return 0;
     }
-    serial_write("[PAGING] paging_new_pml4: alloc_page OK\n");
-    memset(new_pml4, 0, PAGE_SIZE);
+    serial_write("[PAGING] paging_new_pml4: alloc_zeroed_page OK\n");
     extern uint64_t* pml4_table;
     if (!pml4_table) {
         serial_write("[PAGING] paging_new_pml4: pml4_table is NULL!\n");
@@ -134,34 +433,42 @@ uint64_t paging_new_pml4() {
     }
     serial_write("[PAGING] paging_new_pml4: done copying kernel entries\n");
     // Optionally: map user stack/code here
-    return (uint64_t)new_pml4;
+    // The returned CR3 value carries the address space's PCID in bits 0-11
+    return virt_to_phys(new_pml4) | pcid_alloc();
 }
 
 void paging_free_pml4(uint64_t pml4_phys) {
     if (!pml4_phys) return;
     
-    uint64_t* pml4 = (uint64_t*)pml4_phys;
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(pml4_phys & PTE_ADDR_MASK);
+    pcid_free(pml4_phys);
     
     // Free all page tables recursively
     for (int pml4_idx = 0; pml4_idx < 256; pml4_idx++) { // Only user space (lower half)
         if (!(pml4[pml4_idx] & PAGE_PRESENT)) continue;
         
-        uint64_t* pdpt = get_table(pml4[pml4_idx] & ~0xFFFULL);
-        if (!pdpt) continue;
+        uint64_t* pdpt = get_table(pml4[pml4_idx] & PTE_ADDR_MASK);
         
         for (int pdpt_idx = 0; pdpt_idx < PDE_ENTRIES; pdpt_idx++) {
-            if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) continue;
+            if (!(pdpt[pdpt_idx] & PAGE_PRESENT) || (pdpt[pdpt_idx] & PAGE_HUGE)) continue;
             
-            uint64_t* pd = get_table(pdpt[pdpt_idx] & ~0xFFFULL);
-            if (!pd) continue;
+            uint64_t* pd = get_table(pdpt[pdpt_idx] & PTE_ADDR_MASK);
             
             for (int pd_idx = 0; pd_idx < PDE_ENTRIES; pd_idx++) {
                 if (!(pd[pd_idx] & PAGE_PRESENT)) continue;
+                if (pd[pd_idx] & PAGE_HUGE) {
+                    // Transparent huge page: one reference on the block
+                    page_put(pd[pd_idx] & PTE_ADDR_MASK);
+                    continue;
+                }
                 
-                uint64_t* pt = get_table(pd[pd_idx] & ~0xFFFULL);
-                if (pt) {
-                    free_page(pt); // Free page table
+                uint64_t* pt = get_table(pd[pd_idx] & PTE_ADDR_MASK);
+                // Each user mapping holds a reference on its frame
+                for (int pt_idx = 0; pt_idx < PTE_ENTRIES; pt_idx++) {
+                    if (pt[pt_idx] & PAGE_PRESENT) page_put(pt[pt_idx] & PTE_ADDR_MASK);
+                    else if (pt[pt_idx] & PAGE_SWAP) rust_swap_entry_free(pt[pt_idx]);
                 }
+                free_page(pt); // Free page table
             }
             
             free_page(pd); // Free page directory
@@ -170,14 +477,90 @@ void paging_free_pml4(uint64_t pml4_phys) {
         free_page(pdpt); // Free page directory pointer table
     }
     
-    free_page((void*)pml4_phys); // Free PML4 itself
+    free_page(pml4); // Free PML4 itself
+}
+
+// Copy-on-write clone of the user half of an address space. Writable pages
+// become read-only + PAGE_COW in both copies and gain a reference; the
+// first write fault in either one copies the page (see vm.rs). PAGE_SHARED
+// pages (shared file mappings) stay writable in both. Transparent huge
+// pages are shared the same way, as whole 2 MiB blocks, and swapped-out
+// pages by copying their swap entry.
+uint64_t paging_clone_cow(uint64_t src_cr3) {
+    uint64_t dst_cr3 = paging_new_pml4();
+    if (!dst_cr3) return 0;
+    uint64_t* src = (uint64_t*)phys_to_virt(src_cr3 & PTE_ADDR_MASK);
+    uint64_t* dst = (uint64_t*)phys_to_virt(dst_cr3 & PTE_ADDR_MASK);
+    int ok = 1;
+
+    for (uint64_t i = 0; i < 256 && ok; i++) {
+        if (!(src[i] & PAGE_PRESENT)) continue;
+        uint64_t* pdpt = get_table(src[i] & PTE_ADDR_MASK);
+        for (uint64_t j = 0; j < 512 && ok; j++) {
+            if (!(pdpt[j] & PAGE_PRESENT) || (pdpt[j] & PAGE_HUGE)) continue;
+            uint64_t* pd = get_table(pdpt[j] & PTE_ADDR_MASK);
+            for (uint64_t k = 0; k < 512 && ok; k++) {
+                if (!(pd[k] & PAGE_PRESENT)) continue;
+                if (pd[k] & PAGE_HUGE) {
+                    uint64_t pde = pd[k];
+                    if ((pde & PAGE_RW) && !(pde & PAGE_SHARED)) {
+                        pde = (pde & ~(uint64_t)PAGE_RW) | PAGE_COW;
+                        pd[k] = pde;
+                    }
+                    uint64_t virt = (i << 39) | (j << 30) | (k << 21);
+                    if (map_page_in(dst, virt, pde & PTE_ADDR_MASK, pde & 0xFFF, PAGE_SIZE_2M) != 0) {
+                        ok = 0;
+                        break;
+                    }
+                    page_get(pde & PTE_ADDR_MASK);
+                    continue;
+                }
+                uint64_t* pt = get_table(pd[k] & PTE_ADDR_MASK);
+                for (uint64_t l = 0; l < 512; l++) {
+                    uint64_t pte = pt[l];
+                    if (!(pte & PAGE_PRESENT)) {
+                        if (!(pte & PAGE_SWAP)) continue;
+                        // Map a placeholder to get the page table built,
+                        // then store the swap entry over it
+                        uint64_t virt = (i << 39) | (j << 30) | (k << 21) | (l << 12);
+                        if (map_page_in(dst, virt, 0, PAGE_USER, PAGE_SIZE) != 0) {
+                            ok = 0;
+                            break;
+                        }
+                        *rust_get_pte(dst_cr3, virt) = pte;
+                        rust_swap_entry_dup(pte);
+                        continue;
+                    }
+                    if ((pte & PAGE_RW) && !(pte & PAGE_SHARED)) {
+                        pte = (pte & ~(uint64_t)PAGE_RW) | PAGE_COW;
+                        pt[l] = pte;
+                    }
+                    uint64_t virt = (i << 39) | (j << 30) | (k << 21) | (l << 12);
+                    if (map_page_in(dst, virt, pte & PTE_ADDR_MASK, pte & 0xFFF, PAGE_SIZE) != 0) {
+                        ok = 0;
+                        break;
+                    }
+                    page_get(pte & PTE_ADDR_MASK);
+                }
+            }
+        }
+    }
+
+    // The source may still cache writable translations for pages that
+    // just became read-only
+    tlb_invalidate(src_cr3, 0, TLB_FLUSH_ALL);
+
+    if (!ok) {
+        paging_free_pml4(dst_cr3);
+        return 0;
+    }
+    return dst_cr3;
 }
 
 void map_mmio(uint64_t phys_addr, uint64_t size) {
     uint64_t flags = PAGE_PRESENT | PAGE_RW | PAGE_PWT | PAGE_PCD;
-    for (uint64_t addr = phys_addr; addr < phys_addr + size; addr += PAGE_SIZE) {
-        map_page(addr, addr, flags);
-    }
+    uint64_t start = phys_addr & ~(PAGE_SIZE - 1);
+    map_range(start, start, phys_addr + size - start, flags);
 }
 
 // FFI wrappers for Rust
@@ -188,9 +571,71 @@ void rust_paging_free_pml4(uint64_t pml4_phys) {
     paging_free_pml4(pml4_phys);
 }
 void rust_map_page(uint64_t pml4_phys, uint64_t virt, uint64_t phys, uint64_t flags) {
-    // Temporarily switch pml4_table to the target, map, then restore
-    uint64_t* old_pml4 = pml4_table;
-    pml4_table = (uint64_t*)pml4_phys;
-    map_page(virt, phys, flags);
-    pml4_table = old_pml4;
+    map_page_in((uint64_t*)phys_to_virt(pml4_phys & PTE_ADDR_MASK), virt, phys, flags, PAGE_SIZE);
+}
+uint64_t rust_get_phys_addr(uint64_t pml4_phys, uint64_t virt) {
+    return get_phys_addr_in((uint64_t*)phys_to_virt(pml4_phys & PTE_ADDR_MASK), virt);
+}
+
+uint64_t* rust_get_pde(uint64_t pml4_phys, uint64_t virt) {
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(pml4_phys & PTE_ADDR_MASK);
+    uint64_t e = pml4[get_pml4_index(virt)];
+    if (!(e & PAGE_PRESENT)) return 0;
+    e = get_table(e & PTE_ADDR_MASK)[get_pdpt_index(virt)];
+    if (!(e & PAGE_PRESENT) || (e & PAGE_HUGE)) return 0;
+    return &get_table(e & PTE_ADDR_MASK)[get_pd_index(virt)];
+}
+
+int rust_map_huge_page(uint64_t pml4_phys, uint64_t virt, uint64_t phys, uint64_t flags) {
+    uint64_t* pde = rust_get_pde(pml4_phys, virt);
+    // Never replace a page table that may still map 4 KiB pages
+    if (pde && (*pde & PAGE_PRESENT)) return -1;
+    return map_page_in((uint64_t*)phys_to_virt(pml4_phys & PTE_ADDR_MASK), virt, phys, flags, PAGE_SIZE_2M);
+}
+
+int paging_split_user_huge(uint64_t pml4_phys, uint64_t virt) {
+    uint64_t* pde = rust_get_pde(pml4_phys, virt);
+    if (!pde || !(*pde & PAGE_PRESENT) || !(*pde & PAGE_HUGE)) return 0;
+    uint64_t base = *pde & PTE_ADDR_MASK & ~(PAGE_SIZE_2M - 1);
+    uint64_t huge_virt = virt & ~(PAGE_SIZE_2M - 1);
+    if (pmm_split_block(base) == 0) {
+        // Sole owner: the block becomes 512 ordinary pages in place
+        if (!split_huge(pde, PAGE_SIZE_2M)) return -1;
+    } else {
+        // Still shared after fork: give this address space private copies
+        uint64_t* table = alloc_table();
+        if (!table) return -1;
+        uint64_t flags = *pde & 0xFFF & ~(uint64_t)PAGE_HUGE;
+        if (flags & PAGE_COW) flags = (flags & ~(uint64_t)PAGE_COW) | PAGE_RW;
+        for (int i = 0; i < 512; i++) {
+            void* frame = alloc_page();
+            if (!frame) {
+                for (int j = 0; j < i; j++) page_put(table[j] & PTE_ADDR_MASK);
+                free_page(table);
+                return -1;
+            }
+            memcpy(frame, phys_to_virt(base + (uint64_t)i * PAGE_SIZE), PAGE_SIZE);
+            table[i] = virt_to_phys(frame) | flags;
+        }
+        *pde = virt_to_phys(table) | PAGE_PRESENT | PAGE_RW | (flags & PAGE_USER);
+        page_put(base);
+    }
+    // One invlpg drops the whole 2 MiB translation
+    tlb_invalidate(pml4_phys, huge_virt, 1);
+    return 0;
+}
+
+uint64_t* rust_get_pte(uint64_t pml4_phys, uint64_t virt) {
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(pml4_phys & PTE_ADDR_MASK);
+    uint64_t e = pml4[get_pml4_index(virt)];
+    if (!(e & PAGE_PRESENT)) return 0;
+    e = get_table(e & PTE_ADDR_MASK)[get_pdpt_index(virt)];
+    if (!(e & PAGE_PRESENT) || (e & PAGE_HUGE)) return 0;
+    e = get_table(e & PTE_ADDR_MASK)[get_pd_index(virt)];
+    if (!(e & PAGE_PRESENT) || (e & PAGE_HUGE)) return 0;
+    return &get_table(e & PTE_ADDR_MASK)[get_pt_index(virt)];
+}
+
+void paging_invalidate_page(uint64_t cr3, uint64_t virt) {
+    tlb_invalidate(cr3, virt & ~(PAGE_SIZE - 1), 1);
 }
@@ -12,16 +12,66 @@
 #define PAGE_DIRTY     0x40
 #define PAGE_HUGE      0x80
 #define PAGE_GLOBAL    0x100
+#define PAGE_COW       0x200 // Software bit: read-only copy-on-write share
+#define PAGE_SHARED    0x400 // Software bit: MAP_SHARED page, fork keeps it writable
+#define PAGE_SWAP      0x800 // Software bit, non-present PTEs only: swap entry (swap.rs)
 #define PAGE_DEVICE    0x10  // PAGE_PCD - Page Cache Disabled for memory-mapped I/O
 
+#define PAGE_SIZE_2M   0x200000ULL
+#define PAGE_SIZE_1G   0x40000000ULL
+#define PTE_ADDR_MASK  0x000FFFFFFFFFF000ULL
+
+// All physical memory is mapped at PHYS_MAP_BASE (PML4 slot 256, shared by
+// every process PML4). The identity map only covers the kernel image and
+// low memory.
+#define PHYS_MAP_BASE  0xFFFF800000000000ULL
+#define PHYS_MAP_SIZE  (512ULL << 30)
+
 void paging_init();
 void map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
+// Map one 4K, 2M or 1G page; fails (-1) on misalignment or when 1G pages
+// are unsupported. A 4K mapping inside an existing huge page splits it.
+int map_page_size(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, uint64_t page_size);
+// Map [virt_addr, virt_addr + size) using the largest page size that fits
+int map_range(uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags);
 void unmap_page(uint64_t virt_addr);
+// Unmap [virt_addr, virt_addr + size), then invalidate the TLB with invlpg
+// per page for short ranges or a full flush for long ones, on every CPU
+void unmap_range(uint64_t virt_addr, uint64_t size);
 uint64_t get_phys_addr(uint64_t virt_addr);
 void map_user_page(uint64_t virt_addr, uint64_t phys_addr);
+// Returns a CR3 value: PML4 physical address | PCID (0 without PCID support)
 uint64_t paging_new_pml4();
+// Frees the user half's page tables and drops each mapping's page reference
 void paging_free_pml4(uint64_t pml4_phys);
+// Copy-on-write clone of a process address space; returns the new CR3 or 0
+uint64_t paging_clone_cow(uint64_t src_cr3);
+// Replace the 2 MiB user mapping covering virt with 4 KiB mappings (no-op
+// if it is not a huge mapping). Returns -1 when out of memory. pml4_phys
+// must be the active address space.
+int paging_split_user_huge(uint64_t pml4_phys, uint64_t virt);
+// Drop the TLB entry for virt in the address space cr3, which need not be
+// the active one, on every CPU
+void paging_invalidate_page(uint64_t cr3, uint64_t virt);
+// Drop this CPU's TLB entries for `pages` pages from `start` in address
+// space cr3, or for all of them with TLB_FLUSH_ALL. cr3 0 stands for the
+// kernel's mappings, which every address space shares. Called for TLB
+// shootdowns from the other CPUs.
+#define TLB_FLUSH_ALL (~0ULL)
+void paging_flush_local(uint64_t cr3, uint64_t start, uint64_t pages);
 void map_mmio(uint64_t phys_addr, uint64_t size);
+// Load a task's CR3 (0 = kernel PML4), keeping its PCID's TLB entries
+void paging_switch_cr3(uint64_t cr3);
+
+static inline void* phys_to_virt(uint64_t phys) {
+    return (void*)(phys + PHYS_MAP_BASE);
+}
+
+static inline uint64_t virt_to_phys(const void* virt) {
+    uint64_t addr = (uint64_t)virt;
+    if (addr >= PHYS_MAP_BASE && addr < PHYS_MAP_BASE + PHYS_MAP_SIZE) return addr - PHYS_MAP_BASE;
+    return get_phys_addr(addr);
+}
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,6 +79,13 @@ extern "C" {
 uint64_t rust_paging_new_pml4();
 void rust_paging_free_pml4(uint64_t pml4_phys);
 void rust_map_page(uint64_t pml4_phys, uint64_t virt, uint64_t phys, uint64_t flags);
+uint64_t rust_get_phys_addr(uint64_t pml4_phys, uint64_t virt);
+// 4K PTE mapping virt in the given address space, or NULL
+uint64_t* rust_get_pte(uint64_t pml4_phys, uint64_t virt);
+// Page directory entry covering virt, or NULL if there is no page directory
+uint64_t* rust_get_pde(uint64_t pml4_phys, uint64_t virt);
+// Map a 2 MiB page; fails if virt's 2 MiB range already has a page table
+int rust_map_huge_page(uint64_t pml4_phys, uint64_t virt, uint64_t phys, uint64_t flags);
 #ifdef __cplusplus
 }
 #endif
@@ -2,6 +2,9 @@
 #include "kernel.h"
 #include <stdint.h>
 #include "serial.h"
+#include "paging.h"
+#include "memops.h"
+#include "smp.h"
 
 #define MULTIBOOT2_TAG_TYPE_MMAP 6
 #define MULTIBOOT2_TAG_ALIGN 8
@@ -25,35 +28,319 @@ typedef struct {
     uint32_t reserved;
 } mb2_mmap_entry_t;
 
-#define MAX_PHYS_MEM (512ULL * 1024 * 1024) // 512 MiB max for simplicity
-#define MAX_PAGES (MAX_PHYS_MEM / PAGE_SIZE)
+#define LOW_MEM_END 0x100000 // Never hand out the first 1 MiB
+// The boot page tables (boot/loader.asm) only map the first 1 GiB, both
+// identity and at PHYS_MAP_BASE. Frames above it join the free lists once
+// paging_init() has built the full direct map (see pmm_init_highmem).
+#define BOOT_MAP_END (1ULL << 30)
+#define PMM_MAX_RANGES 32
 
-static uint8_t page_bitmap[MAX_PAGES / 8];
+// Buddy allocator state. Frames are indexed by physical frame number (pfn),
+// so an order-n block is always 2^n-page aligned in physical memory.
+// Free lists are linked through the frame array rather than through the free
+// pages themselves, so free memory is never touched.
+// Pages are handed out as pointers into the direct map (see phys_to_virt).
+#define PMM_NO_FRAME 0xFFFFFFFFu
+#define FRAME_FREE      0x1 // Head of a free block of 2^order pages
+#define FRAME_ALLOCATED 0x2 // Head of an allocated block of 2^order pages
+#define FRAME_PCP       0x4 // Order-0 page parked in a per-CPU cache
+#define FRAME_ZEROED    0x8 // Free order-0 page in the pre-zeroed pool
+
+// One struct page per frame up to phys_end, carved out of usable RAM by
+// pmm_init() and reached through the direct map
+static struct page* frames;
+static uint64_t nr_frames = 0;
+static uint32_t free_list[PMM_MAX_ORDER];
+static uint64_t free_blocks[PMM_MAX_ORDER];
 static uint64_t total_pages = 0;
-static uint64_t free_pages = 0;
-static uint64_t base_addr = 0;
+static uint64_t phys_end = 0; // End of the highest managed frame
+static uint64_t free_pages_count = 0;
+
+// Usable RAM from the memory map, page-aligned and clipped to LOW_MEM_END
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} pmm_range_t;
+
+static pmm_range_t ram_ranges[PMM_MAX_RANGES];
+static int nr_ram_ranges = 0;
+// Never handed out: kernel image, Multiboot2 info, the frames array
+static pmm_range_t reserved[3];
+
+// Per-CPU order-0 page caches ("magazines") in front of the buddy lists.
+// Each cache is a ring: the hot end serves allocations and takes ordinary
+// frees, the cold end takes free_page_cold() and is what gets drained back.
+#define PMM_MAX_CPUS SMP_MAX_CPUS
+#define PCP_CAPACITY 512
+
+typedef struct {
+    uint32_t pages[PCP_CAPACITY];
+    uint32_t start; // Cold end
+    uint32_t count;
+    uint32_t low, high, batch;
+    uint64_t hits, misses, refills, drains;
+} pmm_pcp_t;
+
+static pmm_pcp_t pcp[PMM_MAX_CPUS];
+static uint64_t pcp_drain_all_count = 0; // Drains forced by alloc_pages failures
+
+// Pool of free pages that were cleared ahead of time (see
+// pmm_zero_pool_refill) so alloc_zeroed_page() can skip the memset. Pool
+// pages still count as free memory and are handed out by alloc_page() once
+// everything else is gone.
+#define ZERO_POOL_CAPACITY 256
+#define ZERO_POOL_MIN_FREE 1024 // Leave at least this many other free pages
+
+static uint32_t zero_pool[ZERO_POOL_CAPACITY];
+static uint32_t zero_pool_count = 0;
+static uint64_t zero_hits = 0, zero_misses = 0, zero_filled = 0;
+
+// Blocks currently allocated as transparent huge pages (PG_HUGE heads)
+static uint64_t huge_in_use = 0;
+
+static inline uint64_t pmm_lock(void) {
+    return klock_irqsave();
+}
+
+static inline void pmm_unlock(uint64_t rflags) {
+    klock_irqrestore(rflags);
+}
+
+static void list_push(unsigned int order, uint32_t pfn) {
+    frames[pfn].order = (uint8_t)order;
+    frames[pfn].flags = FRAME_FREE;
+    frames[pfn].prev = PMM_NO_FRAME;
+    frames[pfn].next = free_list[order];
+    if (free_list[order] != PMM_NO_FRAME) frames[free_list[order]].prev = pfn;
+    free_list[order] = pfn;
+    free_blocks[order]++;
+}
+
+static void list_remove(unsigned int order, uint32_t pfn) {
+    if (frames[pfn].prev != PMM_NO_FRAME) frames[frames[pfn].prev].next = frames[pfn].next;
+    else free_list[order] = frames[pfn].next;
+    if (frames[pfn].next != PMM_NO_FRAME) frames[frames[pfn].next].prev = frames[pfn].prev;
+    frames[pfn].flags = 0;
+    free_blocks[order]--;
+}
+
+static uint32_t buddy_alloc(unsigned int order) {
+    unsigned int k = order;
+    while (k < PMM_MAX_ORDER && free_list[k] == PMM_NO_FRAME) k++;
+    if (k >= PMM_MAX_ORDER) return PMM_NO_FRAME;
+
+    uint32_t pfn = free_list[k];
+    list_remove(k, pfn);
+    // Split down to the requested order, returning the upper halves
+    while (k > order) {
+        k--;
+        list_push(k, pfn + (1u << k));
+    }
+    frames[pfn].order = (uint8_t)order;
+    frames[pfn].flags = FRAME_ALLOCATED;
+    frames[pfn].pg_flags = 0;
+    frames[pfn].refcount = 1;
+    free_pages_count -= (1ULL << order);
+    return pfn;
+}
+
+// Like buddy_alloc, but the block must end at or below limit_pfn. Free
+// lists are not address ordered, so this walks them; it is meant for the
+// occasional DMA buffer, not for hot paths.
+static uint32_t buddy_alloc_below(unsigned int order, uint64_t limit_pfn) {
+    for (unsigned int k = order; k < PMM_MAX_ORDER; k++) {
+        for (uint32_t pfn = free_list[k]; pfn != PMM_NO_FRAME; pfn = frames[pfn].next) {
+            // Splitting keeps the lowest 2^order pages of the block
+            if (pfn + (1ULL << order) > limit_pfn) continue;
+            list_remove(k, pfn);
+            while (k > order) {
+                k--;
+                list_push(k, pfn + (1u << k));
+            }
+            frames[pfn].order = (uint8_t)order;
+            frames[pfn].flags = FRAME_ALLOCATED;
+            frames[pfn].pg_flags = 0;
+            frames[pfn].refcount = 1;
+            free_pages_count -= (1ULL << order);
+            return pfn;
+        }
+    }
+    return PMM_NO_FRAME;
+}
+
+static void buddy_free(uint32_t pfn, unsigned int order) {
+    free_pages_count += (1ULL << order);
+    frames[pfn].flags = 0;
+    frames[pfn].refcount = 0;
+    // Coalesce with the buddy for as long as it is a free block of the same order
+    while (order < PMM_MAX_ORDER - 1) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= nr_frames) break;
+        if (!(frames[buddy].flags & FRAME_FREE) || frames[buddy].order != order) break;
+        list_remove(order, buddy);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    list_push(order, pfn);
+}
+
+// Frees take direct-map pointers; addresses in the low identity map are
+// accepted as they are.
+static inline uint64_t page_phys(void* addr) {
+    uint64_t a = (uint64_t)addr;
+    return a >= PHYS_MAP_BASE ? a - PHYS_MAP_BASE : a;
+}
+
+static inline pmm_pcp_t* pcp_this_cpu(void) {
+    return &pcp[smp_cpu_id()];
+}
+
+static void pcp_push_hot(pmm_pcp_t* c, uint32_t pfn) {
+    c->pages[(c->start + c->count) % PCP_CAPACITY] = pfn;
+    c->count++;
+}
 
-static void set_page_used(uint64_t page_idx) {
-    page_bitmap[page_idx / 8] |= (1 << (page_idx % 8));
+static void pcp_push_cold(pmm_pcp_t* c, uint32_t pfn) {
+    c->start = (c->start + PCP_CAPACITY - 1) % PCP_CAPACITY;
+    c->pages[c->start] = pfn;
+    c->count++;
 }
-static void set_page_free(uint64_t page_idx) {
-    page_bitmap[page_idx / 8] &= ~(1 << (page_idx % 8));
+
+static uint32_t pcp_pop_hot(pmm_pcp_t* c) {
+    c->count--;
+    return c->pages[(c->start + c->count) % PCP_CAPACITY];
+}
+
+static uint32_t pcp_pop_cold(pmm_pcp_t* c) {
+    uint32_t pfn = c->pages[c->start];
+    c->start = (c->start + 1) % PCP_CAPACITY;
+    c->count--;
+    return pfn;
+}
+
+// Move up to one batch of order-0 pages from the buddy lists into the cache.
+// Called with interrupts disabled.
+static void pcp_refill(pmm_pcp_t* c) {
+    c->refills++;
+    for (uint32_t i = 0; i < c->batch && c->count < PCP_CAPACITY; i++) {
+        uint32_t pfn = buddy_alloc(0);
+        if (pfn == PMM_NO_FRAME) break;
+        frames[pfn].flags = FRAME_PCP;
+        // Keep free_pages_count counting cached pages as free
+        free_pages_count++;
+        pcp_push_cold(c, pfn);
+    }
+}
+
+// Return one batch of the coldest pages to the buddy lists.
+static void pcp_drain(pmm_pcp_t* c, uint32_t n) {
+    c->drains++;
+    while (n-- && c->count) {
+        uint32_t pfn = pcp_pop_cold(c);
+        free_pages_count--;
+        buddy_free(pfn, 0);
+    }
+}
+
+// The buddy lists ran dry: give back what the other CPUs keep cached.
+static void pcp_drain_remote(pmm_pcp_t* self) {
+    for (int i = 0; i < PMM_MAX_CPUS; i++) {
+        if (&pcp[i] != self && pcp[i].count) pcp_drain(&pcp[i], pcp[i].count);
+    }
+}
+
+// Higher-order allocation failed: return every CPU's cached pages to the
+// buddy lists so they can coalesce into larger blocks. The pre-zeroed pool
+// is left alone; its pages are worth more than one multi-page allocation.
+static void pcp_drain_all(void) {
+    pcp_drain_all_count++;
+    pcp_drain_remote(NULL);
+}
+
+// Free the frames in [start, end) as the largest naturally aligned buddy
+// blocks that fit, skipping reserved ranges.
+static void free_range(uint64_t start, uint64_t end) {
+    for (unsigned int i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+        if (reserved[i].start < end && reserved[i].end > start) {
+            if (reserved[i].start > start) free_range(start, reserved[i].start);
+            if (reserved[i].end < end) free_range(reserved[i].end, end);
+            return;
+        }
+    }
+    uint64_t pfn = start / PAGE_SIZE, last = end / PAGE_SIZE;
+    while (pfn < last) {
+        unsigned int order = PMM_MAX_ORDER - 1;
+        while (order && ((pfn & ((1ULL << order) - 1)) || pfn + (1ULL << order) > last)) order--;
+        buddy_free((uint32_t)pfn, order);
+        pfn += 1ULL << order;
+    }
 }
-static int is_page_free(uint64_t page_idx) {
-    return !(page_bitmap[page_idx / 8] & (1 << (page_idx % 8)));
+
+static void add_ram_range(uint64_t start, uint64_t end) {
+    if (nr_ram_ranges >= PMM_MAX_RANGES) {
+        serial_write("[PMM] WARNING: Too many memory map entries, ignoring the rest\n");
+        return;
+    }
+    ram_ranges[nr_ram_ranges].start = start;
+    ram_ranges[nr_ram_ranges].end = end;
+    nr_ram_ranges++;
+    total_pages += (end - start) / PAGE_SIZE;
+    if (end > phys_end) phys_end = end;
+}
+
+// Find room for size bytes of metadata in usable RAM below limit, clear of
+// the reserved ranges. Returns the physical address or 0.
+static uint64_t find_meta_space(uint64_t size, uint64_t limit) {
+    for (int i = 0; i < nr_ram_ranges; i++) {
+        uint64_t start = ram_ranges[i].start;
+        uint64_t end = ram_ranges[i].end < limit ? ram_ranges[i].end : limit;
+        for (unsigned int r = 0; r < 2; r++) {
+            if (start < reserved[r].end && start + size > reserved[r].start) {
+                start = (reserved[r].end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+                r = (unsigned int)-1; // Recheck against every range
+            }
+        }
+        if (start + size <= end) return start;
+    }
+    return 0;
 }
 
 void pmm_init(uint64_t mb2_info_ptr) {
-    // Set base address for physical memory management
-    base_addr = 0x100000; // 1 MiB
-    // Mark all pages as used initially
-    memset(page_bitmap, 0xFF, sizeof(page_bitmap));
+    for (int i = 0; i < PMM_MAX_ORDER; i++) {
+        free_list[i] = PMM_NO_FRAME;
+        free_blocks[i] = 0;
+    }
+    for (int i = 0; i < PMM_MAX_CPUS; i++) {
+        pcp[i].start = 0;
+        pcp[i].count = 0;
+        pcp[i].low = 0;
+        pcp[i].high = 128;
+        pcp[i].batch = 32;
+        pcp[i].hits = pcp[i].misses = pcp[i].refills = pcp[i].drains = 0;
+    }
     total_pages = 0;
-    free_pages = 0;
+    free_pages_count = 0;
+    phys_end = 0;
+    nr_ram_ranges = 0;
+
+    // Reserve the kernel image plus a safety margin, and the Multiboot2
+    // info (still parsed after this); everything below LOW_MEM_END is
+    // never managed.
+    extern uint8_t _kernel_start, _kernel_end;
+    uint64_t kernel_start = (uint64_t)&_kernel_start;
+    uint64_t kernel_end = (uint64_t)&_kernel_end;
+    uint64_t kernel_end_safe = kernel_end + 0x100000; // Add 1MB buffer
+    if (kernel_end_safe < 0x400000) kernel_end_safe = 0x400000; // At least 4MB
 
     // Parse Multiboot2 memory map
     uint8_t* mb2 = (uint8_t*)mb2_info_ptr;
     uint32_t total_size = *(uint32_t*)mb2;
+    reserved[0].start = kernel_start & ~(uint64_t)(PAGE_SIZE - 1);
+    reserved[0].end = (kernel_end_safe + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    reserved[1].start = mb2_info_ptr & ~(uint64_t)(PAGE_SIZE - 1);
+    reserved[1].end = (mb2_info_ptr + total_size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    reserved[2].start = reserved[2].end = 0;
+
     mb2_tag_t* tag = (mb2_tag_t*)(mb2 + 8);
     int mmap_found = 0;
     while ((uint8_t*)tag < mb2 + total_size) {
@@ -65,93 +352,365 @@ void pmm_init(uint64_t mb2_info_ptr) {
                  entry_ptr < mmap_end;
                  entry_ptr += mmap_tag->entry_size) {
                 mb2_mmap_entry_t* entry = (mb2_mmap_entry_t*)entry_ptr;
-                if (entry->type == 1 && entry->addr >= base_addr) {
-                    uint64_t start = entry->addr;
-                    uint64_t end = entry->addr + entry->len;
-                    for (uint64_t addr = start; addr + PAGE_SIZE <= end; addr += PAGE_SIZE) {
-                        uint64_t page_idx = (addr - base_addr) / PAGE_SIZE;
-                        if (page_idx < MAX_PAGES) {
-                            set_page_free(page_idx);
-                            total_pages++;
-                            free_pages++;
-                        }
-                    }
-                }
+                if (entry->type != 1 || entry->addr + entry->len <= LOW_MEM_END) continue;
+                uint64_t start = (entry->addr + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+                uint64_t end = (entry->addr + entry->len) & ~(uint64_t)(PAGE_SIZE - 1);
+                if (start < LOW_MEM_END) start = LOW_MEM_END;
+                // Everything managed must be reachable through the direct map
+                if (end > PHYS_MAP_SIZE) end = PHYS_MAP_SIZE;
+                if (start < end) add_ram_range(start, end);
             }
         }
         tag = (mb2_tag_t*)(((uintptr_t)((uint8_t*)tag + tag->size + MULTIBOOT2_TAG_ALIGN - 1)) & ~(uintptr_t)(MULTIBOOT2_TAG_ALIGN - 1));
     }
     if (!mmap_found) {
         serial_write("[PMM] ERROR: No MMAP tag found!\n");
+        return;
     }
-    // Mark kernel and bitmap as used
-    extern uint8_t _kernel_start, _kernel_end;
-    uint64_t kernel_start = (uint64_t)&_kernel_start;
-    uint64_t kernel_end = (uint64_t)&_kernel_end;
-    
-    // Reserve kernel memory pages more aggressively
-    // Reserve from kernel start up to at least 4MB to include all kernel data
-    uint64_t kernel_end_safe = kernel_end + 0x100000; // Add 1MB buffer
-    if (kernel_end_safe < 0x400000) kernel_end_safe = 0x400000; // At least 4MB
-    
-    for (uint64_t addr = kernel_start; addr < kernel_end_safe; addr += PAGE_SIZE) {
-        if (addr >= base_addr) {
-            uint64_t page_idx = (addr - base_addr) / PAGE_SIZE;
-            if (page_idx < MAX_PAGES && is_page_free(page_idx)) {
-                set_page_used(page_idx);
-                free_pages--;
-            }
-        }
+
+    // Size the frame array for the highest usable address and place it in
+    // RAM the boot page tables already map
+    uint64_t meta_size = (phys_end / PAGE_SIZE) * sizeof(struct page);
+    meta_size = (meta_size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t meta = find_meta_space(meta_size, BOOT_MAP_END);
+    if (!meta) {
+        serial_write("[PMM] ERROR: No room for the page frame array!\n");
+        total_pages = 0;
+        phys_end = 0;
+        return;
     }
-    
-    // Also reserve the bitmap itself if it's in managed memory range
-    uint64_t bitmap_start = (uint64_t)page_bitmap;
-    uint64_t bitmap_end = bitmap_start + sizeof(page_bitmap);
-    if (bitmap_start >= base_addr) {
-        for (uint64_t addr = bitmap_start; addr < bitmap_end; addr += PAGE_SIZE) {
-            uint64_t page_idx = (addr - base_addr) / PAGE_SIZE;
-            if (page_idx < MAX_PAGES && is_page_free(page_idx)) {
-                set_page_used(page_idx);
-                free_pages--;
-            }
-        }
+    frames = (struct page*)phys_to_virt(meta);
+    nr_frames = phys_end / PAGE_SIZE;
+    memset(frames, 0, meta_size);
+    reserved[2].start = meta;
+    reserved[2].end = meta + meta_size;
+
+    for (int i = 0; i < nr_ram_ranges; i++) {
+        uint64_t end = ram_ranges[i].end < BOOT_MAP_END ? ram_ranges[i].end : BOOT_MAP_END;
+        if (ram_ranges[i].start < end) free_range(ram_ranges[i].start, end);
     }
-    
-    // Reserve the first 16MB for critical kernel structures
-    for (uint64_t addr = base_addr; addr < base_addr + 0x1000000 && addr < kernel_end_safe; addr += PAGE_SIZE) {
-        uint64_t page_idx = (addr - base_addr) / PAGE_SIZE;
-        if (page_idx < MAX_PAGES && is_page_free(page_idx)) {
-            set_page_used(page_idx);
-            free_pages--;
-        }
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "[PMM] %d MiB in %d ranges, frame array %d KiB at %d MiB\n",
+             (int)(total_pages >> 8), nr_ram_ranges, (int)(meta_size >> 10), (int)(meta >> 20));
+    serial_write(msg);
+}
+
+void pmm_init_highmem(void) {
+    for (int i = 0; i < nr_ram_ranges; i++) {
+        uint64_t start = ram_ranges[i].start > BOOT_MAP_END ? ram_ranges[i].start : BOOT_MAP_END;
+        if (start < ram_ranges[i].end) free_range(start, ram_ranges[i].end);
+    }
+}
+
+// Opportunistic callers with a fallback pass drain = 0 so that a failure
+// does not empty the per-CPU caches.
+static void* alloc_pages_drain(unsigned int order, int drain) {
+    if (order >= PMM_MAX_ORDER) return NULL;
+    uint64_t flags = pmm_lock();
+    uint32_t pfn = buddy_alloc(order);
+    if (pfn == PMM_NO_FRAME && drain) {
+        pcp_drain_all();
+        pfn = buddy_alloc(order);
+    }
+    pmm_unlock(flags);
+    if (pfn == PMM_NO_FRAME) return NULL; // Out of memory
+    return phys_to_virt((uint64_t)pfn * PAGE_SIZE);
+}
+
+void* alloc_pages(unsigned int order) {
+    return alloc_pages_drain(order, 1);
+}
+
+void* alloc_pages_below(unsigned int order, uint64_t limit) {
+    if (order >= PMM_MAX_ORDER) return NULL;
+    uint64_t flags = pmm_lock();
+    uint32_t pfn = buddy_alloc_below(order, limit / PAGE_SIZE);
+    if (pfn == PMM_NO_FRAME) {
+        pcp_drain_all();
+        pfn = buddy_alloc_below(order, limit / PAGE_SIZE);
+    }
+    pmm_unlock(flags);
+    if (pfn == PMM_NO_FRAME) return NULL;
+    return phys_to_virt((uint64_t)pfn * PAGE_SIZE);
+}
+
+void free_pages(void* addr, unsigned int order) {
+    uint64_t a = page_phys(addr);
+    if (a < LOW_MEM_END || (a & (PAGE_SIZE - 1))) return;
+    uint64_t pfn = a / PAGE_SIZE;
+    if (pfn >= nr_frames || order >= PMM_MAX_ORDER) return;
+    uint64_t flags = pmm_lock();
+    // Only the head of an allocated block of the same order may be freed;
+    // this also rejects double frees.
+    if ((frames[pfn].flags & FRAME_ALLOCATED) && frames[pfn].order == order) {
+        buddy_free((uint32_t)pfn, order);
+    }
+    pmm_unlock(flags);
+}
+
+void* alloc_huge_page(void) {
+    // The fault path falls back to 4 KiB pages, so don't drain for this
+    uint8_t* block = alloc_pages_drain(HUGE_PAGE_ORDER, 0);
+    if (!block) return NULL;
+    for (unsigned int i = 0; i < (1u << HUGE_PAGE_ORDER); i++) {
+        zero_page_nt(block + i * PAGE_SIZE);
     }
+    uint64_t flags = pmm_lock();
+    frames[page_phys(block) / PAGE_SIZE].pg_flags |= PG_HUGE;
+    huge_in_use++;
+    pmm_unlock(flags);
+    return block;
+}
+
+int pmm_split_block(uint64_t phys) {
+    uint64_t pfn = phys / PAGE_SIZE;
+    uint64_t flags = pmm_lock();
+    if (pfn >= nr_frames || !(frames[pfn].flags & FRAME_ALLOCATED) || frames[pfn].refcount != 1) {
+        pmm_unlock(flags);
+        return -1;
+    }
+    if (frames[pfn].pg_flags & PG_HUGE) huge_in_use--;
+    uint64_t count = 1ULL << frames[pfn].order;
+    for (uint64_t i = 0; i < count; i++) {
+        frames[pfn + i].order = 0;
+        frames[pfn + i].flags = FRAME_ALLOCATED;
+        frames[pfn + i].pg_flags = 0;
+        frames[pfn + i].refcount = 1;
+    }
+    pmm_unlock(flags);
+    return 0;
+}
+
+uint64_t pmm_huge_pages_in_use(void) {
+    return huge_in_use;
 }
 
 void* alloc_page() {
-    for (uint64_t i = 0; i < MAX_PAGES; i++) {
-        if (is_page_free(i)) {
-            set_page_used(i);
-            free_pages--;
-            return (void*)(base_addr + i * PAGE_SIZE);
+    uint64_t flags = pmm_lock();
+    pmm_pcp_t* c = pcp_this_cpu();
+    if (c->count > c->low) {
+        c->hits++;
+    } else {
+        c->misses++;
+        pcp_refill(c);
+        if (!c->count && !zero_pool_count) {
+            pcp_drain_remote(c);
+            pcp_refill(c);
+        }
+    }
+    uint32_t pfn = PMM_NO_FRAME;
+    if (c->count) pfn = pcp_pop_hot(c);
+    else if (zero_pool_count) pfn = zero_pool[--zero_pool_count];
+    if (pfn != PMM_NO_FRAME) {
+        frames[pfn].order = 0;
+        frames[pfn].flags = FRAME_ALLOCATED;
+        frames[pfn].pg_flags = 0;
+        frames[pfn].refcount = 1;
+        free_pages_count--;
+    }
+    pmm_unlock(flags);
+    if (pfn == PMM_NO_FRAME) return NULL; // Out of memory
+    return phys_to_virt((uint64_t)pfn * PAGE_SIZE);
+}
+
+void* alloc_zeroed_page() {
+    uint64_t flags = pmm_lock();
+    uint32_t pfn = PMM_NO_FRAME;
+    if (zero_pool_count) {
+        pfn = zero_pool[--zero_pool_count];
+        frames[pfn].order = 0;
+        frames[pfn].flags = FRAME_ALLOCATED;
+        frames[pfn].pg_flags = 0;
+        frames[pfn].refcount = 1;
+        free_pages_count--;
+        zero_hits++;
+    } else {
+        zero_misses++;
+    }
+    pmm_unlock(flags);
+    if (pfn != PMM_NO_FRAME) return phys_to_virt((uint64_t)pfn * PAGE_SIZE);
+    void* page = alloc_page();
+    if (page) memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+unsigned int pmm_zero_pool_refill(unsigned int max) {
+    unsigned int done = 0;
+    while (done < max) {
+        uint64_t flags = pmm_lock();
+        pmm_pcp_t* c = pcp_this_cpu();
+        if (zero_pool_count >= ZERO_POOL_CAPACITY ||
+            free_pages_count - zero_pool_count <= ZERO_POOL_MIN_FREE) {
+            pmm_unlock(flags);
+            break;
+        }
+        if (!c->count) pcp_refill(c);
+        if (!c->count) {
+            pmm_unlock(flags);
+            break;
+        }
+        // Take from the cold end: those pages are the least likely to be
+        // cached, and the stores below bypass the cache anyway
+        uint32_t pfn = pcp_pop_cold(c);
+        frames[pfn].flags = 0; // Owned by us while it is being cleared
+        free_pages_count--;
+        pmm_unlock(flags);
+
+        zero_page_nt(phys_to_virt((uint64_t)pfn * PAGE_SIZE));
+
+        flags = pmm_lock();
+        if (zero_pool_count < ZERO_POOL_CAPACITY) {
+            frames[pfn].flags = FRAME_ZEROED;
+            zero_pool[zero_pool_count++] = pfn;
+            free_pages_count++;
+        } else {
+            buddy_free(pfn, 0); // Someone else filled the pool meanwhile
         }
+        zero_filled++;
+        pmm_unlock(flags);
+        done++;
     }
-    return NULL; // Out of memory
+    return done;
+}
+
+void pmm_zero_pool_get_stats(pmm_zero_stats_t* out) {
+    if (!out) return;
+    uint64_t flags = pmm_lock();
+    out->pooled = zero_pool_count;
+    out->hits = zero_hits;
+    out->misses = zero_misses;
+    out->filled = zero_filled;
+    pmm_unlock(flags);
+}
+
+static void free_page_pcp(void* addr, int cold) {
+    uint64_t a = page_phys(addr);
+    if (a < LOW_MEM_END || (a & (PAGE_SIZE - 1))) return;
+    uint64_t pfn = a / PAGE_SIZE;
+    if (pfn >= nr_frames) return;
+    uint64_t flags = pmm_lock();
+    if (!(frames[pfn].flags & FRAME_ALLOCATED)) {
+        pmm_unlock(flags); // Double free or never allocated
+        return;
+    }
+    if (frames[pfn].order != 0) {
+        buddy_free((uint32_t)pfn, frames[pfn].order);
+        pmm_unlock(flags);
+        return;
+    }
+    pmm_pcp_t* c = pcp_this_cpu();
+    if (c->count >= PCP_CAPACITY) pcp_drain(c, c->batch);
+    frames[pfn].flags = FRAME_PCP;
+    frames[pfn].refcount = 0;
+    free_pages_count++;
+    if (cold) pcp_push_cold(c, (uint32_t)pfn);
+    else pcp_push_hot(c, (uint32_t)pfn);
+    if (c->count > c->high) pcp_drain(c, c->batch);
+    pmm_unlock(flags);
 }
 
 void free_page(void* addr) {
-    uint64_t a = (uint64_t)addr;
-    if (a < base_addr) return;
-    uint64_t page_idx = (a - base_addr) / PAGE_SIZE;
-    if (page_idx < MAX_PAGES && !is_page_free(page_idx)) {
-        set_page_free(page_idx);
-        free_pages++;
+    free_page_pcp(addr, 0);
+}
+
+void free_page_cold(void* addr) {
+    free_page_pcp(addr, 1);
+}
+
+void pmm_pcp_set_watermarks(uint32_t low, uint32_t high, uint32_t batch) {
+    if (batch == 0 || batch > PCP_CAPACITY / 2) return;
+    if (high > PCP_CAPACITY || low >= high) return;
+    uint64_t flags = pmm_lock();
+    for (int i = 0; i < PMM_MAX_CPUS; i++) {
+        pcp[i].low = low;
+        pcp[i].high = high;
+        pcp[i].batch = batch;
+        if (pcp[i].count > high) pcp_drain(&pcp[i], pcp[i].count - high);
+    }
+    pmm_unlock(flags);
+}
+
+void pmm_pcp_get_stats(pmm_pcp_stats_t* out) {
+    if (!out) return;
+    uint64_t flags = pmm_lock();
+    out->cached = out->hits = out->misses = out->refills = out->drains = 0;
+    out->drain_all = pcp_drain_all_count;
+    for (int i = 0; i < PMM_MAX_CPUS; i++) {
+        out->cached += pcp[i].count;
+        out->hits += pcp[i].hits;
+        out->misses += pcp[i].misses;
+        out->refills += pcp[i].refills;
+        out->drains += pcp[i].drains;
     }
+    out->low = pcp[0].low;
+    out->high = pcp[0].high;
+    out->batch = pcp[0].batch;
+    pmm_unlock(flags);
 }
 
 uint64_t pmm_total_memory() {
     return total_pages * PAGE_SIZE;
 }
 
+uint64_t pmm_phys_end() {
+    return phys_end;
+}
+
+int pmm_block_order(void* addr) {
+    uint64_t pfn = page_phys(addr) / PAGE_SIZE;
+    if (pfn >= nr_frames || !(frames[pfn].flags & FRAME_ALLOCATED)) return -1;
+    return frames[pfn].order;
+}
+
+// Allocated page at phys, or NULL. Called with the PMM lock held.
+static struct page* allocated_page(uint64_t phys) {
+    uint64_t pfn = phys / PAGE_SIZE;
+    if (pfn >= nr_frames || !(frames[pfn].flags & FRAME_ALLOCATED)) return NULL;
+    return &frames[pfn];
+}
+
+struct page* phys_to_page(uint64_t phys) {
+    uint64_t pfn = phys / PAGE_SIZE;
+    return pfn < nr_frames ? &frames[pfn] : NULL;
+}
+
+void page_get(uint64_t phys) {
+    uint64_t flags = pmm_lock();
+    struct page* pg = allocated_page(phys);
+    if (pg) pg->refcount++;
+    pmm_unlock(flags);
+}
+
+void page_put(uint64_t phys) {
+    uint64_t flags = pmm_lock();
+    struct page* pg = allocated_page(phys);
+    int last = pg && !(pg->pg_flags & PG_RESERVED) && pg->refcount > 0 && --pg->refcount == 0;
+    if (last && (pg->pg_flags & PG_HUGE)) huge_in_use--;
+    pmm_unlock(flags);
+    if (last) free_page(phys_to_virt(phys & ~(uint64_t)(PAGE_SIZE - 1)));
+}
+
+uint32_t page_refcount(uint64_t phys) {
+    uint64_t flags = pmm_lock();
+    struct page* pg = allocated_page(phys);
+    uint32_t count = pg ? pg->refcount : 0;
+    pmm_unlock(flags);
+    return count;
+}
+
+void page_set_flags(uint64_t phys, uint16_t pg_flags) {
+    uint64_t flags = pmm_lock();
+    struct page* pg = allocated_page(phys);
+    if (pg) pg->pg_flags |= pg_flags;
+    pmm_unlock(flags);
+}
+
 uint64_t pmm_free_memory() {
-    return free_pages * PAGE_SIZE;
+    return free_pages_count * PAGE_SIZE;
+}
+
+uint64_t pmm_free_blocks(unsigned int order) {
+    if (order >= PMM_MAX_ORDER) return 0;
+    return free_blocks[order];
 }
@@ -4,11 +4,95 @@
 #include "kernel.h"
 
 #define PAGE_SIZE 4096
+#define PMM_MAX_ORDER 11 // Buddy orders 0..10 (4 KiB .. 4 MiB blocks)
 
+// Per-frame metadata, one entry per physical frame number. The buddy
+// allocator links free blocks through next/prev; refcount counts the
+// owners of an allocated page (1 after allocation, +1 per extra mapping).
+struct page {
+    uint32_t next;
+    uint32_t prev;
+    uint8_t order;
+    uint8_t flags;     // Buddy/per-CPU cache state, private to pmm.c
+    uint16_t pg_flags; // PG_*
+    uint32_t refcount;
+};
+
+#define PG_RESERVED 0x1 // Shared for the system's lifetime, page_put never frees it
+#define PG_HUGE     0x2 // Head of a block mapped as a transparent huge page
+
+#define HUGE_PAGE_ORDER 9 // 2 MiB
+
+// Builds the frame array from the Multiboot2 memory map and frees the RAM
+// the boot page tables map; pmm_init_highmem() adds the rest once
+// paging_init() has mapped all of it.
 void pmm_init(uint64_t mb2_info_ptr);
+void pmm_init_highmem(void);
+// Pages are returned as direct-map pointers; virt_to_phys() gives the
+// physical address for page tables and DMA.
 void* alloc_page();
 void free_page(void* addr);
+// Like alloc_page(), but the page is zero-filled. Served from the pool of
+// pages cleared at idle time when possible, otherwise cleared on the spot.
+void* alloc_zeroed_page();
+// Free a page that is unlikely to be cache-hot (e.g. after device DMA)
+void free_page_cold(void* addr);
+// Physically contiguous, 2^order-page aligned blocks
+void* alloc_pages(unsigned int order);
+void free_pages(void* addr, unsigned int order);
+// Same, but the whole block lies below the physical address limit (for
+// devices that can only address 32 bits)
+void* alloc_pages_below(unsigned int order, uint64_t limit);
+// Zeroed 2 MiB block for a transparent huge page (PG_HUGE set), or NULL
+// when no block that large is free. Freed by the last page_put().
+void* alloc_huge_page(void);
+// Turn an allocated block with a single owner into independent order-0
+// pages, each with refcount 1 (splitting a huge mapping). Returns -1 if
+// the block is shared or not allocated.
+int pmm_split_block(uint64_t phys);
+uint64_t pmm_huge_pages_in_use(void);
+// Order of the allocated block starting at addr, or -1 if there is none
+int pmm_block_order(void* addr);
+// Metadata of the frame containing phys (NULL beyond managed memory)
+struct page* phys_to_page(uint64_t phys);
+// Take/drop a reference on an allocated page; the last page_put frees it
+void page_get(uint64_t phys);
+void page_put(uint64_t phys);
+uint32_t page_refcount(uint64_t phys);
+void page_set_flags(uint64_t phys, uint16_t pg_flags);
 uint64_t pmm_total_memory();
+// Highest physical address backed by managed RAM
+uint64_t pmm_phys_end();
 uint64_t pmm_free_memory();
+uint64_t pmm_free_blocks(unsigned int order);
+
+// Per-CPU order-0 page cache tuning and statistics
+typedef struct {
+    uint64_t cached;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+    uint64_t drain_all; // Full drains after a failed alloc_pages()
+    uint32_t low;
+    uint32_t high;
+    uint32_t batch;
+} pmm_pcp_stats_t;
+
+void pmm_pcp_set_watermarks(uint32_t low, uint32_t high, uint32_t batch);
+void pmm_pcp_get_stats(pmm_pcp_stats_t* out);
+
+// Pre-zeroed page pool. pmm_zero_pool_refill() clears up to max free pages
+// with non-temporal stores and returns how many it added; it is meant to
+// run when the CPU would otherwise be idle.
+typedef struct {
+    uint64_t pooled;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t filled;
+} pmm_zero_stats_t;
+
+unsigned int pmm_zero_pool_refill(unsigned int max);
+void pmm_zero_pool_get_stats(pmm_zero_stats_t* out);
 
 #endif
@@ -0,0 +1,373 @@
+#include "smp.h"
+#include "acpi.h"
+#include "gdt.h"
+#include "idt.h"
+#include "paging.h"
+#include "pmm.h"
+#include "serial.h"
+#include "timer.h"
+#include "task.h"
+
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+// Local APIC registers (offsets from its base)
+#define LAPIC_ID         0x020
+#define LAPIC_TPR        0x080
+#define LAPIC_EOI        0x0B0
+#define LAPIC_SVR        0x0F0
+#define LAPIC_ESR        0x280
+#define LAPIC_ICR_LO     0x300
+#define LAPIC_ICR_HI     0x310
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_LVT_LINT0  0x350
+#define LAPIC_LVT_LINT1  0x360
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_LVT_EXTINT    0x700
+#define LAPIC_LVT_NMI       0x400
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIV_16  0x3
+#define LAPIC_ICR_PENDING   0x1000
+#define LAPIC_ICR_INIT      0x4500 // INIT, level assert
+#define LAPIC_ICR_STARTUP   0x0600
+
+// Where the AP trampoline is copied; a startup IPI gives its page number
+#define AP_TRAMPOLINE_BASE 0x8000
+#define AP_STACK_ORDER 2 // 16 KiB
+
+#define KLOCK_FREE 0xFFFFFFFFu
+
+extern uint8_t ap_trampoline_start[], ap_trampoline_end[];
+extern uint8_t ap_trampoline_cr3[], ap_trampoline_stack[], ap_trampoline_entry[], ap_trampoline_arg[];
+
+// kernel-rs/src/scheduler.rs: run the scheduler's idle loop on a new CPU
+extern void rust_scheduler_idle_loop(void) __attribute__((noreturn));
+
+static cpu_t cpus[SMP_MAX_CPUS];
+static volatile uint32_t online_mask = 1;
+static volatile int online_count = 1;
+static volatile uint32_t* lapic = 0;
+static uint32_t lapic_timer_count = 0;
+// Control registers of the boot CPU, which the APs copy
+static uint64_t boot_cr4, boot_xcr0;
+
+static volatile uint32_t klock_owner = KLOCK_FREE;
+
+// The TLB shootdown in progress, if any; only started with the kernel lock
+// held, so there is at most one
+static volatile uint64_t tlb_cr3, tlb_start, tlb_pages;
+static volatile uint32_t tlb_pending;
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / 4] = val;
+    (void)lapic[LAPIC_ID / 4]; // Wait for the write to land
+}
+
+// The kernel's GS base is live while in the kernel; entries from and
+// exits to user mode swapgs it with IA32_KERNEL_GS_BASE, so user code can
+// neither see nor clobber it
+static void set_cpu_gs(cpu_t* c) {
+    wrmsr(MSR_GS_BASE, (uint64_t)c);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+static void lapic_eoi(void) {
+    if (lapic) lapic_write(LAPIC_EOI, 0);
+}
+
+void smp_early_init(void) {
+    cpu_t* c = &cpus[0];
+    c->self = c;
+    c->id = 0;
+    c->online = 1;
+    set_cpu_gs(c);
+}
+
+uint32_t smp_cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:8, %0" : "=r"(id));
+    return id;
+}
+
+int smp_cpu_count(void) {
+    return online_count;
+}
+
+// Drop this CPU's part of a pending TLB shootdown. Also called while
+// spinning on the kernel lock, since the CPU that holds it may be waiting
+// for this one.
+static void tlb_service(cpu_t* c) {
+    uint32_t bit = 1u << c->id;
+    if (!(tlb_pending & bit)) return;
+    paging_flush_local(tlb_cr3, tlb_start, tlb_pages);
+    __atomic_fetch_and(&tlb_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+static void klock_acquire(cpu_t* c) {
+    if (c->klock_depth++) return;
+    uint32_t expected = KLOCK_FREE;
+    while (!__atomic_compare_exchange_n(&klock_owner, &expected, c->id, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        expected = KLOCK_FREE;
+        while (klock_owner != KLOCK_FREE) {
+            tlb_service(c);
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static void klock_release(cpu_t* c) {
+    if (--c->klock_depth) return;
+    __atomic_store_n(&klock_owner, KLOCK_FREE, __ATOMIC_RELEASE);
+}
+
+uint64_t klock_irqsave(void) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    klock_acquire(this_cpu());
+    return rflags;
+}
+
+void klock_irqrestore(uint64_t rflags) {
+    klock_release(this_cpu());
+    if (rflags & 0x200) __asm__ volatile("sti" : : : "memory");
+}
+
+uint32_t klock_release_all(void) {
+    cpu_t* c = this_cpu();
+    uint32_t depth = c->klock_depth;
+    if (depth) {
+        c->klock_depth = 1;
+        klock_release(c);
+    }
+    return depth;
+}
+
+void klock_reacquire(uint32_t depth) {
+    if (!depth) return;
+    cpu_t* c = this_cpu();
+    klock_acquire(c);
+    c->klock_depth = depth;
+}
+
+uint32_t klock_depth(void) {
+    return this_cpu()->klock_depth;
+}
+
+void klock_set_depth(uint32_t depth) {
+    this_cpu()->klock_depth = depth;
+}
+
+// Busy-wait on PIT channel 2, which nothing else uses; its gate is the
+// speaker port and its output shows in bit 5 of port 0x61
+static void pit_wait_us(uint32_t us) {
+    uint32_t count = (uint32_t)((uint64_t)PIT_FREQUENCY * us / 1000000);
+    if (count == 0) count = 1;
+    if (count > 0xFFFF) count = 0xFFFF;
+    uint8_t port61 = inb(0x61);
+    outb(0x61, (port61 & ~0x02) | 0x01); // Gate on, speaker off
+    outb(0x43, 0xB0);                    // Channel 2, lobyte/hibyte, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, (count >> 8) & 0xFF);
+    while (!(inb(0x61) & 0x20)) __asm__ volatile("pause");
+    outb(0x61, port61);
+}
+
+static void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING) __asm__ volatile("pause");
+    lapic_write(LAPIC_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    if (rflags & 0x200) __asm__ volatile("sti" : : : "memory");
+}
+
+// Ticks of the APIC timer (divided by 16) in 10 ms, measured with the PIT
+static uint32_t lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    pit_wait_us(10000);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    return elapsed;
+}
+
+// Device interrupts keep coming from the 8259 PIC through LINT0 of the
+// boot CPU; the other CPUs only take IPIs and their own timer
+static void lapic_init_cpu(int boot) {
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_LVT_LINT0, boot ? LAPIC_LVT_EXTINT : LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_TPR, 0);
+    if (!boot && lapic_timer_count) {
+        // Same rate as the PIT tick of the boot CPU (100 Hz)
+        lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+        lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+    }
+    lapic_eoi();
+}
+
+// First C code on an AP, on its own stack with interrupts disabled
+static void __attribute__((noreturn)) ap_entry(cpu_t* c) {
+    set_cpu_gs(c);
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~((1ULL << 2) | (1ULL << 3)); // EM, TS
+    cr0 |= (1ULL << 1);                  // MP
+    __asm__ volatile("mov %0, %%cr0; fninit" : : "r"(cr0));
+    // FPU/SSE/AVX state, global pages and PCIDs as on the boot CPU
+    __asm__ volatile("mov %0, %%cr4" : : "r"(boot_cr4));
+    if (boot_cr4 & (1ULL << 18)) {
+        __asm__ volatile("xsetbv" : : "a"((uint32_t)boot_xcr0), "d"((uint32_t)(boot_xcr0 >> 32)), "c"(0));
+    }
+    gdt_init_cpu(c->id);
+    idt_load();
+    lapic_init_cpu(0);
+
+    uint64_t rflags = klock_irqsave();
+    online_mask |= 1u << c->id;
+    online_count++;
+    klock_irqrestore(rflags);
+    c->online = 1;
+    rust_scheduler_idle_loop();
+}
+
+static int start_ap(uint32_t id, uint8_t apic_id, uint64_t cr3) {
+    cpu_t* c = &cpus[id];
+    c->self = c;
+    c->id = id;
+    c->apic_id = apic_id;
+    c->online = 0;
+
+    void* stack = alloc_pages(AP_STACK_ORDER);
+    if (!stack) return -1;
+    uint8_t* tramp = (uint8_t*)phys_to_virt(AP_TRAMPOLINE_BASE);
+    uint64_t size = (uint64_t)(ap_trampoline_end - ap_trampoline_start);
+    memcpy(tramp, ap_trampoline_start, size);
+    *(uint64_t*)(tramp + (ap_trampoline_cr3 - ap_trampoline_start)) = cr3;
+    *(uint64_t*)(tramp + (ap_trampoline_stack - ap_trampoline_start)) =
+        (uint64_t)stack + (PAGE_SIZE << AP_STACK_ORDER);
+    *(uint64_t*)(tramp + (ap_trampoline_entry - ap_trampoline_start)) = (uint64_t)ap_entry;
+    *(uint64_t*)(tramp + (ap_trampoline_arg - ap_trampoline_start)) = (uint64_t)c;
+    __asm__ volatile("" ::: "memory");
+
+    // INIT, then up to two startup IPIs as the MP spec asks
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+    pit_wait_us(10000);
+    for (int i = 0; i < 2 && !c->online; i++) {
+        lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE_BASE >> 12));
+        pit_wait_us(200);
+    }
+    for (int ms = 0; ms < 100 && !c->online; ms++) pit_wait_us(1000);
+    if (!c->online) {
+        free_pages(stack, AP_STACK_ORDER);
+        return -1;
+    }
+    return 0;
+}
+
+void smp_init(uint64_t mb2_info_ptr) {
+    if (acpi_init(mb2_info_ptr) != 0) {
+        serial_write("[SMP] No MADT, running on the boot CPU only\n");
+        return;
+    }
+    const acpi_madt_info_t* madt = acpi_madt();
+    // Uncached, and in the direct map so every address space has it
+    map_page(PHYS_MAP_BASE + madt->lapic_base, madt->lapic_base,
+             PAGE_PRESENT | PAGE_RW | PAGE_PCD | PAGE_PWT);
+    lapic = (volatile uint32_t*)phys_to_virt(madt->lapic_base);
+    cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+    lapic_init_cpu(1);
+    lapic_timer_count = lapic_timer_calibrate();
+
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    cr3 &= PTE_ADDR_MASK;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(boot_cr4));
+    if (boot_cr4 & (1ULL << 18)) {
+        uint32_t lo, hi;
+        __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        boot_xcr0 = ((uint64_t)hi << 32) | lo;
+    }
+    if (cr3 >= 0x100000000ULL) {
+        // The trampoline loads CR3 in 32-bit mode
+        serial_write("[SMP] Kernel page tables above 4 GiB, not starting APs\n");
+        return;
+    }
+
+    uint32_t next_id = 1;
+    for (int i = 0; i < madt->cpu_count && next_id < SMP_MAX_CPUS; i++) {
+        if (madt->lapic_ids[i] == cpus[0].apic_id) continue;
+        if (start_ap(next_id, madt->lapic_ids[i], cr3) == 0) {
+            next_id++;
+        } else {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "[SMP] CPU with APIC ID %d did not start\n", madt->lapic_ids[i]);
+            serial_write(msg);
+        }
+    }
+    char msg[64];
+    snprintf(msg, sizeof(msg), "[SMP] %d CPUs online\n", online_count);
+    serial_write(msg);
+}
+
+void smp_send_reschedule(uint32_t cpu) {
+    if (cpu >= SMP_MAX_CPUS || !(online_mask & (1u << cpu)) || cpu == smp_cpu_id()) return;
+    lapic_send_ipi(cpus[cpu].apic_id, IPI_RESCHEDULE_VECTOR);
+}
+
+void smp_tlb_shootdown(uint64_t cr3, uint64_t start, uint64_t pages) {
+    if (online_count < 2) return;
+    uint64_t rflags = klock_irqsave();
+    uint32_t self = smp_cpu_id();
+    uint32_t targets = online_mask & ~(1u << self);
+    tlb_cr3 = cr3;
+    tlb_start = start;
+    tlb_pages = pages;
+    __atomic_store_n(&tlb_pending, targets, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (targets & (1u << i)) lapic_send_ipi(cpus[i].apic_id, IPI_TLB_VECTOR);
+    }
+    while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE)) __asm__ volatile("pause");
+    klock_irqrestore(rflags);
+}
+
+void smp_handle_interrupt(uint64_t int_no) {
+    switch (int_no) {
+    case LAPIC_SPURIOUS_VECTOR:
+        return; // No EOI for spurious interrupts
+    case IPI_TLB_VECTOR:
+        tlb_service(this_cpu());
+        lapic_eoi();
+        return;
+    case LAPIC_TIMER_VECTOR:
+        this_cpu()->lapic_ticks++;
+        // EOI first, as for the PIT: the tick may switch tasks
+        lapic_eoi();
+        rust_scheduler_tick();
+        return;
+    case IPI_RESCHEDULE_VECTOR:
+        lapic_eoi();
+        task_schedule();
+        return;
+    default:
+        lapic_eoi();
+        return;
+    }
+}
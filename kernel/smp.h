@@ -0,0 +1,61 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "kernel.h"
+
+#define SMP_MAX_CPUS 16
+
+// Local APIC vectors, above the remapped PIC range
+#define LAPIC_TIMER_VECTOR    0xEF
+#define IPI_RESCHEDULE_VECTOR 0xF0
+#define IPI_TLB_VECTOR        0xF1
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Per-CPU data, reached through the GS base of each CPU. Kernel entry and
+// exit paths swapgs when coming from or returning to user mode, so this
+// holds in kernel mode only.
+typedef struct cpu {
+    struct cpu* self;     // %gs:0
+    uint32_t id;          // %gs:8, index into the CPU table (0 = boot CPU)
+    uint32_t apic_id;
+    uint32_t klock_depth; // Nesting of the kernel lock on this CPU
+    volatile uint32_t online;
+    uint64_t lapic_ticks; // Local APIC timer interrupts (APs)
+} cpu_t;
+
+static inline cpu_t* this_cpu(void) {
+    cpu_t* c;
+    __asm__ volatile("movq %%gs:0, %0" : "=r"(c));
+    return c;
+}
+
+// Point GS at the boot CPU's data. First thing in kernel_main.
+void smp_early_init(void);
+// Parse the MADT, enable the local APIC and start the other CPUs
+void smp_init(uint64_t mb2_info_ptr);
+uint32_t smp_cpu_id(void);
+int smp_cpu_count(void); // CPUs online
+// Ask a CPU to run the scheduler (a task was queued for it)
+void smp_send_reschedule(uint32_t cpu);
+// Make the other CPUs drop their TLB entries for `pages` pages from
+// `start` in address space cr3 (see paging_flush_local); waits until all
+// of them have
+void smp_tlb_shootdown(uint64_t cr3, uint64_t start, uint64_t pages);
+// Local APIC timer, reschedule and TLB shootdown interrupts
+void smp_handle_interrupt(uint64_t int_no);
+
+// Kernel lock. Sections that keep interrupts off for exclusion (irq_save
+// in heap.rs, pmm_lock, zram_lock) take it too, so that they also exclude
+// the other CPUs. It is recursive and held by a CPU, not a task: the
+// scheduler switches tasks with it held.
+uint64_t klock_irqsave(void);
+void klock_irqrestore(uint64_t rflags);
+// Drop the lock however deeply it is held and take it back to the same
+// depth; interrupts are left alone
+uint32_t klock_release_all(void);
+void klock_reacquire(uint32_t depth);
+// Nesting depth, saved and restored around a task switch
+uint32_t klock_depth(void);
+void klock_set_depth(uint32_t depth);
+
+#endif
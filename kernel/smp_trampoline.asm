@@ -0,0 +1,87 @@
+; kernel/smp_trampoline.asm - Application processor startup code
+;
+; smp.c copies this to AP_BASE, below 1 MiB where a startup IPI can point,
+; and fills in the parameters at the end before starting each AP. The AP
+; arrives in real mode at 0800:0000, goes through protected mode into long
+; mode on the kernel page tables, then calls entry(arg) on its own stack.
+BITS 16
+
+section .rodata
+
+AP_BASE equ 0x8000
+; Address of a label in the copy at AP_BASE
+%define ABS(x) (AP_BASE + ((x) - ap_trampoline_start))
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_trampoline_cr3
+global ap_trampoline_stack
+global ap_trampoline_entry
+global ap_trampoline_arg
+
+align 16
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    lgdt [ABS(tramp_gdt_ptr)]
+    mov eax, cr0
+    or eax, 1                 ; PE
+    mov cr0, eax
+    jmp dword 0x08:ABS(ap_protected)
+
+BITS 32
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov eax, cr4
+    or eax, 1 << 5            ; PAE
+    mov cr4, eax
+    mov eax, [ABS(ap_trampoline_cr3)]
+    mov cr3, eax
+    mov ecx, 0xC0000080       ; EFER
+    rdmsr
+    or eax, 1 << 8            ; LME
+    wrmsr
+    mov eax, cr0
+    or eax, 1 << 31           ; PG
+    mov cr0, eax
+    jmp 0x18:ABS(ap_long)
+
+BITS 64
+ap_long:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov rsp, [ABS(ap_trampoline_stack)]
+    mov rdi, [ABS(ap_trampoline_arg)]
+    mov rax, [ABS(ap_trampoline_entry)]
+    call rax
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF     ; 0x08: 32-bit code
+    dq 0x00CF92000000FFFF     ; 0x10: data
+    dq 0x00AF9A000000FFFF     ; 0x18: 64-bit code
+tramp_gdt_ptr:
+    dw tramp_gdt_ptr - tramp_gdt - 1
+    dd ABS(tramp_gdt)
+
+; Parameters, written by smp.c into the copy
+align 8
+ap_trampoline_cr3:   dq 0     ; Kernel PML4, below 4 GiB
+ap_trampoline_stack: dq 0
+ap_trampoline_entry: dq 0
+ap_trampoline_arg:   dq 0
+ap_trampoline_end:
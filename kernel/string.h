@@ -17,5 +17,6 @@ int safe_sscanf(const char* str, const char* format, ...);
 int is_valid_pointer(const void* ptr);
 int is_valid_string(const char* str, size_t max_len);
 int is_valid_buffer(const void* buf, size_t len);
+int is_valid_range(const void* buf, size_t len);
 
 #endif // STRING_H
@@ -5,6 +5,11 @@ global syscall_entry
 extern rust_syscall_handler
 
 syscall_entry:
+    ; int 0x80 from user mode: switch to the kernel's GS base (see idt.asm)
+    test byte [rsp + 8], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
     ; The user-space C code (syscall() in syscall.h) will place arguments in:
     ; RAX (num), RDI (arg1), RSI (arg2), RDX (arg3), R10 (arg4), R8 (arg5), R9 (arg6)
 
@@ -20,4 +25,8 @@ syscall_entry:
     mov rdi, rax      ; 1st argument (syscall_num)
     call rust_syscall_handler
     ; The return value is placed in RAX by the function call, which is correct for syscalls.
+    test byte [rsp + 8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
     iretq
@@ -5,6 +5,8 @@
 #include "gdt.h"
 #include "timer.h"
 #include "paging.h"
+#include "smp.h"
+#include "heap.h"
 #include "syscall.h" // For sys_pipe, sys_read, sys_write, sys_close
 #include <string.h>  // For strlen
 
@@ -13,7 +15,7 @@ extern void rust_task_init();
 extern int rust_task_create(void (*entry)(void));
 extern int rust_task_create_user(void (*entry)(void), void* user_stack, int stack_size, void* arg);
 extern void rust_task_yield();
-extern void rust_task_exit();
+extern void rust_task_exit() __attribute__((noreturn));
 extern void rust_task_schedule();
 
 void task_init() { rust_task_init(); }
@@ -22,25 +24,31 @@ int task_create_user(void (*entry)(void), void* user_stack, int stack_size, void
 void task_yield() { rust_task_yield(); }
 void task_exit() { rust_task_exit(); }
 void task_schedule() { rust_task_schedule(); }
+void task_block() { rust_task_block(); }
+void task_wake(task_t* t) { rust_task_wake(t); }
+
+// First code a new task runs: task_switch "returns" here on its fresh
+// stack, with interrupts still disabled and the kernel lock still held by
+// the scheduler, whose heap tag this CPU still carries. There is nothing to
+// return to.
+__attribute__((noreturn)) void task_entry_trampoline(void) {
+    rust_heap_set_tag(HEAP_TAG_OTHER);
+    klock_release_all();
+    __asm__ volatile("sti");
+    ((void (*)(void))current->rip)();
+    task_exit();
+    for (;;) __asm__ volatile("cli; hlt");
+}
 
 // Assembly context switch (save/restore rsp)
-__attribute__((naked)) void task_switch(uint64_t* /*old_rsp*/, uint64_t /*new_rsp*/) {
+__attribute__((naked)) void task_switch(uint64_t* /*old_rsp*/, uint64_t /*new_rsp*/, uint64_t /*cr3*/) {
     __asm__ volatile (
         "movq %rsp, (%rdi)\n"
         "movq %rsi, %rsp\n"
-        // Load new CR3 if needed
-        "movq current, %rax\n"
-        "movq (%rax), %rbx\n" // current task pointer
-        // Load new CR3 if needed. rbx holds the address of the next task's struct.
-        "movq current, %rax\n"    // rax = &current
-        "movq (%rax), %rbx\n"     // rbx = current (the task_t* of the next task)
-        "movq %cr3, %rcx\n"
-        "cmpq 0x20(%rbx), %rcx\n" // Compare current cr3 with next task's cr3 (offset 32)
-        "je 1f\n"
-        "movq 0x20(%rbx), %rcx\n" // Load new cr3
-        "movq %rcx, %cr3\n"
-        "1:\n"
-        "ret\n"
+        // Switch address space: tail-call paging_switch_cr3(cr3), whose ret
+        // resumes the next task
+        "movq %rdx, %rdi\n"
+        "jmp paging_switch_cr3\n"
     );
 }
 
@@ -57,7 +65,12 @@ __attribute__((naked)) void enter_user_mode(uint64_t /*rsp*/) {
         "push %rcx\n"
         "push %rdx\n"
         "push %rsi\n"
-        "iretq\n"
+        // Leave the kernel's GS base (per-CPU data) behind for the next
+        // kernel entry
+        "testb $3, 8(%rsp)\n"
+        "jz 1f\n"
+        "swapgs\n"
+        "1: iretq\n"
     );
 }
 
@@ -74,14 +87,12 @@ void rust_task_link_force() {
     extern int rust_task_create(void (*entry)(void));
     extern int rust_task_create_user(void (*entry)(void), void* user_stack, int stack_size, void* arg);
     extern void rust_task_yield();
-    extern void rust_task_exit();
+    extern void rust_task_exit() __attribute__((noreturn));
     extern void rust_task_schedule();
-    extern task_t* current;
     extern task_t* TASKS;
     extern int* NUM_TASKS;
     extern size_t* RUST_MAX_TASKS;
-    volatile void* p = current;
-    p = TASKS;
+    volatile void* p = TASKS;
     p = NUM_TASKS;
     p = RUST_MAX_TASKS;
     rust_task_init();
@@ -93,16 +104,25 @@ void rust_task_link_force() {
     (void)p;
 }
 
+// Callers check their wait condition before sleeping; do that with
+// interrupts disabled if an interrupt handler does the wakeup, or the wakeup
+// can come between the check and the sleep
 void scheduler_sleep(void* wait_channel) {
-    // In a real implementation, you'd add the current task to a wait queue
-    // associated with wait_channel. For now, just yield.
-    (void)wait_channel;
-    task_yield();
+    rust_wait_sleep((uint64_t)wait_channel, 0);
+}
+
+int scheduler_sleep_timeout(void* wait_channel, uint64_t ticks) {
+    // A timeout of 0 would mean no timeout
+    if (ticks == 0) return -1;
+    return rust_wait_sleep((uint64_t)wait_channel, ticks);
 }
 
 void scheduler_wakeup(void* wait_channel) {
-    (void)wait_channel;
-    task_schedule();
+    rust_wait_wake((uint64_t)wait_channel, 1);
+}
+
+void scheduler_wakeup_one(void* wait_channel) {
+    rust_wait_wake((uint64_t)wait_channel, 0);
 }
 
 // static int pipe_fds[2];
@@ -6,6 +6,10 @@
 #define MAX_TASKS 16
 #define TASK_STACK_SIZE 16384 // Increased from 4096
 
+// Scheduling policies (sched_setscheduler), numbered as in Linux
+#define SCHED_NORMAL 0 // Fair share by virtual runtime
+#define SCHED_RR     2 // Fixed priority, round robin within a level
+
 typedef enum { TASK_RUNNING, TASK_READY, TASK_BLOCKED, TASK_TERMINATED } task_state_t;
 
 typedef struct task {
@@ -17,17 +21,32 @@ typedef struct task {
   int priority; // Lower value = higher priority
   uint64_t cr3; // Per-process page table (PML4) physical address
     struct task* next;
+    struct task* rq_next; // Run queue link (kernel-rs/src/scheduler.rs)
+    int time_slice;       // Timer ticks left
+    int policy;           // SCHED_RR or SCHED_NORMAL
+    uint64_t vruntime;    // Weighted run time in ns (fair class)
+    uint64_t exec_ticks;  // Timer ticks spent running
+    uint64_t wait_channel; // Channel slept on, 0 if none (kernel-rs/src/waitqueue.rs)
+    struct task* wait_next;
+    uint64_t wait_deadline; // Tick the sleep times out at, 0 for none
+    int cpu;              // CPU whose run queue the task is on
     uint8_t stack[TASK_STACK_SIZE]; // Moved to the end for stable offsets
 } task_t;
 
-extern task_t* current;
+// The task running on this CPU, NULL when it is idle
+task_t* rust_current_task(void);
+#define current (rust_current_task())
 
 void task_init();
 int task_create(void (*entry)(void));
 int task_create_user(void (*entry)(void), void* user_stack, int stack_size, void* arg);
 void task_yield();
-void task_exit();
+// Does not return; the task is never resumed
+void task_exit() __attribute__((noreturn));
 void task_schedule();
+// Sleep until task_wake(); the caller is responsible for being findable
+void task_block();
+void task_wake(task_t* t);
 void timer_task_handler();
 void ipc_test();
 
@@ -35,6 +54,10 @@ void ipc_test();
 extern "C" {
 #endif
 void rust_scheduler_tick();
+void rust_task_block();
+void rust_task_wake(task_t* t);
+int rust_wait_sleep(uint64_t channel, uint64_t timeout_ticks);
+int rust_wait_wake(uint64_t channel, int all);
 #ifdef __cplusplus
 }
 #endif
@@ -9,7 +9,6 @@ void timer_interrupt_wrapper(registers_t regs);
 
 #define PIT_CHANNEL0 0x40
 #define PIT_COMMAND  0x43
-#define PIT_FREQUENCY 1193182
 
 static volatile uint64_t timer_ticks = 0;
 static uint32_t pit_freq_hz = 100;
@@ -3,6 +3,8 @@
 
 #include "kernel.h"
 
+#define PIT_FREQUENCY 1193182 // PIT input clock in Hz
+
 void timer_init(uint32_t frequency);
 void timer_interrupt_handler();
 uint64_t timer_get_ticks();
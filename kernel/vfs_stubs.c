@@ -6,6 +6,7 @@
 #include "memory.h"
 #include "string.h"
 #include <string.h>
+#include "memops.h"
 char *strstr(const char *haystack, const char *needle);
 
 extern int rust_vfs_init();
@@ -29,16 +30,22 @@ static vfs_node_t fallback_root = {
     .sibling = NULL
 };
 
+// Paths reaching the VFS come from kernel code; user paths are checked with
+// is_valid_string() at the syscall boundary.
 static int is_valid_path(const char* path) {
-    if (!path) return 0;
-    if (!is_valid_string(path, 4096)) return 0;
+    if (!path || !is_valid_pointer(path)) return 0;
     
-    size_t len = safe_strlen(path, 4096);
+    size_t len = strnlen(path, 4096);
     if (len == 0 || len >= 4096) return 0;
     
-    // Check for path traversal attacks
-    if (strstr(path, "..") != NULL) return 0;
-    if (strstr(path, "//") != NULL) return 0;
+    // Check for path traversal attacks ("..", "//")
+    const char* end = path + len;
+    for (const char* p = path; (p = memchr(p, '.', end - p)) != NULL; p++) {
+        if (p + 1 < end && p[1] == '.') return 0;
+    }
+    for (const char* p = path; (p = memchr(p, '/', end - p)) != NULL; p++) {
+        if (p + 1 < end && p[1] == '/') return 0;
+    }
     
     return 1;
 }
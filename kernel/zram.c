@@ -0,0 +1,336 @@
+#include "zram.h"
+#include "blockdev.h"
+#include "heap.h"
+#include "pmm.h"
+#include "string.h"
+#include "serial.h"
+#include "smp.h"
+
+#define ZRAM_PAGES            (ZRAM_DISK_SIZE / PAGE_SIZE)
+#define ZRAM_SECTORS          (ZRAM_DISK_SIZE / BLOCKDEV_SECTOR_SIZE)
+#define ZRAM_SECTORS_PER_PAGE (PAGE_SIZE / BLOCKDEV_SECTOR_SIZE)
+// Pages that do not compress to this size or less are stored whole
+#define ZRAM_MAX_COMPRESSED   3072
+
+enum { ZRAM_EMPTY, ZRAM_ZERO, ZRAM_COMPRESSED, ZRAM_RAW };
+
+typedef struct {
+    void* data;
+    uint16_t len;   // Compressed bytes
+    uint8_t state;
+    uint8_t cls;    // Size class of the chunk holding the data
+} zram_slot_t;
+
+// Chunk size classes, one slab cache each
+#define ZRAM_CLASSES 7
+static const uint16_t class_sizes[ZRAM_CLASSES] = { 256, 512, 768, 1024, 1536, 2048, 3072 };
+static const char* const class_names[ZRAM_CLASSES] = {
+    "zram-256", "zram-512", "zram-768", "zram-1k", "zram-1.5k", "zram-2k", "zram-3k"
+};
+static kmem_cache_t* class_caches[ZRAM_CLASSES];
+
+static zram_slot_t slots[ZRAM_PAGES];
+static uint8_t page_buf[PAGE_SIZE];
+static uint8_t comp_buf[ZRAM_MAX_COMPRESSED];
+static zram_stats_t stats;
+
+static inline uint64_t zram_lock(void) {
+    return klock_irqsave();
+}
+
+static inline void zram_unlock(uint64_t rflags) {
+    klock_irqrestore(rflags);
+}
+
+// --- LZ codec ---
+//
+// Sequences of (token, literal length, literals, 16-bit offset, match
+// length) as in the LZ4 block format. The last sequence has literals only,
+// and matches stop LZ_LAST_LITERALS bytes before the end of the input.
+
+#define LZ_HASH_BITS     12
+#define LZ_MIN_MATCH     4
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT       12
+
+static uint16_t lz_table[1 << LZ_HASH_BITS]; // Input offsets by hash of 4 bytes
+
+static inline uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_put_len(uint8_t* op, uint32_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Compress src (at most 64 KiB) into dst. Returns the compressed size, or
+// 0 if it would not fit in cap bytes.
+static int lz_compress(const uint8_t* src, int len, uint8_t* dst, int cap) {
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    memset(lz_table, 0, sizeof(lz_table));
+    if (len >= LZ_MFLIMIT) {
+        const uint8_t* mflimit = end - LZ_MFLIMIT;
+        const uint8_t* mlimit = end - LZ_LAST_LITERALS;
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t* ref = src + lz_table[h];
+            lz_table[h] = (uint16_t)(ip - src);
+            if (lz_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* mp = ip + LZ_MIN_MATCH;
+            const uint8_t* mr = ref + LZ_MIN_MATCH;
+            while (mp < mlimit && *mp == *mr) {
+                mp++;
+                mr++;
+            }
+            uint32_t lit = (uint32_t)(ip - anchor);
+            uint32_t mlen = (uint32_t)(mp - ip) - LZ_MIN_MATCH;
+            if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend) return 0;
+
+            uint8_t* token = op++;
+            *token = (uint8_t)(((lit >= 15 ? 15 : lit) << 4) | (mlen >= 15 ? 15 : mlen));
+            if (lit >= 15) op = lz_put_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            uint16_t offset = (uint16_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            if (mlen >= 15) op = lz_put_len(op, mlen - 15);
+            ip = anchor = mp;
+        }
+    }
+
+    uint32_t lit = (uint32_t)(end - anchor);
+    if (op + 1 + lit / 255 + 1 + lit > oend) return 0;
+    *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (int)(op - dst);
+}
+
+// Returns the decompressed size, or -1 if src is malformed or the output
+// would not fit in cap bytes.
+static int lz_decompress(const uint8_t* src, int len, uint8_t* dst, int cap) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        uint32_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (uint32_t)(iend - ip) || lit > (uint32_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // The last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        uint32_t offset = ip[0] | ((uint32_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)) return -1;
+        uint32_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (uint32_t)(oend - op)) return -1;
+        // Byte by byte: the match may overlap the bytes it produces
+        const uint8_t* ref = op - offset;
+        while (mlen--) *op++ = *ref++;
+    }
+    return (int)(op - dst);
+}
+
+// --- Page slots ---
+
+static int page_is_zero(const uint8_t* page) {
+    const uint64_t* w = (const uint64_t*)page;
+    for (int i = 0; i < PAGE_SIZE / 8; i++) {
+        if (w[i]) return 0;
+    }
+    return 1;
+}
+
+static void slot_free(zram_slot_t* s) {
+    switch (s->state) {
+    case ZRAM_ZERO:
+        stats.zero_pages--;
+        break;
+    case ZRAM_COMPRESSED:
+        rust_kmem_cache_free(class_caches[s->cls], s->data);
+        stats.compr_bytes -= s->len;
+        stats.mem_used -= class_sizes[s->cls];
+        break;
+    case ZRAM_RAW:
+        free_page(s->data);
+        stats.compr_bytes -= PAGE_SIZE;
+        stats.mem_used -= PAGE_SIZE;
+        break;
+    default:
+        return;
+    }
+    stats.pages--;
+    s->state = ZRAM_EMPTY;
+    s->data = 0;
+}
+
+static int slot_read(const zram_slot_t* s, uint8_t* out) {
+    switch (s->state) {
+    case ZRAM_COMPRESSED:
+        return lz_decompress(s->data, s->len, out, PAGE_SIZE) == PAGE_SIZE ? 0 : -1;
+    case ZRAM_RAW:
+        memcpy(out, s->data, PAGE_SIZE);
+        return 0;
+    default:
+        memset(out, 0, PAGE_SIZE);
+        return 0;
+    }
+}
+
+static int slot_write(zram_slot_t* s, const uint8_t* page) {
+    if (page_is_zero(page)) {
+        slot_free(s);
+        s->state = ZRAM_ZERO;
+        stats.zero_pages++;
+        stats.pages++;
+        return 0;
+    }
+    // The new copy is made before the old one is dropped, so a failed
+    // write leaves the old contents in place
+    int len = lz_compress(page, PAGE_SIZE, comp_buf, ZRAM_MAX_COMPRESSED);
+    uint8_t cls = 0;
+    void* data;
+    if (len > 0) {
+        while (class_sizes[cls] < len) cls++;
+        data = rust_kmem_cache_alloc(class_caches[cls]);
+    } else {
+        data = alloc_page();
+    }
+    if (!data) {
+        stats.failed++;
+        return -1;
+    }
+    slot_free(s);
+    s->data = data;
+    if (len > 0) {
+        memcpy(data, comp_buf, len);
+        s->state = ZRAM_COMPRESSED;
+        s->len = (uint16_t)len;
+        s->cls = cls;
+        stats.compr_bytes += len;
+        stats.mem_used += class_sizes[cls];
+    } else {
+        memcpy(data, page, PAGE_SIZE);
+        s->state = ZRAM_RAW;
+        s->len = PAGE_SIZE;
+        stats.compr_bytes += PAGE_SIZE;
+        stats.mem_used += PAGE_SIZE;
+    }
+    stats.pages++;
+    return 0;
+}
+
+// Sector I/O goes page by page; a partial page is read, patched and
+// compressed again.
+static int zram_rw(int sector, uint8_t* buf, int count, int write) {
+    if (sector < 0 || count < 0 || sector + count > ZRAM_SECTORS) return -1;
+    uint64_t flags = zram_lock();
+    int ret = 0;
+    while (count > 0 && ret == 0) {
+        zram_slot_t* s = &slots[sector / ZRAM_SECTORS_PER_PAGE];
+        int first = sector % ZRAM_SECTORS_PER_PAGE;
+        int n = ZRAM_SECTORS_PER_PAGE - first;
+        if (n > count) n = count;
+        int offset = first * BLOCKDEV_SECTOR_SIZE;
+        int bytes = n * BLOCKDEV_SECTOR_SIZE;
+        if (!write) {
+            if (bytes == PAGE_SIZE) {
+                ret = slot_read(s, buf);
+            } else {
+                ret = slot_read(s, page_buf);
+                memcpy(buf, page_buf + offset, bytes);
+            }
+            stats.reads++;
+        } else {
+            if (bytes == PAGE_SIZE) {
+                ret = slot_write(s, buf);
+            } else {
+                ret = slot_read(s, page_buf);
+                memcpy(page_buf + offset, buf, bytes);
+                if (ret == 0) ret = slot_write(s, page_buf);
+            }
+            stats.writes++;
+        }
+        sector += n;
+        count -= n;
+        buf += bytes;
+    }
+    zram_unlock(flags);
+    return ret;
+}
+
+static int zram_read(int sector, void* buf, int count) {
+    return zram_rw(sector, (uint8_t*)buf, count, 0);
+}
+
+static int zram_write(int sector, const void* buf, int count) {
+    return zram_rw(sector, (uint8_t*)buf, count, 1);
+}
+
+void zram_init(void) {
+    for (int i = 0; i < ZRAM_CLASSES; i++) {
+        class_caches[i] = rust_kmem_cache_create(class_names[i], class_sizes[i]);
+    }
+    stats.disk_size = ZRAM_DISK_SIZE;
+    if (blockdev_register(ZRAM_BLOCKDEV_ID, zram_read, zram_write, ZRAM_SECTORS) != 0) {
+        serial_write("[ZRAM] Could not register block device\n");
+        return;
+    }
+    serial_write("[ZRAM] 32 MiB compressed block device ready\n");
+}
+
+void zram_get_stats(zram_stats_t* out) {
+    uint64_t flags = zram_lock();
+    *out = stats;
+    out->orig_bytes = (stats.pages - stats.zero_pages) * PAGE_SIZE;
+    zram_unlock(flags);
+}
@@ -0,0 +1,28 @@
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include "kernel.h"
+
+// Compressed RAM block device, registered as block device ZRAM_BLOCKDEV_ID.
+// Each 4 KiB page is compressed with a small LZ77 codec (LZ4 block layout)
+// and kept in a slab chunk of the nearest size class; all-zero pages take
+// no storage at all, and pages that do not compress are kept whole.
+#define ZRAM_BLOCKDEV_ID 1
+#define ZRAM_DISK_SIZE   (32 * 1024 * 1024)
+
+typedef struct {
+    uint64_t disk_size;   // Bytes
+    uint64_t pages;       // Pages holding data, zero pages included
+    uint64_t zero_pages;
+    uint64_t orig_bytes;  // Uncompressed size of the non-zero pages
+    uint64_t compr_bytes; // Their compressed size
+    uint64_t mem_used;    // Slab chunks and pages holding the data
+    uint64_t reads;       // Pages
+    uint64_t writes;
+    uint64_t failed;      // Writes that found no memory
+} zram_stats_t;
+
+void zram_init(void);
+void zram_get_stats(zram_stats_t* out);
+
+#endif